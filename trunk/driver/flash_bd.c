@@ -14,8 +14,20 @@
 #include <linux/random.h>
 #include <linux/rbtree.h>
 #include <linux/bitrev.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/kref.h>
 #include <asm/div64.h>
 
+/* Backing store of the binary block map; may outlive the flash_bd while
+ * user space keeps it mapped.
+ */
+struct flash_bd_map {
+	struct kref                ref;
+	size_t                     size;
+	struct flash_bd_map_header *header;
+};
+
 struct flash_bd {
 	unsigned int       zone_cnt;
 	unsigned int       phy_block_cnt;
@@ -47,10 +59,31 @@ struct flash_bd {
 	unsigned int       last_count;
 	int                last_error;
 
+	/* Open block: destination block, written up to o_page_off, whose
+	 * remaining pages are yet to be copied from the source block.
+	 */
+	unsigned int       o_log_block;
+	unsigned int       o_src_block;
+	unsigned int       o_dst_block;
+	unsigned int       o_page_off;
+	unsigned int       o_fill_cnt;
+	unsigned int       sync:1;
+	unsigned int       map_depth;
+	int                (*o_next)(struct flash_bd *fbd,
+				     struct flash_bd_request *req);
+	/* Failed destination, pending relocation, and the step to retry. */
+	unsigned int       o_bad_block;
+	int                (*o_retry)(struct flash_bd *fbd,
+				      struct flash_bd_request *req);
+	/* Source pages found unreadable when closing open blocks. */
+	unsigned int       lost_pages;
+
 	int                (*cmd_handler)(struct flash_bd *fbd,
 					  struct flash_bd_request *req);
 	unsigned int       p_line_size;
 	char               *p_line;
+
+	struct flash_bd_map *map;
 };
 
 /* For each block two bits are maintained:
@@ -62,6 +95,9 @@ struct flash_bd {
  *
  */
 
+static int flash_bd_map_read(struct flash_bd *fbd, unsigned long long offset,
+			     unsigned int count, struct flash_bd_request *req,
+			     unsigned int *buf_offset);
 static int h_flash_bd_read(struct flash_bd *fbd, struct flash_bd_request *req);
 static int h_flash_bd_write(struct flash_bd *fbd, struct flash_bd_request *req);
 static int h_flash_bd_write_inc(struct flash_bd *fbd,
@@ -70,6 +106,122 @@ static int h_flash_bd_erase_src(struct flash_bd *fbd,
 				struct flash_bd_request *req);
 static int h_flash_bd_erase_dst(struct flash_bd *fbd,
 				struct flash_bd_request *req);
+static int h_flash_bd_flush(struct flash_bd *fbd,
+			    struct flash_bd_request *req);
+static int h_flash_bd_mark_dst_bad(struct flash_bd *fbd,
+				   struct flash_bd_request *req);
+static int flash_bd_close_open(struct flash_bd *fbd,
+			       struct flash_bd_request *req,
+			       int (*next)(struct flash_bd *fbd,
+					   struct flash_bd_request *req));
+
+static int open_blocks = 1;
+module_param(open_blocks, bool, 0644);
+
+static void flash_bd_map_release(struct kref *ref)
+{
+	struct flash_bd_map *map = container_of(ref, struct flash_bd_map, ref);
+
+	vfree(map->header);
+	kfree(map);
+}
+
+static void flash_bd_map_vm_open(struct vm_area_struct *vma)
+{
+	struct flash_bd_map *map = vma->vm_private_data;
+
+	kref_get(&map->ref);
+}
+
+static void flash_bd_map_vm_close(struct vm_area_struct *vma)
+{
+	struct flash_bd_map *map = vma->vm_private_data;
+
+	kref_put(&map->ref, flash_bd_map_release);
+}
+
+static struct vm_operations_struct flash_bd_map_vm_ops = {
+	.open  = flash_bd_map_vm_open,
+	.close = flash_bd_map_vm_close
+};
+
+/*
+ * Block table and both bitmaps are allocated as a part of the binary map
+ * image, so that the exported map is always current.
+ */
+static int flash_bd_alloc_map(struct flash_bd *fbd)
+{
+	unsigned int b_cnt = fbd->zone_cnt << fbd->block_addr_bits;
+	size_t t_size = sizeof(unsigned int) * b_cnt;
+	size_t m_size = BITS_TO_LONGS(b_cnt) * sizeof(unsigned long);
+	struct flash_bd_map_header *hdr;
+	unsigned int cnt;
+
+	fbd->map = kzalloc(sizeof(struct flash_bd_map), GFP_KERNEL);
+	if (!fbd->map)
+		return -ENOMEM;
+
+	kref_init(&fbd->map->ref);
+	fbd->map->size = ALIGN(sizeof(struct flash_bd_map_header),
+			       sizeof(unsigned long));
+	fbd->map->size += ALIGN(t_size, sizeof(unsigned long)) + 2 * m_size;
+
+	hdr = vmalloc_user(fbd->map->size);
+	if (!hdr) {
+		kfree(fbd->map);
+		fbd->map = NULL;
+		return -ENOMEM;
+	}
+
+	fbd->map->header = hdr;
+	hdr->magic = FLASH_BD_MAP_MAGIC;
+	hdr->version = FLASH_BD_MAP_VERSION;
+	hdr->header_size = sizeof(struct flash_bd_map_header);
+	hdr->zone_cnt = fbd->zone_cnt;
+	hdr->phy_block_cnt = fbd->phy_block_cnt;
+	hdr->log_block_cnt = fbd->log_block_cnt;
+	hdr->block_addr_bits = fbd->block_addr_bits;
+	hdr->word_size = sizeof(unsigned long);
+	hdr->table_offset = ALIGN(sizeof(struct flash_bd_map_header),
+				  sizeof(unsigned long));
+	hdr->data_map_offset = hdr->table_offset
+			       + ALIGN(t_size, sizeof(unsigned long));
+	hdr->erase_map_offset = hdr->data_map_offset + m_size;
+	hdr->map_size = fbd->map->size;
+
+	fbd->block_table = (void *)hdr + hdr->table_offset;
+	fbd->data_map = (void *)hdr + hdr->data_map_offset;
+	fbd->erase_map = (void *)hdr + hdr->erase_map_offset;
+
+	for (cnt = 0; cnt < b_cnt; ++cnt)
+		fbd->block_table[cnt] = FLASH_BD_INVALID;
+
+	return 0;
+}
+
+/*
+ * The map generation works as a sequence counter: it is odd while the map
+ * is being updated. Only the actual changes of the table and bitmaps are
+ * bracketed, so readers are not held off for the duration of a request.
+ * Brackets nest; the generation moves on the outermost pair only.
+ */
+static void flash_bd_map_begin(struct flash_bd *fbd)
+{
+	if (fbd->map_depth++)
+		return;
+
+	fbd->map->header->generation++;
+	smp_wmb();
+}
+
+static void flash_bd_map_end(struct flash_bd *fbd)
+{
+	if (--fbd->map_depth)
+		return;
+
+	smp_wmb();
+	fbd->map->header->generation++;
+}
 
 static void flash_bd_mark_used(struct flash_bd *fbd, unsigned int phy_block)
 {
@@ -79,8 +231,10 @@ static void flash_bd_mark_used(struct flash_bd *fbd, unsigned int phy_block)
 			fbd->free_cnt[zone]--;
 	}
 
+	flash_bd_map_begin(fbd);
 	set_bit(phy_block, fbd->data_map);
 	clear_bit(phy_block, fbd->erase_map);
+	flash_bd_map_end(fbd);
 }
 
 static void flash_bd_mark_erased(struct flash_bd *fbd, unsigned int phy_block)
@@ -90,8 +244,10 @@ static void flash_bd_mark_erased(struct flash_bd *fbd, unsigned int phy_block)
 		fbd->free_cnt[zone]++;
 	}
 
+	flash_bd_map_begin(fbd);
 	clear_bit(phy_block, fbd->data_map);
 	set_bit(phy_block, fbd->erase_map);
+	flash_bd_map_end(fbd);
 }
 
 struct flash_bd* flash_bd_init(unsigned int zone_cnt,
@@ -146,25 +302,9 @@ struct flash_bd* flash_bd_init(unsigned int zone_cnt,
 	for (cnt = 0; cnt < fbd->zone_cnt; ++cnt)
 		fbd->free_cnt[cnt] = fbd->phy_block_cnt;
 
-	fbd->block_table = kmalloc(sizeof(unsigned int)
-				   * (fbd->zone_cnt << fbd->block_addr_bits),
-				   GFP_KERNEL);
-	if (!fbd->block_table)
-		goto err_out;
-
-	for (cnt = 0; cnt < (fbd->zone_cnt << fbd->block_addr_bits); ++cnt)
-		fbd->block_table[cnt] = FLASH_BD_INVALID;
-
-	fbd->erase_map = kzalloc(BITS_TO_LONGS(fbd->zone_cnt
-					       << fbd->block_addr_bits)
-				 * sizeof(unsigned long), GFP_KERNEL);
-	if (!fbd->erase_map)
-		goto err_out;
+	fbd->o_log_block = FLASH_BD_INVALID;
 
-	fbd->data_map = kzalloc(BITS_TO_LONGS(fbd->zone_cnt
-					      << fbd->block_addr_bits)
-				* sizeof(unsigned long), GFP_KERNEL);
-	if (!fbd->data_map)
+	if (flash_bd_alloc_map(fbd))
 		goto err_out;
 
 	return fbd;
@@ -181,9 +321,8 @@ void flash_bd_destroy(struct flash_bd *fbd)
 		return;
 
 	kfree(fbd->free_cnt);
-	kfree(fbd->block_table);
-	kfree(fbd->erase_map);
-	kfree(fbd->data_map);
+	if (fbd->map)
+		kref_put(&fbd->map->ref, flash_bd_map_release);
 	kfree(fbd->p_line);
 	kfree(fbd);
 }
@@ -232,6 +371,7 @@ int flash_bd_set_empty(struct flash_bd *fbd, unsigned int zone,
 		return -EINVAL;
 
 	phy_block |= zone << fbd->block_addr_bits;
+	flash_bd_map_begin(fbd);
 
 	if (test_bit(phy_block, fbd->data_map)) {
 		log_block = flash_bd_get_logical(fbd, phy_block);
@@ -245,6 +385,8 @@ int flash_bd_set_empty(struct flash_bd *fbd, unsigned int zone,
 	if (erased)
 		set_bit(phy_block, fbd->erase_map);
 
+	flash_bd_map_end(fbd);
+
 	return 0;
 }
 EXPORT_SYMBOL(flash_bd_set_empty);
@@ -258,20 +400,32 @@ int flash_bd_set_full(struct flash_bd *fbd, unsigned int zone,
 
 	phy_block |= zone << fbd->block_addr_bits;
 
+	if (log_block != FLASH_BD_INVALID) {
+		if (log_block >= fbd->log_block_cnt)
+			return -EINVAL;
+
+		if (test_bit(phy_block, fbd->data_map))
+			return -EEXIST;
+
+		/* Another block claims the same logical block. */
+		if (fbd->block_table[log_block
+				     | (zone << fbd->block_addr_bits)]
+		    != FLASH_BD_INVALID)
+			return -EEXIST;
+	}
+
+	flash_bd_map_begin(fbd);
+
 	if (log_block == FLASH_BD_INVALID) {
 		if (test_bit(phy_block, fbd->data_map)) {
 			log_block = flash_bd_get_logical(fbd, phy_block);
 			if (log_block != FLASH_BD_INVALID)
 				fbd->block_table[log_block] = FLASH_BD_INVALID;
 		}
-	} else if (log_block < fbd->log_block_cnt) {
-		if (test_bit(phy_block, fbd->data_map))
-			return -EEXIST;
-
+	} else {
 		log_block |= zone << fbd->block_addr_bits;
 		fbd->block_table[log_block] = phy_block;
-	} else
-		return -EINVAL;
+	}
 
 
 	if (!test_bit(phy_block, fbd->data_map)) {
@@ -281,16 +435,64 @@ int flash_bd_set_full(struct flash_bd *fbd, unsigned int zone,
 	}
 
 	clear_bit(phy_block, fbd->erase_map);
+	flash_bd_map_end(fbd);
+
 	return 0;
 }
 EXPORT_SYMBOL(flash_bd_set_full);
 
+/**
+ * flash_bd_set_open - take over a partially written block found on media
+ * The destination block holds the first page_off pages of log_block, the
+ * rest of which is still in the source block. The pair is set up as the
+ * open block, to be closed (the tail copied and the source erased) like one
+ * left by a write. Returns -EBUSY if there is an open block already.
+ * fbd:       flash_bd to use
+ * zone:      zone of both blocks
+ * log_block: logical block
+ * src_block: complete, older copy of log_block
+ * dst_block: partially written copy
+ * page_off:  number of pages written into dst_block
+ */
+int flash_bd_set_open(struct flash_bd *fbd, unsigned int zone,
+		      unsigned int log_block, unsigned int src_block,
+		      unsigned int dst_block, unsigned int page_off)
+{
+	if (log_block >= fbd->log_block_cnt
+	    || src_block >= fbd->phy_block_cnt
+	    || dst_block >= fbd->phy_block_cnt
+	    || src_block == dst_block
+	    || !page_off || page_off >= fbd->page_cnt)
+		return -EINVAL;
+
+	if (fbd->o_log_block != FLASH_BD_INVALID)
+		return -EBUSY;
+
+	log_block |= zone << fbd->block_addr_bits;
+	src_block |= zone << fbd->block_addr_bits;
+	dst_block |= zone << fbd->block_addr_bits;
+
+	flash_bd_map_begin(fbd);
+	fbd->block_table[log_block] = src_block;
+	flash_bd_mark_used(fbd, src_block);
+	flash_bd_mark_used(fbd, dst_block);
+	flash_bd_map_end(fbd);
+
+	fbd->o_log_block = log_block;
+	fbd->o_src_block = src_block;
+	fbd->o_dst_block = dst_block;
+	fbd->o_page_off = page_off;
+	return 0;
+}
+EXPORT_SYMBOL(flash_bd_set_open);
+
 int flash_bd_start_writing(struct flash_bd *fbd, unsigned long long offset,
 			   unsigned int count)
 {
 	fbd->byte_offset = offset;
 	fbd->t_count = 0;
 	fbd->rem_count = count;
+	fbd->sync = 0;
 
 	fbd->cmd_handler = h_flash_bd_write;
 
@@ -298,6 +500,58 @@ int flash_bd_start_writing(struct flash_bd *fbd, unsigned long long offset,
 }
 EXPORT_SYMBOL(flash_bd_start_writing);
 
+/**
+ * flash_bd_sync - make current write request durable
+ * Any block left open by the current write request will be closed before
+ * the request completes.
+ * fbd: flash_bd to use
+ */
+void flash_bd_sync(struct flash_bd *fbd)
+{
+	fbd->sync = 1;
+}
+EXPORT_SYMBOL(flash_bd_sync);
+
+/**
+ * flash_bd_start_flushing - close the open block, if any
+ * fbd: flash_bd to use
+ */
+int flash_bd_start_flushing(struct flash_bd *fbd)
+{
+	fbd->t_count = 0;
+	fbd->rem_count = 0;
+	fbd->last_count = 0;
+	fbd->last_error = 0;
+	fbd->req_count = 0;
+	fbd->cmd_handler = h_flash_bd_flush;
+
+	return 0;
+}
+EXPORT_SYMBOL(flash_bd_start_flushing);
+
+/**
+ * flash_bd_has_open_block - check whether some data awaits flushing
+ * fbd: flash_bd to use
+ */
+int flash_bd_has_open_block(struct flash_bd *fbd)
+{
+	return fbd->o_log_block != FLASH_BD_INVALID;
+}
+EXPORT_SYMBOL(flash_bd_has_open_block);
+
+/**
+ * flash_bd_lost_pages - count of pages replaced with blank ones
+ * Source pages that cannot be read when an open block is closed are written
+ * out blank, so that the data already in the open block is kept. Returns
+ * the number of such pages since flash_bd_init.
+ * fbd: flash_bd to use
+ */
+unsigned int flash_bd_lost_pages(struct flash_bd *fbd)
+{
+	return fbd->lost_pages;
+}
+EXPORT_SYMBOL(flash_bd_lost_pages);
+
 int flash_bd_start_reading(struct flash_bd *fbd, unsigned long long offset,
 			   unsigned int count)
 {
@@ -315,6 +569,51 @@ int flash_bd_start_reading(struct flash_bd *fbd, unsigned long long offset,
 }
 EXPORT_SYMBOL(flash_bd_start_reading);
 
+/**
+ * flash_bd_plan_read - list media commands needed to read a range in advance
+ * Returns the number of commands stored into plan (at most plan_len), or
+ * -EAGAIN if the range touches the open block (the plan then depends on the
+ * outcome of the block close), or other negative error.
+ * fbd:      flash_bd to use
+ * offset:   byte offset of the range
+ * count:    byte count of the range
+ * plan:     array receiving the commands
+ * plan_len: size of the plan array
+ * left:     receives the byte count at the end of the range not covered by
+ *           the plan, non-zero if plan_len was too small
+ *
+ * Reading never alters the block map, so the returned plan is exactly the
+ * sequence flash_bd_next_req will produce for the same range, as long as no
+ * writing is done in between. Every FBD_READ_TMP is followed by an implied
+ * FBD_FLUSH_TMP, which is not listed.
+ */
+int flash_bd_plan_read(struct flash_bd *fbd, unsigned long long offset,
+		       unsigned int count, struct flash_bd_request *plan,
+		       unsigned int plan_len, unsigned int *left)
+{
+	unsigned int cnt = 0, b_off;
+	int rc;
+
+	while (count && cnt < plan_len) {
+		rc = flash_bd_map_read(fbd, offset, count, &plan[cnt], &b_off);
+		if (rc < 0)
+			return rc;
+
+		if (fbd->o_log_block
+		    == (plan[cnt].log_block
+			| (plan[cnt].zone << fbd->block_addr_bits)))
+			return -EAGAIN;
+
+		offset += rc;
+		count -= rc;
+		cnt++;
+	}
+
+	*left = count;
+	return cnt;
+}
+EXPORT_SYMBOL(flash_bd_plan_read);
+
 int flash_bd_next_req(struct flash_bd *fbd, struct flash_bd_request *req,
 		      unsigned int count, int error)
 {
@@ -328,7 +627,6 @@ int flash_bd_next_req(struct flash_bd *fbd, struct flash_bd_request *req,
 }
 EXPORT_SYMBOL(flash_bd_next_req);
 
-/* Nothing interesting for now */
 unsigned int flash_bd_end(struct flash_bd *fbd)
 {
 	return fbd->t_count;
@@ -477,6 +775,63 @@ ssize_t flash_bd_read_map(struct flash_bd *fbd, char *buf, loff_t offset,
 }
 EXPORT_SYMBOL(flash_bd_read_map);
 
+/**
+ * flash_bd_bin_map_size - size of the binary block map image
+ * fbd: owner of the map
+ */
+size_t flash_bd_bin_map_size(struct flash_bd *fbd)
+{
+	return fbd->map->size;
+}
+EXPORT_SYMBOL(flash_bd_bin_map_size);
+
+/**
+ * flash_bd_read_bin_map - copy out a part of the binary block map image.
+ * Return number of bytes written into buffer.
+ * fbd: owner of the map
+ * buf: where to put the data
+ * offset: offset into the map image
+ * count: size of the buffer
+ */
+ssize_t flash_bd_read_bin_map(struct flash_bd *fbd, char *buf, loff_t offset,
+			      size_t count)
+{
+	if (offset >= fbd->map->size)
+		return 0;
+
+	if (count > (fbd->map->size - offset))
+		count = fbd->map->size - offset;
+
+	memcpy(buf, (void *)fbd->map->header + offset, count);
+	return count;
+}
+EXPORT_SYMBOL(flash_bd_read_bin_map);
+
+/**
+ * flash_bd_mmap_bin_map - map the binary block map image into user space.
+ * The mapping is read-only and remains valid (though frozen) after the
+ * flash_bd is destroyed.
+ * fbd: owner of the map
+ * vma: user space area to use
+ */
+int flash_bd_mmap_bin_map(struct flash_bd *fbd, struct vm_area_struct *vma)
+{
+	int rc;
+
+	if (vma->vm_flags & (VM_WRITE | VM_MAYWRITE))
+		return -EPERM;
+
+	rc = remap_vmalloc_range(vma, fbd->map->header, vma->vm_pgoff);
+	if (rc)
+		return rc;
+
+	vma->vm_private_data = fbd->map;
+	vma->vm_ops = &flash_bd_map_vm_ops;
+	flash_bd_map_vm_open(vma);
+	return 0;
+}
+EXPORT_SYMBOL(flash_bd_mmap_bin_map);
+
 /*** Protocol processing ***/
 
 static unsigned int flash_bd_get_free(struct flash_bd *fbd, unsigned int zone)
@@ -503,13 +858,542 @@ static unsigned int flash_bd_get_free(struct flash_bd *fbd, unsigned int zone)
 		pos++;
 	};
 
+	flash_bd_map_begin(fbd);
 	set_bit(pos, fbd->data_map);
+	flash_bd_map_end(fbd);
 	if (fbd->free_cnt[zone])
 		fbd->free_cnt[zone]--;
 
 	return pos;
 }
 
+/*
+ * Open blocks: a page aligned write, not covering the whole logical block, is
+ * written into a fresh block without copying the rest of the source block.
+ * The destination block stays open, so that the subsequent writes continuing
+ * the stream can go straight into it. Remaining pages are copied from the
+ * source block (and the logical block remapped) only when the block gets
+ * closed: on non-sequential write, read of this logical block, sync write or
+ * explicit flush.
+ */
+
+static int flash_bd_aligned(struct flash_bd *fbd)
+{
+	return !(fbd->buf_offset % fbd->page_size)
+	       && !(fbd->buf_count % fbd->page_size);
+}
+
+static void flash_bd_open_req(struct flash_bd *fbd,
+			      struct flash_bd_request *req,
+			      unsigned int phy_block)
+{
+	req->zone = fbd->o_log_block >> fbd->block_addr_bits;
+	req->log_block = fbd->o_log_block & ((1 << fbd->block_addr_bits) - 1);
+	req->phy_block = phy_block == FLASH_BD_INVALID
+			 ? FLASH_BD_INVALID
+			 : (phy_block & ((1 << fbd->block_addr_bits) - 1));
+}
+
+/* Return partially written destination block to the pool, dirty. */
+static void flash_bd_discard_open(struct flash_bd *fbd)
+{
+	unsigned int zone = fbd->o_dst_block >> fbd->block_addr_bits;
+
+	if (test_bit(fbd->o_dst_block, fbd->data_map))
+		fbd->free_cnt[zone]++;
+
+	flash_bd_map_begin(fbd);
+	clear_bit(fbd->o_dst_block, fbd->data_map);
+	clear_bit(fbd->o_dst_block, fbd->erase_map);
+	flash_bd_map_end(fbd);
+	fbd->o_log_block = FLASH_BD_INVALID;
+}
+
+static int flash_bd_open_next(struct flash_bd *fbd,
+			      struct flash_bd_request *req)
+{
+	fbd->last_error = 0;
+	fbd->last_count = 0;
+	fbd->req_count = 0;
+	return (fbd->o_next)(fbd, req);
+}
+
+static int h_flash_bd_open_next(struct flash_bd *fbd,
+				struct flash_bd_request *req)
+{
+	return flash_bd_open_next(fbd, req);
+}
+
+static int h_flash_bd_open_dropped(struct flash_bd *fbd,
+				   struct flash_bd_request *req)
+{
+	if (fbd->last_error == -EFAULT) {
+		flash_bd_mark_used(fbd, fbd->o_dst_block);
+		flash_bd_open_req(fbd, req, fbd->o_dst_block);
+		fbd->o_log_block = FLASH_BD_INVALID;
+		req->cmd = FBD_MARK_BAD;
+		req->page_off = 0;
+		req->page_cnt = fbd->page_cnt;
+		fbd->req_count = 0;
+		fbd->cmd_handler = h_flash_bd_open_next;
+		return 0;
+	} else if (fbd->last_error)
+		return fbd->last_error;
+
+	flash_bd_mark_erased(fbd, fbd->o_dst_block);
+	fbd->o_log_block = FLASH_BD_INVALID;
+	return flash_bd_open_next(fbd, req);
+}
+
+/*
+ * Drop the open block, as its logical block is about to be rewritten as a
+ * whole. The partial block is erased first: left on the media, it would be
+ * taken for an open block interrupted by removal at the next scan.
+ */
+static int flash_bd_drop_open(struct flash_bd *fbd,
+			      struct flash_bd_request *req,
+			      int (*next)(struct flash_bd *fbd,
+					  struct flash_bd_request *req))
+{
+	fbd->o_next = next;
+	flash_bd_open_req(fbd, req, fbd->o_dst_block);
+	req->cmd = FBD_ERASE;
+	req->page_off = 0;
+	req->page_cnt = 0;
+	fbd->req_count = 0;
+	fbd->cmd_handler = h_flash_bd_open_dropped;
+	return 0;
+}
+
+/*
+ * A page of the open block failed to program. Pages below o_page_off belong
+ * to writes already reported complete, so they are moved to a spare block
+ * before the failed block is retired; the failed step is then retried with
+ * the spare as the destination.
+ */
+static int flash_bd_open_relocate(struct flash_bd *fbd,
+				  struct flash_bd_request *req);
+
+static int h_flash_bd_open_lost(struct flash_bd *fbd,
+				struct flash_bd_request *req)
+{
+	return -EIO;
+}
+
+static int h_flash_bd_open_retired(struct flash_bd *fbd,
+				   struct flash_bd_request *req)
+{
+	/* Failure to mark the block is not fatal: its data is elsewhere. */
+	fbd->o_bad_block = FLASH_BD_INVALID;
+	return (fbd->o_retry)(fbd, req);
+}
+
+static int flash_bd_open_retire(struct flash_bd *fbd,
+				struct flash_bd_request *req)
+{
+	flash_bd_open_req(fbd, req, fbd->o_bad_block);
+	req->cmd = FBD_MARK_BAD;
+	req->page_off = 0;
+	req->page_cnt = fbd->page_cnt;
+	fbd->req_count = 0;
+	fbd->cmd_handler = h_flash_bd_open_retired;
+	return 0;
+}
+
+static int h_flash_bd_open_spare_retired(struct flash_bd *fbd,
+					 struct flash_bd_request *req)
+{
+	return flash_bd_open_relocate(fbd, req);
+}
+
+/* The spare block failed as well: retire it and pick another one. */
+static int flash_bd_open_spare_failed(struct flash_bd *fbd,
+				      struct flash_bd_request *req)
+{
+	flash_bd_mark_used(fbd, fbd->o_dst_block);
+	flash_bd_open_req(fbd, req, fbd->o_dst_block);
+	req->cmd = FBD_MARK_BAD;
+	req->page_off = 0;
+	req->page_cnt = fbd->page_cnt;
+	fbd->req_count = 0;
+	fbd->cmd_handler = h_flash_bd_open_spare_retired;
+	return 0;
+}
+
+static int h_flash_bd_open_moved(struct flash_bd *fbd,
+				 struct flash_bd_request *req)
+{
+	if (!fbd->last_error && (fbd->req_count == fbd->last_count))
+		return flash_bd_open_retire(fbd, req);
+
+	if (fbd->last_error == -EFAULT)
+		return flash_bd_open_spare_failed(fbd, req);
+
+	return fbd->last_error ? fbd->last_error : -EIO;
+}
+
+static int flash_bd_open_move(struct flash_bd *fbd,
+			      struct flash_bd_request *req)
+{
+	if (!fbd->o_page_off)
+		return flash_bd_open_retire(fbd, req);
+
+	flash_bd_open_req(fbd, req, fbd->o_dst_block);
+	req->cmd = FBD_COPY;
+	req->page_off = 0;
+	req->page_cnt = fbd->o_page_off;
+	req->src.phy_block = fbd->o_bad_block
+			     & ((1 << fbd->block_addr_bits) - 1);
+	req->src.page_off = 0;
+	fbd->req_count = fbd->o_page_off * fbd->page_size;
+	fbd->cmd_handler = h_flash_bd_open_moved;
+	return 0;
+}
+
+static int h_flash_bd_open_spare_erased(struct flash_bd *fbd,
+					struct flash_bd_request *req)
+{
+	if (fbd->last_error == -EFAULT)
+		return flash_bd_open_spare_failed(fbd, req);
+	else if (fbd->last_error)
+		return fbd->last_error;
+
+	return flash_bd_open_move(fbd, req);
+}
+
+static int flash_bd_open_relocate(struct flash_bd *fbd,
+				  struct flash_bd_request *req)
+{
+	unsigned int zone = fbd->o_log_block >> fbd->block_addr_bits;
+
+	fbd->o_dst_block = flash_bd_get_free(fbd, zone);
+
+	if (fbd->o_dst_block == FLASH_BD_INVALID) {
+		/* No spare left: the open block data is lost, say so. */
+		fbd->o_dst_block = fbd->o_bad_block;
+		fbd->o_log_block = FLASH_BD_INVALID;
+		flash_bd_open_req(fbd, req, fbd->o_bad_block);
+		req->cmd = FBD_MARK_BAD;
+		req->page_off = 0;
+		req->page_cnt = fbd->page_cnt;
+		fbd->req_count = 0;
+		fbd->cmd_handler = h_flash_bd_open_lost;
+		return 0;
+	}
+
+	if (test_bit(fbd->o_dst_block, fbd->erase_map))
+		return flash_bd_open_move(fbd, req);
+
+	flash_bd_open_req(fbd, req, fbd->o_dst_block);
+	req->cmd = FBD_ERASE;
+	req->page_off = 0;
+	req->page_cnt = 0;
+	fbd->req_count = 0;
+	fbd->cmd_handler = h_flash_bd_open_spare_erased;
+	return 0;
+}
+
+static int flash_bd_open_failed(struct flash_bd *fbd,
+				struct flash_bd_request *req,
+				int (*retry)(struct flash_bd *fbd,
+					     struct flash_bd_request *req))
+{
+	if (fbd->last_error != -EFAULT)
+		return fbd->last_error;
+
+	flash_bd_mark_used(fbd, fbd->o_dst_block);
+	fbd->o_bad_block = fbd->o_dst_block;
+	fbd->o_retry = retry;
+	return flash_bd_open_relocate(fbd, req);
+}
+
+static int h_flash_bd_open_erase_src(struct flash_bd *fbd,
+				     struct flash_bd_request *req)
+{
+	flash_bd_open_req(fbd, req, fbd->o_src_block);
+	fbd->o_log_block = FLASH_BD_INVALID;
+	flash_bd_map_begin(fbd);
+	flash_bd_mark_erased(fbd, fbd->o_src_block);
+	if (fbd->last_error == -EFAULT)
+		flash_bd_mark_used(fbd, fbd->o_src_block);
+	flash_bd_map_end(fbd);
+
+	if (fbd->last_error) {
+		if (fbd->last_error == -EFAULT) {
+			req->cmd = FBD_MARK_BAD;
+			req->page_off = 0;
+			req->page_cnt = fbd->page_cnt;
+			fbd->req_count = 0;
+			fbd->cmd_handler = h_flash_bd_open_next;
+			return 0;
+		} else
+			return fbd->last_error;
+	}
+
+	return flash_bd_open_next(fbd, req);
+}
+
+static int flash_bd_open_commit(struct flash_bd *fbd,
+				struct flash_bd_request *req)
+{
+	flash_bd_map_begin(fbd);
+	fbd->block_table[fbd->o_log_block] = fbd->o_dst_block;
+	flash_bd_mark_used(fbd, fbd->o_dst_block);
+	if (fbd->o_src_block != FLASH_BD_INVALID)
+		clear_bit(fbd->o_src_block, fbd->erase_map);
+	flash_bd_map_end(fbd);
+
+	if (fbd->o_src_block == FLASH_BD_INVALID) {
+		fbd->o_log_block = FLASH_BD_INVALID;
+		return flash_bd_open_next(fbd, req);
+	}
+
+	flash_bd_open_req(fbd, req, fbd->o_src_block);
+	req->cmd = FBD_ERASE;
+	req->page_off = 0;
+	req->page_cnt = 0;
+	fbd->req_count = 0;
+	fbd->cmd_handler = h_flash_bd_open_erase_src;
+	return 0;
+}
+
+static int h_flash_bd_write_next(struct flash_bd *fbd,
+				 struct flash_bd_request *req)
+{
+	if (fbd->rem_count)
+		return h_flash_bd_write(fbd, req);
+
+	if (fbd->sync && (fbd->o_log_block != FLASH_BD_INVALID))
+		return flash_bd_close_open(fbd, req, h_flash_bd_flush);
+
+	req->cmd = FBD_NONE;
+	return 0;
+}
+
+static int flash_bd_open_write(struct flash_bd *fbd,
+			       struct flash_bd_request *req);
+static int flash_bd_open_fill(struct flash_bd *fbd,
+			      struct flash_bd_request *req);
+
+static int h_flash_bd_open_written(struct flash_bd *fbd,
+				   struct flash_bd_request *req)
+{
+	if (fbd->last_error)
+		return flash_bd_open_failed(fbd, req, flash_bd_open_write);
+
+	if (fbd->req_count != fbd->last_count)
+		return -EIO;
+
+	fbd->t_count += fbd->buf_count;
+	fbd->rem_count -= fbd->buf_count;
+	fbd->o_page_off = fbd->buf_page_off + fbd->buf_page_cnt;
+
+	if (fbd->o_page_off == fbd->page_cnt) {
+		fbd->o_next = h_flash_bd_write_next;
+		return flash_bd_open_commit(fbd, req);
+	}
+
+	return h_flash_bd_write_next(fbd, req);
+}
+
+static int h_flash_bd_open_filled(struct flash_bd *fbd,
+				  struct flash_bd_request *req)
+{
+	if (fbd->last_error)
+		return flash_bd_open_failed(fbd, req, flash_bd_open_fill);
+
+	if (fbd->req_count != fbd->last_count)
+		return -EIO;
+
+	fbd->o_page_off += fbd->o_fill_cnt;
+
+	if (fbd->o_page_off == fbd->page_cnt)
+		return flash_bd_open_commit(fbd, req);
+	else
+		return flash_bd_open_write(fbd, req);
+}
+
+static int h_flash_bd_open_fill_t(struct flash_bd *fbd,
+				  struct flash_bd_request *req)
+{
+	if (fbd->last_error)
+		return fbd->last_error;
+
+	if (fbd->req_count != fbd->last_count)
+		return -EIO;
+
+	flash_bd_open_req(fbd, req, fbd->o_dst_block);
+	req->cmd = FBD_WRITE_TMP;
+	req->page_off = fbd->o_page_off;
+	req->page_cnt = fbd->o_fill_cnt;
+	fbd->cmd_handler = h_flash_bd_open_filled;
+	return 0;
+}
+
+static int flash_bd_open_fill_blank(struct flash_bd *fbd,
+				    struct flash_bd_request *req)
+{
+	flash_bd_open_req(fbd, req, FLASH_BD_INVALID);
+	req->cmd = FBD_ERASE_TMP;
+	req->byte_off = 0;
+	req->byte_cnt = fbd->req_count;
+	fbd->cmd_handler = h_flash_bd_open_fill_t;
+	return 0;
+}
+
+static int h_flash_bd_open_fill_r(struct flash_bd *fbd,
+				  struct flash_bd_request *req)
+{
+	/* Unreadable source pages are replaced with blank ones, lest the
+	 * data already written into the open block is lost. They are counted,
+	 * for the owner to report (see flash_bd_lost_pages).
+	 */
+	if (fbd->last_error || (fbd->req_count != fbd->last_count)) {
+		fbd->lost_pages += fbd->o_fill_cnt;
+		return flash_bd_open_fill_blank(fbd, req);
+	}
+
+	return h_flash_bd_open_fill_t(fbd, req);
+}
+
+static int flash_bd_open_read(struct flash_bd *fbd,
+			      struct flash_bd_request *req)
+{
+	fbd->req_count = fbd->o_fill_cnt * fbd->page_size;
+
+	flash_bd_open_req(fbd, req, fbd->o_src_block);
+	req->cmd = FBD_READ_TMP;
+	req->page_off = fbd->o_page_off;
+	req->page_cnt = fbd->o_fill_cnt;
+	fbd->cmd_handler = h_flash_bd_open_fill_r;
+	return 0;
+}
+
+static int h_flash_bd_open_copied(struct flash_bd *fbd,
+				  struct flash_bd_request *req)
+{
+	unsigned int cnt;
+
+	if (!fbd->last_error && (fbd->req_count == fbd->last_count))
+		return h_flash_bd_open_filled(fbd, req);
+
+	if (fbd->last_error == -EFAULT)
+		return flash_bd_open_failed(fbd, req, flash_bd_open_fill);
+
+	/* Pages copied so far are in place; the rest is read through the
+	 * buffer, so that unreadable source pages can be blanked.
+	 */
+	cnt = fbd->last_count / fbd->page_size;
+	fbd->o_page_off += cnt;
+	fbd->o_fill_cnt -= cnt;
+	return flash_bd_open_read(fbd, req);
+}
+
+/* Copy o_fill_cnt pages, starting at o_page_off, from source block. */
+static int flash_bd_open_fill(struct flash_bd *fbd,
+			      struct flash_bd_request *req)
+{
+	fbd->req_count = fbd->o_fill_cnt * fbd->page_size;
+
+	if (fbd->o_src_block == FLASH_BD_INVALID)
+		return flash_bd_open_fill_blank(fbd, req);
+
+	flash_bd_open_req(fbd, req, fbd->o_dst_block);
+	req->cmd = FBD_COPY;
+	req->page_off = fbd->o_page_off;
+	req->page_cnt = fbd->o_fill_cnt;
+	req->src.phy_block = fbd->o_src_block
+			     & ((1 << fbd->block_addr_bits) - 1);
+	req->src.page_off = fbd->o_page_off;
+	fbd->cmd_handler = h_flash_bd_open_copied;
+	return 0;
+}
+
+static int flash_bd_close_open(struct flash_bd *fbd,
+			       struct flash_bd_request *req,
+			       int (*next)(struct flash_bd *fbd,
+					   struct flash_bd_request *req))
+{
+	fbd->o_next = next;
+	fbd->o_fill_cnt = fbd->page_cnt - fbd->o_page_off;
+	return flash_bd_open_fill(fbd, req);
+}
+
+/* Write current buffer into the open block, filling the gap if needed. */
+static int flash_bd_open_write(struct flash_bd *fbd,
+			       struct flash_bd_request *req)
+{
+	if (fbd->buf_page_off > fbd->o_page_off) {
+		fbd->o_fill_cnt = fbd->buf_page_off - fbd->o_page_off;
+		return flash_bd_open_fill(fbd, req);
+	}
+
+	flash_bd_open_req(fbd, req, fbd->o_dst_block);
+	req->cmd = FBD_WRITE;
+	req->page_off = fbd->buf_page_off;
+	req->page_cnt = fbd->buf_page_cnt;
+	fbd->req_count = fbd->buf_count;
+	fbd->cmd_handler = h_flash_bd_open_written;
+	return 0;
+}
+
+static int h_flash_bd_open_erased(struct flash_bd *fbd,
+				  struct flash_bd_request *req)
+{
+	if (fbd->last_error) {
+		if (fbd->last_error == -EFAULT) {
+			flash_bd_mark_used(fbd, fbd->o_dst_block);
+			flash_bd_open_req(fbd, req, fbd->o_dst_block);
+			req->cmd = FBD_MARK_BAD;
+			req->page_off = 0;
+			req->page_cnt = fbd->page_cnt;
+			fbd->req_count = 0;
+			fbd->cmd_handler = h_flash_bd_mark_dst_bad;
+			fbd->o_log_block = FLASH_BD_INVALID;
+			return 0;
+		}
+
+		flash_bd_discard_open(fbd);
+		return fbd->last_error;
+	}
+
+	return flash_bd_open_write(fbd, req);
+}
+
+static int flash_bd_open_block(struct flash_bd *fbd,
+			       struct flash_bd_request *req)
+{
+	fbd->o_log_block = fbd->w_log_block;
+	fbd->o_src_block = fbd->w_src_block;
+	fbd->o_dst_block = fbd->w_dst_block;
+	fbd->o_page_off = 0;
+
+	if (test_bit(fbd->o_dst_block, fbd->erase_map))
+		return flash_bd_open_write(fbd, req);
+
+	flash_bd_open_req(fbd, req, fbd->o_dst_block);
+	req->cmd = FBD_ERASE;
+	req->page_off = 0;
+	req->page_cnt = 0;
+	fbd->req_count = 0;
+	fbd->cmd_handler = h_flash_bd_open_erased;
+	return 0;
+}
+
+static int h_flash_bd_flush(struct flash_bd *fbd,
+			    struct flash_bd_request *req)
+{
+	if (fbd->last_error)
+		return fbd->last_error;
+
+	if (fbd->o_log_block == FLASH_BD_INVALID) {
+		req->cmd = FBD_NONE;
+		return 0;
+	}
+
+	return flash_bd_close_open(fbd, req, h_flash_bd_flush);
+}
+
 static int h_flash_bd_read_tmp_r(struct flash_bd *fbd,
 			         struct flash_bd_request *req)
 {
@@ -530,10 +1414,56 @@ static int h_flash_bd_read_tmp_r(struct flash_bd *fbd,
 	return 0;
 }
 
+/*
+ * Work out the media command needed to read "count" bytes at "offset", up to
+ * the end of the logical block. Returns the number of bytes covered by the
+ * command and the in-block offset via "buf_offset".
+ */
+static int flash_bd_map_read(struct flash_bd *fbd, unsigned long long offset,
+			     unsigned int count, struct flash_bd_request *req,
+			     unsigned int *buf_offset)
+{
+	unsigned long long zone_off = offset;
+	unsigned int b_off, b_cnt, p_off, p_cnt;
+
+	b_off = do_div(zone_off, fbd->block_size);
+	req->log_block = do_div(zone_off, fbd->log_block_cnt);
+	req->zone = zone_off;
+
+	if (req->zone >= fbd->zone_cnt)
+		return -ENOSPC;
+
+	b_cnt = min(count, fbd->block_size - b_off);
+	*buf_offset = b_off;
+
+	req->phy_block = flash_bd_get_physical(fbd, req->zone, req->log_block);
+
+	if (req->phy_block == FLASH_BD_INVALID) {
+		req->cmd = FBD_SKIP;
+		req->byte_off = 0;
+		req->byte_cnt = b_cnt;
+		return b_cnt;
+	}
+
+	p_off = b_off / fbd->page_size;
+	p_cnt = ((b_off + b_cnt) / fbd->page_size) - p_off;
+	if ((b_off + b_cnt) % fbd->page_size)
+		p_cnt++;
+
+	req->page_off = p_off;
+	req->page_cnt = p_cnt;
+
+	if ((b_off % fbd->page_size) || (b_cnt % fbd->page_size))
+		req->cmd = FBD_READ_TMP;
+	else
+		req->cmd = FBD_READ;
+
+	return b_cnt;
+}
+
 static int h_flash_bd_read(struct flash_bd *fbd, struct flash_bd_request *req)
 {
-	unsigned long long zone_off;
-	unsigned int log_block;
+	int rc;
 
 	if (fbd->last_error)
 		return fbd->last_error;
@@ -549,48 +1479,32 @@ static int h_flash_bd_read(struct flash_bd *fbd, struct flash_bd_request *req)
 		return 0;
 	}
 
-	zone_off = fbd->byte_offset + fbd->t_count;
-	fbd->buf_offset = do_div(zone_off, fbd->block_size);
-	log_block = do_div(zone_off, fbd->log_block_cnt);
-
-	req->zone = zone_off;
-
-	if (req->zone >= fbd->zone_cnt)
-		return -ENOSPC;
-
-	fbd->buf_count = min(fbd->rem_count, fbd->block_size - fbd->buf_offset);
-
-	fbd->buf_page_off = fbd->buf_offset / fbd->page_size;
-	fbd->buf_page_cnt = ((fbd->buf_offset + fbd->buf_count)
-			     / fbd->page_size) - fbd->buf_page_off;
-	if ((fbd->buf_offset + fbd->buf_count) % fbd->page_size)
-		fbd->buf_page_cnt++;
+	rc = flash_bd_map_read(fbd, fbd->byte_offset + fbd->t_count,
+			       fbd->rem_count, req, &fbd->buf_offset);
+	if (rc < 0)
+		return rc;
 
-	req->log_block = log_block;
+	fbd->buf_count = rc;
 
-	req->phy_block = flash_bd_get_physical(fbd, zone_off, log_block);
+	if (fbd->o_log_block
+	    == (req->log_block | (req->zone << fbd->block_addr_bits))) {
+		return flash_bd_close_open(fbd, req, h_flash_bd_read);
+	}
 
-	if (req->phy_block == FLASH_BD_INVALID) {
-		req->cmd = FBD_SKIP;
-		req->byte_off = 0;
-		req->byte_cnt = fbd->buf_count;
+	if (req->cmd == FBD_SKIP) {
 		fbd->req_count = fbd->buf_count;
 		fbd->cmd_handler = h_flash_bd_read;
 		return 0;
 	}
 
-	req->page_off = fbd->buf_page_off;
-	req->page_cnt = fbd->buf_page_cnt;
+	fbd->buf_page_off = req->page_off;
+	fbd->buf_page_cnt = req->page_cnt;
 	fbd->req_count = fbd->buf_page_cnt * fbd->page_size;
 
-	if ((fbd->buf_offset % fbd->page_size)
-	    || (fbd->buf_count % fbd->page_size)) {
-		req->cmd = FBD_READ_TMP;
+	if (req->cmd == FBD_READ_TMP)
 		fbd->cmd_handler = h_flash_bd_read_tmp_r;
-	} else {
-		req->cmd = FBD_READ;
+	else
 		fbd->cmd_handler = h_flash_bd_read;
-	}
 
 	return 0;
 }
@@ -661,11 +1575,14 @@ static int h_flash_bd_erase_src(struct flash_bd *fbd,
 	req->phy_block = fbd->w_src_block
 			 & ((1 << fbd->block_addr_bits) - 1);
 
+	flash_bd_map_begin(fbd);
 	flash_bd_mark_erased(fbd, fbd->w_src_block);
+	if (fbd->last_error == -EFAULT)
+		flash_bd_mark_used(fbd, fbd->w_src_block);
+	flash_bd_map_end(fbd);
 
 	if (fbd->last_error) {
 		if (fbd->last_error == -EFAULT) {
-			flash_bd_mark_used(fbd, fbd->w_src_block);
 			req->cmd = FBD_MARK_BAD;
 			req->page_off = 0;
 			req->page_cnt = fbd->page_cnt;
@@ -705,13 +1622,18 @@ static int h_flash_bd_write_inc(struct flash_bd *fbd,
 	} else
 		return fbd->last_error;
 
+	flash_bd_map_begin(fbd);
 	fbd->block_table[fbd->w_log_block] = fbd->w_dst_block;
+	if ((fbd->w_src_block != fbd->w_dst_block)
+	    && (fbd->w_src_block != FLASH_BD_INVALID))
+		clear_bit(fbd->w_src_block, fbd->erase_map);
+	flash_bd_map_end(fbd);
+
 	fbd->t_count += fbd->buf_count;
 	fbd->rem_count -= fbd->buf_count;
 
 	if ((fbd->w_src_block != fbd->w_dst_block)
 	    && (fbd->w_src_block != FLASH_BD_INVALID)) {
-		clear_bit(fbd->w_src_block, fbd->erase_map);
 		req->cmd = FBD_ERASE;
 		req->phy_block = fbd->w_src_block
 				 & ((1 <<  fbd->block_addr_bits) - 1);
@@ -806,12 +1728,33 @@ static int h_flash_bd_write(struct flash_bd *fbd,
 	if (fbd->w_src_block != FLASH_BD_INVALID)
 		fbd->w_src_block |= req->zone << fbd->block_addr_bits;
 
+	if (fbd->o_log_block != FLASH_BD_INVALID) {
+		if ((fbd->o_log_block != fbd->w_log_block)
+		    || !flash_bd_aligned(fbd))
+			return flash_bd_close_open(fbd, req, h_flash_bd_write);
+
+		if (fbd->buf_page_off >= fbd->o_page_off)
+			return flash_bd_open_write(fbd, req);
+
+		/* Whole block is rewritten - no point in keeping the old
+		 * partial one.
+		 */
+		if (fbd->buf_count == fbd->block_size)
+			return flash_bd_drop_open(fbd, req, h_flash_bd_write);
+		else
+			return flash_bd_close_open(fbd, req, h_flash_bd_write);
+	}
+
 	fbd->w_dst_block = flash_bd_get_free(fbd, zone_off);
 	if (fbd->w_dst_block == FLASH_BD_INVALID)
 		fbd->w_dst_block = fbd->w_src_block;
 	if (fbd->w_dst_block == FLASH_BD_INVALID)
 		return -EIO;
 
+	if (open_blocks && (fbd->w_dst_block != fbd->w_src_block)
+	    && (fbd->buf_count < fbd->block_size) && flash_bd_aligned(fbd))
+		return flash_bd_open_block(fbd, req);
+
 	if ((fbd->w_dst_block != fbd->w_src_block)
 	    || (fbd->buf_count == fbd->block_size)) {
 
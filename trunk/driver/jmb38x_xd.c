@@ -24,6 +24,19 @@
 #define PCI_DEVICE_ID_JMICRON_JMB38X_XD 0x2384
 #define DRIVER_NAME "jmb38x_xd"
 
+/* Advertise copy-back to xd_card; the controller's copy-back support is
+ * undocumented, so this stays off unless asked for.
+ */
+static int copy_back;
+module_param(copy_back, bool, 0644);
+
+/* Page extra areas to fetch with one READ3 on media needing software ECC;
+ * how the controller transfers several extra areas is undocumented, so
+ * batching stays off unless asked for.
+ */
+static unsigned int extra_batch;
+module_param(extra_batch, uint, 0444);
+
 enum {
 	DMA_ADDRESS       = 0x00,
 	HOST_CONTROL      = 0x04,
@@ -680,6 +693,11 @@ static int jmb38x_xd_probe(struct pci_dev *pdev,
 	host->caps = XD_CARD_CAP_AUTO_ECC | XD_CARD_CAP_FIXED_EXTRA
 		     | XD_CARD_CAP_CMD_SHORTCUT;
 
+	if (copy_back)
+		host->caps |= XD_CARD_CAP_COPY_BACK;
+
+	host->extra_batch = extra_batch;
+
 	pci_set_drvdata(pdev, host);
 
 	snprintf(jhost->id, DEVICE_ID_SIZE, DRIVER_NAME);
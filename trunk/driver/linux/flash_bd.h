@@ -25,6 +25,48 @@
 
 struct flash_bd;
 
+#define FLASH_BD_MAP_MAGIC   0x4d444246 /* "FBDM" in host byte order */
+#define FLASH_BD_MAP_VERSION 1
+
+/*
+ * Binary block map, exported read-only (and mmap-able) for monitoring tools.
+ * The header is followed by the live translation tables, so reading the map
+ * involves no formatting at all. All values are in host byte order (check
+ * the magic to detect the byte order) and offsets are in bytes, counting
+ * from the start of the header.
+ *
+ * table:     u32 entry for each (zone << block_addr_bits | log_block), holding
+ *            (zone << block_addr_bits | phy_block) or FLASH_BD_INVALID
+ * data_map:  bitmap of (zone << block_addr_bits | phy_block), set if block
+ *            holds data (or is bad)
+ * erase_map: same as above, set if block is known to be erased
+ *
+ * Bitmaps are arrays of word_size-sized words, bit n being bit (n % word bits)
+ * of word (n / word bits). The generation counter is a sequence counter: it
+ * is odd while the mapping is being updated and is advanced again when the
+ * update is complete. A consistent snapshot is one copied while generation
+ * was even and unchanged from before the copy to after it.
+ */
+struct flash_bd_map_header {
+	__u32 magic;
+	__u16 version;
+	__u16 header_size;
+	__u32 generation;
+	__u32 zone_cnt;
+	__u32 phy_block_cnt;
+	__u32 log_block_cnt;
+	__u32 block_addr_bits;
+	__u32 word_size;
+	__u32 table_offset;
+	__u32 data_map_offset;
+	__u32 erase_map_offset;
+	__u32 map_size;
+} __attribute__((packed));
+
+#ifdef __KERNEL__
+
+struct vm_area_struct;
+
 enum flash_bd_cmd {
 	FBD_NONE = 0,
 	FBD_READ,           /* read from media                               */
@@ -104,6 +146,9 @@ int flash_bd_set_empty(struct flash_bd *fbd, unsigned int zone,
 		       unsigned int phy_block, int erased);
 int flash_bd_set_full(struct flash_bd *fbd, unsigned int zone,
 		      unsigned int phy_block, unsigned int log_block);
+int flash_bd_set_open(struct flash_bd *fbd, unsigned int zone,
+		      unsigned int log_block, unsigned int src_block,
+		      unsigned int dst_block, unsigned int page_off);
 unsigned int flash_bd_get_physical(struct flash_bd *fbd, unsigned int zone,
 				   unsigned int log_block);
 int flash_bd_next_req(struct flash_bd *fbd, struct flash_bd_request *req,
@@ -111,9 +156,22 @@ int flash_bd_next_req(struct flash_bd *fbd, struct flash_bd_request *req,
 unsigned int flash_bd_end(struct flash_bd *fbd);
 int flash_bd_start_reading(struct flash_bd *fbd, unsigned long long offset,
 			   unsigned int count);
+int flash_bd_plan_read(struct flash_bd *fbd, unsigned long long offset,
+		       unsigned int count, struct flash_bd_request *plan,
+		       unsigned int plan_len, unsigned int *left);
 int flash_bd_start_writing(struct flash_bd *fbd, unsigned long long offset,
 			   unsigned int count);
+void flash_bd_sync(struct flash_bd *fbd);
+int flash_bd_start_flushing(struct flash_bd *fbd);
+int flash_bd_has_open_block(struct flash_bd *fbd);
+unsigned int flash_bd_lost_pages(struct flash_bd *fbd);
 size_t flash_bd_map_size(struct flash_bd *fbd);
 ssize_t flash_bd_read_map(struct flash_bd *fbd, char *buf, loff_t offset,
 			  size_t count);
+size_t flash_bd_bin_map_size(struct flash_bd *fbd);
+ssize_t flash_bd_read_bin_map(struct flash_bd *fbd, char *buf, loff_t offset,
+			      size_t count);
+int flash_bd_mmap_bin_map(struct flash_bd *fbd, struct vm_area_struct *vma);
+
+#endif /* __KERNEL__ */
 #endif
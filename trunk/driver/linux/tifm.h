@@ -111,6 +111,10 @@ struct tifm_dev {
 	void          (*card_event)(struct tifm_dev *sock);
 	void          (*data_event)(struct tifm_dev *sock);
 
+	/* Socket events pending dispatch, protected by adapter lock */
+	unsigned int          irq_status;
+	struct tasklet_struct event_tasklet;
+
 	struct device dev;
 };
 
@@ -132,6 +136,7 @@ struct tifm_adapter {
 	unsigned int        socket_change_set;
 	unsigned int        id;
 	unsigned int        num_sockets;
+	unsigned int        suspended;
 	struct completion   *finish_me;
 
 	struct work_struct  media_switcher;
@@ -163,6 +168,10 @@ int tifm_map_sg(struct tifm_dev *sock, struct scatterlist *sg, int nents,
 		int direction);
 void tifm_unmap_sg(struct tifm_dev *sock, struct scatterlist *sg, int nents,
 		   int direction);
+void tifm_sync_sg_for_cpu(struct tifm_dev *sock, struct scatterlist *sg,
+			  int nents, int direction);
+void tifm_sync_sg_for_device(struct tifm_dev *sock, struct scatterlist *sg,
+			     int nents, int direction);
 void tifm_queue_work(struct work_struct *work);
 
 static inline void *tifm_get_drvdata(struct tifm_dev *dev)
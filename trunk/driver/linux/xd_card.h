@@ -69,6 +69,7 @@ enum {
 	XD_CARD_CMD_PAGE_PROG   = 0x10,
 	XD_CARD_CMD_DUMMY_PROG  = 0x11,
 	XD_CARD_CMD_MULTI_PROG  = 0x15,
+	XD_CARD_CMD_COPY_PROG   = 0x8a,
 	XD_CARD_CMD_ERASE_SET   = 0x60,
 	XD_CARD_CMD_ERASE_START = 0xd0,
 	XD_CARD_CMD_STATUS1     = 0x70,
@@ -126,10 +127,12 @@ struct xd_card_media {
 	struct request_queue    *queue;
 	spinlock_t              q_lock;
 	struct task_struct      *f_thread;
+	struct task_struct      *s_thread;
 	struct request          *block_req;
 	struct flash_bd_request flash_req;
 	struct flash_bd         *fbd;
 	struct bin_attribute    dev_attr_block_map;
+	struct bin_attribute    dev_attr_block_map_bin;
 	struct xd_card_request  req;
 	struct completion       req_complete;
 	int                   (*next_request[2])(struct xd_card_media *card,
@@ -138,12 +141,21 @@ struct xd_card_media {
 	unsigned char           mask_rom:1,
 				sm_media:1,
 				read_only:1,
-				auto_ecc:1;
+				auto_ecc:1,
+				copy_back:1,
+				w_extra_ready:1;
 
 	/* These bits must be protected by q_lock */
 	unsigned char           has_request:1,
 				format:1,
-				eject:1;
+				eject:1,
+				scan_failed:1;
+
+	/* Time of the last write leaving a block open, protected by q_lock */
+	unsigned long           w_stamp;
+
+	/* flash_bd_lost_pages count already reported */
+	unsigned int            lost_pages;
 
 	unsigned char           page_addr_bits;
 	unsigned char           block_addr_bits;
@@ -178,6 +190,27 @@ struct xd_card_media {
 	unsigned int            trans_cnt;
 	unsigned int            trans_len;
 	unsigned char           *t_buf;
+
+	/* Background LUT scan position; zones below scan_zone are ready.
+	 * scan_zone must be protected by q_lock.
+	 */
+	unsigned int            scan_zone;
+	unsigned int            scan_block;
+	/* Requests waiting for the scan to reach their zone, protected by
+	 * q_lock.
+	 */
+	struct list_head        held_reqs;
+
+	/* Batched software ECC reads (see xd_card_host.extra_batch) */
+	unsigned int            extra_batch;
+	unsigned int            run_pos;
+	unsigned int            run_len;
+	struct xd_card_extra    *e_buf;
+
+	/* Extra data of the next page to write, prepared while the current
+	 * one is being programmed.
+	 */
+	struct xd_card_extra    w_extra;
 };
 
 enum xd_card_param {
@@ -198,6 +231,7 @@ struct xd_card_host {
 	struct device           *dev;
 	struct mutex            lock;
 	struct work_struct      media_checker;
+	struct delayed_work     flush_work;
 	struct xd_card_media    *card;
 	struct xd_card_extra    extra;
 	unsigned int            extra_pos;
@@ -207,6 +241,17 @@ struct xd_card_host {
 #define XD_CARD_CAP_AUTO_ECC     1
 #define XD_CARD_CAP_FIXED_EXTRA  2
 #define XD_CARD_CAP_CMD_SHORTCUT 4
+/* Host can issue address only XD_CARD_CMD_READ1 (no data phase), and treats
+ * XD_CARD_CMD_COPY_PROG the same way as XD_CARD_CMD_INPUT.
+ */
+#define XD_CARD_CAP_COPY_BACK    8
+
+	/* Maximal number of page extra areas the host can fetch with a single
+	 * XD_CARD_CMD_READ3 data request (extra areas are transferred back to
+	 * back into the request sg). Zero if not supported. Only used for
+	 * media requiring software ECC.
+	 */
+	unsigned int            extra_batch;
 
 	/* Notify the host that some flash memory requests are pending. */
 	void (*request)(struct xd_card_host *host);
@@ -26,6 +26,9 @@
 static int major = 0;
 module_param(major, int, 0644);
 
+static int direct_dispatch = 1;
+module_param(direct_dispatch, int, 0444);
+
 #define MS_BLOCK_MAX_SEGS      32
 #define MS_BLOCK_MAX_PAGES     ((2 << 16) - 1)
 
@@ -34,6 +37,7 @@ module_param(major, int, 0644);
 #define MS_BLOCK_INVALID       0xffff
 
 #define MS_BLOCK_MAP_LINE_SZ   16
+#define MS_BLOCK_LAT_BUCKETS   16
 
 struct ms_boot_header {
 	unsigned short block_id;
@@ -147,6 +151,7 @@ struct ms_block_data {
 
 	struct gendisk           *disk;
 	struct request_queue     *queue;
+	struct request           *block_req;
 	spinlock_t               q_lock;
 	wait_queue_head_t        q_wait;
 	struct task_struct       *q_thread;
@@ -161,13 +166,17 @@ struct ms_block_data {
 				 active:1,
 				 has_request:1,
 				 physical_src:1,
-				 format_media:1;
+				 format_media:1,
+				 direct_dispatch:1,
+				 async_req:1,
+				 recover_block:1;
 
 	struct ms_boot_attr_info boot_attr;
 	struct ms_cis_idi        cis_idi;
 
 	struct bin_attribute     dev_attr_logical_block_map;
 	struct bin_attribute     dev_attr_physical_block_map;
+	unsigned int             req_latency[MS_BLOCK_LAT_BUCKETS];
 
 	int                      (*mrq_handler)(struct memstick_dev *card,
 						struct memstick_request **mrq);
@@ -177,6 +186,7 @@ struct ms_block_data {
 	unsigned short           current_seg;
 	unsigned short           current_page;
 	struct ms_extra_data_register current_extra;
+	struct ms_param_register copy_param[2];
 	unsigned short           src_block;
 	unsigned short           dst_block;
 	unsigned short           total_page_cnt;
@@ -499,9 +509,49 @@ static ssize_t ms_format_store(struct device *dev,
 	return count;
 }
 
+static ssize_t ms_request_latency_show(struct device *dev,
+				       struct device_attribute *attr,
+				       char *buf)
+{
+	struct ms_block_data *msb
+		= memstick_get_drvdata(container_of(dev, struct memstick_dev,
+						    dev));
+	ssize_t rc = 0;
+	int cnt;
+
+	rc += sprintf(buf, "dispatch: %s\n",
+		      msb->direct_dispatch ? "direct" : "thread");
+
+	for (cnt = 0; cnt < (MS_BLOCK_LAT_BUCKETS - 1); cnt++)
+		rc += sprintf(buf + rc, "< %u ms: %u\n", 1U << cnt,
+			      msb->req_latency[cnt]);
+
+	rc += sprintf(buf + rc, ">= %u ms: %u\n",
+		      1U << (MS_BLOCK_LAT_BUCKETS - 2),
+		      msb->req_latency[MS_BLOCK_LAT_BUCKETS - 1]);
+	return rc;
+}
+
+static ssize_t ms_request_latency_store(struct device *dev,
+					struct device_attribute *attr,
+					const char *buf, size_t count)
+{
+	struct ms_block_data *msb
+		= memstick_get_drvdata(container_of(dev, struct memstick_dev,
+						    dev));
+	unsigned long flags;
+
+	spin_lock_irqsave(&msb->q_lock, flags);
+	memset(msb->req_latency, 0, sizeof(msb->req_latency));
+	spin_unlock_irqrestore(&msb->q_lock, flags);
+	return count;
+}
+
 static DEVICE_ATTR(boot_attr, S_IRUGO, ms_boot_attr_show, NULL);
 static DEVICE_ATTR(cis_idi, S_IRUGO, ms_cis_idi_show, NULL);
 static DEVICE_ATTR(format, S_IRUGO | S_IWUSR, ms_format_show, ms_format_store);
+static DEVICE_ATTR(request_latency, S_IRUGO | S_IWUSR, ms_request_latency_show,
+		   ms_request_latency_store);
 
 static ssize_t ms_block_log_block_map_read(struct kobject *kobj,
 					   struct bin_attribute *attr,
@@ -639,14 +689,14 @@ static int h_ms_block_write_next_state(struct memstick_dev *card,
 				       struct memstick_request **mrq);
 static int h_ms_block_set_extra(struct memstick_dev *card,
 				struct memstick_request **mrq);
+static int ms_block_complete_req(struct memstick_dev *card, int error);
 
 static int h_ms_block_default(struct memstick_dev *card,
 			      struct memstick_request **mrq)
 {
-	if ((*mrq)->error) {
-		complete(&card->mrq_complete);
-		return (*mrq)->error;
-	} else
+	if ((*mrq)->error)
+		return ms_block_complete_req(card, (*mrq)->error);
+	else
 		return h_ms_block_write_next_state(card, mrq);
 }
 
@@ -655,10 +705,8 @@ static int h_ms_block_write_single(struct memstick_dev *card,
 {
 	unsigned char t_val = MS_CMD_BLOCK_WRITE;
 
-	if ((*mrq)->error) {
-		complete(&card->mrq_complete);
-		return (*mrq)->error;
-	}
+	if ((*mrq)->error)
+		return ms_block_complete_req(card, (*mrq)->error);
 
 	switch ((*mrq)->tpc) {
 	case MS_TPC_WRITE_REG:
@@ -679,10 +727,8 @@ has_int_reg:
 		else if (t_val & MEMSTICK_INT_ERR)
 			(*mrq)->error = -EROFS;
 
-		if ((*mrq)->error) {
-			complete(&card->mrq_complete);
-			return (*mrq)->error;
-		}
+		if ((*mrq)->error)
+			return ms_block_complete_req(card, (*mrq)->error);
 
 		if (t_val & MEMSTICK_INT_CED)
 			return h_ms_block_write_next_state(card, mrq);
@@ -698,14 +744,10 @@ static int h_ms_block_copy_write(struct memstick_dev *card,
 				 struct memstick_request **mrq)
 {
 	struct ms_block_data *msb = memstick_get_drvdata(card);
-	struct ms_param_register param;
-	unsigned short src_phy_block;
 	unsigned char t_val = MS_CMD_BLOCK_WRITE;
 
-	if ((*mrq)->error) {
-		complete(&card->mrq_complete);
-		return (*mrq)->error;
-	}
+	if ((*mrq)->error)
+		return ms_block_complete_req(card, (*mrq)->error);
 
 	switch ((*mrq)->tpc) {
 	case MS_TPC_WRITE_REG:
@@ -726,10 +768,8 @@ has_int_reg:
 		else if (t_val & MEMSTICK_INT_ERR)
 			(*mrq)->error = -EROFS;
 
-		if ((*mrq)->error) {
-			complete(&card->mrq_complete);
-			return (*mrq)->error;
-		}
+		if ((*mrq)->error)
+			return ms_block_complete_req(card, (*mrq)->error);
 
 		if (t_val & MEMSTICK_INT_CED) {
 			msb->copy_pos++;
@@ -738,21 +778,11 @@ has_int_reg:
 			if (msb->copy_pos == msb->block_psize)
 				return h_ms_block_write_next_state(card, mrq);
 
-			src_phy_block = msb->src_block;
-			if (!msb->physical_src)
-				src_phy_block = ms_block_physical(msb,
-								  src_phy_block);
-
 			card->next_request = h_ms_block_copy_read;
-			param = (struct ms_param_register){
-				.system = msb->system,
-				.block_address_msb = 0,
-				.block_address = cpu_to_be16(src_phy_block),
-				.cp = MEMSTICK_CP_PAGE,
-				.page_address = msb->copy_pos
-			};
+			msb->copy_param[0].page_address = msb->copy_pos;
 			memstick_init_req(*mrq, MS_TPC_WRITE_REG,
-					  &param, sizeof(param));
+					  &msb->copy_param[0],
+					  sizeof(struct ms_param_register));
 		}
 		break;
 	default:
@@ -761,26 +791,55 @@ has_int_reg:
 	return 0;
 }
 
+/*
+ * Page copy relies on the card's page buffer: BLOCK_READ loads the source
+ * page into it and the following BLOCK_WRITE programs it into the
+ * destination, so page data never crosses the host bus. Only one page buffer
+ * exists and the card is busy until CED, so the read of page N + 1 can not
+ * be overlapped with the program of page N; instead the per-page command
+ * chain is kept as short as possible. Both parameter registers are prepared
+ * once per block (copy_param[0] - source, copy_param[1] - destination) and
+ * the status register is only fetched when the card reports an error.
+ */
 static int h_ms_block_copy_read(struct memstick_dev *card,
 				struct memstick_request **mrq)
 {
 	struct ms_block_data *msb = memstick_get_drvdata(card);
 	struct ms_status_register *status;
-	struct ms_param_register param;
 	unsigned char t_val = MS_CMD_BLOCK_READ;
 
-	if ((*mrq)->error) {
-		complete(&card->mrq_complete);
-		return (*mrq)->error;
-	}
+	if ((*mrq)->error)
+		return ms_block_complete_req(card, (*mrq)->error);
 
 	switch ((*mrq)->tpc) {
 	case MS_TPC_WRITE_REG:
 		memstick_init_req(*mrq, MS_TPC_SET_CMD, &t_val, 1);
-		break;
+		(*mrq)->get_int_reg = 1;
+		return 0;
 	case MS_TPC_SET_CMD:
-		memstick_init_req(*mrq, MS_TPC_READ_REG, NULL,
-				  sizeof(struct ms_status_register));
+		t_val = (*mrq)->int_reg;
+		memstick_init_req(*mrq, MS_TPC_GET_INT, NULL, 1);
+		if (card->host->caps & MEMSTICK_CAP_AUTO_GET_INT)
+			goto has_int_reg;
+		return 0;
+	case MS_TPC_GET_INT:
+		t_val = (*mrq)->data[0];
+has_int_reg:
+		if (t_val & MEMSTICK_INT_CMDNAK) {
+			(*mrq)->error = -EFAULT;
+			return ms_block_complete_req(card, (*mrq)->error);
+		}
+
+		if (t_val & MEMSTICK_INT_ERR) {
+			/* correctable errors are fine, find out which */
+			memstick_init_req(*mrq, MS_TPC_READ_REG, NULL,
+					  sizeof(struct ms_status_register));
+			return 0;
+		}
+
+		if (!(t_val & MEMSTICK_INT_CED))
+			return 0;
+
 		break;
 	case MS_TPC_READ_REG:
 		status = (struct ms_status_register*)card->current_mrq.data;
@@ -794,26 +853,17 @@ static int h_ms_block_copy_read(struct memstick_dev *card,
 			   | MEMSTICK_STATUS1_UCDT)))
 			(*mrq)->error = -EFAULT;
 
-		if ((*mrq)->error) {
-			complete(&card->mrq_complete);
-			return (*mrq)->error;
-		}
-
-		card->next_request = h_ms_block_copy_write;
-		param = (struct ms_param_register){
-			.system = msb->system,
-			.block_address_msb = 0,
-			.block_address = cpu_to_be16(msb->dst_block),
-			.cp = MEMSTICK_CP_PAGE,
-			.page_address = msb->copy_pos
-		};
-		memstick_init_req(*mrq, MS_TPC_WRITE_REG,
-				  &param, sizeof(param));
+		if ((*mrq)->error)
+			return ms_block_complete_req(card, (*mrq)->error);
 		break;
 	default:
 		BUG();
 	};
 
+	card->next_request = h_ms_block_copy_write;
+	msb->copy_param[1].page_address = msb->copy_pos;
+	memstick_init_req(*mrq, MS_TPC_WRITE_REG, &msb->copy_param[1],
+			  sizeof(struct ms_param_register));
 	return 0;
 }
 
@@ -825,10 +875,8 @@ static int h_ms_block_write_pages(struct memstick_dev *card,
 	struct scatterlist t_sg = { 0 };
 	unsigned char t_val = MS_CMD_BLOCK_WRITE;
 
-	if ((*mrq)->error) {
-		complete(&card->mrq_complete);
-		return (*mrq)->error;
-	}
+	if ((*mrq)->error)
+		return ms_block_complete_req(card, (*mrq)->error);
 
 	switch ((*mrq)->tpc) {
 	case MS_TPC_WRITE_LONG_DATA:
@@ -860,10 +908,8 @@ has_int_reg:
 		else if (t_val & MEMSTICK_INT_ERR)
 			(*mrq)->error = -EROFS;
 
-		if ((*mrq)->error) {
-			complete(&card->mrq_complete);
-			return (*mrq)->error;
-		}
+		if ((*mrq)->error)
+			return ms_block_complete_req(card, (*mrq)->error);
 
 		if (t_val & MEMSTICK_INT_CED) {
 			msb->current_page++;
@@ -964,15 +1010,23 @@ get_next_block:
 
 		if (msb->w_state == COPY_PAGES) {
 			card->next_request = h_ms_block_copy_read;
-			param = (struct ms_param_register){
+			msb->copy_param[0] = (struct ms_param_register){
 				.system = msb->system,
 				.block_address_msb = 0,
 				.block_address = cpu_to_be16(src_phy_block),
 				.cp = MEMSTICK_CP_PAGE,
 				.page_address = msb->copy_pos
 			};
+			msb->copy_param[1] = (struct ms_param_register){
+				.system = msb->system,
+				.block_address_msb = 0,
+				.block_address = cpu_to_be16(msb->dst_block),
+				.cp = MEMSTICK_CP_PAGE,
+				.page_address = msb->copy_pos
+			};
 			memstick_init_req(*mrq, MS_TPC_WRITE_REG,
-					  &param, sizeof(param));
+					  &msb->copy_param[0],
+					  sizeof(struct ms_param_register));
 			return 0;
 		}
 		/* Deliberate fall-through */
@@ -1060,8 +1114,7 @@ get_next_block:
 		BUG();
 	}
 
-	complete(&card->mrq_complete);
-	return -EAGAIN;
+	return ms_block_complete_req(card, (*mrq)->error);
 }
 
 static int h_ms_block_req_init(struct memstick_dev *card,
@@ -1074,16 +1127,19 @@ static int h_ms_block_req_init(struct memstick_dev *card,
 	return 0;
 }
 
+static int h_ms_block_default_bad(struct memstick_dev *card,
+				  struct memstick_request **mrq)
+{
+	return -ENXIO;
+}
 
 static int h_ms_block_get_ro(struct memstick_dev *card,
 			     struct memstick_request **mrq)
 {
 	struct ms_block_data *msb = memstick_get_drvdata(card);
 
-	if ((*mrq)->error) {
-		complete(&card->mrq_complete);
-		return (*mrq)->error;
-	}
+	if ((*mrq)->error)
+		return ms_block_complete_req(card, (*mrq)->error);
 
 	if ((*mrq)->data[offsetof(struct ms_status_register, status0)]
 	    & MEMSTICK_STATUS0_WP)
@@ -1091,8 +1147,7 @@ static int h_ms_block_get_ro(struct memstick_dev *card,
 	else
 		msb->read_only = 0;
 
-	complete(&card->mrq_complete);
-	return -EAGAIN;
+	return ms_block_complete_req(card, 0);
 }
 
 static int h_ms_block_read_pages(struct memstick_dev *card,
@@ -1111,10 +1166,8 @@ static int h_ms_block_read_pages(struct memstick_dev *card,
 		.page_address = 0
 	};
 
-	if ((*mrq)->error) {
-		complete(&card->mrq_complete);
-		return (*mrq)->error;
-	}
+	if ((*mrq)->error)
+		return ms_block_complete_req(card, (*mrq)->error);
 
 	switch ((*mrq)->tpc) {
 	case MS_TPC_WRITE_REG:
@@ -1140,10 +1193,8 @@ static int h_ms_block_read_pages(struct memstick_dev *card,
 			   | MEMSTICK_STATUS1_UCDT)))
 			(*mrq)->error = -EFAULT;
 
-		if ((*mrq)->error) {
-			complete(&card->mrq_complete);
-			return (*mrq)->error;
-		}
+		if ((*mrq)->error)
+			return ms_block_complete_req(card, (*mrq)->error);
 
 		ms_block_set_sg(msb, &t_sg);
 		memstick_init_req_sg(*mrq, MS_TPC_READ_LONG_DATA, &t_sg);
@@ -1160,8 +1211,7 @@ skip_page:
 			msb->current_seg++;
 
 			if (msb->current_seg == msb->seg_cnt) {
-				complete(&card->mrq_complete);
-				return -EAGAIN;
+				return ms_block_complete_req(card, 0);
 			}
 		}
 		msb->page_off++;
@@ -1200,10 +1250,8 @@ static int h_ms_block_get_extra(struct memstick_dev *card,
 		card->reg_addr.w_length
 	};
 
-	if ((*mrq)->error) {
-		complete(&card->mrq_complete);
-		return (*mrq)->error;
-	}
+	if ((*mrq)->error)
+		return ms_block_complete_req(card, (*mrq)->error);
 
 	switch ((*mrq)->tpc) {
 	case MS_TPC_SET_RW_REG_ADRS:
@@ -1235,10 +1283,8 @@ static int h_ms_block_set_extra(struct memstick_dev *card,
 		sizeof(struct ms_param_register)
 	};
 
-	if ((*mrq)->error) {
-		complete(&card->mrq_complete);
-		return (*mrq)->error;
-	}
+	if ((*mrq)->error)
+		return ms_block_complete_req(card, (*mrq)->error);
 
 	switch ((*mrq)->tpc) {
 	case MS_TPC_SET_RW_REG_ADRS:
@@ -1273,10 +1319,8 @@ static int h_ms_block_read_extra(struct memstick_dev *card,
 	};
 
 
-	if ((*mrq)->error) {
-		complete(&card->mrq_complete);
-		return (*mrq)->error;
-	}
+	if ((*mrq)->error)
+		return ms_block_complete_req(card, (*mrq)->error);
 
 	switch ((*mrq)->tpc) {
 	case MS_TPC_WRITE_REG:
@@ -1299,10 +1343,8 @@ static int h_ms_block_read_extra(struct memstick_dev *card,
 			   | MEMSTICK_STATUS1_UCDT)))
 			(*mrq)->error = -EFAULT;
 
-		if ((*mrq)->error) {
-			complete(&card->mrq_complete);
-			return (*mrq)->error;
-		}
+		if ((*mrq)->error)
+			return ms_block_complete_req(card, (*mrq)->error);
 
 		memstick_init_req(*mrq, MS_TPC_SET_RW_REG_ADRS, &reg_addr,
 				  sizeof(reg_addr));
@@ -1311,8 +1353,7 @@ static int h_ms_block_read_extra(struct memstick_dev *card,
 		card->next_request = h_ms_block_get_extra;
 		return 0;
 	case MS_TPC_SET_RW_REG_ADRS:
-		complete(&card->mrq_complete);
-		return -EAGAIN;
+		return ms_block_complete_req(card, 0);
 	default:
 		BUG();
 	}
@@ -1323,10 +1364,8 @@ static int h_ms_block_erase(struct memstick_dev *card,
 {
 	unsigned char t_val = MS_CMD_BLOCK_ERASE;
 
-	if ((*mrq)->error) {
-		complete(&card->mrq_complete);
-		return (*mrq)->error;
-	}
+	if ((*mrq)->error)
+		return ms_block_complete_req(card, (*mrq)->error);
 
 	switch ((*mrq)->tpc) {
 	case MS_TPC_WRITE_REG:
@@ -1348,10 +1387,8 @@ has_int_reg:
 		else if (t_val & MEMSTICK_INT_ERR)
 			(*mrq)->error = -EROFS;
 
-		if ((*mrq)->error) {
-			complete(&card->mrq_complete);
-			return (*mrq)->error;
-		}
+		if ((*mrq)->error)
+			return ms_block_complete_req(card, (*mrq)->error);
 
 		if (t_val & MEMSTICK_INT_CED)
 			return h_ms_block_write_next_state(card, mrq);
@@ -1365,84 +1402,93 @@ has_int_reg:
 
 /*** Data transfer ***/
 
-static int ms_block_write_req(struct memstick_dev *card)
+static void ms_block_account_req(struct ms_block_data *msb,
+				 struct request *req)
+{
+	unsigned int lat = jiffies_to_msecs(jiffies - req->start_time);
+	unsigned int bucket = fls(lat);
+
+	if (bucket >= MS_BLOCK_LAT_BUCKETS)
+		bucket = MS_BLOCK_LAT_BUCKETS - 1;
+
+	msb->req_latency[bucket]++;
+}
+
+/* Should be called with q_lock held */
+static int ms_block_end_chunk(struct ms_block_data *msb, int error)
+{
+	struct request *req = msb->block_req;
+	int chunk;
+
+	if (!error)
+		chunk = end_that_request_chunk(req, 1,
+					       msb->total_page_cnt
+					       * msb->page_size);
+	else
+		chunk = end_that_request_first(req, error,
+					       req->current_nr_sectors);
+
+	if (!chunk) {
+		ms_block_account_req(msb, req);
+		add_disk_randomness(req->rq_disk);
+		blkdev_dequeue_request(req);
+		end_that_request_last(req, error ? error : 1);
+		msb->block_req = NULL;
+	}
+
+	return chunk;
+}
+
+static int ms_block_setup_req(struct ms_block_data *msb)
+{
+	struct request *req = msb->block_req;
+	sector_t t_sec;
+
+	msb->seg_cnt = blk_rq_map_sg(req->q, req, msb->req_sg);
+	if (!msb->seg_cnt)
+		return -EFAULT;
+
+	t_sec = req->sector;
+	msb->page_off = sector_div(t_sec, msb->block_psize
+					  * (msb->page_size >> 9));
+	msb->src_block = (size_t)t_sec;
+	msb->physical_src = 0;
+	msb->current_seg = 0;
+	msb->current_page = 0;
+	msb->total_page_cnt = 0;
+	return 0;
+}
+
+static int ms_block_setup_write(struct memstick_dev *card)
 {
 	struct ms_block_data *msb = memstick_get_drvdata(card);
 	struct memstick_request *mrq = &card->current_mrq;
-	struct ms_param_register param;
+	unsigned int async_req = msb->async_req;
+	int rc;
 
-	enum write_state w_state;
-	int rc = 0, t_rc = 0;
+	/* The first write step is prepared synchronously, so it must not
+	 * complete the block request from within the dispatcher (q_lock is
+	 * held whenever async_req is set).
+	 */
+	if (async_req)
+		msb->async_req = 0;
 
-	msb->total_page_cnt = 0;
+	card->current_mrq.error = 0;
 	msb->w_state = GET_BLOCK;
 	rc = h_ms_block_write_next_state(card, &mrq);
 
+	if (async_req)
+		msb->async_req = 1;
+
 	if (!rc) {
 		msb->mrq_handler = card->next_request;
 		card->next_request = h_ms_block_req_init;
-		memstick_new_req(card->host);
-		wait_for_completion(&card->mrq_complete);
-		rc = card->current_mrq.error;
 	}
 
-	w_state = msb->w_state;
-	msb->w_state = NOTHING;
-
-	/* write error - dst_block should be bad */
-	if ((rc == -EROFS) && (w_state != DEL_SRC)) {
-		msb->current_extra = (struct ms_extra_data_register){
-			.overwrite_flag = 0xf8 & (~MEMSTICK_OVERWRITE_BLOCK),
-			.management_flag = 0xff,
-			.logical_address = MS_BLOCK_INVALID
-		};
-		msb->mrq_handler = h_ms_block_set_extra;
-		card->next_request = h_ms_block_req_init;
-		card->reg_addr = (struct ms_register_addr){
-			card->reg_addr.r_offset,
-			card->reg_addr.r_length,
-			offsetof(struct ms_register, extra_data),
-			sizeof(struct ms_extra_data_register)
-		};
-		memstick_init_req(mrq, MS_TPC_SET_RW_REG_ADRS,
-				  &card->reg_addr, sizeof(card->reg_addr));
-		memstick_new_req(card->host);
-		wait_for_completion(&card->mrq_complete);
-		t_rc = card->current_mrq.error;
-
-		if (!t_rc) {
-			msb->mrq_handler = h_ms_block_write_single;
-			card->next_request = h_ms_block_req_init;
-			param = (struct ms_param_register){
-				.system = msb->system,
-				.block_address_msb = 0,
-				.block_address = cpu_to_be16(msb->dst_block),
-				.cp = MEMSTICK_CP_EXTRA,
-				.page_address = 0
-			};
-			memstick_init_req(mrq, MS_TPC_WRITE_REG, &param,
-					  sizeof(param));
-			memstick_new_req(card->host);
-			wait_for_completion(&card->mrq_complete);
-			t_rc = card->current_mrq.error;
-		}
-	}
-
-	if (t_rc) {
-		card->reg_addr = (struct ms_register_addr){
-			offsetof(struct ms_register, status),
-			sizeof(struct ms_status_register),
-			offsetof(struct ms_register, param),
-			sizeof(struct ms_param_register)
-		};
-		if (memstick_set_rw_addr(card))
-			return -EIO;
-	}
-
-	return msb->total_page_cnt ? 0 : rc;
+	return rc;
 }
 
-static int ms_block_read_req(struct memstick_dev *card)
+static int ms_block_setup_read(struct memstick_dev *card)
 {
 	struct ms_block_data *msb = memstick_get_drvdata(card);
 	unsigned short src_phy_block = ms_block_physical(msb, msb->src_block);
@@ -1454,8 +1500,6 @@ static int ms_block_read_req(struct memstick_dev *card)
 		.page_address = msb->page_off
 	};
 
-	msb->total_page_cnt = 0;
-
 	/* unmapped blocks are considered undefined, yet legal */
 	while (src_phy_block == MS_BLOCK_INVALID) {
 		msb->total_page_cnt++;
@@ -1468,7 +1512,7 @@ static int ms_block_read_req(struct memstick_dev *card)
 			msb->current_seg++;
 
 			if (msb->current_seg == msb->seg_cnt)
-				goto out;
+				return -EAGAIN;
 		}
 		msb->page_off++;
 		if (msb->page_off == msb->block_psize) {
@@ -1486,57 +1530,245 @@ static int ms_block_read_req(struct memstick_dev *card)
 
 	memstick_init_req(&card->current_mrq, MS_TPC_WRITE_REG,
 			  (unsigned char*)&param, sizeof(param));
+	return 0;
+}
+
+/* write error - dst_block should be bad */
+static int ms_block_mark_bad(struct memstick_dev *card)
+{
+	struct ms_block_data *msb = memstick_get_drvdata(card);
+	struct memstick_request *mrq = &card->current_mrq;
+	struct ms_param_register param;
+	int rc;
+
+	msb->current_extra = (struct ms_extra_data_register){
+		.overwrite_flag = 0xf8 & (~MEMSTICK_OVERWRITE_BLOCK),
+		.management_flag = 0xff,
+		.logical_address = MS_BLOCK_INVALID
+	};
+	msb->mrq_handler = h_ms_block_set_extra;
+	card->next_request = h_ms_block_req_init;
+	card->reg_addr = (struct ms_register_addr){
+		card->reg_addr.r_offset,
+		card->reg_addr.r_length,
+		offsetof(struct ms_register, extra_data),
+		sizeof(struct ms_extra_data_register)
+	};
+	memstick_init_req(mrq, MS_TPC_SET_RW_REG_ADRS,
+			  &card->reg_addr, sizeof(card->reg_addr));
 	memstick_new_req(card->host);
 	wait_for_completion(&card->mrq_complete);
-out:
+	rc = card->current_mrq.error;
+
+	if (!rc) {
+		msb->mrq_handler = h_ms_block_write_single;
+		card->next_request = h_ms_block_req_init;
+		param = (struct ms_param_register){
+			.system = msb->system,
+			.block_address_msb = 0,
+			.block_address = cpu_to_be16(msb->dst_block),
+			.cp = MEMSTICK_CP_EXTRA,
+			.page_address = 0
+		};
+		memstick_init_req(mrq, MS_TPC_WRITE_REG, &param,
+				  sizeof(param));
+		memstick_new_req(card->host);
+		wait_for_completion(&card->mrq_complete);
+		rc = card->current_mrq.error;
+	}
+
+	if (rc) {
+		card->reg_addr = (struct ms_register_addr){
+			offsetof(struct ms_register, status),
+			sizeof(struct ms_status_register),
+			offsetof(struct ms_register, param),
+			sizeof(struct ms_param_register)
+		};
+		if (memstick_set_rw_addr(card))
+			return -EIO;
+	}
+
+	return 0;
+}
+
+static int ms_block_write_req(struct memstick_dev *card)
+{
+	struct ms_block_data *msb = memstick_get_drvdata(card);
+	enum write_state w_state;
+	int rc;
+
+	rc = ms_block_setup_write(card);
+
+	if (!rc) {
+		memstick_new_req(card->host);
+		wait_for_completion(&card->mrq_complete);
+		rc = card->current_mrq.error;
+	}
+
+	w_state = msb->w_state;
+	msb->w_state = NOTHING;
+
+	if ((rc == -EROFS) && (w_state != DEL_SRC)) {
+		if (ms_block_mark_bad(card))
+			return -EIO;
+	}
+
+	return msb->total_page_cnt ? 0 : rc;
+}
+
+static int ms_block_read_req(struct memstick_dev *card)
+{
+	struct ms_block_data *msb = memstick_get_drvdata(card);
+
+	if (!ms_block_setup_read(card)) {
+		memstick_new_req(card->host);
+		wait_for_completion(&card->mrq_complete);
+	}
+
 	return msb->total_page_cnt ? 0 : card->current_mrq.error;
 }
 
-static void ms_block_process_request(struct memstick_dev *card,
-				     struct request *req)
+static void ms_block_process_request(struct memstick_dev *card)
 {
 	struct ms_block_data *msb = memstick_get_drvdata(card);
 	int rc, chunk;
-	sector_t t_sec;
 	unsigned long flags;
 
 	do {
-		msb->seg_cnt = blk_rq_map_sg(req->q, req, msb->req_sg);
-
-		if (msb->seg_cnt) {
-			t_sec = req->sector;
-			msb->page_off = sector_div(t_sec, msb->block_psize
-							  * (msb->page_size
-							     >> 9));
-			msb->src_block = (size_t)t_sec;
-			msb->physical_src = 0;
-			msb->current_seg = 0;
-			msb->current_page = 0;
+		rc = ms_block_setup_req(msb);
 
-			if (rq_data_dir(req) == READ)
+		if (!rc) {
+			if (rq_data_dir(msb->block_req) == READ)
 				rc = ms_block_read_req(card);
 			else
 				rc = ms_block_write_req(card);
-		} else
-			rc = -EFAULT;
+		}
 
 		spin_lock_irqsave(&msb->q_lock, flags);
-		if (!rc)
-			chunk = end_that_request_chunk(req, 1,
-						       msb->total_page_cnt
-						       * msb->page_size);
-		else
-			chunk = end_that_request_first(req, rc,
-						       req->current_nr_sectors);
+		chunk = ms_block_end_chunk(msb, rc);
+		spin_unlock_irqrestore(&msb->q_lock, flags);
+	} while (chunk);
+}
+
+/*
+ * Direct dispatch: block requests are started from the request function and
+ * advanced from the protocol callbacks, much like mspro_block does. The queue
+ * thread is only woken up for media format and for bad block marking after a
+ * failed write, both of which need to issue synchronous commands. Should be
+ * called with q_lock held.
+ */
+static int ms_block_issue_req(struct memstick_dev *card, int chunk)
+{
+	struct ms_block_data *msb = memstick_get_drvdata(card);
+	int rc;
 
-		if (!chunk) {
-			add_disk_randomness(req->rq_disk);
-			blkdev_dequeue_request(req);
-			end_that_request_last(req, rc > 0 ? 1 : rc);
+try_again:
+	while (chunk) {
+		rc = ms_block_setup_req(msb);
+
+		if (!rc) {
+			if (rq_data_dir(msb->block_req) == READ)
+				rc = ms_block_setup_read(card);
+			else
+				rc = ms_block_setup_write(card);
+		}
+
+		if (!rc) {
+			memstick_new_req(card->host);
+			return 0;
+		}
+
+		if (msb->total_page_cnt || rc == -EAGAIN)
+			rc = 0;
+
+		chunk = ms_block_end_chunk(msb, rc);
+	}
+
+	msb->block_req = elv_next_request(msb->queue);
+	if (!msb->block_req)
+		return -EAGAIN;
+
+	chunk = 1;
+	goto try_again;
+}
+
+static int ms_block_complete_req(struct memstick_dev *card, int error)
+{
+	struct ms_block_data *msb = memstick_get_drvdata(card);
+	unsigned long flags;
+	int chunk = 0;
+
+	if (!msb->async_req) {
+		complete(&card->mrq_complete);
+		return error ? error : -EAGAIN;
+	}
+
+	spin_lock_irqsave(&msb->q_lock, flags);
+	dev_dbg(&card->dev, "complete %d\n", error);
+
+	if (msb->block_req) {
+		if (rq_data_dir(msb->block_req) == WRITE
+		    && error == -EROFS && msb->w_state != DEL_SRC) {
+			msb->recover_block = 1;
+			msb->has_request = 1;
+		}
+		msb->w_state = NOTHING;
+
+		if (msb->total_page_cnt)
+			error = 0;
+
+		chunk = ms_block_end_chunk(msb, error);
+	}
+
+	if (msb->has_request)
+		error = -EAGAIN;
+	else
+		error = ms_block_issue_req(card, chunk);
+
+	if (!error) {
+		card->next_request = msb->mrq_handler;
+		goto out;
+	}
+
+	msb->async_req = 0;
+	card->next_request = h_ms_block_default_bad;
+	complete_all(&card->mrq_complete);
+	if (msb->has_request)
+		wake_up_all(&msb->q_wait);
+out:
+	spin_unlock_irqrestore(&msb->q_lock, flags);
+	return error;
+}
+
+static void ms_block_stop(struct memstick_dev *card)
+{
+	struct ms_block_data *msb = memstick_get_drvdata(card);
+	int rc = 0;
+	unsigned long flags;
+
+	while (1) {
+		spin_lock_irqsave(&msb->q_lock, flags);
+		if (!msb->async_req) {
+			blk_stop_queue(msb->queue);
+			rc = 1;
 		}
 		spin_unlock_irqrestore(&msb->q_lock, flags);
-	} while (chunk);
 
+		if (rc)
+			break;
+
+		wait_for_completion(&card->mrq_complete);
+	}
+}
+
+static void ms_block_start(struct memstick_dev *card)
+{
+	struct ms_block_data *msb = memstick_get_drvdata(card);
+	unsigned long flags;
+
+	spin_lock_irqsave(&msb->q_lock, flags);
+	blk_start_queue(msb->queue);
+	spin_unlock_irqrestore(&msb->q_lock, flags);
 }
 
 static int ms_block_has_request(struct ms_block_data *msb)
@@ -1545,20 +1777,20 @@ static int ms_block_has_request(struct ms_block_data *msb)
 	unsigned long flags;
 
 	spin_lock_irqsave(&msb->q_lock, flags);
-	if (kthread_should_stop() || msb->has_request)
+	if (kthread_should_stop() || (msb->has_request && !msb->async_req))
 		rc = 1;
 	spin_unlock_irqrestore(&msb->q_lock, flags);
 	return rc;
 }
 
 static void ms_block_format(struct memstick_dev *card);
+static void ms_block_request(struct request_queue *q);
 
 static int ms_block_queue_thread(void *data)
 {
 	struct memstick_dev *card = data;
 	struct memstick_host *host = card->host;
 	struct ms_block_data *msb = memstick_get_drvdata(card);
-	struct request *req = NULL;
 	unsigned long flags;
 
 	while (1) {
@@ -1574,8 +1806,30 @@ static int ms_block_queue_thread(void *data)
 			msb->format_media = 0;
 		}
 
-		req = elv_next_request(msb->queue);
-		if (!req) {
+		if (msb->recover_block) {
+			spin_unlock_irqrestore(&msb->q_lock, flags);
+			mutex_lock(&host->lock);
+			ms_block_mark_bad(card);
+			mutex_unlock(&host->lock);
+			spin_lock_irqsave(&msb->q_lock, flags);
+			msb->recover_block = 0;
+		}
+
+		if (msb->direct_dispatch) {
+			msb->has_request = 0;
+			if (kthread_should_stop()) {
+				spin_unlock_irqrestore(&msb->q_lock, flags);
+				break;
+			}
+			ms_block_request(msb->queue);
+			spin_unlock_irqrestore(&msb->q_lock, flags);
+			continue;
+		}
+
+		if (!msb->block_req)
+			msb->block_req = elv_next_request(msb->queue);
+
+		if (!msb->block_req) {
 			msb->has_request = 0;
 			if (kthread_should_stop()) {
 				spin_unlock_irqrestore(&msb->q_lock, flags);
@@ -1585,9 +1839,9 @@ static int ms_block_queue_thread(void *data)
 			msb->has_request = 1;
 		spin_unlock_irqrestore(&msb->q_lock, flags);
 
-		if (req) {
+		if (msb->block_req) {
 			mutex_lock(&host->lock);
-			ms_block_process_request(card, req);
+			ms_block_process_request(card);
 			mutex_unlock(&host->lock);
 		}
 	}
@@ -1601,6 +1855,7 @@ static void ms_block_request(struct request_queue *q)
 	struct request *req = NULL;
 
 	if (!msb->q_thread) {
+		msb->block_req = NULL;
 		for (req = elv_next_request(q); req;
 		     req = elv_next_request(q)) {
 			while (end_that_request_chunk(req, -ENODEV,
@@ -1608,9 +1863,13 @@ static void ms_block_request(struct request_queue *q)
 						      << 9)) {}
 			end_that_request_last(req, -ENODEV);
 		}
-	} else {
+	} else if (!msb->direct_dispatch) {
 		msb->has_request = 1;
 		wake_up_all(&msb->q_wait);
+	} else if (!msb->async_req && !msb->has_request) {
+		msb->async_req = 1;
+		if (ms_block_issue_req(card, msb->block_req != NULL))
+			msb->async_req = 0;
 	}
 }
 
@@ -2192,6 +2451,30 @@ static int ms_block_switch_to_parallel(struct memstick_dev *card)
 	return 0;
 }
 
+static int ms_block_switch_to_serial(struct memstick_dev *card)
+{
+	struct memstick_host *host = card->host;
+	struct ms_block_data *msb = memstick_get_drvdata(card);
+	struct ms_param_register param = {
+		.system = 0x80,
+		.block_address_msb = 0,
+		.block_address = 0,
+		.cp = MEMSTICK_CP_BLOCK,
+		.page_address = 0
+	};
+
+	card->next_request = h_ms_block_req_init;
+	msb->mrq_handler = h_ms_block_default;
+	memstick_init_req(&card->current_mrq, MS_TPC_WRITE_REG, &param,
+			  sizeof(param));
+	memstick_new_req(card->host);
+	wait_for_completion(&card->mrq_complete);
+
+	msb->system = 0x80;
+	host->set_param(host, MEMSTICK_INTERFACE, MEMSTICK_SERIAL);
+	return card->current_mrq.error;
+}
+
 static int ms_block_init_card(struct memstick_dev *card)
 {
 	struct ms_block_data *msb = memstick_get_drvdata(card);
@@ -2238,6 +2521,17 @@ static int ms_block_init_card(struct memstick_dev *card)
 	boot_pages[1] = (struct ms_boot_page*)(buf + msb->page_size);
 
 	rc = ms_block_find_boot_blocks(card, boot_pages, boot_blocks);
+
+	/* Boot block scan doubles as parallel interface self test. */
+	if ((rc || boot_blocks[0] == MS_BLOCK_INVALID)
+	    && (msb->system == 0x88)) {
+		printk(KERN_WARNING "%s: boot block scan failed in parallel "
+		       "mode, falling back to serial\n", card->dev.bus_id);
+		if (!ms_block_switch_to_serial(card))
+			rc = ms_block_find_boot_blocks(card, boot_pages,
+						       boot_blocks);
+	}
+
 	if (rc || boot_blocks[0] == MS_BLOCK_INVALID)
 		goto out_free_buf;
 
@@ -2388,6 +2682,7 @@ static int ms_block_init_disk(struct memstick_dev *card)
 
 	spin_lock_init(&msb->q_lock);
 	init_waitqueue_head(&msb->q_wait);
+	msb->direct_dispatch = direct_dispatch ? 1 : 0;
 
 	msb->queue = blk_init_queue(ms_block_request, &msb->q_lock);
 	if (!msb->queue) {
@@ -2465,10 +2760,16 @@ static int ms_block_sysfs_register(struct memstick_dev *card)
 	if (rc)
 		goto out_remove_cis_idi;
 
+	rc = device_create_file(&card->dev, &dev_attr_request_latency);
+	if (rc)
+		goto out_remove_format;
+
 	rc = ms_block_create_rel_table_attr(card);
 	if (!rc)
 		return 0;
 
+	device_remove_file(&card->dev, &dev_attr_request_latency);
+out_remove_format:
 	device_remove_file(&card->dev, &dev_attr_format);
 out_remove_cis_idi:
 	device_remove_file(&card->dev, &dev_attr_cis_idi);
@@ -2486,6 +2787,7 @@ static void ms_block_sysfs_unregister(struct memstick_dev *card)
 	sysfs_remove_bin_file(&card->dev.kobj,
 			      &msb->dev_attr_logical_block_map);
 
+	device_remove_file(&card->dev, &dev_attr_request_latency);
 	device_remove_file(&card->dev, &dev_attr_format);
 	device_remove_file(&card->dev, &dev_attr_cis_idi);
 	device_remove_file(&card->dev, &dev_attr_boot_attr);
@@ -2518,6 +2820,8 @@ static int ms_block_probe(struct memstick_dev *card)
 	rc = ms_block_init_disk(card);
 	if (!rc) {
 		card->check = ms_block_check_card;
+		card->stop = ms_block_stop;
+		card->start = ms_block_start;
 		return 0;
 	}
 
@@ -2535,11 +2839,13 @@ static void ms_block_remove(struct memstick_dev *card)
 	struct task_struct *q_thread = NULL;
 	unsigned long flags;
 
+	ms_block_stop(card);
 	del_gendisk(msb->disk);
 	spin_lock_irqsave(&msb->q_lock, flags);
 	q_thread = msb->q_thread;
 	msb->q_thread = NULL;
 	msb->active = 0;
+	blk_start_queue(msb->queue);
 	spin_unlock_irqrestore(&msb->q_lock, flags);
 
 	if (q_thread) {
@@ -2570,6 +2876,8 @@ static int ms_block_suspend(struct memstick_dev *card, pm_message_t state)
 	struct task_struct *q_thread = NULL;
 	unsigned long flags;
 
+	ms_block_stop(card);
+
 	spin_lock_irqsave(&msb->q_lock, flags);
 	q_thread = msb->q_thread;
 	msb->q_thread = NULL;
@@ -16,6 +16,7 @@
 #include <linux/idr.h>
 #include <linux/hdreg.h>
 #include <linux/delay.h>
+#include <linux/ktime.h>
 #include "linux/memstick.h"
 
 #define DRIVER_NAME "mspro_block"
@@ -23,8 +24,14 @@
 static int major;
 module_param(major, int, 0644);
 
+/* Verify parallel interface with a short read before using it */
+static int interface_test = 1;
+module_param(interface_test, bool, 0644);
+
 #define MSPRO_BLOCK_MAX_SEGS  32
 #define MSPRO_BLOCK_MAX_PAGES ((2 << 16) - 1)
+#define MSPRO_BLOCK_MAX_COUNT 0xffff /* data_count is 16 bit */
+#define MSPRO_BLOCK_TEST_PAGES 16
 
 #define MSPRO_BLOCK_SIGNATURE        0xa5c3
 #define MSPRO_BLOCK_MAX_ATTRIBUTES   41
@@ -141,11 +148,13 @@ struct mspro_block_data {
 	spinlock_t            q_lock;
 
 	unsigned short        page_size;
+	unsigned short        block_size; /* pages per erase unit */
 	unsigned short        cylinders;
 	unsigned short        heads;
 	unsigned short        sectors_per_track;
 
 	unsigned char         system;
+	unsigned int          if_rate; /* KB/s, measured by interface test */
 	unsigned char         read_only:1,
 			      eject:1,
 			      has_request:1,
@@ -162,6 +171,8 @@ struct mspro_block_data {
 	unsigned int          seg_count;
 	unsigned int          current_seg;
 	unsigned int          current_page;
+	unsigned int          data_count; /* pages in current command */
+	unsigned int          data_done;
 };
 
 static DEFINE_IDR(mspro_block_disk_idr);
@@ -515,6 +526,34 @@ static sysfs_show_t mspro_block_attr_show(unsigned char tag)
  * finished (and request processor should come back some time later).
  */
 
+static ssize_t mspro_block_interface_show(struct device *dev,
+					  struct device_attribute *attr,
+					  char *buf)
+{
+	struct mspro_block_data *msb
+		= memstick_get_drvdata(container_of(dev, struct memstick_dev,
+						    dev));
+	ssize_t rc;
+
+	switch (msb->system) {
+	case MEMSTICK_SYS_PAR4:
+		rc = sprintf(buf, "mode: par4\n");
+		break;
+	case MEMSTICK_SYS_PAR8:
+		rc = sprintf(buf, "mode: par8\n");
+		break;
+	default:
+		rc = sprintf(buf, "mode: serial\n");
+	}
+
+	if (msb->if_rate)
+		rc += sprintf(buf + rc, "rate: %u KB/s\n", msb->if_rate);
+
+	return rc;
+}
+
+static DEVICE_ATTR(interface, S_IRUGO, mspro_block_interface_show, NULL);
+
 static int h_mspro_block_req_init(struct memstick_dev *card,
 				  struct memstick_request **mrq)
 {
@@ -605,18 +644,17 @@ has_int_reg:
 			/ msb->page_size)) {
 			msb->current_page = 0;
 			msb->current_seg++;
+		}
 
-			if (msb->current_seg == msb->seg_count) {
-				if (t_val & MEMSTICK_INT_CED) {
-					return mspro_block_complete_req(card,
-									0);
-				} else {
-					card->next_request
-						= h_mspro_block_wait_for_ced;
-					memstick_init_req(*mrq, MS_TPC_GET_INT,
-							  NULL, 1);
-					return 0;
-				}
+		if ((msb->data_done == msb->data_count)
+		    || (msb->current_seg == msb->seg_count)) {
+			if (t_val & MEMSTICK_INT_CED) {
+				return mspro_block_complete_req(card, 0);
+			} else {
+				card->next_request = h_mspro_block_wait_for_ced;
+				memstick_init_req(*mrq, MS_TPC_GET_INT, NULL,
+						  1);
+				return 0;
 			}
 		}
 
@@ -642,6 +680,7 @@ has_int_reg:
 	case MS_TPC_READ_LONG_DATA:
 	case MS_TPC_WRITE_LONG_DATA:
 		msb->current_page++;
+		msb->data_done++;
 		if (msb->caps & MEMSTICK_CAP_AUTO_GET_INT) {
 			t_val = (*mrq)->int_reg;
 			goto has_int_reg;
@@ -657,6 +696,40 @@ has_int_reg:
 
 /*** Data transfer ***/
 
+/*
+ * Writes are issued as commands covering whole erase units: a write starting
+ * in the middle of a unit is cut at the unit boundary, and a write too long
+ * for a single command is cut at the last unit boundary fitting into it.
+ * Only the request's own start and end may thus fall inside a unit; the card
+ * would otherwise have to do read-modify-write on every unit the command
+ * touches. Remaining part of the request is issued as a new command upon
+ * completion.
+ */
+static unsigned int mspro_block_data_count(struct mspro_block_data *msb,
+					   unsigned int address,
+					   unsigned int count)
+{
+	unsigned int b_off;
+
+	if ((msb->data_dir == READ) || !msb->block_size) {
+		if (count > MSPRO_BLOCK_MAX_COUNT)
+			count = MSPRO_BLOCK_MAX_COUNT;
+
+		return count;
+	}
+
+	b_off = address % msb->block_size;
+	if (b_off && (count > (msb->block_size - b_off)))
+		return msb->block_size - b_off;
+
+	if (count > MSPRO_BLOCK_MAX_COUNT) {
+		count = MSPRO_BLOCK_MAX_COUNT;
+		count -= count % msb->block_size;
+	}
+
+	return count;
+}
+
 static int mspro_block_issue_req(struct memstick_dev *card, int chunk)
 {
 	struct mspro_block_data *msb = memstick_get_drvdata(card);
@@ -668,6 +741,7 @@ try_again:
 	while (chunk) {
 		msb->current_page = 0;
 		msb->current_seg = 0;
+		msb->data_done = 0;
 		msb->seg_count = blk_rq_map_sg(msb->block_req->q,
 					       msb->block_req,
 					       msb->req_sg);
@@ -684,12 +758,15 @@ try_again:
 		count = msb->block_req->nr_sectors << 9;
 		count /= msb->page_size;
 
+		msb->data_dir = rq_data_dir(msb->block_req);
+		count = mspro_block_data_count(msb, (uint32_t)t_sec, count);
+		msb->data_count = count;
+
 		param.system = msb->system;
 		param.data_count = cpu_to_be16(count);
 		param.data_address = cpu_to_be32((uint32_t)t_sec);
 		param.tpc_param = 0;
 
-		msb->data_dir = rq_data_dir(msb->block_req);
 		msb->transfer_cmd = msb->data_dir == READ
 				    ? MSPRO_CMD_READ_DATA
 				    : MSPRO_CMD_WRITE_DATA;
@@ -721,7 +798,7 @@ try_again:
 static int mspro_block_complete_req(struct memstick_dev *card, int error)
 {
 	struct mspro_block_data *msb = memstick_get_drvdata(card);
-	int chunk, cnt;
+	int chunk;
 	unsigned int t_len = 0;
 	unsigned long flags;
 
@@ -736,17 +813,13 @@ static int mspro_block_complete_req(struct memstick_dev *card, int error)
 
 		if (error || (card->current_mrq.tpc == MSPRO_CMD_STOP)) {
 			if (msb->data_dir == READ) {
-				for (cnt = 0; cnt < msb->current_seg; cnt++)
-					t_len += msb->req_sg[cnt].length
-						 / msb->page_size;
-
-					if (msb->current_page)
-						t_len += msb->current_page - 1;
+				if (msb->data_done)
+					t_len = msb->data_done - 1;
 
-					t_len *= msb->page_size;
+				t_len *= msb->page_size;
 			}
 		} else
-			t_len = msb->block_req->nr_sectors << 9;
+			t_len = msb->data_count * msb->page_size;
 
 		dev_dbg(&card->dev, "transferred %x (%d)\n", t_len, error);
 
@@ -872,6 +945,72 @@ static int mspro_block_set_interface(struct memstick_dev *card,
 	return card->current_mrq.error;
 }
 
+/*
+ * Read the attribute header page a number of times over the current
+ * interface. A link unable to carry data reliably fails here instead of in
+ * the middle of block transfers; the time taken gives the interface rate.
+ */
+static int mspro_block_test_interface(struct memstick_dev *card)
+{
+	struct mspro_block_data *msb = memstick_get_drvdata(card);
+	struct mspro_param_register param = {
+		.system = msb->system,
+		.data_count = cpu_to_be16(1),
+		.data_address = 0,
+		.tpc_param = 0
+	};
+	struct mspro_attribute *attr;
+	ktime_t t_start;
+	u64 t_rate;
+	s64 t_us;
+	int cnt, rc = 0;
+
+	attr = kmalloc(msb->page_size, GFP_KERNEL);
+	if (!attr)
+		return -ENOMEM;
+
+	t_start = ktime_get();
+
+	for (cnt = 0; cnt < MSPRO_BLOCK_TEST_PAGES; ++cnt) {
+		memset(attr, 0, msb->page_size);
+		sg_init_one(&msb->req_sg[0], attr, msb->page_size);
+		msb->seg_count = 1;
+		msb->current_seg = 0;
+		msb->current_page = 0;
+		msb->data_count = 1;
+		msb->data_done = 0;
+		msb->data_dir = READ;
+		msb->transfer_cmd = MSPRO_CMD_READ_ATRB;
+
+		card->next_request = h_mspro_block_req_init;
+		msb->mrq_handler = h_mspro_block_transfer_data;
+		memstick_init_req(&card->current_mrq, MS_TPC_WRITE_REG, &param,
+				  sizeof(param));
+		memstick_new_req(card->host);
+		wait_for_completion(&card->mrq_complete);
+		rc = card->current_mrq.error;
+		if (rc)
+			break;
+
+		if (be16_to_cpu(attr->signature) != MSPRO_BLOCK_SIGNATURE) {
+			rc = -EILSEQ;
+			break;
+		}
+	}
+
+	t_us = ktime_to_us(ktime_sub(ktime_get(), t_start));
+
+	if (!rc && t_us > 0) {
+		t_rate = MSPRO_BLOCK_TEST_PAGES * msb->page_size;
+		t_rate *= 1000;
+		do_div(t_rate, (u32)t_us);
+		msb->if_rate = t_rate;
+	}
+
+	kfree(attr);
+	return rc;
+}
+
 static int mspro_block_switch_interface(struct memstick_dev *card)
 {
 	struct memstick_host *host = card->host;
@@ -919,11 +1058,19 @@ try_again:
 	wait_for_completion(&card->mrq_complete);
 	rc = card->current_mrq.error;
 
+	if (!rc && interface_test) {
+		rc = mspro_block_test_interface(card);
+		if (!rc)
+			printk(KERN_INFO "%s: interface test passed, %u KB/s\n",
+			       card->dev.bus_id, msb->if_rate);
+	}
+
 	if (rc) {
 		printk(KERN_WARNING
 		       "%s: interface error, trying to fall back to serial\n",
 		       card->dev.bus_id);
 		msb->system = MEMSTICK_SYS_SERIAL;
+		msb->if_rate = 0;
 		host->set_param(host, MEMSTICK_POWER, MEMSTICK_POWER_OFF);
 		msleep(10);
 		host->set_param(host, MEMSTICK_POWER, MEMSTICK_POWER_ON);
@@ -976,6 +1123,8 @@ static int mspro_block_read_attributes(struct memstick_dev *card)
 	msb->seg_count = 1;
 	msb->current_seg = 0;
 	msb->current_page = 0;
+	msb->data_count = 1;
+	msb->data_done = 0;
 	msb->data_dir = READ;
 	msb->transfer_cmd = MSPRO_CMD_READ_ATRB;
 
@@ -1085,6 +1234,8 @@ static int mspro_block_read_attributes(struct memstick_dev *card)
 		msb->seg_count = 1;
 		msb->current_seg = 0;
 		msb->current_page = 0;
+		msb->data_count = be16_to_cpu(param.data_count);
+		msb->data_done = 0;
 		msb->data_dir = READ;
 		msb->transfer_cmd = MSPRO_CMD_READ_ATRB;
 
@@ -1130,6 +1281,7 @@ static int mspro_block_init_card(struct memstick_dev *card)
 		return -EIO;
 
 	msb->caps = host->caps;
+	msb->page_size = 512;
 
 	msleep(150);
 	rc = mspro_block_wait_for_ced(card);
@@ -1155,7 +1307,6 @@ static int mspro_block_init_card(struct memstick_dev *card)
 
 	dev_dbg(&card->dev, "card r/w status %d\n", msb->read_only ? 0 : 1);
 
-	msb->page_size = 512;
 	rc = mspro_block_read_attributes(card);
 	if (rc)
 		return rc;
@@ -1196,6 +1347,9 @@ static int mspro_block_init_disk(struct memstick_dev *card)
 	msb->sectors_per_track = be16_to_cpu(dev_info->sectors_per_track);
 
 	msb->page_size = be16_to_cpu(sys_info->unit_size);
+	msb->block_size = be16_to_cpu(sys_info->block_size);
+	if (msb->block_size > MSPRO_BLOCK_MAX_COUNT)
+		msb->block_size = 0;
 
 	if (!idr_pre_get(&mspro_block_disk_idr, GFP_KERNEL))
 		return -ENOMEM;
@@ -1311,6 +1465,10 @@ static int mspro_block_probe(struct memstick_dev *card)
 	if (rc)
 		goto out_free;
 
+	rc = device_create_file(&card->dev, &dev_attr_interface);
+	if (rc)
+		goto out_remove_group;
+
 	rc = mspro_block_init_disk(card);
 	if (!rc) {
 		card->check = mspro_block_check_card;
@@ -1319,6 +1477,8 @@ static int mspro_block_probe(struct memstick_dev *card)
 		return 0;
 	}
 
+	device_remove_file(&card->dev, &dev_attr_interface);
+out_remove_group:
 	sysfs_remove_group(&card->dev.kobj, &msb->attr_group);
 out_free:
 	memstick_set_drvdata(card, NULL);
@@ -1342,6 +1502,7 @@ static void mspro_block_remove(struct memstick_dev *card)
 	blk_cleanup_queue(msb->queue);
 	msb->queue = NULL;
 
+	device_remove_file(&card->dev, &dev_attr_interface);
 	sysfs_remove_group(&card->dev.kobj, &msb->attr_group);
 
 	mutex_lock(&mspro_block_disk_lock);
@@ -1402,6 +1563,10 @@ static int mspro_block_resume(struct memstick_dev *card)
 			if (memcmp(s_attr->data, r_attr->data, s_attr->size))
 				break;
 
+			/* Interface may have been negotiated differently */
+			msb->system = new_msb->system;
+			msb->caps = new_msb->caps;
+			msb->if_rate = new_msb->if_rate;
 			msb->active = 1;
 			break;
 		}
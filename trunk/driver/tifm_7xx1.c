@@ -36,11 +36,43 @@ static void tifm_7xx1_eject(struct tifm_adapter *fm, struct tifm_dev *sock)
 	spin_unlock_irqrestore(&fm->lock, flags);
 }
 
+/*
+ * Socket events are dispatched from per-socket tasklets, so that transfers on
+ * different sockets are not serialized on the adapter lock; the handlers take
+ * the socket lock themselves. Socket interrupts stay masked until the socket's
+ * tasklet has run. While the adapter is suspended, or resume is waiting for
+ * the sockets to settle (finish_me), the masks are left to suspend/resume.
+ */
+static void tifm_7xx1_sock_event(unsigned long data)
+{
+	struct tifm_dev *sock = (struct tifm_dev *)data;
+	struct tifm_adapter *fm = dev_get_drvdata(sock->dev.parent);
+	unsigned int irq_status;
+	unsigned long flags;
+
+	spin_lock_irqsave(&fm->lock, flags);
+	irq_status = sock->irq_status;
+	sock->irq_status = 0;
+	spin_unlock_irqrestore(&fm->lock, flags);
+
+	if (irq_status & TIFM_IRQ_FIFOMASK(1))
+		sock->data_event(sock);
+	if (irq_status & TIFM_IRQ_CARDMASK(1))
+		sock->card_event(sock);
+
+	spin_lock_irqsave(&fm->lock, flags);
+	if (!fm->finish_me && !fm->suspended)
+		writel(TIFM_IRQ_FIFOMASK(1 << sock->socket_id)
+		       | TIFM_IRQ_CARDMASK(1 << sock->socket_id),
+		       fm->addr + FM_SET_INTERRUPT_ENABLE);
+	spin_unlock_irqrestore(&fm->lock, flags);
+}
+
 static irqreturn_t tifm_7xx1_isr(int irq, void *dev_id)
 {
 	struct tifm_adapter *fm = dev_id;
 	struct tifm_dev *sock;
-	unsigned int irq_status, cnt;
+	unsigned int irq_status, sock_status, cnt;
 
 	spin_lock(&fm->lock);
 	irq_status = readl(fm->addr + FM_INTERRUPT_STATUS);
@@ -54,11 +86,15 @@ static irqreturn_t tifm_7xx1_isr(int irq, void *dev_id)
 
 		for (cnt = 0; cnt < fm->num_sockets; cnt++) {
 			sock = fm->sockets[cnt];
-			if (sock) {
-				if ((irq_status >> cnt) & TIFM_IRQ_FIFOMASK(1))
-					sock->data_event(sock);
-				if ((irq_status >> cnt) & TIFM_IRQ_CARDMASK(1))
-					sock->card_event(sock);
+			sock_status = (irq_status >> cnt)
+				      & (TIFM_IRQ_FIFOMASK(1)
+					 | TIFM_IRQ_CARDMASK(1));
+			if (sock && sock_status) {
+				writel(TIFM_IRQ_FIFOMASK(1 << cnt)
+				       | TIFM_IRQ_CARDMASK(1 << cnt),
+				       fm->addr + FM_CLEAR_INTERRUPT_ENABLE);
+				sock->irq_status |= sock_status;
+				tasklet_schedule(&sock->event_tasklet);
 			}
 		}
 
@@ -81,49 +117,109 @@ static irqreturn_t tifm_7xx1_isr(int irq, void *dev_id)
 	return IRQ_HANDLED;
 }
 
-static unsigned char tifm_7xx1_toggle_sock_power(char __iomem *sock_addr)
+inline static char __iomem *
+tifm_7xx1_sock_addr(char __iomem *base_addr, unsigned int sock_num)
 {
-	unsigned int s_state;
-	int cnt;
+	return base_addr + ((sock_num + 1) << 10);
+}
+
+/* Wait, with increasing back off, until all sockets in the set reach the
+ * requested power state.
+ */
+static void tifm_7xx1_wait_sock_power(struct tifm_adapter *fm,
+				      unsigned int sock_set, int powered)
+{
+	unsigned int s_state, cnt, w_cnt;
 
-	writel(0x0e00, sock_addr + SOCK_CONTROL);
+	for (w_cnt = 16; w_cnt <= 256; w_cnt <<= 1) {
+		for (cnt = 0; cnt < fm->num_sockets; cnt++) {
+			if (!(sock_set & (1 << cnt)))
+				continue;
+
+			s_state = readl(tifm_7xx1_sock_addr(fm->addr, cnt)
+					+ SOCK_PRESENT_STATE);
+			if (!(TIFM_SOCK_STATE_POWERED & s_state) == !powered)
+				sock_set &= ~(1 << cnt);
+		}
 
-	for (cnt = 16; cnt <= 256; cnt <<= 1) {
-		if (!(TIFM_SOCK_STATE_POWERED
-		      & readl(sock_addr + SOCK_PRESENT_STATE)))
+		if (!sock_set)
 			break;
 
-		msleep(cnt);
+		msleep(w_cnt);
+	}
+}
+
+/*
+ * Power cycle all sockets in the set at once, so that the settle delays of
+ * different sockets overlap instead of adding up. Media type of each socket
+ * is stored into media_id (0 for empty sockets).
+ */
+static void tifm_7xx1_toggle_sock_power(struct tifm_adapter *fm,
+					unsigned int sock_set,
+					unsigned char *media_id)
+{
+	char __iomem *sock_addr;
+	unsigned int s_state, cnt, xd_set = 0;
+
+	for (cnt = 0; cnt < fm->num_sockets; cnt++) {
+		if (sock_set & (1 << cnt))
+			writel(0x0e00, tifm_7xx1_sock_addr(fm->addr, cnt)
+				       + SOCK_CONTROL);
 	}
 
-	s_state = readl(sock_addr + SOCK_PRESENT_STATE);
-	if (!(TIFM_SOCK_STATE_OCCUPIED & s_state))
-		return 0;
+	tifm_7xx1_wait_sock_power(fm, sock_set, 0);
 
-	writel(readl(sock_addr + SOCK_CONTROL) | TIFM_CTRL_LED,
-	       sock_addr + SOCK_CONTROL);
+	for (cnt = 0; cnt < fm->num_sockets; cnt++) {
+		if (!(sock_set & (1 << cnt)))
+			continue;
+
+		media_id[cnt] = 0;
+		sock_addr = tifm_7xx1_sock_addr(fm->addr, cnt);
+		s_state = readl(sock_addr + SOCK_PRESENT_STATE);
+		if (!(TIFM_SOCK_STATE_OCCUPIED & s_state)) {
+			sock_set &= ~(1 << cnt);
+			continue;
+		}
+
+		writel(readl(sock_addr + SOCK_CONTROL) | TIFM_CTRL_LED,
+		       sock_addr + SOCK_CONTROL);
+
+		if (((s_state >> 4) & 7) == TIFM_TYPE_XD)
+			xd_set |= 1 << cnt;
+	}
+
+	if (!sock_set)
+		return;
 
 	/* xd needs some extra time before power on */
-	if (((readl(sock_addr + SOCK_PRESENT_STATE) >> 4) & 7)
-	    == TIFM_TYPE_XD)
+	if (xd_set)
 		msleep(40);
 
-	writel((s_state & TIFM_CTRL_POWER_MASK) | 0x0c00,
-	       sock_addr + SOCK_CONTROL);
+	for (cnt = 0; cnt < fm->num_sockets; cnt++) {
+		if (!(sock_set & (1 << cnt)))
+			continue;
+
+		sock_addr = tifm_7xx1_sock_addr(fm->addr, cnt);
+		s_state = readl(sock_addr + SOCK_PRESENT_STATE);
+		writel((s_state & TIFM_CTRL_POWER_MASK) | 0x0c00,
+		       sock_addr + SOCK_CONTROL);
+	}
+
 	/* wait for power to stabilize */
 	msleep(20);
-	for (cnt = 16; cnt <= 256; cnt <<= 1) {
-		if ((TIFM_SOCK_STATE_POWERED
-		     & readl(sock_addr + SOCK_PRESENT_STATE)))
-			break;
+	tifm_7xx1_wait_sock_power(fm, sock_set, 1);
 
-		msleep(cnt);
-	}
+	for (cnt = 0; cnt < fm->num_sockets; cnt++) {
+		if (!(sock_set & (1 << cnt)))
+			continue;
 
-	writel(readl(sock_addr + SOCK_CONTROL) & (~TIFM_CTRL_LED),
-	       sock_addr + SOCK_CONTROL);
+		sock_addr = tifm_7xx1_sock_addr(fm->addr, cnt);
+		writel(readl(sock_addr + SOCK_CONTROL) & (~TIFM_CTRL_LED),
+		       sock_addr + SOCK_CONTROL);
 
-	return (readl(sock_addr + SOCK_PRESENT_STATE) >> 4) & 7;
+		media_id[cnt] = (readl(sock_addr + SOCK_PRESENT_STATE) >> 4)
+				& 7;
+	}
 }
 
 inline static void tifm_7xx1_sock_power_off(char __iomem *sock_addr)
@@ -132,12 +228,6 @@ inline static void tifm_7xx1_sock_power_off(char __iomem *sock_addr)
 	       sock_addr + SOCK_CONTROL);
 }
 
-inline static char __iomem *
-tifm_7xx1_sock_addr(char __iomem *base_addr, unsigned int sock_num)
-{
-	return base_addr + ((sock_num + 1) << 10);
-}
-
 static void tifm_7xx1_switch_media(struct work_struct *work)
 {
 	struct tifm_adapter *fm = container_of(work, struct tifm_adapter,
@@ -145,7 +235,7 @@ static void tifm_7xx1_switch_media(struct work_struct *work)
 	struct tifm_dev *sock;
 	char __iomem *sock_addr;
 	unsigned long flags;
-	unsigned char media_id;
+	unsigned char media_id[fm->num_sockets];
 	unsigned int socket_change_set, cnt;
 
 	spin_lock_irqsave(&fm->lock, flags);
@@ -171,21 +261,29 @@ static void tifm_7xx1_switch_media(struct work_struct *work)
 			fm->sockets[cnt] = NULL;
 			sock_addr = sock->addr;
 			spin_unlock_irqrestore(&fm->lock, flags);
+			tasklet_kill(&sock->event_tasklet);
 			device_unregister(&sock->dev);
 			spin_lock_irqsave(&fm->lock, flags);
 			tifm_7xx1_sock_power_off(sock_addr);
 			writel(0x0e00, sock_addr + SOCK_CONTROL);
 		}
+	}
 
-		spin_unlock_irqrestore(&fm->lock, flags);
+	spin_unlock_irqrestore(&fm->lock, flags);
+
+	tifm_7xx1_toggle_sock_power(fm, socket_change_set, media_id);
 
-		media_id = tifm_7xx1_toggle_sock_power(
-				tifm_7xx1_sock_addr(fm->addr, cnt));
+	for (cnt = 0; cnt < fm->num_sockets; cnt++) {
+		if (!(socket_change_set & (1 << cnt)))
+			continue;
 
 		// tifm_alloc_device will check if media_id is valid
-		sock = tifm_alloc_device(fm, cnt, media_id);
+		sock = tifm_alloc_device(fm, cnt, media_id[cnt]);
 		if (sock) {
 			sock->addr = tifm_7xx1_sock_addr(fm->addr, cnt);
+			tasklet_init(&sock->event_tasklet,
+				     tifm_7xx1_sock_event,
+				     (unsigned long)sock);
 
 			if (!device_register(&sock->dev)) {
 				spin_lock_irqsave(&fm->lock, flags);
@@ -198,9 +296,9 @@ static void tifm_7xx1_switch_media(struct work_struct *work)
 			if (sock)
 				tifm_free_device(&sock->dev);
 		}
-		spin_lock_irqsave(&fm->lock, flags);
 	}
 
+	spin_lock_irqsave(&fm->lock, flags);
 	writel(TIFM_IRQ_FIFOMASK(socket_change_set)
 	       | TIFM_IRQ_CARDMASK(socket_change_set),
 	       fm->addr + FM_CLEAR_INTERRUPT_ENABLE);
@@ -218,10 +316,15 @@ static void tifm_7xx1_switch_media(struct work_struct *work)
 static int tifm_7xx1_suspend(struct pci_dev *dev, pm_message_t state)
 {
 	struct tifm_adapter *fm = pci_get_drvdata(dev);
+	unsigned long flags;
 	int cnt;
 
 	dev_dbg(&dev->dev, "suspending host\n");
 
+	spin_lock_irqsave(&fm->lock, flags);
+	fm->suspended = 1;
+	spin_unlock_irqrestore(&fm->lock, flags);
+
 	for (cnt = 0; cnt < fm->num_sockets; cnt++) {
 		if (fm->sockets[cnt])
 			tifm_7xx1_sock_power_off(fm->sockets[cnt]->addr);
@@ -252,10 +355,9 @@ static int tifm_7xx1_resume(struct pci_dev *dev)
 
 	dev_dbg(&dev->dev, "resuming host\n");
 
-	for (rc = 0; rc < fm->num_sockets; rc++)
-		new_ids[rc] = tifm_7xx1_toggle_sock_power(
-					tifm_7xx1_sock_addr(fm->addr, rc));
+	tifm_7xx1_toggle_sock_power(fm, (1 << fm->num_sockets) - 1, new_ids);
 	spin_lock_irqsave(&fm->lock, flags);
+	fm->suspended = 0;
 	for (rc = 0; rc < fm->num_sockets; rc++) {
 		if (fm->sockets[rc]) {
 			if (fm->sockets[rc]->type == new_ids[rc])
@@ -403,6 +505,11 @@ static void tifm_7xx1_remove(struct pci_dev *dev)
 	mmiowb();
 	free_irq(dev->irq, fm);
 
+	for (cnt = 0; cnt < fm->num_sockets; cnt++) {
+		if (fm->sockets[cnt])
+			tasklet_kill(&fm->sockets[cnt]->event_tasklet);
+	}
+
 	tifm_remove_adapter(fm);
 
 	for (cnt = 0; cnt < fm->num_sockets; cnt++)
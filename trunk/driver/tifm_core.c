@@ -306,6 +306,22 @@ void tifm_unmap_sg(struct tifm_dev *sock, struct scatterlist *sg, int nents,
 }
 EXPORT_SYMBOL(tifm_unmap_sg);
 
+void tifm_sync_sg_for_cpu(struct tifm_dev *sock, struct scatterlist *sg,
+			  int nents, int direction)
+{
+	pci_dma_sync_sg_for_cpu(to_pci_dev(sock->dev.parent), sg, nents,
+				direction);
+}
+EXPORT_SYMBOL(tifm_sync_sg_for_cpu);
+
+void tifm_sync_sg_for_device(struct tifm_dev *sock, struct scatterlist *sg,
+			     int nents, int direction)
+{
+	pci_dma_sync_sg_for_device(to_pci_dev(sock->dev.parent), sg, nents,
+				   direction);
+}
+EXPORT_SYMBOL(tifm_sync_sg_for_device);
+
 void tifm_queue_work(struct work_struct *work)
 {
 	queue_work(workqueue, work);
@@ -105,6 +105,7 @@ struct tifm_sd {
 	int                   sg_len;
 	int                   sg_pos;
 	unsigned int          block_pos;
+	/* mapped for the lifetime of the host, unless no_dma is set */
 	struct scatterlist    bounce_buf;
 	unsigned char         bounce_buf_data[TIFM_MMCSD_MAX_BLOCK_SIZE];
 };
@@ -272,6 +273,8 @@ int tifm_sd_set_dma_data(struct tifm_sd *host, struct mmc_data *r_data)
 
 	if (host->cmd_flags & DATA_CARRY) {
 		host->cmd_flags &= ~DATA_CARRY;
+		tifm_sync_sg_for_cpu(sock, &host->bounce_buf, 1,
+				     PCI_DMA_BIDIRECTIONAL);
 		local_irq_save(flags);
 		tifm_sd_bounce_block(host, r_data);
 		local_irq_restore(flags);
@@ -305,8 +308,16 @@ int tifm_sd_set_dma_data(struct tifm_sd *host, struct mmc_data *r_data)
 			local_irq_save(flags);
 			tifm_sd_bounce_block(host, r_data);
 			local_irq_restore(flags);
-		} else
+			tifm_sync_sg_for_device(sock, &host->bounce_buf, 1,
+						PCI_DMA_BIDIRECTIONAL);
+		} else {
+			/* Bounce buffer may still be owned by the CPU from
+			 * the previous carry.
+			 */
+			tifm_sync_sg_for_device(sock, &host->bounce_buf, 1,
+						PCI_DMA_BIDIRECTIONAL);
 			host->cmd_flags |= DATA_CARRY;
+		}
 
 		sg = &host->bounce_buf;
 		dma_off = 0;
@@ -618,23 +629,42 @@ static void tifm_sd_set_data_timeout(struct tifm_sd *host,
 	}
 }
 
+static int tifm_sd_data_dir(struct mmc_data *r_data)
+{
+	return r_data->flags & MMC_DATA_WRITE ? PCI_DMA_TODEVICE
+					      : PCI_DMA_FROMDEVICE;
+}
+
 static void tifm_sd_request(struct mmc_host *mmc, struct mmc_request *mrq)
 {
 	struct tifm_sd *host = mmc_priv(mmc);
 	struct tifm_dev *sock = host->dev;
 	unsigned long flags;
 	struct mmc_data *r_data = mrq->cmd->data;
+	int sg_len = 0;
+
+	/* Mapping does not need the socket lock; keep it off the locked
+	 * section, which the interrupt path contends for.
+	 */
+	if (r_data && !host->no_dma) {
+		sg_len = tifm_map_sg(sock, r_data->sg, r_data->sg_len,
+				     tifm_sd_data_dir(r_data));
+		if (sg_len < 1) {
+			dev_err(&sock->dev, "scatterlist map failed\n");
+			goto err_out;
+		}
+	}
 
 	spin_lock_irqsave(&sock->lock, flags);
 	if (host->eject) {
 		spin_unlock_irqrestore(&sock->lock, flags);
-		goto err_out;
+		goto err_out_unmap;
 	}
 
 	if (host->req) {
 		dev_err(&sock->dev, "unfinished request detected\n");
 		spin_unlock_irqrestore(&sock->lock, flags);
-		goto err_out;
+		goto err_out_unmap;
 	}
 
 	host->cmd_flags = 0;
@@ -659,32 +689,7 @@ static void tifm_sd_request(struct mmc_host *mmc, struct mmc_request *mrq)
 
 			host->sg_len = r_data->sg_len;
 		} else {
-			sg_init_one(&host->bounce_buf, host->bounce_buf_data,
-				    r_data->blksz);
-
-			if(1 != tifm_map_sg(sock, &host->bounce_buf, 1,
-					    r_data->flags & MMC_DATA_WRITE
-					    ? PCI_DMA_TODEVICE
-					    : PCI_DMA_FROMDEVICE)) {
-				dev_err(&sock->dev, "scatterlist map failed\n");
-				spin_unlock_irqrestore(&sock->lock, flags);
-				goto err_out;
-			}
-			host->sg_len = tifm_map_sg(sock, r_data->sg,
-						   r_data->sg_len,
-						   r_data->flags
-						   & MMC_DATA_WRITE
-						   ? PCI_DMA_TODEVICE
-						   : PCI_DMA_FROMDEVICE);
-			if (host->sg_len < 1) {
-				dev_err(&sock->dev, "scatterlist map failed\n");
-				tifm_unmap_sg(sock, &host->bounce_buf, 1,
-					      r_data->flags & MMC_DATA_WRITE
-					      ? PCI_DMA_TODEVICE
-					      : PCI_DMA_FROMDEVICE);
-				spin_unlock_irqrestore(&sock->lock, flags);
-				goto err_out;
-			}
+			host->sg_len = sg_len;
 
 			writel(TIFM_FIFO_INT_SETALL,
 			       sock->addr + SOCK_DMA_FIFO_INT_ENABLE_CLEAR);
@@ -719,6 +724,10 @@ static void tifm_sd_request(struct mmc_host *mmc, struct mmc_request *mrq)
 	spin_unlock_irqrestore(&sock->lock, flags);
 	return;
 
+err_out_unmap:
+	if (sg_len)
+		tifm_unmap_sg(sock, r_data->sg, r_data->sg_len,
+			      tifm_sd_data_dir(r_data));
 err_out:
 	mrq->cmd->error = -ETIME;
 	mmc_request_done(mmc, mrq);
@@ -751,13 +760,6 @@ static void tifm_sd_end_cmd(unsigned long data)
 			writel((~TIFM_MMCSD_BUFINT)
 			       & readl(sock->addr + SOCK_MMCSD_INT_ENABLE),
 			       sock->addr + SOCK_MMCSD_INT_ENABLE);
-		} else {
-			tifm_unmap_sg(sock, &host->bounce_buf, 1,
-				      (r_data->flags & MMC_DATA_WRITE)
-				      ? PCI_DMA_TODEVICE : PCI_DMA_FROMDEVICE);
-			tifm_unmap_sg(sock, r_data->sg, r_data->sg_len,
-				      (r_data->flags & MMC_DATA_WRITE)
-				      ? PCI_DMA_TODEVICE : PCI_DMA_FROMDEVICE);
 		}
 
 		r_data->bytes_xfered = r_data->blocks
@@ -771,6 +773,11 @@ static void tifm_sd_end_cmd(unsigned long data)
 	       sock->addr + SOCK_CONTROL);
 
 	spin_unlock_irqrestore(&sock->lock, flags);
+
+	if (r_data && !host->no_dma)
+		tifm_unmap_sg(sock, r_data->sg, r_data->sg_len,
+			      tifm_sd_data_dir(r_data));
+
 	mmc_request_done(mmc, mrq);
 }
 
@@ -958,6 +965,17 @@ static int tifm_sd_probe(struct tifm_dev *sock)
 
 	tasklet_init(&host->finish_tasklet, tifm_sd_end_cmd,
 		     (unsigned long)host);
+
+	if (!host->no_dma) {
+		sg_init_one(&host->bounce_buf, host->bounce_buf_data,
+			    TIFM_MMCSD_MAX_BLOCK_SIZE);
+		if (1 != tifm_map_sg(sock, &host->bounce_buf, 1,
+				     PCI_DMA_BIDIRECTIONAL)) {
+			dev_err(&sock->dev, "bounce buffer map failed\n");
+			mmc_free_host(mmc);
+			return -ENOMEM;
+		}
+	}
 	setup_timer(&host->timer, tifm_sd_abort, (unsigned long)host);
 
 	mmc->ops = &tifm_sd_ops;
@@ -987,6 +1005,9 @@ static int tifm_sd_probe(struct tifm_dev *sock)
 	if (!rc)
 		return 0;
 
+	if (!host->no_dma)
+		tifm_unmap_sg(sock, &host->bounce_buf, 1,
+			      PCI_DMA_BIDIRECTIONAL);
 	mmc_free_host(mmc);
 	return rc;
 }
@@ -1019,6 +1040,9 @@ static void tifm_sd_remove(struct tifm_dev *sock)
 	mmc_remove_host(mmc);
 	dev_dbg(&sock->dev, "after remove\n");
 
+	if (!host->no_dma)
+		tifm_unmap_sg(sock, &host->bounce_buf, 1,
+			      PCI_DMA_BIDIRECTIONAL);
 	mmc_free_host(mmc);
 }
 
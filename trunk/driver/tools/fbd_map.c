@@ -0,0 +1,191 @@
+/*
+ *  fbd_map.c - decoder for the binary flash_bd block map
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Usage: fbd_map /sys/class/.../xd_card_block_map_bin
+ *
+ * Prints one line per logical block, same as the text block map:
+ * [<zone>: ]<log_block> <phy_block> <U|F|C>, or "--" for unmapped blocks.
+ * The live map is copied out first, retrying until the copy is consistent
+ * according to the map generation.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <byteswap.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../linux/flash_bd.h"
+
+static int swapped;
+
+static __u32 map_u32(__u32 val)
+{
+	return swapped ? bswap_32(val) : val;
+}
+
+static int map_test_bit(const unsigned char *map, unsigned int word_size,
+			unsigned int bit)
+{
+	unsigned long long word = 0;
+	unsigned int cnt;
+
+	/* bitmaps are arrays of kernel "unsigned long" words */
+	map += (bit / (word_size * 8)) * word_size;
+	memcpy(&word, map, word_size);
+
+	if (word_size == 4) {
+		__u32 w32;
+
+		memcpy(&w32, map, 4);
+		word = swapped ? bswap_32(w32) : w32;
+	} else if (swapped)
+		word = bswap_64(word);
+
+	cnt = bit % (word_size * 8);
+	return (word >> cnt) & 1;
+}
+
+/* Hex digits needed for values below cnt, as flash_bd_print_line uses. */
+static int map_hex_width(unsigned int cnt)
+{
+	int bits = 0;
+
+	while ((1U << bits) < cnt)
+		bits++;
+
+	return (bits + 3) / 4;
+}
+
+static unsigned char *map_snapshot(const unsigned char *map, unsigned int size)
+{
+	const volatile __u32 *gen
+		= (const volatile __u32 *)(map
+					   + offsetof(struct flash_bd_map_header,
+						      generation));
+	unsigned char *copy = malloc(size);
+	unsigned int retry;
+	__u32 g_start;
+
+	if (!copy)
+		return NULL;
+
+	for (retry = 0; retry < 1000; ++retry) {
+		g_start = *gen;
+		__sync_synchronize();
+
+		if (!(map_u32(g_start) & 1)) {
+			memcpy(copy, map, size);
+			__sync_synchronize();
+			if (*gen == g_start)
+				return copy;
+		}
+
+		usleep(1000);
+	}
+
+	free(copy);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct flash_bd_map_header hdr;
+	const unsigned char *map;
+	unsigned char *snap;
+	const __u32 *table;
+	unsigned int zone, log_block, phy_block, b_mask, size, word_size;
+	int fd, state, z_width, b_width;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <block map file>\n", argv[0]);
+		return 1;
+	}
+
+	fd = open(argv[1], O_RDONLY);
+	if (fd < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		fprintf(stderr, "%s: short header\n", argv[1]);
+		return 1;
+	}
+
+	if (hdr.magic == bswap_32(FLASH_BD_MAP_MAGIC))
+		swapped = 1;
+	else if (hdr.magic != FLASH_BD_MAP_MAGIC) {
+		fprintf(stderr, "%s: bad magic %08x\n", argv[1], hdr.magic);
+		return 1;
+	}
+
+	if ((swapped ? bswap_16(hdr.version) : hdr.version)
+	    != FLASH_BD_MAP_VERSION) {
+		fprintf(stderr, "%s: unsupported version\n", argv[1]);
+		return 1;
+	}
+
+	size = map_u32(hdr.map_size);
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	snap = map_snapshot(map, size);
+	munmap((void *)map, size);
+	if (!snap) {
+		fprintf(stderr, "%s: map is being updated\n", argv[1]);
+		return 1;
+	}
+
+	map = snap;
+	memcpy(&hdr, map, sizeof(hdr));
+
+	word_size = map_u32(hdr.word_size);
+	b_mask = (1U << map_u32(hdr.block_addr_bits)) - 1;
+	table = (const __u32 *)(map + map_u32(hdr.table_offset));
+	z_width = map_hex_width(map_u32(hdr.zone_cnt));
+	b_width = (map_u32(hdr.block_addr_bits) + 3) / 4;
+
+	printf("# generation %u\n", map_u32(hdr.generation));
+
+	for (zone = 0; zone < map_u32(hdr.zone_cnt); ++zone) {
+		for (log_block = 0; log_block < map_u32(hdr.log_block_cnt);
+		     ++log_block) {
+			if (map_u32(hdr.zone_cnt) > 1)
+				printf("%0*x: ", z_width, zone);
+
+			printf("%0*x ", b_width, log_block);
+			phy_block = map_u32(table[(zone
+						   << map_u32(hdr.block_addr_bits))
+						  | log_block]);
+			if (phy_block == FLASH_BD_INVALID) {
+				printf("--\n");
+				continue;
+			}
+
+			state = map_test_bit(map
+					     + map_u32(hdr.data_map_offset),
+					     word_size, phy_block);
+			state |= map_test_bit(map
+					      + map_u32(hdr.erase_map_offset),
+					      word_size, phy_block) << 1;
+			printf("%0*x %c\n", b_width, phy_block & b_mask,
+			       state == 2 ? 'C' : (state ? 'F' : 'U'));
+		}
+	}
+
+	free(snap);
+	close(fd);
+	return 0;
+}
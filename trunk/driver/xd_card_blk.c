@@ -108,6 +108,8 @@ void end_queued_request(struct request *rq, int uptodate)
 
 static int h_xd_card_read(struct xd_card_media *card,
 			  struct xd_card_request **req);
+static int h_xd_card_read_run(struct xd_card_media *card,
+			      struct xd_card_request **req);
 static int h_xd_card_read_tmp(struct xd_card_media *card,
 			      struct xd_card_request **req);
 static int h_xd_card_read_copy(struct xd_card_media *card,
@@ -122,6 +124,7 @@ static int h_xd_card_req_init(struct xd_card_media *card,
 			      struct xd_card_request **req);
 static void xd_card_free_media(struct xd_card_media *card);
 static int xd_card_stop_queue(struct xd_card_media *card);
+static void xd_card_submit_req(struct request_queue *q);
 static int xd_card_trans_req(struct xd_card_media *card,
 			     struct xd_card_request *req);
 
@@ -133,6 +136,18 @@ module_param(major, int, 0644);
 static unsigned int cmd_retries = 3;
 module_param(cmd_retries, uint, 0644);
 
+/* On-chip page copy skips ECC verification of relocated pages */
+static int copy_back = 1;
+module_param(copy_back, bool, 0644);
+
+/* Idle time (ms) after which partially written block is closed */
+static unsigned int open_block_timeout = 500;
+module_param(open_block_timeout, uint, 0644);
+
+/* Make the disk available after zone 0 is scanned, scan the rest later */
+static int async_scan = 1;
+module_param(async_scan, bool, 0644);
+
 static struct workqueue_struct *workqueue;
 static DEFINE_IDR(xd_card_disk_idr);
 static DEFINE_MUTEX(xd_card_disk_lock);
@@ -178,6 +193,24 @@ static unsigned int xd_card_extra_to_addr(struct xd_card_extra *extra)
 	return addr1;
 }
 
+/*
+ * Copy-back program is an optional NAND feature. Only trust it on xD media
+ * from vendors implementing it across the whole range.
+ */
+static int xd_card_has_copy_back(struct xd_card_media *card)
+{
+	if (card->sm_media || card->mask_rom)
+		return 0;
+
+	switch (card->id1.maker_code) {
+	case 0x98: /* Toshiba */
+	case 0xec: /* Samsung */
+		return 1;
+	default:
+		return 0;
+	}
+}
+
 /*** Block device ***/
 
 static int xd_card_bd_open(struct inode *inode, struct file *filp)
@@ -421,7 +454,7 @@ static ssize_t xd_card_format_store(struct device *dev,
 	unsigned long flags;
 
 	mutex_lock(&host->lock);
-	if (!host->card)
+	if (!host->card || host->card->s_thread)
 		goto out;
 
 	if (count < 6 || strncmp(buf, "format", 6))
@@ -474,6 +507,38 @@ static ssize_t xd_card_block_map_read(struct kobject *kobj,
 	return rc;
 }
 
+static ssize_t xd_card_block_map_bin_read(struct kobject *kobj,
+					  struct bin_attribute *attr,
+					  char *buf, loff_t offset,
+					  size_t count)
+{
+	struct device *dev = container_of(kobj, struct device, kobj);
+	struct xd_card_host *host = dev_get_drvdata(dev);
+	ssize_t rc = 0;
+
+	mutex_lock(&host->lock);
+	if (host->card)
+		rc = flash_bd_read_bin_map(host->card->fbd, buf, offset,
+					   count);
+	mutex_unlock(&host->lock);
+	return rc;
+}
+
+static int xd_card_block_map_bin_mmap(struct kobject *kobj,
+				      struct bin_attribute *attr,
+				      struct vm_area_struct *vma)
+{
+	struct device *dev = container_of(kobj, struct device, kobj);
+	struct xd_card_host *host = dev_get_drvdata(dev);
+	int rc = -ENODEV;
+
+	mutex_lock(&host->lock);
+	if (host->card)
+		rc = flash_bd_mmap_bin_map(host->card->fbd, vma);
+	mutex_unlock(&host->lock);
+	return rc;
+}
+
 /*** Protocol handlers ***/
 
 /**
@@ -569,6 +634,91 @@ EXPORT_SYMBOL(xd_card_get_extra);
  * finished (and request processor should come back some time later).
  */
 
+/*
+ * Requests touching zones not yet scanned by xd_card_scan_thread are held
+ * back (the scan thread restarts the queue as it progresses) or failed, if
+ * the scan has failed or the media is gone. A scan merely paused (by suspend)
+ * keeps them held. Held requests are moved off the queue to held_reqs, so
+ * that requests to zones already scanned can go past them. No ordered mode
+ * is set on the queue, so barriers never get here and need no special care.
+ */
+static int xd_card_zone_ready(struct xd_card_media *card, struct request *req)
+{
+	sector_t last = req->sector + req->nr_sectors - 1;
+
+	if (card->scan_zone >= card->zone_cnt)
+		return 1;
+
+	sector_div(last, card->log_block_cnt * card->page_cnt
+			 * (card->page_size >> 9));
+	return last < card->scan_zone;
+}
+
+/* Oldest held request which can go now, or the next one on the queue */
+static struct request *xd_card_next_req(struct xd_card_media *card)
+{
+	struct request *req;
+
+	list_for_each_entry(req, &card->held_reqs, queuelist) {
+		if (card->scan_failed || card->eject
+		    || xd_card_zone_ready(card, req)) {
+			list_del_init(&req->queuelist);
+			return req;
+		}
+	}
+
+	return elv_next_request(card->queue);
+}
+
+/*
+ * Restart the queue. Held requests must be looked at even if there's nothing
+ * on the queue itself. Called with q_lock held.
+ */
+static void xd_card_start_queue(struct xd_card_media *card)
+{
+	blk_start_queue(card->queue);
+
+	if (!list_empty(&card->held_reqs))
+		xd_card_submit_req(card->queue);
+}
+
+#ifdef DEBUG
+#define XD_CARD_PLAN_LEN 8
+
+/* Log the media commands a read request is going to produce */
+static void xd_card_dump_plan(struct xd_card_media *card,
+			      unsigned long long offset, unsigned int count)
+{
+	struct flash_bd_request plan[XD_CARD_PLAN_LEN];
+	unsigned int left;
+	int cnt, rc;
+
+	rc = flash_bd_plan_read(card->fbd, offset, count, plan,
+				XD_CARD_PLAN_LEN, &left);
+	if (rc < 0) {
+		dev_dbg(card->host->dev, "no read plan: %d\n", rc);
+		return;
+	}
+
+	for (cnt = 0; cnt < rc; ++cnt)
+		dev_dbg(card->host->dev, "read plan %d: %s (%x) %x -> %x, "
+			"%x + %x\n", cnt, flash_bd_cmd_name(plan[cnt].cmd),
+			plan[cnt].zone, plan[cnt].log_block,
+			plan[cnt].phy_block, plan[cnt].page_off,
+			plan[cnt].page_cnt);
+
+	if (left)
+		dev_dbg(card->host->dev, "read plan truncated, %x bytes "
+			"left\n", left);
+}
+#else
+static inline void xd_card_dump_plan(struct xd_card_media *card,
+				     unsigned long long offset,
+				     unsigned int count)
+{
+}
+#endif
+
 static int xd_card_issue_req(struct xd_card_media *card, int chunk)
 {
 	unsigned long long offset;
@@ -577,6 +727,24 @@ static int xd_card_issue_req(struct xd_card_media *card, int chunk)
 
 try_again:
 	while (chunk) {
+		if (!xd_card_zone_ready(card, card->block_req)) {
+			if (!card->scan_failed && !card->eject) {
+				dev_dbg(card->host->dev, "zone not ready\n");
+				blkdev_dequeue_request(card->block_req);
+				list_add_tail(&card->block_req->queuelist,
+					      &card->held_reqs);
+				break;
+			}
+
+			rc = -EIO;
+			goto req_failed;
+		}
+
+		if (card->read_only && rq_data_dir(card->block_req) != READ) {
+			rc = -EROFS;
+			goto req_failed;
+		}
+
 		card->seg_pos = 0;
 		card->seg_off = 0;
 		card->seg_count = blk_rq_map_sg(card->block_req->q,
@@ -595,12 +763,16 @@ try_again:
 			dev_dbg(card->host->dev, "Read segs: %d, offset: %llx, "
 				"size: %x\n", card->seg_count, offset, count);
 
+			xd_card_dump_plan(card, offset, count);
 			rc = flash_bd_start_reading(card->fbd, offset, count);
 		} else {
 			dev_dbg(card->host->dev, "Write segs: %d, offset: %llx,"
 				" size: %x\n", card->seg_count, offset, count);
 		
 			rc = flash_bd_start_writing(card->fbd, offset, count);
+			if (blk_barrier_rq(card->block_req)
+			    || rq_is_sync(card->block_req))
+				flash_bd_sync(card->fbd);
 		}
 
 		if (rc)
@@ -632,7 +804,7 @@ req_failed:
 	}
 
 	dev_dbg(card->host->dev, "elv_next\n");
-	card->block_req = elv_next_request(card->queue);
+	card->block_req = xd_card_next_req(card);
 	if (!card->block_req) {
 		dev_dbg(card->host->dev, "issue end\n");
 		return -EAGAIN;
@@ -649,6 +821,20 @@ static int h_xd_card_default_bad(struct xd_card_media *card,
 	return -ENXIO;
 }
 
+/* Report source pages flash_bd had to blank when closing an open block. */
+static void xd_card_check_lost(struct xd_card_media *card)
+{
+	unsigned int lost = flash_bd_lost_pages(card->fbd);
+
+	if (lost == card->lost_pages)
+		return;
+
+	dev_warn(card->host->dev, "%d unreadable pages replaced with blank "
+		 "ones while closing a block (%d in total)\n",
+		 lost - card->lost_pages, lost);
+	card->lost_pages = lost;
+}
+
 static int xd_card_complete_req(struct xd_card_media *card, int error)
 {
 	int chunk;
@@ -663,6 +849,7 @@ static int xd_card_complete_req(struct xd_card_media *card, int error)
 		if (error == -EAGAIN)
 			error = 0;
 		t_len = flash_bd_end(card->fbd);
+		xd_card_check_lost(card);
 
 		dev_dbg(card->host->dev, "transferred %x (%d)\n", t_len, error);
 		if (error == -EAGAIN)
@@ -673,6 +860,15 @@ static int xd_card_complete_req(struct xd_card_media *card, int error)
 
 		chunk = __blk_end_request(card->block_req, error, t_len);
 
+		/* If the flush is already pending, it will wait for the rest
+		 * of the idle time by itself.
+		 */
+		if (flash_bd_has_open_block(card->fbd)) {
+			card->w_stamp = jiffies;
+			queue_delayed_work(workqueue, &card->host->flush_work,
+					   msecs_to_jiffies(open_block_timeout));
+		}
+
 		error = xd_card_issue_req(card, chunk);
 
 		if (!error)
@@ -705,6 +901,81 @@ static int xd_card_stop_queue(struct xd_card_media *card)
 	return rc;
 }
 
+/*
+ * Close the block left open by the last write, so that the data is safe on
+ * the media. If that fails, the media is made read-only, as writes already
+ * reported complete may not be retrievable. Called with host lock held.
+ */
+static void xd_card_flush_media(struct xd_card_media *card)
+{
+	unsigned long flags;
+	int rc;
+
+	/* Scan thread owns the queue; it will queue the flush when done. */
+	if (!flash_bd_has_open_block(card->fbd) || card->s_thread)
+		return;
+
+	while (!xd_card_stop_queue(card))
+		wait_for_completion(&card->req_complete);
+
+	spin_lock_irqsave(&card->q_lock, flags);
+	if (card->format || card->eject) {
+		spin_unlock_irqrestore(&card->q_lock, flags);
+		return;
+	}
+	spin_unlock_irqrestore(&card->q_lock, flags);
+
+	dev_dbg(card->host->dev, "flushing open block\n");
+	flash_bd_start_flushing(card->fbd);
+	rc = flash_bd_next_req(card->fbd, &card->flash_req, 0, 0);
+
+	if (!rc)
+		rc = xd_card_trans_req(card, &card->req);
+
+	if (!rc) {
+		xd_card_new_req(card->host);
+		wait_for_completion(&card->req_complete);
+		rc = card->req.error;
+	}
+
+	flash_bd_end(card->fbd);
+	xd_card_check_lost(card);
+
+	if (rc && rc != -EAGAIN) {
+		dev_err(card->host->dev, "failed to flush open block (%d), "
+			"media is now read-only\n", rc);
+		card->read_only = 1;
+		set_disk_ro(card->disk, 1);
+	}
+
+	spin_lock_irqsave(&card->q_lock, flags);
+	xd_card_start_queue(card);
+	spin_unlock_irqrestore(&card->q_lock, flags);
+}
+
+static void xd_card_flush(struct work_struct *work)
+{
+	struct xd_card_host *host = container_of(work, struct xd_card_host,
+						 flush_work.work);
+	unsigned long timeout = msecs_to_jiffies(open_block_timeout);
+	unsigned long flags, idle;
+
+	mutex_lock(&host->lock);
+	if (host->card) {
+		spin_lock_irqsave(&host->card->q_lock, flags);
+		idle = jiffies - host->card->w_stamp;
+		spin_unlock_irqrestore(&host->card->q_lock, flags);
+
+		/* Written to since the flush was queued: wait some more */
+		if (idle < timeout)
+			queue_delayed_work(workqueue, &host->flush_work,
+					   timeout - idle);
+		else
+			xd_card_flush_media(host->card);
+	}
+	mutex_unlock(&host->lock);
+}
+
 static unsigned long long xd_card_req_address(struct xd_card_media *card,
 					      unsigned int byte_off)
 {
@@ -722,6 +993,57 @@ static unsigned long long xd_card_req_address(struct xd_card_media *card,
 	return rv;
 }
 
+static unsigned long long xd_card_copy_src_address(struct xd_card_media *card,
+						   unsigned int byte_off)
+{
+	unsigned long long rv = card->flash_req.zone;
+
+	rv <<= card->block_addr_bits;
+	rv |= card->flash_req.src.phy_block;
+	rv <<= card->page_addr_bits;
+	rv |= card->flash_req.src.page_off
+	      * (card->page_size / card->hw_page_size);
+	rv <<= 8;
+
+	if (byte_off)
+		rv += (byte_off / card->hw_page_size) << 8;
+
+	return rv;
+}
+
+static int h_xd_card_copy_back(struct xd_card_media *card,
+			       struct xd_card_request **req);
+
+/*
+ * Copy-back program can not cross the chip's plane (district) boundary. The
+ * plane is selected by the low bits of the block address on multi-plane parts
+ * (up to 4 planes in xD media), while districts are larger than a zone; so
+ * pages are only copied on-chip between blocks with matching low address bits.
+ * Other copies go through the host buffer.
+ */
+static int xd_card_copy_back_ok(struct xd_card_media *card)
+{
+	return card->copy_back
+	       && !((card->flash_req.phy_block ^ card->flash_req.src.phy_block)
+		    & 3);
+}
+
+/*
+ * Copy-back: the page is loaded into the chip's page register by an address
+ * only read and programmed into destination page straight from there, so
+ * that relocated data never crosses the bus.
+ */
+static void xd_card_copy_back_read(struct xd_card_media *card,
+				   struct xd_card_request *req)
+{
+	req->cmd = XD_CARD_CMD_READ1;
+	req->flags = 0;
+	req->addr = xd_card_copy_src_address(card, card->trans_cnt);
+	req->error = 0;
+	req->count = 0;
+	card->next_request[0] = h_xd_card_copy_back;
+}
+
 static int h_xd_card_req_init(struct xd_card_media *card,
 			      struct xd_card_request **req)
 {
@@ -928,7 +1250,8 @@ static int xd_card_check_ecc(struct xd_card_media *card)
 	return 0;
 }
 
-static void xd_card_update_extra(struct xd_card_media *card)
+static void xd_card_calc_extra(struct xd_card_media *card,
+			       struct xd_card_extra *extra)
 {
 	unsigned int act_ecc;
 	unsigned int e_pos = 0, off = 0, e_state, p_off, p_cnt, s_len;
@@ -945,7 +1268,7 @@ static void xd_card_update_extra(struct xd_card_media *card)
 	if (s_len < card->page_size)
 		return;
 
-	xd_card_addr_to_extra(&card->host->extra, card->flash_req.log_block);
+	xd_card_addr_to_extra(extra, card->flash_req.log_block);
 
 	if (card->auto_ecc || (card->req.flags & XD_CARD_REQ_NO_ECC))
 		return;
@@ -979,13 +1302,13 @@ static void xd_card_update_extra(struct xd_card_media *card)
 		act_ecc = xd_card_ecc_value(e_state);
 
 		if (!do_other) {
-			card->host->extra.ecc_lo[0] = act_ecc & 0xff;
-			card->host->extra.ecc_lo[1] = (act_ecc >> 8) & 0xff;
-			card->host->extra.ecc_lo[2] = (act_ecc >> 16) & 0xff;
+			extra->ecc_lo[0] = act_ecc & 0xff;
+			extra->ecc_lo[1] = (act_ecc >> 8) & 0xff;
+			extra->ecc_lo[2] = (act_ecc >> 16) & 0xff;
 		} else {
-			card->host->extra.ecc_hi[0] = act_ecc & 0xff;
-			card->host->extra.ecc_hi[1] = (act_ecc >> 8) & 0xff;
-			card->host->extra.ecc_hi[2] = (act_ecc >> 16) & 0xff;
+			extra->ecc_hi[0] = act_ecc & 0xff;
+			extra->ecc_hi[1] = (act_ecc >> 8) & 0xff;
+			extra->ecc_hi[2] = (act_ecc >> 16) & 0xff;
 		}
 		
 		off += e_pos;
@@ -994,13 +1317,15 @@ static void xd_card_update_extra(struct xd_card_media *card)
 	}
 }
 
-static void xd_card_update_extra_tmp(struct xd_card_media *card)
+static void xd_card_calc_extra_tmp(struct xd_card_media *card,
+				   struct xd_card_extra *extra,
+				   unsigned int t_off)
 {
 	unsigned int act_ecc;
 	unsigned int e_pos = 0, e_state = 0, len = card->page_size;
-	unsigned char *buf = card->t_buf + card->trans_cnt;
+	unsigned char *buf = card->t_buf + t_off;
 
-	if ((card->trans_len - card->trans_cnt) < card->page_size)
+	if ((card->trans_len - t_off) < card->page_size)
 		return;
 
 	if (card->auto_ecc || (card->req.flags & XD_CARD_REQ_NO_ECC))
@@ -1008,9 +1333,9 @@ static void xd_card_update_extra_tmp(struct xd_card_media *card)
 
 	xd_card_ecc_step(&e_state, &e_pos, buf, len);
 	act_ecc = xd_card_ecc_value(e_state);
-	card->host->extra.ecc_lo[0] = act_ecc & 0xff;
-	card->host->extra.ecc_lo[1] = (act_ecc >> 8) & 0xff;
-	card->host->extra.ecc_lo[2] = (act_ecc >> 16) & 0xff;
+	extra->ecc_lo[0] = act_ecc & 0xff;
+	extra->ecc_lo[1] = (act_ecc >> 8) & 0xff;
+	extra->ecc_lo[2] = (act_ecc >> 16) & 0xff;
 
 	e_state = 0;
 	buf += e_pos;
@@ -1018,9 +1343,67 @@ static void xd_card_update_extra_tmp(struct xd_card_media *card)
 	e_pos = 0;
 	xd_card_ecc_step(&e_state, &e_pos, buf, len);
 	act_ecc = xd_card_ecc_value(e_state);
-	card->host->extra.ecc_hi[0] = act_ecc & 0xff;
-	card->host->extra.ecc_hi[1] = (act_ecc >> 8) & 0xff;
-	card->host->extra.ecc_hi[2] = (act_ecc >> 16) & 0xff;
+	extra->ecc_hi[0] = act_ecc & 0xff;
+	extra->ecc_hi[1] = (act_ecc >> 8) & 0xff;
+	extra->ecc_hi[2] = (act_ecc >> 16) & 0xff;
+}
+
+/*
+ * Extra data for the page about to be written. It may have been prepared
+ * already, while the previous page was being programmed.
+ */
+static void xd_card_update_extra(struct xd_card_media *card)
+{
+	if (card->w_extra_ready) {
+		memcpy(&card->host->extra, &card->w_extra,
+		       sizeof(struct xd_card_extra));
+		card->w_extra_ready = 0;
+	} else
+		xd_card_calc_extra(card, &card->host->extra);
+}
+
+static void xd_card_update_extra_tmp(struct xd_card_media *card)
+{
+	if (card->w_extra_ready) {
+		memcpy(&card->host->extra, &card->w_extra,
+		       sizeof(struct xd_card_extra));
+		card->w_extra_ready = 0;
+	} else
+		xd_card_calc_extra_tmp(card, &card->host->extra,
+				       card->trans_cnt);
+}
+
+/*
+ * Page program takes a few hundred microseconds, during which the host only
+ * waits for the status. Software ECC of the next page is computed in this
+ * window, instead of between the status check and the next page input.
+ * Position of the next page is that of the current one, advanced by the page
+ * just transferred.
+ */
+static void xd_card_prepare_extra(struct xd_card_media *card, int tmp)
+{
+	unsigned int seg_pos = card->seg_pos, seg_off = card->seg_off;
+	unsigned int t_off = card->trans_cnt + card->hw_page_size;
+
+	card->w_extra_ready = 0;
+
+	if (card->auto_ecc || card->host->extra_pos
+	    || ((t_off + card->hw_page_size) > card->trans_len))
+		return;
+
+	memcpy(&card->w_extra, &card->host->extra,
+	       sizeof(struct xd_card_extra));
+
+	if (tmp)
+		xd_card_calc_extra_tmp(card, &card->w_extra, t_off);
+	else {
+		xd_card_advance(card, card->hw_page_size);
+		xd_card_calc_extra(card, &card->w_extra);
+		card->seg_pos = seg_pos;
+		card->seg_off = seg_off;
+	}
+
+	card->w_extra_ready = 1;
 }
 
 static int xd_card_check_ecc_tmp(struct xd_card_media *card)
@@ -1069,6 +1452,39 @@ static int xd_card_check_ecc_tmp(struct xd_card_media *card)
 	return 0;
 }
 
+/*
+ * Software ECC media is normally read one hardware page at a time, as the
+ * extra area of each page has to be fetched along with the data. When the
+ * host can fetch a batch of extra areas at once, pages are read in runs:
+ * data for the whole run is transferred first, followed by a single
+ * XD_CARD_CMD_READ3 for the run's extra areas; ECC is then checked for every
+ * page of the run in turn. card->trans_cnt only ever counts verified pages.
+ */
+static void xd_card_setup_run_data(struct xd_card_media *card,
+				   struct xd_card_request *req)
+{
+	unsigned int count = min(card->req_sg[card->seg_pos].length
+				 - card->seg_off,
+				 card->run_len - card->run_pos);
+
+	req->cmd = XD_CARD_CMD_READ1;
+	req->flags = XD_CARD_REQ_DATA | XD_CARD_REQ_NO_ECC;
+	req->addr = xd_card_req_address(card, card->trans_cnt + card->run_pos);
+	req->error = 0;
+	req->count = 0;
+	sg_set_page(&req->sg, sg_page(&card->req_sg[card->seg_pos]), count,
+		    card->req_sg[card->seg_pos].offset + card->seg_off);
+}
+
+static void xd_card_start_run(struct xd_card_media *card,
+			      struct xd_card_request *req)
+{
+	card->run_pos = 0;
+	card->run_len = min(card->trans_len - card->trans_cnt,
+			    card->extra_batch * card->page_size);
+	xd_card_setup_run_data(card, req);
+}
+
 static int xd_card_trans_req(struct xd_card_media *card,
 			     struct xd_card_request *req)
 {
@@ -1104,6 +1520,12 @@ process_next:
 		card->trans_cnt = 0;
 		card->trans_len = card->flash_req.page_cnt * card->page_size;
 
+		if (card->extra_batch) {
+			xd_card_start_run(card, req);
+			card->next_request[0] = h_xd_card_read_run;
+			return 0;
+		}
+
 		if (card->auto_ecc) {
 			req->sg.length = min(card->trans_len, req->sg.length);
 		} else {
@@ -1171,20 +1593,19 @@ process_next:
 		card->next_request[0] = h_xd_card_erase;
 		return 0;
 	case FBD_COPY:
+		card->trans_cnt = 0;
+		card->trans_len = card->flash_req.page_cnt * card->page_size;
+
+		if (xd_card_copy_back_ok(card)) {
+			xd_card_copy_back_read(card, req);
+			return 0;
+		}
+
 		req->cmd = XD_CARD_CMD_READ1;
 		req->flags = XD_CARD_REQ_DATA;
-		req->addr = card->flash_req.zone;
-		req->addr <<= card->block_addr_bits;
-		req->addr |= card->flash_req.src.phy_block;
-		req->addr <<= card->page_addr_bits;
-		req->addr |= card->flash_req.src.page_off
-			     * (card->page_size / card->hw_page_size);
-		req->addr <<= 8;
-
+		req->addr = xd_card_copy_src_address(card, 0);
 		req->error = 0;
 		req->count = 0;
-		card->trans_cnt = 0;
-		card->trans_len = card->flash_req.page_cnt * card->page_size;
 
 		if (card->auto_ecc)
 			sg_set_buf(&req->sg, card->t_buf, card->trans_len);
@@ -1214,6 +1635,7 @@ process_next:
 			card->trans_len);
 
 		memset(&card->host->extra, 0xff, sizeof(struct xd_card_extra));
+		card->w_extra_ready = 0;
 		xd_card_addr_to_extra(&card->host->extra,
 				      card->flash_req.log_block);
 		xd_card_update_extra(card);
@@ -1235,6 +1657,7 @@ process_next:
 		sg_set_buf(&req->sg, card->t_buf, card->hw_page_size);
 
 		memset(&card->host->extra, 0xff, sizeof(struct xd_card_extra));
+		card->w_extra_ready = 0;
 		xd_card_addr_to_extra(&card->host->extra,
 				      card->flash_req.log_block);
 		xd_card_update_extra_tmp(card);
@@ -1263,6 +1686,7 @@ process_next:
 		sg_set_buf(&req->sg, card->t_buf, card->hw_page_size);
 
 		memset(&card->host->extra, 0xff, sizeof(struct xd_card_extra));
+		card->w_extra_ready = 0;
 		xd_card_addr_to_extra(&card->host->extra,
 				      card->flash_req.log_block);
 		xd_card_update_extra_tmp(card);
@@ -1285,6 +1709,7 @@ process_next:
 		sg_set_buf(&req->sg, card->t_buf, card->hw_page_size);
 
 		memset(&card->host->extra, 0xff, sizeof(struct xd_card_extra));
+		card->w_extra_ready = 0;
 		card->host->extra.block_status = 0xf0;
 
 		card->next_request[0] = h_xd_card_write_tmp; 
@@ -1409,6 +1834,76 @@ out:
 	return xd_card_try_next_req(card, req);
 }
 
+static int h_xd_card_read_run_extra(struct xd_card_media *card,
+				    struct xd_card_request **req)
+{
+	unsigned int p_cnt = card->run_len / card->page_size, cnt;
+	int rc = (*req)->error;
+
+	dev_dbg(card->host->dev, "read run extra %d (%d) of %d\n",
+		(*req)->count, (*req)->error, p_cnt);
+
+	if (!rc && ((*req)->count != p_cnt * sizeof(struct xd_card_extra)))
+		rc = -EIO;
+
+	xd_card_advance(card, -card->run_pos);
+
+	for (cnt = 0; !rc && (cnt < p_cnt); ++cnt) {
+		memcpy(&card->host->extra, &card->e_buf[cnt],
+		       sizeof(struct xd_card_extra));
+		rc = xd_card_check_ecc(card);
+		if (!rc) {
+			xd_card_advance(card, card->page_size);
+			card->trans_cnt += card->page_size;
+		}
+	}
+
+	if (!rc && (card->trans_cnt < card->trans_len)) {
+		xd_card_start_run(card, *req);
+		card->next_request[0] = h_xd_card_read_run;
+		return 0;
+	}
+
+	(*req)->error = rc;
+	return xd_card_try_next_req(card, req);
+}
+
+static int h_xd_card_read_run(struct xd_card_media *card,
+			      struct xd_card_request **req)
+{
+	dev_dbg(card->host->dev, "read run %d (%d) at %d of %d\n",
+		(*req)->count, (*req)->error, card->run_pos, card->run_len);
+
+	if (!(*req)->error) {
+		if (!(*req)->count || ((*req)->count % card->hw_page_size))
+			(*req)->error = -EIO;
+	}
+
+	if ((*req)->error) {
+		xd_card_advance(card, -card->run_pos);
+		return xd_card_try_next_req(card, req);
+	}
+
+	xd_card_advance(card, (*req)->count);
+	card->run_pos += (*req)->count;
+
+	if (card->run_pos < card->run_len) {
+		xd_card_setup_run_data(card, *req);
+		return 0;
+	}
+
+	(*req)->cmd = XD_CARD_CMD_READ3;
+	(*req)->flags = XD_CARD_REQ_DATA | XD_CARD_REQ_NO_ECC;
+	(*req)->addr = xd_card_req_address(card, card->trans_cnt);
+	(*req)->error = 0;
+	(*req)->count = 0;
+	sg_set_buf(&(*req)->sg, card->e_buf,
+		   (card->run_len / card->page_size)
+		   * sizeof(struct xd_card_extra));
+	card->next_request[0] = h_xd_card_read_run_extra;
+	return 0;
+}
+
 static int h_xd_card_read_tmp(struct xd_card_media *card,
 			      struct xd_card_request **req)
 {
@@ -1507,6 +2002,16 @@ static int h_xd_card_write_tmp_adv(struct xd_card_media *card,
 	return xd_card_try_next_req(card, req);
 }
 
+/*
+ * flash_bd may retry a failed FBD_WRITE on another block, so data position
+ * goes back to where the command started.
+ */
+static void xd_card_write_rewind(struct xd_card_media *card)
+{
+	if (card->trans_cnt)
+		xd_card_advance(card, -card->trans_cnt);
+}
+
 static int h_xd_card_write_adv(struct xd_card_media *card,
 			       struct xd_card_request **req)
 {
@@ -1540,7 +2045,8 @@ static int h_xd_card_write_adv(struct xd_card_media *card,
 			card->next_request[0] = h_xd_card_write;
 			return 0;
 		}
-	}
+	} else
+		xd_card_write_rewind(card);
 
 	return xd_card_try_next_req(card, req);
 }
@@ -1556,6 +2062,12 @@ static int h_xd_card_write_stat(struct xd_card_media *card,
 		(*req)->error = 0;
 		(*req)->count = 0;
 		card->next_request[0] = card->next_request[1];
+
+		if (card->next_request[1] == h_xd_card_write_adv)
+			xd_card_prepare_extra(card, 0);
+		else if (card->next_request[1] == h_xd_card_write_tmp_adv)
+			xd_card_prepare_extra(card, 1);
+
 		return 0;
 	} else
 		return xd_card_try_next_req(card, req);
@@ -1571,8 +2083,10 @@ static int h_xd_card_write(struct xd_card_media *card,
 	dev_dbg(card->host->dev, "card_write %d, %d\n", (*req)->error,
 		(*req)->count);
 
-	if ((*req)->error)
+	if ((*req)->error) {
+		xd_card_write_rewind(card);
 		return xd_card_try_next_req(card, req);
+	}
 
 	if (card->host->caps & XD_CARD_CAP_CMD_SHORTCUT) {
 		return h_xd_card_write_adv(card, req);
@@ -1615,6 +2129,62 @@ static int h_xd_card_write_tmp(struct xd_card_media *card,
 	}
 }
 
+static int h_xd_card_copy_back_adv(struct xd_card_media *card,
+				   struct xd_card_request **req)
+{
+	if (!(*req)->error && ((*req)->status & XD_CARD_STTS_FAIL))
+		(*req)->error = -EFAULT;
+
+	dev_dbg(card->host->dev, "copy_back_adv %d, %02x, %x of %x\n",
+		(*req)->error, (*req)->status, card->trans_cnt,
+		card->trans_len);
+
+	if (!(*req)->error) {
+		card->trans_cnt += card->hw_page_size;
+
+		if (card->trans_cnt < card->trans_len) {
+			xd_card_copy_back_read(card, *req);
+			return 0;
+		}
+	}
+
+	return xd_card_try_next_req(card, req);
+}
+
+static int h_xd_card_copy_back_prog(struct xd_card_media *card,
+				    struct xd_card_request **req)
+{
+	if ((*req)->error)
+		return xd_card_try_next_req(card, req);
+
+	if (card->host->caps & XD_CARD_CAP_CMD_SHORTCUT)
+		return h_xd_card_copy_back_adv(card, req);
+
+	(*req)->cmd = XD_CARD_CMD_PAGE_PROG;
+	(*req)->flags = XD_CARD_REQ_DIR;
+	(*req)->error = 0;
+	(*req)->count = 0;
+
+	card->next_request[0] = h_xd_card_write_stat;
+	card->next_request[1] = h_xd_card_copy_back_adv;
+	return 0;
+}
+
+static int h_xd_card_copy_back(struct xd_card_media *card,
+			       struct xd_card_request **req)
+{
+	if ((*req)->error)
+		return xd_card_try_next_req(card, req);
+
+	(*req)->cmd = XD_CARD_CMD_COPY_PROG;
+	(*req)->flags = XD_CARD_REQ_DIR | XD_CARD_REQ_STATUS;
+	(*req)->addr = xd_card_req_address(card, card->trans_cnt);
+	(*req)->error = 0;
+	(*req)->count = 0;
+	card->next_request[0] = h_xd_card_copy_back_prog;
+	return 0;
+}
+
 static int h_xd_card_read_copy(struct xd_card_media *card,
 			       struct xd_card_request **req)
 {
@@ -1652,8 +2222,8 @@ static int h_xd_card_read_copy(struct xd_card_media *card,
 				(*req)->count = 0;
 				(*req)->error = 0;
 				(*req)->addr
-					= xd_card_req_address(card,
-							      card->trans_cnt);
+					= xd_card_copy_src_address(card,
+								   card->trans_cnt);
 				sg_set_buf(&(*req)->sg,
 					   card->t_buf + card->trans_cnt,
 					   card->hw_page_size);
@@ -1669,6 +2239,10 @@ static int h_xd_card_read_copy(struct xd_card_media *card,
 			(*req)->error = -EIO;
 	}
 
+	/* FBD_COPY reports the amount of data written to destination */
+	if ((*req)->error)
+		card->trans_cnt = 0;
+
 	if (!(*req)->error) {
 		(*req)->cmd = XD_CARD_CMD_INPUT;
 		(*req)->flags = XD_CARD_REQ_DATA | XD_CARD_REQ_DIR
@@ -1682,6 +2256,7 @@ static int h_xd_card_read_copy(struct xd_card_media *card,
 		sg_set_buf(&(*req)->sg, card->t_buf, card->hw_page_size);
 
 		memset(&card->host->extra, 0xff, sizeof(struct xd_card_extra));
+		card->w_extra_ready = 0;
 		xd_card_addr_to_extra(&card->host->extra,
 				      card->flash_req.log_block);
 		xd_card_update_extra_tmp(card);
@@ -1951,6 +2526,66 @@ out:
 	return rc;
 }
 
+static int xd_card_blank_extra(struct xd_card_host *host)
+{
+	unsigned char *extra = (unsigned char *)&host->extra;
+	unsigned int cnt;
+
+	for (cnt = 0; cnt < sizeof(host->extra); ++cnt) {
+		if (extra[cnt] != 0xff)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * A block with the address in its first page and a blank last page was left
+ * open by a write when the media went away: its head holds data already
+ * reported written, its tail is still in the complete block. Hand the pair
+ * to flash_bd as the open block, so that the tail gets copied over, instead
+ * of throwing the newer data away.
+ */
+static int xd_card_resume_open(struct xd_card_host *host, unsigned int zone,
+			       unsigned int log_block, unsigned int src_block,
+			       unsigned int dst_block)
+{
+	struct xd_card_media *card = host->card;
+	unsigned int page;
+	int rc;
+
+	/* Pages are programmed in order; find the first blank one. */
+	for (page = 1; page < card->page_cnt - 1; ++page) {
+		rc = xd_card_read_extra(host, zone, dst_block, page);
+		if (rc)
+			return rc;
+
+		if (xd_card_blank_extra(host))
+			break;
+	}
+
+	rc = flash_bd_set_open(card->fbd, zone, log_block, src_block,
+			       dst_block, page);
+	if (rc) {
+		dev_warn(host->dev, "can not resume partial block (%x) %x -> "
+			 "%x (%d), dropping it\n", zone, log_block, dst_block,
+			 rc);
+		flash_bd_set_empty(card->fbd, zone, dst_block, 0);
+		flash_bd_set_empty(card->fbd, zone, src_block, 0);
+		return flash_bd_set_full(card->fbd, zone, src_block,
+					 log_block);
+	}
+
+	dev_info(host->dev, "resuming partial block (%x) %x -> %x, %x pages, "
+		 "rest in %x\n", zone, log_block, dst_block, page, src_block);
+
+	/* The flush closes it, unless some request gets to it first. */
+	card->w_stamp = jiffies;
+	queue_delayed_work(workqueue, &host->flush_work,
+			   msecs_to_jiffies(open_block_timeout));
+	return 0;
+}
+
 static int xd_card_resolve_conflict(struct xd_card_host *host,
 				    unsigned int zone,
 				    unsigned int phy_block,
@@ -1960,20 +2595,21 @@ static int xd_card_resolve_conflict(struct xd_card_host *host,
 	unsigned int o_phy_block = flash_bd_get_physical(card->fbd, zone,
 							 log_block);
 	unsigned int l_addr, l_addr_o;
-	int rc;
+	int rc, blank, blank_o;
 
 	rc = xd_card_read_extra(host, zone, phy_block, card->page_cnt - 1);
 	if (rc)
 		return rc;
 
 	l_addr = xd_card_extra_to_addr(&host->extra);
+	blank = xd_card_blank_extra(host);
 
 	rc = xd_card_read_extra(host, zone, o_phy_block, card->page_cnt - 1);
 	if (rc)
 		return rc;
 
 	l_addr_o = xd_card_extra_to_addr(&host->extra);
-
+	blank_o = xd_card_blank_extra(host);
 
 	dev_warn(host->dev, "block map conflict (%x) %x -> %x, %x (%x, %x)\n",
 		 zone, log_block, phy_block, o_phy_block, l_addr, l_addr_o);
@@ -1984,6 +2620,14 @@ static int xd_card_resolve_conflict(struct xd_card_host *host,
 	if (l_addr_o !=log_block)
 		l_addr_o = FLASH_BD_INVALID;
 
+	/* Both carry the address in the first page (see fill_lut_block). */
+	if (blank && l_addr_o != FLASH_BD_INVALID)
+		return xd_card_resume_open(host, zone, log_block, o_phy_block,
+					   phy_block);
+	else if (blank_o && l_addr != FLASH_BD_INVALID)
+		return xd_card_resume_open(host, zone, log_block, phy_block,
+					   o_phy_block);
+
 	if (l_addr == l_addr_o) {
 		if (phy_block < o_phy_block) {
 			flash_bd_set_empty(card->fbd, zone, o_phy_block, 0);
@@ -2001,51 +2645,183 @@ static int xd_card_resolve_conflict(struct xd_card_host *host,
 	return 0;
 }
 
-static int xd_card_fill_lut(struct xd_card_host *host)
+static int xd_card_fill_lut_block(struct xd_card_host *host,
+				  unsigned int z_cnt, unsigned int b_cnt)
 {
 	struct xd_card_media *card = host->card;
-	unsigned int z_cnt = 0, b_cnt, log_block, s_block = card->cis_block + 1;
+	unsigned int log_block;
 	int rc;
 
-	for (z_cnt = 0; z_cnt < card->zone_cnt; ++z_cnt) {
-		for (b_cnt = s_block; b_cnt < card->phy_block_cnt; ++b_cnt) {
-			rc = xd_card_read_extra(host, z_cnt, b_cnt, 0);
+	rc = xd_card_read_extra(host, z_cnt, b_cnt, 0);
+	if (rc)
+		return rc;
+
+	dev_dbg(host->dev, "extra (%x) %x : %02x, %04x, %04x\n",
+		z_cnt, b_cnt, host->extra.block_status,
+		host->extra.addr1, host->extra.addr2);
+
+	if (xd_card_bad_block(host)) {
+		flash_bd_set_full(card->fbd, z_cnt, b_cnt, FLASH_BD_INVALID);
+		return 0;
+	}
+
+	log_block = xd_card_extra_to_addr(&host->extra);
+	if (log_block == FLASH_BD_INVALID) {
+		flash_bd_set_empty(card->fbd, z_cnt, b_cnt, 0);
+		return 0;
+	}
+
+	rc = flash_bd_set_full(card->fbd, z_cnt, b_cnt, log_block);
+	if (rc == -EEXIST)
+		rc = xd_card_resolve_conflict(host, z_cnt, b_cnt, log_block);
+
+	dev_dbg(host->dev, "fill lut (%x) %x -> %x, %x\n",
+		z_cnt, log_block, b_cnt, rc);
+
+	return rc;
+}
+
+/* Scan zones synchronously, up to (not including) zone "z_last". */
+static int xd_card_fill_lut(struct xd_card_host *host, unsigned int z_last)
+{
+	struct xd_card_media *card = host->card;
+	int rc;
+
+	for (; card->scan_zone < z_last; ++card->scan_zone) {
+		for (; card->scan_block < card->phy_block_cnt;
+		     ++card->scan_block) {
+			rc = xd_card_fill_lut_block(host, card->scan_zone,
+						    card->scan_block);
 			if (rc)
 				return rc;
+		}
+		card->scan_block = 0;
+	}
+	return 0;
+}
 
-			dev_dbg(host->dev, "extra (%x) %x : %02x, %04x, %04x\n",
-				z_cnt, b_cnt, host->extra.block_status,
-				host->extra.addr1, host->extra.addr2);
+#define XD_CARD_SCAN_BATCH 64
 
-			if (xd_card_bad_block(host)) {
-				flash_bd_set_full(card->fbd, z_cnt, b_cnt,
-						  FLASH_BD_INVALID);
-				continue;
-			}
+/*
+ * Background LUT scan. The queue is stopped for XD_CARD_SCAN_BATCH blocks at
+ * a time, so that requests to the zones already scanned can go through
+ * in between.
+ */
+static int xd_card_scan_thread(void *data)
+{
+	struct xd_card_media *card = data;
+	struct xd_card_host *host = card->host;
+	unsigned int b_cnt;
+	unsigned long flags;
+	int rc = 0;
 
-			log_block = xd_card_extra_to_addr(&host->extra);
-			if (log_block == FLASH_BD_INVALID) {
-				flash_bd_set_empty(card->fbd, z_cnt, b_cnt, 0);
-				continue;
+	while (card->scan_zone < card->zone_cnt) {
+		while (!xd_card_stop_queue(card))
+			wait_for_completion(&card->req_complete);
+
+		for (b_cnt = 0; b_cnt < XD_CARD_SCAN_BATCH; ++b_cnt) {
+			if (kthread_should_stop()) {
+				rc = -EINTR;
+				break;
 			}
 
-			rc = flash_bd_set_full(card->fbd, z_cnt, b_cnt,
-					       log_block);
-			if (rc == -EEXIST)
-				rc = xd_card_resolve_conflict(host, z_cnt,
-							      b_cnt, log_block);
+			rc = xd_card_fill_lut_block(host, card->scan_zone,
+						    card->scan_block);
+			if (rc)
+				break;
+
+			if (++card->scan_block == card->phy_block_cnt)
+				break;
+		}
 
-			dev_dbg(host->dev, "fill lut (%x) %x -> %x, %x\n",
-				z_cnt, log_block, b_cnt, rc);
+		spin_lock_irqsave(&card->q_lock, flags);
+		if (card->scan_block == card->phy_block_cnt) {
+			card->scan_block = 0;
+			card->scan_zone++;
+			dev_dbg(host->dev, "zone %x scanned\n",
+				card->scan_zone - 1);
+		}
+		/* Whoever is stopping us keeps the queue stopped */
+		if (card->s_thread)
+			xd_card_start_queue(card);
+		spin_unlock_irqrestore(&card->q_lock, flags);
 
-			if (rc)
-				return rc;
+		if (rc)
+			break;
+	}
+
+	if (rc && rc != -EINTR)
+		dev_err(host->dev, "media scan failed at %x:%x (%d)\n",
+			card->scan_zone, card->scan_block, rc);
+
+	spin_lock_irqsave(&card->q_lock, flags);
+	if (card->s_thread) {
+		card->s_thread = NULL;
+		card->scan_failed = rc ? 1 : 0;
+		if (flash_bd_has_open_block(card->fbd)) {
+			card->w_stamp = jiffies;
+			queue_delayed_work(workqueue, &host->flush_work,
+					   msecs_to_jiffies(open_block_timeout));
 		}
-		s_block = 0;
+		/* Let held requests to unscanned zones fail */
+		xd_card_start_queue(card);
+		spin_unlock_irqrestore(&card->q_lock, flags);
+		return rc;
 	}
+	spin_unlock_irqrestore(&card->q_lock, flags);
+
+	/* Someone is stopping us, wait for it */
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+	return rc;
+}
+
+static int xd_card_start_scan(struct xd_card_media *card)
+{
+	struct task_struct *s_thread;
+	unsigned long flags;
+
+	s_thread = kthread_create(xd_card_scan_thread, card,
+				  DRIVER_NAME"_scand");
+
+	spin_lock_irqsave(&card->q_lock, flags);
+	if (IS_ERR(s_thread)) {
+		/* Nothing is going to scan the rest of the media */
+		card->scan_failed = 1;
+		spin_unlock_irqrestore(&card->q_lock, flags);
+		return PTR_ERR(s_thread);
+	}
+
+	card->s_thread = s_thread;
+	card->scan_failed = 0;
+	spin_unlock_irqrestore(&card->q_lock, flags);
 	return 0;
 }
 
+/*
+ * Pause the scan; it can be picked up later from scan_zone/scan_block. The
+ * queue is left stopped, so that requests to unscanned zones stay held.
+ */
+static void xd_card_stop_scan(struct xd_card_media *card)
+{
+	struct task_struct *s_thread;
+	unsigned long flags;
+
+	spin_lock_irqsave(&card->q_lock, flags);
+	s_thread = card->s_thread;
+	if (s_thread && card->queue)
+		blk_stop_queue(card->queue);
+	card->s_thread = NULL;
+	spin_unlock_irqrestore(&card->q_lock, flags);
+
+	if (s_thread)
+		kthread_stop(s_thread);
+}
+
 /* Mask ROM devices are required to have the same format as Flash ones */
 static int xd_card_fill_lut_rom(struct xd_card_host *host)
 {
@@ -2084,6 +2860,7 @@ static int xd_card_format_thread(void *data)
 	}
 
 	flash_bd_destroy(o_fbd);
+	card->lost_pages = 0;
 
 	for(card->trans_cnt = card->cis_block + 1;
 	    card->trans_cnt < card->trans_len;
@@ -2143,7 +2920,9 @@ out:
 	spin_lock_irqsave(&host->card->q_lock, flags);
 	host->card->format = 0;
 	host->card->f_thread = NULL;
-	blk_start_queue(host->card->queue);
+	if (!rc)
+		host->card->scan_zone = host->card->zone_cnt;
+	xd_card_start_queue(host->card);
 	spin_unlock_irqrestore(&host->card->q_lock, flags);
 
 	mutex_unlock(&host->lock);
@@ -2171,6 +2950,13 @@ static void xd_card_submit_req(struct request_queue *q)
 		return;
 
 	if (card->eject) {
+		while (!list_empty(&card->held_reqs)) {
+			req = list_first_entry(&card->held_reqs, struct request,
+					       queuelist);
+			list_del_init(&req->queuelist);
+			end_dequeued_request(req, -ENODEV);
+		}
+
 		while ((req = elv_next_request(q)) != NULL)
 				end_queued_request(req, -ENODEV);
 
@@ -2451,10 +3237,26 @@ static int xd_card_sysfs_register(struct xd_card_host *host)
 	if (rc)
 		goto out_remove_idi;
 
+	host->card->dev_attr_block_map_bin.attr.name = "xd_card_block_map_bin";
+	host->card->dev_attr_block_map_bin.attr.mode = S_IRUGO;
+	host->card->dev_attr_block_map_bin.attr.owner = THIS_MODULE;
+
+	host->card->dev_attr_block_map_bin.size
+		= flash_bd_bin_map_size(host->card->fbd);
+	host->card->dev_attr_block_map_bin.read = xd_card_block_map_bin_read;
+	host->card->dev_attr_block_map_bin.mmap = xd_card_block_map_bin_mmap;
+
+	rc = device_create_bin_file(host->dev,
+				    &host->card->dev_attr_block_map_bin);
+	if (rc)
+		goto out_remove_block_map;
+
 	rc = device_create_file(host->dev, &dev_attr_xd_card_format);
 	if (!rc)
 		return 0;
 
+	device_remove_bin_file(host->dev, &host->card->dev_attr_block_map_bin);
+out_remove_block_map:
 	device_remove_bin_file(host->dev, &host->card->dev_attr_block_map);
 out_remove_idi:
 	device_remove_file(host->dev, &dev_attr_xd_card_idi);
@@ -2468,6 +3270,7 @@ out_remove_id:
 static void xd_card_sysfs_unregister(struct xd_card_host *host)
 {
 	device_remove_file(host->dev, &dev_attr_xd_card_format);
+	device_remove_bin_file(host->dev, &host->card->dev_attr_block_map_bin);
 	device_remove_bin_file(host->dev, &host->card->dev_attr_block_map);
 	device_remove_file(host->dev, &dev_attr_xd_card_idi);
 	device_remove_file(host->dev, &dev_attr_xd_card_cis);
@@ -2535,10 +3338,21 @@ static int xd_card_init_media(struct xd_card_host *host)
 
 	xd_card_set_media_param(host);
 
-	if (!host->card->mask_rom)
-		rc = xd_card_fill_lut(host);
-	else
+	host->card->scan_zone = 0;
+	host->card->scan_block = host->card->cis_block + 1;
+
+	if (!host->card->mask_rom) {
+		if (async_scan && (host->card->zone_cnt > 1)) {
+			rc = xd_card_fill_lut(host, 1);
+			if (!rc && xd_card_start_scan(host->card))
+				rc = xd_card_fill_lut(host,
+						      host->card->zone_cnt);
+		} else
+			rc = xd_card_fill_lut(host, host->card->zone_cnt);
+	} else {
 		rc = xd_card_fill_lut_rom(host);
+		host->card->scan_zone = host->card->zone_cnt;
+	}
 
 	if (rc)
 		return rc;
@@ -2572,19 +3386,25 @@ static int xd_card_init_media(struct xd_card_host *host)
 
 	rc = xd_card_sysfs_register(host);
 	if (rc)
-		return rc;
+		goto out_stop_scan;
 
 	rc = xd_card_init_disk(host->card);
-	if (!rc)
+	if (!rc) {
+		if (host->card->s_thread)
+			wake_up_process(host->card->s_thread);
 		return 0;
+	}
 
 	xd_card_sysfs_unregister(host);
+out_stop_scan:
+	xd_card_stop_scan(host->card);
 	return rc;
 }
 
 static void xd_card_free_media(struct xd_card_media *card)
 {
 	flash_bd_destroy(card->fbd);
+	kfree(card->e_buf);
 	kfree(card->t_buf);
 	kfree(card);
 }
@@ -2606,6 +3426,7 @@ struct xd_card_media *xd_card_alloc_media(struct xd_card_host *host)
 	card->usage_count = 1;
 	spin_lock_init(&card->q_lock);
 	init_completion(&card->req_complete);
+	INIT_LIST_HEAD(&card->held_reqs);
 
 	rc = xd_card_get_status(host, XD_CARD_CMD_RESET, &status);
 	if (rc)
@@ -2682,6 +3503,9 @@ struct xd_card_media *xd_card_alloc_media(struct xd_card_host *host)
 			       sizeof(card->id3));
 	}
 
+	if (copy_back && (host->caps & XD_CARD_CAP_COPY_BACK))
+		card->copy_back = xd_card_has_copy_back(card);
+
 	xd_card_set_media_param(host);
 
 	dev_dbg(host->dev, "alloc %d bytes for tmp\n",
@@ -2692,6 +3516,16 @@ struct xd_card_media *xd_card_alloc_media(struct xd_card_host *host)
 		goto out;
 	}
 
+	if (!card->auto_ecc && host->extra_batch) {
+		card->extra_batch = min(host->extra_batch, card->page_cnt);
+		card->e_buf = kmalloc(sizeof(struct xd_card_extra)
+				      * card->extra_batch, GFP_KERNEL);
+		if (!card->e_buf) {
+			rc = -ENOMEM;
+			goto out;
+		}
+	}
+
 	dev_dbg(host->dev, "init flash_bd\n");
 	card->fbd = flash_bd_init(card->zone_cnt, card->phy_block_cnt,
 				  card->log_block_cnt, card->page_cnt,
@@ -2733,12 +3567,13 @@ static void xd_card_remove_media(struct xd_card_media *card)
 	del_gendisk(card->disk);
 	dev_dbg(host->dev, "xd card remove\n");
 	xd_card_sysfs_unregister(host);
+	xd_card_stop_scan(card);
 
 	spin_lock_irqsave(&card->q_lock, flags);
 	f_thread = card->f_thread;
 	card->f_thread = NULL;
 	card->eject = 1;
-	blk_start_queue(card->queue);
+	xd_card_start_queue(card);
 	spin_unlock_irqrestore(&card->q_lock, flags);
 
 	if (f_thread) {
@@ -2766,6 +3601,8 @@ static void xd_card_check(struct work_struct *work)
 	if (!host->card)
 		host->set_param(host, XD_CARD_POWER, XD_CARD_POWER_ON);
 	else {
+		xd_card_stop_scan(host->card);
+		xd_card_flush_media(host->card);
 		while (!xd_card_stop_queue(host->card))
 			wait_for_completion(&host->card->req_complete);
 	}
@@ -2827,6 +3664,8 @@ int xd_card_suspend_host(struct xd_card_host *host)
 
 	mutex_lock(&host->lock);
 	if (host->card) {
+		xd_card_stop_scan(host->card);
+		xd_card_flush_media(host->card);
 		spin_lock_irqsave(&host->card->q_lock, flags);
 		f_thread = host->card->f_thread;
 		host->card->f_thread = NULL;
@@ -2865,13 +3704,18 @@ int xd_card_resume_host(struct xd_card_host *host)
 		    && !memcmp(&card->idi, &host->card->idi,
 			       sizeof(card->idi))) {
 			xd_card_free_media(card);
+
+			/* Pick up the scan where suspend left it */
+			if ((host->card->scan_zone < host->card->zone_cnt)
+			    && !xd_card_start_scan(host->card))
+				wake_up_process(host->card->s_thread);
 		} else
 			xd_card_detect_change(host);
 #else
 		xd_card_detect_change(host);
 #endif /* CONFIG_XD_CARD_UNSAFE_RESUME */
 		spin_lock_irqsave(&host->card->q_lock, flags);
-		blk_start_queue(host->card->queue);
+		xd_card_start_queue(host->card);
 		spin_unlock_irqrestore(&host->card->q_lock, flags);
 	} else
 		xd_card_detect_change(host);
@@ -2896,6 +3740,7 @@ struct xd_card_host *xd_card_alloc_host(unsigned int extra, struct device *dev)
 	host->dev = dev;
 	mutex_init(&host->lock);
 	INIT_WORK(&host->media_checker, xd_card_check);
+	INIT_DELAYED_WORK(&host->flush_work, xd_card_flush);
 	return host;
 }
 EXPORT_SYMBOL(xd_card_alloc_host);
@@ -2908,11 +3753,16 @@ void xd_card_free_host(struct xd_card_host *host)
 {
 	flush_workqueue(workqueue);
 	mutex_lock(&host->lock);
-	if (host->card)
+	if (host->card) {
+		xd_card_flush_media(host->card);
 		xd_card_remove_media(host->card);
+	}
 	host->card = NULL;
 	mutex_unlock(&host->lock);
 
+	cancel_delayed_work(&host->flush_work);
+	flush_workqueue(workqueue);
+
 	mutex_destroy(&host->lock);
 	kfree(host);
 }
@@ -29,6 +29,44 @@ struct ftl_simple_data;
 typedef int (req_fn_t)(struct ftl_simple_data *fsd);
 
 #define FTL_SIMPLE_MAX_REQ_FN 10
+/* Number of blocks to fetch oob from with one MTDX_CMD_READ_OOB request */
+#define FTL_SIMPLE_SCAN_BATCH 32
+/* Number of mapping conflicts put aside until the end of zone sweep */
+#define FTL_SIMPLE_MAX_CONFLICTS 16
+
+/*
+ * Blocks claiming an already mapped logical address, to be resolved once
+ * the zone sweep is over (so that the sweep itself stays sequential).
+ */
+struct ftl_simple_conflicts {
+	unsigned int cnt;
+	unsigned int pos;
+	struct {
+		unsigned int phy_block;
+		unsigned int log_block;
+	} ent[FTL_SIMPLE_MAX_CONFLICTS];
+};
+
+/*
+ * Write request put aside between two media commands, so that client reads
+ * can be served ahead of it. Only the state touched by read processing is
+ * kept; the rest (dst_block, oob and block buffers) is left alone by reads.
+ */
+struct ftl_simple_parked {
+	struct mtdx_dev     *req_dev;
+	struct mtdx_request *req_in;
+	unsigned int        t_count;
+	int                 dst_error;
+	int                 src_error;
+	unsigned int        logical;
+	unsigned int        zone;
+	unsigned int        z_log_block;
+	unsigned int        src_block;
+	unsigned int        b_off;
+	unsigned int        b_len;
+	unsigned int        req_fn_pos;
+	req_fn_t            *req_fn[FTL_SIMPLE_MAX_REQ_FN];
+};
 
 struct ftl_simple_data {
 	struct mtdx_dev       *mdev;
@@ -55,7 +93,10 @@ struct ftl_simple_data {
 			      clean_dst:1,
 			      req_active:1,
 			      req_suspend:1,
-			      bmap_avail:1;
+			      bmap_avail:1,
+			      bg_scan:1,
+			      no_prefetch:1,
+			      no_oob_batch:1;
 
 	/* Current request address */
 	unsigned int          zone;
@@ -75,12 +116,46 @@ struct ftl_simple_data {
 	struct long_map       *b_map;
 	struct mtdx_peb_alloc *b_alloc;
 	unsigned int          *block_table;
+	unsigned char         *block_heat;
+	unsigned int          heat_clock;
 
 	unsigned int          zone_scan_pos;
 	unsigned int          conflict_pos;
+	unsigned char         *scan_oob;  /* oob of blocks from zone_scan_pos */
+	unsigned int          scan_pos;
+	unsigned int          scan_cnt;
+	unsigned int          scan_bad;  /* entry failing to read, if any */
+	struct ftl_simple_conflicts conflicts;
 	struct list_head      *sp_block_pos;
 	struct list_head      special_blocks;
 
+	/* Background zone scan; the scan preempted by a client request is
+	 * kept in pf_* and resumed later (pf_fn is NULL if there's none).
+	 */
+	unsigned int          last_zone;  /* zone of the last client access */
+	unsigned int          pf_zone;
+	unsigned int          pf_scan_pos;
+	unsigned int          pf_conflict_pos;
+	struct ftl_simple_conflicts pf_conflicts;
+	struct list_head      *pf_sp_block_pos;
+	req_fn_t              *pf_fn;
+
+	/* Zone scan statistics */
+	unsigned long         miss_start;
+	unsigned int          miss_cnt;
+	unsigned int          miss_time;
+	unsigned int          miss_max;
+	unsigned int          prefetch_cnt;
+
+	/* Reads overtaking the write in progress; a request fetched for that
+	 * purpose which turned out not to be an eligible read is held until
+	 * the write completes.
+	 */
+	struct ftl_simple_parked parked;
+	struct mtdx_dev       *held_dev;
+	struct mtdx_request   *held_req;
+	unsigned int          preempt_cnt;
+
 	/* Request processing */
 	unsigned int          req_fn_pos;
 	req_fn_t              *req_fn[FTL_SIMPLE_MAX_REQ_FN];
@@ -110,6 +185,13 @@ static unsigned long *ftl_simple_zone_map(struct ftl_simple_data *fsd)
 		return &fsd->valid_zones;
 }
 
+static void ftl_simple_put_peb(struct ftl_simple_data *fsd, unsigned int peb,
+			       int dirty)
+{
+	mtdx_trace(fsd->mdev, MTDX_TRACE_PEB_PUT, peb, dirty, 0, 0);
+	mtdx_put_peb(fsd->b_alloc, peb, dirty);
+}
+
 static void ftl_simple_pop_all_req_fn(struct ftl_simple_data *fsd)
 {
 	fsd->req_fn_pos = 0;
@@ -136,9 +218,75 @@ static void ftl_simple_push_req_fn(struct ftl_simple_data *fsd,
 	fsd->req_fn[fsd->req_fn_pos++] = req_fn;
 }
 
+/*
+ * Update frequency of each logical block is tracked with a small decaying
+ * counter: every write adds FTL_SIMPLE_HEAT_STEP to it, and all counters are
+ * halved after each log_block_cnt writes, though never below 1, so that a
+ * block written before stays apart from one never written. Blocks rewritten
+ * several times within the decay period are considered hot, blocks rewritten
+ * after a decay period or more - cold. Blocks with no history (counters start
+ * at 0 on every mount) carry no hint.
+ */
+#define FTL_SIMPLE_HEAT_STEP 16
+#define FTL_SIMPLE_HEAT_HOT  64
+
+static enum mtdx_peb_temp ftl_simple_heat_up(struct ftl_simple_data *fsd,
+					     unsigned int log_block)
+{
+	unsigned int cnt, heat = fsd->block_heat[log_block];
+
+	if (++fsd->heat_clock >= fsd->geo.log_block_cnt) {
+		fsd->heat_clock = 0;
+		for (cnt = 0; cnt < fsd->geo.log_block_cnt; ++cnt)
+			if (fsd->block_heat[cnt] > 1)
+				fsd->block_heat[cnt] >>= 1;
+	}
+
+	if (heat >= FTL_SIMPLE_HEAT_HOT)
+		return MTDX_PEB_HOT;
+
+	fsd->block_heat[log_block] = heat + FTL_SIMPLE_HEAT_STEP;
+
+	if (!heat || heat >= FTL_SIMPLE_HEAT_STEP)
+		return MTDX_PEB_WARM;
+	else
+		return MTDX_PEB_COLD;
+}
+
 static int ftl_simple_lookup_block(struct ftl_simple_data *fsd);
 static int ftl_simple_setup_request(struct ftl_simple_data *fsd);
 
+static int zone_prefetch = 1;
+module_param(zone_prefetch, bool, 0644);
+
+/*
+ * Number of client reads which may overtake a write, 0 for FIFO order. Set at
+ * load time only: the queue depth reported to clients depends on it.
+ */
+static unsigned int read_priority = 4;
+module_param(read_priority, uint, 0444);
+
+/* Called when the scan of the current zone has completed. */
+static void ftl_simple_zone_done(struct ftl_simple_data *fsd)
+{
+	unsigned int msec;
+
+	set_bit(fsd->zone, ftl_simple_zone_map(fsd));
+
+	if (fsd->bg_scan) {
+		fsd->bg_scan = 0;
+		fsd->prefetch_cnt++;
+		dev_dbg(&fsd_dev(fsd), "prefetched zone %x\n", fsd->zone);
+		return;
+	}
+
+	msec = jiffies_to_msecs(jiffies - fsd->miss_start);
+	fsd->miss_cnt++;
+	fsd->miss_time += msec;
+	if (msec > fsd->miss_max)
+		fsd->miss_max = msec;
+}
+
 static void ftl_simple_complete_req(struct ftl_simple_data *fsd)
 {
 	FUNC_START_DBG(fsd);
@@ -154,6 +302,9 @@ static void ftl_simple_complete_req(struct ftl_simple_data *fsd)
 	fsd->t_count = 0;
 	fsd->dst_error = 0;
 	fsd->src_error = 0;
+
+	if (!fsd->parked.req_in)
+		fsd->preempt_cnt = 0;
 }
 
 static void ftl_simple_end_abort(struct ftl_simple_data *fsd, int free_dst)
@@ -161,29 +312,26 @@ static void ftl_simple_end_abort(struct ftl_simple_data *fsd, int free_dst)
 	FUNC_START_DBG(fsd);
 	if (free_dst && (fsd->dst_block != fsd->src_block)) {
 		dev_dbg(&fsd_dev(fsd), "release dst %x\n", fsd->dst_block);
-		fsd->b_alloc->put_peb(fsd->b_alloc, fsd->dst_block,
-				      fsd->clean_dst == 1);
+		ftl_simple_put_peb(fsd, fsd->dst_block, fsd->clean_dst == 1);
 		fsd->dst_block = MTDX_INVALID_BLOCK;
 	}
 
 	ftl_simple_complete_req(fsd);
 }
 
-static void ftl_simple_end_resolve(struct ftl_simple_data *fsd,
-				   unsigned int count)
+/*
+ * Decide between phy_block and conflict_pos (the block currently mapped to
+ * the same logical address), given conflict_pos oob in oob_buf: selected
+ * block wins, otherwise the one with higher address does.
+ */
+static void ftl_simple_settle_conflict(struct ftl_simple_data *fsd,
+				       unsigned int phy_block)
 {
 	struct mtdx_dev *parent = container_of(fsd->mdev->dev.parent,
 					       struct mtdx_dev, dev);
-	unsigned int max_block = mtdx_geo_zone_to_phy(&fsd->geo, fsd->zone + 1,
-						      0);
 	unsigned int zone, z_log_block;
 	struct mtdx_page_info p_info = {};
 
-	FUNC_START_DBG(fsd);
-
-	if (max_block == MTDX_INVALID_BLOCK)
-		max_block = fsd->geo.phy_block_cnt;
-
 	p_info.phy_block = fsd->conflict_pos;
 
 	if (!fsd->dst_error)
@@ -198,19 +346,48 @@ static void ftl_simple_end_resolve(struct ftl_simple_data *fsd,
 	}
 
 	if (!fsd->dst_error) {
-		if (p_info.status == MTDX_PAGE_SMAPPED)
-			mtdx_put_peb(fsd->b_alloc, fsd->zone_scan_pos, 1);
+		if ((p_info.status == MTDX_PAGE_SMAPPED)
+		    || (phy_block < fsd->conflict_pos))
+			ftl_simple_put_peb(fsd, phy_block, 1);
 		else {
-			mtdx_put_peb(fsd->b_alloc,
-				     fsd->block_table[p_info.log_block], 1);
-			fsd->block_table[p_info.log_block] = fsd->zone_scan_pos;
+			ftl_simple_put_peb(fsd,
+					   fsd->block_table[p_info.log_block],
+					   1);
+			fsd->block_table[p_info.log_block] = phy_block;
 		}
 	}
+}
+
+static int ftl_simple_resolve_deferred(struct ftl_simple_data *fsd);
+
+/* Zone sweep is over; deferred conflicts are resolved before it's usable. */
+static void ftl_simple_end_sweep(struct ftl_simple_data *fsd)
+{
+	if (fsd->conflicts.cnt) {
+		dev_dbg(&fsd_dev(fsd), "resolving %x conflicts\n",
+			fsd->conflicts.cnt);
+		ftl_simple_push_req_fn(fsd, ftl_simple_resolve_deferred);
+	} else
+		ftl_simple_zone_done(fsd);
+}
+
+static void ftl_simple_end_resolve(struct ftl_simple_data *fsd,
+				   unsigned int count)
+{
+	unsigned int max_block = mtdx_geo_zone_to_phy(&fsd->geo, fsd->zone + 1,
+						      0);
+
+	FUNC_START_DBG(fsd);
+
+	if (max_block == MTDX_INVALID_BLOCK)
+		max_block = fsd->geo.phy_block_cnt;
+
+	ftl_simple_settle_conflict(fsd, fsd->zone_scan_pos);
 
 	fsd->zone_scan_pos++;
 	if (fsd->zone_scan_pos >= max_block) {
 		ftl_simple_pop_all_req_fn(fsd);
-		set_bit(fsd->zone, ftl_simple_zone_map(fsd));
+		ftl_simple_end_sweep(fsd);
 	} else
 		ftl_simple_push_req_fn(fsd, ftl_simple_lookup_block);
 }
@@ -231,107 +408,180 @@ static int ftl_simple_resolve(struct ftl_simple_data *fsd)
 	fsd->req_out.req_oob = &fsd->req_oob;
 	fsd->end_req_fn = ftl_simple_end_resolve;
 	return 0;
+}
+
+static void ftl_simple_end_resolve_deferred(struct ftl_simple_data *fsd,
+					    unsigned int count)
+{
+	FUNC_START_DBG(fsd);
 
+	ftl_simple_settle_conflict(fsd,
+				   fsd->conflicts.ent[fsd->conflicts.pos]
+					.phy_block);
+	fsd->conflicts.pos++;
+	ftl_simple_push_req_fn(fsd, ftl_simple_resolve_deferred);
 }
 
-static void ftl_simple_end_lookup_block(struct ftl_simple_data *fsd,
-					unsigned int count)
+/* Second pass of zone scan: deferred conflicts, one at a time. */
+static int ftl_simple_resolve_deferred(struct ftl_simple_data *fsd)
+{
+	FUNC_START_DBG(fsd);
+
+	if (fsd->conflicts.pos == fsd->conflicts.cnt) {
+		fsd->conflicts.cnt = 0;
+		fsd->conflicts.pos = 0;
+		ftl_simple_zone_done(fsd);
+		return -EAGAIN;
+	}
+
+	fsd->conflict_pos = fsd->block_table[fsd->conflicts
+						  .ent[fsd->conflicts.pos]
+						  .log_block];
+	ftl_simple_resolve(fsd);
+	fsd->end_req_fn = ftl_simple_end_resolve_deferred;
+	return 0;
+}
+
+/*
+ * Account for the block at zone_scan_pos, given its first page oob (or NULL
+ * if it could not be read). Conflicts with the block already mapped to the
+ * same logical address are put aside; returns 1 if there's no more room for
+ * them and the conflict must be resolved right away.
+ */
+static int ftl_simple_map_block(struct ftl_simple_data *fsd, void *oob)
 {
 	struct mtdx_dev *parent = container_of(fsd->mdev->dev.parent,
 					       struct mtdx_dev, dev);
-	unsigned int max_block = mtdx_geo_zone_to_phy(&fsd->geo, fsd->zone + 1,
-						      0);
 	unsigned int zone, z_log_block;
 	struct mtdx_page_info p_info = {};
-
-	FUNC_START_DBG(fsd);
-
-	if ((max_block == MTDX_INVALID_BLOCK)
-	    || (max_block > fsd->geo.phy_block_cnt))
-		max_block = fsd->geo.phy_block_cnt;
+	int rc;
 
 	p_info.phy_block = fsd->zone_scan_pos;
 
-	if (!fsd->dst_error) {
-		fsd->dst_error = parent->oob_to_info(parent, &p_info,
-						     fsd->oob_buf);
+	if (oob) {
+		rc = parent->oob_to_info(parent, &p_info, oob);
+		if (rc)
+			return rc;
+
 		zone = mtdx_geo_log_to_zone(&fsd->geo, p_info.log_block,
 					    &z_log_block);
 		if (zone != fsd->zone) {
 			p_info.log_block = MTDX_INVALID_BLOCK;
 			p_info.status = MTDX_PAGE_UNMAPPED;
 		}	
-	} else if (fsd->dst_error == -EFAULT) {
+	} else {
 		/* Uncorrectable error reading block */
 		p_info.status = MTDX_PAGE_FAILURE;
 		p_info.log_block = MTDX_INVALID_BLOCK;
-		fsd->dst_error = 0;
 	}
 
-	if (!fsd->dst_error) {
-		if (p_info.log_block != MTDX_INVALID_BLOCK)
-			fsd->conflict_pos = fsd->block_table[p_info.log_block];
-		else if ((p_info.status == MTDX_PAGE_MAPPED)
-			   || (p_info.status == MTDX_PAGE_SMAPPED))
-			p_info.status = MTDX_PAGE_UNMAPPED;
-
-		switch (p_info.status) {
-		case MTDX_PAGE_ERASED:
-			dev_dbg(&fsd_dev(fsd), "erased block %x\n",
-				fsd->zone_scan_pos);
-			mtdx_put_peb(fsd->b_alloc, fsd->zone_scan_pos, 0);
-			break;
-		case MTDX_PAGE_UNMAPPED:
-			dev_dbg(&fsd_dev(fsd), "free block %x\n",
-				fsd->zone_scan_pos);
-			mtdx_put_peb(fsd->b_alloc, fsd->zone_scan_pos, 1);
+	if (p_info.log_block != MTDX_INVALID_BLOCK)
+		fsd->conflict_pos = fsd->block_table[p_info.log_block];
+	else if ((p_info.status == MTDX_PAGE_MAPPED)
+		   || (p_info.status == MTDX_PAGE_SMAPPED))
+		p_info.status = MTDX_PAGE_UNMAPPED;
+
+	switch (p_info.status) {
+	case MTDX_PAGE_ERASED:
+		dev_dbg(&fsd_dev(fsd), "erased block %x\n",
+			fsd->zone_scan_pos);
+		ftl_simple_put_peb(fsd, fsd->zone_scan_pos, 0);
+		break;
+	case MTDX_PAGE_UNMAPPED:
+		dev_dbg(&fsd_dev(fsd), "free block %x\n",
+			fsd->zone_scan_pos);
+		ftl_simple_put_peb(fsd, fsd->zone_scan_pos, 1);
+		break;
+	case MTDX_PAGE_MAPPED:
+		dev_dbg(&fsd_dev(fsd), "allocated block %x\n",
+			fsd->zone_scan_pos);
+		if (fsd->conflict_pos != MTDX_INVALID_BLOCK) {
+			if (fsd->conflicts.cnt == FTL_SIMPLE_MAX_CONFLICTS)
+				return 1;
+
+			fsd->conflicts.ent[fsd->conflicts.cnt].phy_block
+				= fsd->zone_scan_pos;
+			fsd->conflicts.ent[fsd->conflicts.cnt].log_block
+				= p_info.log_block;
+			fsd->conflicts.cnt++;
 			break;
-		case MTDX_PAGE_MAPPED:
-			dev_dbg(&fsd_dev(fsd), "allocated block %x\n",
-				fsd->zone_scan_pos);
-			if (fsd->conflict_pos != MTDX_INVALID_BLOCK) {
-				ftl_simple_pop_all_req_fn(fsd);
-				ftl_simple_push_req_fn(fsd, ftl_simple_resolve);
-				return;
-			} else
-				fsd->block_table[p_info.log_block]
-					= fsd->zone_scan_pos;
-			break;
-		case MTDX_PAGE_SMAPPED:
-			dev_dbg(&fsd_dev(fsd), "selected block %x\n",
-				fsd->zone_scan_pos);
-			/* As higher address supposedly take preference over
-			 * lower ones and the block is selected, conflict
-			 * can be decided right now.
-			 */
-			fsd->block_table[p_info.log_block] = fsd->zone_scan_pos;
-			if (fsd->conflict_pos != MTDX_INVALID_BLOCK)
-				mtdx_put_peb(fsd->b_alloc, fsd->conflict_pos,
-					     1);
-			break;
-		case MTDX_PAGE_INVALID:
-		case MTDX_PAGE_FAILURE:
-		case MTDX_PAGE_RESERVED:
-			dev_dbg(&parent->dev, "bad block %x\n",
-				fsd->zone_scan_pos);
-			break;
-		default:
-			fsd->dst_error = -EINVAL;
 		}
+
+		fsd->block_table[p_info.log_block] = fsd->zone_scan_pos;
+		break;
+	case MTDX_PAGE_SMAPPED:
+		dev_dbg(&fsd_dev(fsd), "selected block %x\n",
+			fsd->zone_scan_pos);
+		/* As higher address supposedly take preference over
+		 * lower ones and the block is selected, conflict
+		 * can be decided right now.
+		 */
+		fsd->block_table[p_info.log_block] = fsd->zone_scan_pos;
+		if (fsd->conflict_pos != MTDX_INVALID_BLOCK)
+			ftl_simple_put_peb(fsd, fsd->conflict_pos, 1);
+		break;
+	case MTDX_PAGE_INVALID:
+	case MTDX_PAGE_FAILURE:
+	case MTDX_PAGE_RESERVED:
+		dev_dbg(&parent->dev, "bad block %x\n", fsd->zone_scan_pos);
+		break;
+	default:
+		return -EINVAL;
 	}
 
-	if (fsd->dst_error)
-		ftl_simple_end_abort(fsd, 0);
-	else {
-		fsd->zone_scan_pos++;
-		if (fsd->zone_scan_pos >= max_block) {
-			ftl_simple_pop_all_req_fn(fsd);
-			set_bit(fsd->zone, ftl_simple_zone_map(fsd));
-			if (fsd->req_in)
-				ftl_simple_setup_request(fsd);
-		} else
-			ftl_simple_push_req_fn(fsd, ftl_simple_lookup_block);
+	return 0;
+}
+
+/* Zone scan failed; background scans are dropped silently. */
+static int ftl_simple_scan_error(struct ftl_simple_data *fsd, int error)
+{
+	ftl_simple_pop_all_req_fn(fsd);
+
+	if (!fsd->bg_scan)
+		return error;
+
+	/* Leave the zone to be scanned on demand. */
+	dev_dbg(&fsd_dev(fsd), "prefetch failed %d\n", error);
+	fsd->bg_scan = 0;
+	fsd->no_prefetch = 1;
+	return -EAGAIN;
+}
+
+static void ftl_simple_end_lookup_block(struct ftl_simple_data *fsd,
+					unsigned int count)
+{
+	FUNC_START_DBG(fsd);
+
+	fsd->scan_pos = 0;
+	fsd->scan_cnt = 0;
+	fsd->scan_bad = FTL_SIMPLE_SCAN_BATCH;
+
+	if (fsd->req_out.cmd == MTDX_CMD_READ_OOB) {
+		if (fsd->dst_error == -EINVAL) {
+			dev_dbg(&fsd_dev(fsd), "no batch oob reads\n");
+			fsd->no_oob_batch = 1;
+			fsd->dst_error = 0;
+			count = 0;
+		}
+	} else if (count)
+		count = 1; /* single page read completes with byte count */
+
+	if (fsd->dst_error == -EFAULT) {
+		/* Uncorrectable error reading block after the last good one */
+		fsd->scan_bad = count;
+		count++;
+		fsd->dst_error = 0;
+	}
+
+	if (fsd->dst_error) {
+		if (ftl_simple_scan_error(fsd, fsd->dst_error) != -EAGAIN)
+			ftl_simple_end_abort(fsd, 0);
+		return;
 	}
+
+	fsd->scan_cnt = count;
+	ftl_simple_pop_all_req_fn(fsd);
+	ftl_simple_push_req_fn(fsd, ftl_simple_lookup_block);
 }
 
 static int ftl_simple_lookup_block(struct ftl_simple_data *fsd)
@@ -340,12 +590,34 @@ static int ftl_simple_lookup_block(struct ftl_simple_data *fsd)
 						      fsd->zone + 1,
 						      0);
 	struct mtdx_page_info *p_info;
+	unsigned int cnt;
+	int rc;
 
 	FUNC_START_DBG(fsd);
 
-	if (max_block == MTDX_INVALID_BLOCK)
+	if ((max_block == MTDX_INVALID_BLOCK)
+	    || (max_block > fsd->geo.phy_block_cnt))
 		max_block = fsd->geo.phy_block_cnt;
 
+	while (fsd->scan_pos < fsd->scan_cnt) {
+		rc = ftl_simple_map_block(fsd, fsd->scan_pos != fsd->scan_bad
+					       ? fsd->scan_oob
+						 + fsd->scan_pos
+						   * fsd->geo.oob_size
+					       : NULL);
+		fsd->scan_pos++;
+
+		if (rc < 0)
+			return ftl_simple_scan_error(fsd, rc);
+		else if (rc > 0) {
+			ftl_simple_pop_all_req_fn(fsd);
+			ftl_simple_push_req_fn(fsd, ftl_simple_resolve);
+			return -EAGAIN;
+		}
+
+		fsd->zone_scan_pos++;
+	}
+
 	while (fsd->sp_block_pos) {
 		if (fsd->sp_block_pos == &fsd->special_blocks) {
 			fsd->sp_block_pos = NULL;
@@ -368,17 +640,37 @@ static int ftl_simple_lookup_block(struct ftl_simple_data *fsd)
 		ftl_simple_pop_all_req_fn(fsd);
 		ftl_simple_push_req_fn(fsd, ftl_simple_lookup_block);
 	} else {
-		set_bit(fsd->zone, ftl_simple_zone_map(fsd));
+		ftl_simple_end_sweep(fsd);
 		return -EAGAIN;
 	}
 
-	memset(fsd->oob_buf, fsd->geo.fill_value, fsd->geo.oob_size);
-	mtdx_oob_iter_init(&fsd->req_oob, ftl_simple_dst_oob(fsd), 1,
+	/* Batch stops short of the next special block */
+	cnt = min(max_block - fsd->zone_scan_pos,
+		  (unsigned int)FTL_SIMPLE_SCAN_BATCH);
+
+	if (fsd->sp_block_pos) {
+		p_info = list_entry(fsd->sp_block_pos, struct mtdx_page_info,
+				    node);
+		cnt = min(cnt, p_info->phy_block - fsd->zone_scan_pos);
+	}
+
+	if (fsd->no_oob_batch)
+		cnt = 1;
+
+	memset(fsd->scan_oob, fsd->geo.fill_value, cnt * fsd->geo.oob_size);
+	mtdx_oob_iter_init(&fsd->req_oob, fsd->scan_oob, cnt,
 			   fsd->geo.oob_size);
-	fsd->req_out.cmd = MTDX_CMD_READ;
 	fsd->req_out.phy.b_addr = fsd->zone_scan_pos;
 	fsd->req_out.phy.offset = 0;
-	fsd->req_out.length = fsd->geo.page_size;
+
+	if (cnt > 1) {
+		fsd->req_out.cmd = MTDX_CMD_READ_OOB;
+		fsd->req_out.length = cnt;
+	} else {
+		fsd->req_out.cmd = MTDX_CMD_READ;
+		fsd->req_out.length = fsd->geo.page_size;
+	}
+
 	fsd->req_out.req_data = NULL;
 	fsd->req_out.req_oob = &fsd->req_oob;
 	fsd->end_req_fn = ftl_simple_end_lookup_block;
@@ -417,6 +709,10 @@ static int ftl_simple_setup_zone_scan(struct ftl_simple_data *fsd)
 
 	fsd->zone_scan_pos = mtdx_geo_zone_to_phy(&fsd->geo, fsd->zone, 0);
 	fsd->conflict_pos = MTDX_INVALID_BLOCK;
+	fsd->conflicts.cnt = 0;
+	fsd->conflicts.pos = 0;
+	fsd->scan_pos = 0;
+	fsd->scan_cnt = 0;
 
 	if (max_block == MTDX_INVALID_BLOCK)
 		max_block = fsd->geo.phy_block_cnt;
@@ -448,6 +744,225 @@ static int ftl_simple_setup_zone_scan(struct ftl_simple_data *fsd)
 	return 0;
 }
 
+/*
+ * Client request addresses a zone which was not scanned yet. If the
+ * background scan of this zone was preempted, it is continued from where it
+ * stopped.
+ */
+static int ftl_simple_zone_miss(struct ftl_simple_data *fsd)
+{
+	fsd->miss_start = jiffies;
+
+	if (!fsd->pf_fn || (fsd->pf_zone != fsd->zone))
+		return ftl_simple_setup_zone_scan(fsd);
+
+	dev_dbg(&fsd_dev(fsd), "resuming scan of zone %x at %x\n", fsd->zone,
+		fsd->pf_scan_pos);
+	fsd->zone_scan_pos = fsd->pf_scan_pos;
+	fsd->conflict_pos = fsd->pf_conflict_pos;
+	fsd->conflicts = fsd->pf_conflicts;
+	fsd->sp_block_pos = fsd->pf_sp_block_pos;
+	fsd->scan_pos = 0;
+	fsd->scan_cnt = 0;
+	ftl_simple_push_req_fn(fsd, fsd->pf_fn);
+	fsd->pf_fn = NULL;
+	return 0;
+}
+
+/*
+ * Device is idle: scan a zone not scanned yet (preempted scan first), so that
+ * the clients will not have to wait for it later. Zones accessed by clients
+ * are always scanned on demand, so the next unscanned zone following the last
+ * one accessed is picked: it is the one sequential access will reach first.
+ */
+static int ftl_simple_start_prefetch(struct ftl_simple_data *fsd)
+{
+	unsigned int cnt, zone = 0;
+
+	if (!zone_prefetch || fsd->no_prefetch)
+		return -EAGAIN;
+
+	if (fsd->pf_fn) {
+		fsd->zone = fsd->pf_zone;
+		ftl_simple_zone_miss(fsd);
+		fsd->bg_scan = 1;
+		return 0;
+	}
+
+	for (cnt = 1; cnt <= fsd->geo.zone_cnt; ++cnt) {
+		zone = (fsd->last_zone + cnt) % fsd->geo.zone_cnt;
+		if (!test_bit(zone, ftl_simple_zone_map(fsd)))
+			break;
+	}
+
+	if (cnt > fsd->geo.zone_cnt)
+		return -EAGAIN;
+
+	fsd->zone = zone;
+	ftl_simple_setup_zone_scan(fsd);
+	fsd->bg_scan = 1;
+	return 0;
+}
+
+/* Put the background scan aside, letting the client request through. */
+static void ftl_simple_preempt_prefetch(struct ftl_simple_data *fsd)
+{
+	fsd->pf_fn = ftl_simple_pop_req_fn(fsd);
+	fsd->pf_zone = fsd->zone;
+	fsd->pf_scan_pos = fsd->zone_scan_pos;
+	fsd->pf_conflict_pos = fsd->conflict_pos;
+	fsd->pf_conflicts = fsd->conflicts;
+	fsd->pf_sp_block_pos = fsd->sp_block_pos;
+	ftl_simple_pop_all_req_fn(fsd);
+	fsd->bg_scan = 0;
+	dev_dbg(&fsd_dev(fsd), "prefetch of zone %x preempted at %x\n",
+		fsd->pf_zone, fsd->pf_scan_pos);
+}
+
+static void ftl_simple_park_write(struct ftl_simple_data *fsd)
+{
+	struct ftl_simple_parked *pw = &fsd->parked;
+
+	pw->req_dev = fsd->req_dev;
+	pw->req_in = fsd->req_in;
+	pw->t_count = fsd->t_count;
+	pw->dst_error = fsd->dst_error;
+	pw->src_error = fsd->src_error;
+	pw->logical = fsd->req_out.logical;
+	pw->zone = fsd->zone;
+	pw->z_log_block = fsd->z_log_block;
+	pw->src_block = fsd->src_block;
+	pw->b_off = fsd->b_off;
+	pw->b_len = fsd->b_len;
+	pw->req_fn_pos = fsd->req_fn_pos;
+	memcpy(pw->req_fn, fsd->req_fn, sizeof(fsd->req_fn));
+
+	ftl_simple_pop_all_req_fn(fsd);
+	fsd->req_dev = NULL;
+	fsd->req_in = NULL;
+	fsd->t_count = 0;
+	fsd->dst_error = 0;
+	fsd->src_error = 0;
+}
+
+static void ftl_simple_unpark_write(struct ftl_simple_data *fsd)
+{
+	struct ftl_simple_parked *pw = &fsd->parked;
+
+	fsd->req_dev = pw->req_dev;
+	fsd->req_in = pw->req_in;
+	fsd->t_count = pw->t_count;
+	fsd->dst_error = pw->dst_error;
+	fsd->src_error = pw->src_error;
+	fsd->req_out.logical = pw->logical;
+	fsd->zone = pw->zone;
+	fsd->z_log_block = pw->z_log_block;
+	fsd->src_block = pw->src_block;
+	fsd->b_off = pw->b_off;
+	fsd->b_len = pw->b_len;
+	fsd->req_fn_pos = pw->req_fn_pos;
+	memcpy(fsd->req_fn, pw->req_fn, sizeof(fsd->req_fn));
+
+	pw->req_dev = NULL;
+	pw->req_in = NULL;
+}
+
+/*
+ * Read may overtake the parked write if it does not touch the block being
+ * written and needs no zone scans (which use the buffers of the write).
+ */
+static int ftl_simple_read_can_pass(struct ftl_simple_data *fsd,
+				    struct mtdx_request *req)
+{
+	unsigned int log, last, b_off, z_log_block;
+
+	if (req->cmd != MTDX_CMD_READ || !req->length)
+		return 0;
+
+	log = mtdx_geo_block(&fsd->geo, req->phy.offset, &b_off);
+	last = mtdx_geo_block(&fsd->geo, req->phy.offset + req->length - 1,
+			      &b_off);
+	log += req->logical;
+	last += req->logical;
+
+	for (; log <= last; ++log) {
+		if ((log >= fsd->geo.log_block_cnt)
+		    || (log == fsd->req_out.logical))
+			return 0;
+
+		if (!test_bit(mtdx_geo_log_to_zone(&fsd->geo, log,
+						   &z_log_block),
+			      ftl_simple_zone_map(fsd)))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Called between media commands of a write: if another client is waiting,
+ * fetch its request and, if it is a read which can pass, serve it first.
+ */
+static void ftl_simple_preempt_write(struct ftl_simple_data *fsd)
+{
+	struct mtdx_dev *req_dev;
+	struct mtdx_request *req;
+
+	if (!read_priority || fsd->preempt_cnt >= read_priority
+	    || !fsd->req_in || fsd->req_in->cmd != MTDX_CMD_WRITE
+	    || fsd->parked.req_in || fsd->held_req || fsd->bmap_avail)
+		return;
+
+	req_dev = mtdx_dev_queue_pop_front(&fsd->c_queue);
+	if (!req_dev)
+		return;
+
+	req = req_dev->get_request(req_dev);
+	if (!req) {
+		put_device(&req_dev->dev);
+		return;
+	}
+
+	if (!ftl_simple_read_can_pass(fsd, req)) {
+		fsd->held_dev = req_dev;
+		fsd->held_req = req;
+		return;
+	}
+
+	dev_dbg(&fsd_dev(fsd), "read %x-%x:%x overtakes write at %x\n",
+		req->logical, req->phy.offset, req->length,
+		fsd->req_out.logical);
+	ftl_simple_park_write(fsd);
+	fsd->req_dev = req_dev;
+	fsd->req_in = req;
+	fsd->preempt_cnt++;
+}
+
+/*
+ * Client request has completed: continue with the parked write, or with the
+ * request held behind it. Current client goes back to the queue.
+ */
+static int ftl_simple_resume_parked(struct ftl_simple_data *fsd)
+{
+	if (!fsd->parked.req_in && !fsd->held_req)
+		return 0;
+
+	if (fsd->req_dev
+	    && !mtdx_dev_queue_push_back(&fsd->c_queue, fsd->req_dev))
+		put_device(&fsd->req_dev->dev);
+
+	if (fsd->parked.req_in)
+		ftl_simple_unpark_write(fsd);
+	else {
+		fsd->req_dev = fsd->held_dev;
+		fsd->req_in = fsd->held_req;
+		fsd->held_dev = NULL;
+		fsd->held_req = NULL;
+	}
+
+	return 1;
+}
+
 static int ftl_simple_can_merge(struct ftl_simple_data *fsd,
 				unsigned int peb, unsigned int offset,
 				unsigned int count)
@@ -461,11 +976,11 @@ static int ftl_simple_can_merge(struct ftl_simple_data *fsd,
 
 
 	if (fsd->track_inc)
-		return *map_ref <= offset / fsd->geo.page_size;
+		return *map_ref <= mtdx_geo_page(&fsd->geo, offset);
 	else
 		return bitmap_region_empty(map_ref,
-					   offset / fsd->geo.page_size,
-					   count / fsd->geo.page_size);
+					   mtdx_geo_page(&fsd->geo, offset),
+					   mtdx_geo_page(&fsd->geo, count));
 }
 
 static void ftl_simple_advance(struct ftl_simple_data *fsd)
@@ -492,7 +1007,7 @@ static void ftl_simple_advance(struct ftl_simple_data *fsd)
 	tmp_off = fsd->b_off + fsd->b_len;
 
 	if (fsd->track_inc) {
-		tmp_off /= fsd->geo.page_size;
+		tmp_off = mtdx_geo_page(&fsd->geo, tmp_off);
 
 		if (*map_ref < tmp_off)
 			*map_ref = tmp_off;
@@ -508,8 +1023,8 @@ static void ftl_simple_advance(struct ftl_simple_data *fsd)
 				map_key, fsd->dst_block);
 		}
 	} else {
-		unsigned int p_off = fsd->b_off / fsd->geo.page_size;
-		unsigned int p_len = fsd->b_len / fsd->geo.page_size;
+		unsigned int p_off = mtdx_geo_page(&fsd->geo, fsd->b_off);
+		unsigned int p_len = mtdx_geo_page(&fsd->geo, fsd->b_len);
 
 		if (fsd->b_off) {
 			if (ftl_simple_can_merge(fsd, map_key, 0,
@@ -592,7 +1107,7 @@ static void ftl_simple_end_erase_src(struct ftl_simple_data *fsd,
 
 	if (!fsd->dst_error) {
 		dev_dbg(&fsd_dev(fsd), "release src %x\n", fsd->src_block);
-		fsd->b_alloc->put_peb(fsd->b_alloc, fsd->src_block, 1);
+		ftl_simple_put_peb(fsd, fsd->src_block, 1);
 	}
 }
 
@@ -1001,10 +1516,10 @@ static void ftl_simple_set_address(struct ftl_simple_data *fsd)
 	unsigned int pos = fsd->req_in->phy.offset + fsd->t_count;
 
 	fsd->req_out.logical = fsd->req_in->logical;
-	fsd->req_out.logical += pos / fsd->block_size;
+	fsd->req_out.logical += mtdx_geo_block(&fsd->geo, pos, &fsd->b_off);
 	fsd->zone = mtdx_geo_log_to_zone(&fsd->geo, fsd->req_out.logical,
 					 &fsd->z_log_block);
-	fsd->b_off = pos % fsd->block_size;
+	fsd->last_zone = fsd->zone;
 	fsd->b_len = min(fsd->req_in->length - fsd->t_count,
 			 fsd->block_size - fsd->b_off);
 	dev_dbg(&fsd_dev(fsd), "set address in_blk %x, in_off %x, t_count %x, "
@@ -1066,6 +1581,7 @@ static int ftl_simple_setup_write(struct ftl_simple_data *fsd)
 					       struct mtdx_dev, dev);
 	unsigned int tmp_off;
 	struct mtdx_page_info p_info = {};
+	enum mtdx_peb_temp temp;
 	int rc = 0;
 
 	if (fsd->bmap_avail) {
@@ -1076,7 +1592,7 @@ static int ftl_simple_setup_write(struct ftl_simple_data *fsd)
 	ftl_simple_set_address(fsd);
 
 	if (!test_bit(fsd->zone, ftl_simple_zone_map(fsd)))
-		return ftl_simple_setup_zone_scan(fsd);
+		return ftl_simple_zone_miss(fsd);
 
 	dev_dbg(&fsd_dev(fsd), "setup write - log %x, %x:%x\n",
 		fsd->req_out.logical, fsd->b_off, fsd->b_len);
@@ -1084,6 +1600,7 @@ static int ftl_simple_setup_write(struct ftl_simple_data *fsd)
 	fsd->src_block = fsd->block_table[fsd->req_out.logical];
 	fsd->clean_dst = 0;
 	fsd->src_error = 0;
+	temp = ftl_simple_heat_up(fsd, fsd->req_out.logical);
 
 	if (ftl_simple_can_merge(fsd, fsd->src_block, fsd->b_off, fsd->b_len)) {
 		fsd->dst_block = fsd->src_block;
@@ -1091,9 +1608,12 @@ static int ftl_simple_setup_write(struct ftl_simple_data *fsd)
 		dev_dbg(&fsd_dev(fsd), "merging into block %x\n",
 			fsd->src_block);
 	} else {
-		fsd->dst_block = mtdx_get_peb(fsd->b_alloc, fsd->zone, &rc);
-		dev_dbg(&fsd_dev(fsd), "allocating new block %x\n",
-			fsd->dst_block);
+		fsd->dst_block = mtdx_get_peb_temp(fsd->b_alloc, fsd->zone, &rc,
+						   temp);
+		mtdx_trace(fsd->mdev, MTDX_TRACE_PEB_GET, fsd->zone,
+			   fsd->dst_block, rc, temp);
+		dev_dbg(&fsd_dev(fsd), "allocating new block %x (temp %d)\n",
+			fsd->dst_block, temp);
 
 		if (fsd->dst_block == MTDX_INVALID_BLOCK) {
 			dev_dbg(&fsd_dev(fsd), "no new block, current %x\n",
@@ -1254,7 +1774,7 @@ static int ftl_simple_setup_read(struct ftl_simple_data *fsd)
 	ftl_simple_set_address(fsd);
 
 	if (!test_bit(fsd->zone, ftl_simple_zone_map(fsd)))
-		return ftl_simple_setup_zone_scan(fsd);
+		return ftl_simple_zone_miss(fsd);
 
 	fsd->src_block = fsd->block_table[fsd->req_out.logical];
 
@@ -1274,6 +1794,9 @@ static void ftl_simple_end_request(struct mtdx_dev *this_dev,
 	struct ftl_simple_data *fsd = mtdx_get_drvdata(this_dev);
 	unsigned long flags;
 
+	mtdx_trace(this_dev, MTDX_TRACE_CMD_END, req->cmd, count, dst_error,
+		   src_error);
+
 	spin_lock_irqsave(&fsd->lock, flags);
 	fsd->dst_error = dst_error;
 	fsd->src_error = src_error;
@@ -1318,10 +1841,18 @@ static struct mtdx_request *ftl_simple_get_request(struct mtdx_dev *this_dev)
 	if (fsd->req_suspend)
 		goto out;
 
+	if (fsd->bg_scan && (fsd->no_prefetch
+			     || !mtdx_dev_queue_empty(&fsd->c_queue)))
+		ftl_simple_preempt_prefetch(fsd);
+	else if (!mtdx_dev_queue_empty(&fsd->c_queue))
+		ftl_simple_preempt_write(fsd);
+
 	while (1) {
 		rc = 0;
 		dev_dbg(&this_dev->dev, "ftl request loop\n");
 		while ((req_fn = ftl_simple_pop_req_fn(fsd))) {
+			mtdx_trace(this_dev, MTDX_TRACE_REQ_FN,
+				   (unsigned long)req_fn, fsd->req_fn_pos, 0, 0);
 			rc = (*req_fn)(fsd);
 			if (!rc)
 				goto out;
@@ -1349,6 +1880,9 @@ static struct mtdx_request *ftl_simple_get_request(struct mtdx_dev *this_dev)
 			}
 		}
 
+		if (!fsd->req_in && ftl_simple_resume_parked(fsd))
+			continue;
+
 		if (!fsd->req_in) {
 			if (fsd->req_dev)
 				fsd->req_in = fsd->req_dev
@@ -1367,6 +1901,9 @@ static struct mtdx_request *ftl_simple_get_request(struct mtdx_dev *this_dev)
 			fsd->req_dev = mtdx_dev_queue_pop_front(&fsd->c_queue);
 
 			if (!fsd->req_dev) {
+				if (!rc && !ftl_simple_start_prefetch(fsd))
+					continue;
+
 				if (!rc)
 					rc = -EAGAIN;
 
@@ -1375,8 +1912,12 @@ static struct mtdx_request *ftl_simple_get_request(struct mtdx_dev *this_dev)
 		}
 	}
 out:
-	if (!rc)
+	if (!rc) {
 		fsd->req_active = 1;
+		mtdx_trace(this_dev, MTDX_TRACE_CMD_ISSUE, fsd->req_out.cmd,
+			   fsd->req_out.phy.b_addr, fsd->req_out.phy.offset,
+			   fsd->req_out.length);
+	}
 	spin_unlock_irqrestore(&fsd->lock, flags);
 
 	return !rc ? &fsd->req_out : NULL;
@@ -1396,7 +1937,8 @@ static void ftl_simple_new_request(struct mtdx_dev *this_dev,
 	struct ftl_simple_data *fsd = mtdx_get_drvdata(this_dev);
 
 	get_device(&req_dev->dev);
-	mtdx_dev_queue_push_back(&fsd->c_queue, req_dev);
+	if (!mtdx_dev_queue_push_back(&fsd->c_queue, req_dev))
+		put_device(&req_dev->dev);
 
 	parent->new_request(parent, this_dev);
 }
@@ -1419,6 +1961,13 @@ static int ftl_simple_get_param(struct mtdx_dev *this_dev,
 	case MTDX_PARAM_SPECIAL_BLOCKS:
 	/* What about them in FTLs? */
 		return -EINVAL;
+	case MTDX_PARAM_QUEUE_DEPTH:
+	/*
+	 * Only one write is ever outstanding; with read_priority a second
+	 * request slot lets a single client read overtake it.
+	 */
+		*(unsigned int *)val = read_priority ? 2 : 1;
+		return 0;
 	case MTDX_PARAM_HD_GEO:
 	/* Really, we should make something up instead of blindly relying on
 	 * parent to provide this info.
@@ -1447,6 +1996,14 @@ static void ftl_simple_notify(struct mtdx_dev *this_dev, enum mtdx_message msg)
 			}
 		}
 		fsd->zone = 0;
+		fsd->last_zone = 0;
+		fsd->pf_fn = NULL;
+		/* Background scan in flight clears bg_scan upon completion;
+		 * prefetch failure on old media says nothing of the new one.
+		 */
+		if (!fsd->req_active)
+			fsd->bg_scan = 0;
+		fsd->no_prefetch = 0;
 		spin_unlock_irqrestore(&fsd->lock, flags);
 	default:
 		mtdx_notify_children(this_dev, msg);
@@ -1462,8 +2019,10 @@ static void ftl_simple_free(struct ftl_simple_data *fsd)
 		kfree(fsd->valid_zones_ptr);
 
 	kfree(fsd->block_table);
+	kfree(fsd->block_heat);
 
 	kfree(fsd->oob_buf);
+	kfree(fsd->scan_oob);
 	kfree(fsd->block_buf);
 
 	mtdx_page_list_free(&fsd->special_blocks);
@@ -1472,6 +2031,32 @@ static void ftl_simple_free(struct ftl_simple_data *fsd)
 	kfree(fsd);
 }
 
+static ssize_t ftl_simple_zone_stats_show(struct device *dev,
+					  struct device_attribute *attr,
+					  char *buf)
+{
+	struct ftl_simple_data *fsd = mtdx_get_drvdata(container_of(dev,
+							struct mtdx_dev,
+							dev));
+	unsigned long flags;
+	ssize_t rc;
+
+	spin_lock_irqsave(&fsd->lock, flags);
+	rc = scnprintf(buf, PAGE_SIZE, "zones ready: %d/%d\n"
+		       "zones prefetched: %d\n"
+		       "zone misses: %d\n"
+		       "miss time: %d ms\n"
+		       "max miss time: %d ms\n",
+		       bitmap_weight(ftl_simple_zone_map(fsd), fsd->geo.zone_cnt),
+		       fsd->geo.zone_cnt, fsd->prefetch_cnt, fsd->miss_cnt,
+		       fsd->miss_time, fsd->miss_max);
+	spin_unlock_irqrestore(&fsd->lock, flags);
+
+	return rc;
+}
+
+static DEVICE_ATTR(zone_stats, S_IRUGO, ftl_simple_zone_stats_show, NULL);
+
 static int ftl_simple_probe(struct mtdx_dev *mdev)
 {
 	struct mtdx_dev *parent = container_of(mdev->dev.parent,
@@ -1495,6 +2080,8 @@ static int ftl_simple_probe(struct mtdx_dev *mdev)
 		memcpy(&fsd->geo, &geo, sizeof(geo));
 	}
 
+	mtdx_geo_compile(&fsd->geo);
+
 	fsd->block_size = fsd->geo.page_cnt * fsd->geo.page_size;
 	dev_dbg(&mdev->dev, "parent geo: zone_cnt %x, log_block_cnt %x, "
 		"phy_block_cnt %x, page_cnt %x, page_size %x, oob_size %x\n",
@@ -1526,13 +2113,19 @@ static int ftl_simple_probe(struct mtdx_dev *mdev)
 	for (rc = 0; rc < fsd->geo.log_block_cnt; ++rc)
 		fsd->block_table[rc] = MTDX_INVALID_BLOCK;
 
-
 	fsd->oob_buf = kmalloc(fsd->geo.oob_size * 2, GFP_KERNEL);
 	if (!fsd->oob_buf) {
 		rc = -ENOMEM;
 		goto err_out;
 	}
 
+	fsd->scan_oob = kmalloc(fsd->geo.oob_size * FTL_SIMPLE_SCAN_BATCH,
+				GFP_KERNEL);
+	if (!fsd->scan_oob) {
+		rc = -ENOMEM;
+		goto err_out;
+	}
+
 	rc = 0;
 	parent->get_param(parent, MTDX_PARAM_READ_ONLY, &rc);
 
@@ -1561,6 +2154,12 @@ static int ftl_simple_probe(struct mtdx_dev *mdev)
 			goto err_out;
 		}
 
+		fsd->block_heat = kzalloc(fsd->geo.log_block_cnt, GFP_KERNEL);
+		if (!fsd->block_heat) {
+			rc = -ENOMEM;
+			goto err_out;
+		}
+
 		fsd->block_buf = kmalloc(fsd->block_size, GFP_KERNEL);
 		if (!fsd->block_buf) {
 			rc = -ENOMEM;
@@ -1597,6 +2196,12 @@ static int ftl_simple_probe(struct mtdx_dev *mdev)
 	mdev->get_param = ftl_simple_get_param;
 	mdev->notify = ftl_simple_notify;
 
+	rc = device_create_file(&mdev->dev, &dev_attr_zone_stats);
+	if (rc) {
+		mtdx_set_drvdata(mdev, NULL);
+		goto err_out;
+	}
+
 	{
 		struct mtdx_dev *cdev;
 		struct mtdx_device_id c_id = {
@@ -1636,9 +2241,12 @@ static void ftl_simple_remove(struct mtdx_dev *mdev)
 		}
 	} while (c_dev);
 
-	/* Wait for last client to finish. */
+	device_remove_file(&mdev->dev, &dev_attr_zone_stats);
+
+	/* Wait for last client (or background scan) to finish. */
 	spin_lock_irqsave(&fsd->lock, flags);
-	while (fsd->req_in) {
+	fsd->no_prefetch = 1;
+	while (fsd->req_in || (fsd->bg_scan && fsd->req_active)) {
 		spin_unlock_irqrestore(&fsd->lock, flags);
 		msleep_interruptible(1);
 		spin_lock_irqsave(&fsd->lock, flags);
@@ -166,6 +166,7 @@ struct ms_block_data {
 #define MS_BLOCK_FLG_COPY         0x08
 #define MS_BLOCK_FLG_WRITE        0x10
 #define MS_BLOCK_FLG_OV           0x20
+#define MS_BLOCK_FLG_SCAN         0x40
 
 	unsigned int              dst_page;
 	struct mtdx_pos           src_pos;
@@ -813,6 +814,17 @@ static int ms_block_trans_req(struct ms_block_data *msb)
 			}
 		}
 		break;
+	case MTDX_CMD_READ_OOB:
+		if (!msb->req_in->req_oob || !msb->req_in->length)
+			return -EINVAL;
+
+		msb->cmd = MS_CMD_BLOCK_READ;
+		msb->cmd_flags |= MS_BLOCK_FLG_EXTRA | MS_BLOCK_FLG_SCAN;
+		msb->cmd_param.cp = MEMSTICK_CP_EXTRA;
+		msb->cmd_param.page_address = 0;
+		msb->dst_page = 0;
+		msb->page_count = msb->req_in->length;
+		break;
 	case MTDX_CMD_ERASE:
 		msb->cmd_param.page_address = 0;
 		msb->cmd = MS_CMD_BLOCK_ERASE;
@@ -862,6 +874,9 @@ static int ms_block_trans_req(struct ms_block_data *msb)
 		return -EINVAL;
 	};
 
+	mtdx_trace(msb->mdev, MTDX_TRACE_CMD_ISSUE, msb->req_in->cmd,
+		   msb->req_in->phy.b_addr, msb->req_in->phy.offset,
+		   msb->req_in->length);
 	return 0;
 }
 
@@ -1003,8 +1018,12 @@ static int ms_block_complete_multi(struct memstick_dev *card,
 		memstick_init_req(*mrq, MS_TPC_SET_CMD, &msb->cmd, 1);
 		card->next_request = h_ms_block_set_cmd;
 		return 0;
-	} else
+	} else {
+		if (error && !(msb->cmd_flags & MS_BLOCK_FLG_COPY))
+			(*mrq)->error = error;
+
 		return ms_block_complete_req(card, mrq);
+	}
 }
 
 static int h_ms_block_set_param_addr(struct memstick_dev *card,
@@ -1020,7 +1039,13 @@ static int h_ms_block_set_param_addr(struct memstick_dev *card,
 	ms_block_reg_addr_set(card, (struct ms_register_addr *)((*mrq)->data));
 
 	if (!(msb->cmd_flags & MS_BLOCK_FLG_COPY)) {
-		ms_param_set_addr(&msb->cmd_param, msb->req_in->phy.b_addr);
+		if (msb->cmd_flags & MS_BLOCK_FLG_SCAN)
+			ms_param_set_addr(&msb->cmd_param,
+					  msb->req_in->phy.b_addr
+					  + msb->t_count);
+		else
+			ms_param_set_addr(&msb->cmd_param,
+					  msb->req_in->phy.b_addr);
 
 		if (msb->cmd_flags & MS_BLOCK_FLG_DATA)
 			msb->cmd_param.cp = MEMSTICK_CP_PAGE;
@@ -1329,7 +1354,8 @@ static int h_ms_block_read_status(struct memstick_dev *card,
 		if (!ms_block_reg_addr_cmp(card, &ms_block_r_stat_w_param))
 			return h_ms_block_set_param_addr(card, mrq);
 	} else if (!(msb->cmd_flags & MS_BLOCK_FLG_PAGE_INC)) {
-		msb->dst_page++;
+		if (!(msb->cmd_flags & MS_BLOCK_FLG_SCAN))
+			msb->dst_page++;
 		msb->t_count++;
 
 		if (msb->t_count == msb->page_count)
@@ -1675,12 +1701,17 @@ static int ms_block_complete_req(struct memstick_dev *card,
 				 struct memstick_request **mrq)
 {
 	struct ms_block_data *msb = memstick_get_drvdata(card);
+	unsigned int count = msb->t_count;
 	unsigned long flags;
 
+	if (!(msb->cmd_flags & MS_BLOCK_FLG_SCAN))
+		count *= msb->geo.page_size;
+
 	spin_lock_irqsave(&msb->lock, flags);
 	dev_dbg(&card->dev, "complete %p, %d\n", *mrq, (*mrq)->error);
-	msb->req_dev->end_request(msb->req_dev, msb->req_in,
-				  msb->t_count * msb->geo.page_size,
+	mtdx_trace(msb->mdev, MTDX_TRACE_CMD_END, msb->req_in->cmd, count,
+		   (*mrq)->error, msb->src_error);
+	msb->req_dev->end_request(msb->req_dev, msb->req_in, count,
 				  (*mrq)->error, msb->src_error);
 	msb->req_in = NULL;
 	msb->t_count = 0;
@@ -20,6 +20,7 @@
 #define MTDX_BLOCK_PART_SHIFT 3
 #define MTDX_BLOCK_MAX_SEGS  32
 #define MTDX_BLOCK_MAX_PAGES 0x7ffffff
+#define MTDX_BLOCK_MAX_DEPTH 32
 
 //#undef dev_dbg
 //#define dev_dbg dev_emerg
@@ -27,20 +28,31 @@
 static int major;
 module_param(major, int, 0644);
 
-struct mtdx_block_data {
-	struct mtdx_dev       *mdev;
-	unsigned int          usage_count;
-	struct gendisk        *disk;
-	struct request_queue  *queue;
+/*
+ * Block request handed to the parent, indexed by the block layer tag. Tagged
+ * requests are off the queue, so the rest of a partially completed one is
+ * kept in its slot (retry set) to be handed out again.
+ */
+struct mtdx_block_slot {
 	struct request        *block_req;
 	struct mtdx_request   req_out;
 	struct mtdx_data_iter req_data;
-	spinlock_t            q_lock;
-	struct mtdx_geo       geo;
-	unsigned int          peb_size;
-	struct hd_geometry    hd_geo;
-	unsigned int          read_only:1,
-			      eject:1;
+	unsigned int          retry:1;
+};
+
+struct mtdx_block_data {
+	struct mtdx_dev        *mdev;
+	unsigned int           usage_count;
+	struct gendisk         *disk;
+	struct request_queue   *queue;
+	spinlock_t             q_lock;
+	struct mtdx_geo        geo;
+	unsigned int           peb_size;
+	struct hd_geometry     hd_geo;
+	unsigned int           read_only:1,
+			       eject:1;
+	unsigned int           queue_depth;
+	struct mtdx_block_slot slots[];
 };
 
 static DEFINE_MUTEX(mtdx_block_disk_lock);
@@ -121,8 +133,12 @@ static void mtdx_block_end_request(struct mtdx_dev *this_dev,
 				   int dst_error, int src_error)
 {
 	struct mtdx_block_data *mbd = mtdx_get_drvdata(this_dev);
+	struct mtdx_block_slot *slot = container_of(req, struct mtdx_block_slot,
+						    req_out);
 	unsigned int flags;
 
+	mtdx_trace(this_dev, MTDX_TRACE_REQ_END, req->cmd, count, dst_error,
+		   src_error);
 	dev_dbg(&this_dev->dev, "end_request 1 %d, %x\n", dst_error, count);
 	spin_lock_irqsave(&mbd->q_lock, flags);
 	if (count)
@@ -131,59 +147,83 @@ static void mtdx_block_end_request(struct mtdx_dev *this_dev,
 		if (!dst_error)
 			dst_error = -EIO;
 
-		count = blk_rq_bytes(mbd->block_req);
+		count = blk_rq_bytes(slot->block_req);
 	}
 
-	dev_dbg(&this_dev->dev, "end_request 2 %d, %x\n", dst_error, count);
+	dev_dbg(&this_dev->dev, "end_request 2 %d, %x, tag %d\n", dst_error,
+		count, slot->block_req->tag);
 
-	__blk_end_request(mbd->block_req, dst_error, count);
-	mbd->block_req = NULL;
+	/* releases the tag as well, once the request is done */
+	if (__blk_end_request(slot->block_req, dst_error, count))
+		slot->retry = 1;
+	else
+		slot->block_req = NULL;
 	spin_unlock_irqrestore(&mbd->q_lock, flags);
 }
 
-//int limit = 500;
-
+/*
+ * Every call hands out a block request: the rest of a partially completed
+ * one, if any, or a fresh one, as long as the queue has one and a tag is
+ * free. Up to queue_depth requests may thus be outstanding.
+ */
 static struct mtdx_request *mtdx_block_get_request(struct mtdx_dev *mdev)
 {
 	struct mtdx_block_data *mbd = mtdx_get_drvdata(mdev);
+	struct mtdx_block_slot *slot;
+	struct request *block_req;
 	sector_t t_sec;
-	unsigned int flags;
+	unsigned int flags, cnt;
 
-//	if (!limit)
-//		return NULL;
-//	limit--;
 	spin_lock_irqsave(&mbd->q_lock, flags);
-try_again:
-	if (mbd->block_req) {
-		t_sec = mbd->block_req->sector << 9;
-		mbd->req_out.phy.b_addr = MTDX_INVALID_BLOCK;
-		mbd->req_out.phy.offset = sector_div(t_sec, mbd->peb_size);
-		mbd->req_out.logical = t_sec;
-		mbd->req_out.length = blk_rq_bytes(mbd->block_req);
-
-		dev_dbg(&mdev->dev, "req: logical %x, offset %x, length %x, "
-			"peb_size %x\n", mbd->req_out.logical,
-			mbd->req_out.phy.offset,
-			mbd->req_out.length, mbd->peb_size);
-
-		mbd->req_out.cmd = rq_data_dir(mbd->block_req) == READ
-				   ? MTDX_CMD_READ
-				   : MTDX_CMD_WRITE;
-
-		mtdx_data_iter_init_bio(&mbd->req_data, mbd->block_req->bio);
-		mbd->req_out.req_data = &mbd->req_data;
-		spin_unlock_irqrestore(&mbd->q_lock, flags);
-		return &mbd->req_out;
+	for (cnt = 0; cnt < mbd->queue_depth; ++cnt) {
+		if (mbd->slots[cnt].retry)
+			break;
+	}
+
+	if (cnt < mbd->queue_depth) {
+		slot = &mbd->slots[cnt];
+		slot->retry = 0;
+		block_req = slot->block_req;
+		dev_dbg(&mdev->dev, "retry tag %d\n", block_req->tag);
 	} else {
 		dev_dbg(&mdev->dev, "elv_next\n");
-		mbd->block_req = elv_next_request(mbd->queue);
-		if (!mbd->block_req) {
+		block_req = elv_next_request(mbd->queue);
+		if (!block_req || blk_queue_start_tag(mbd->queue, block_req)) {
 			dev_dbg(&mdev->dev, "issue end\n");
 			spin_unlock_irqrestore(&mbd->q_lock, flags);
 			return NULL;
 		}
+
+		slot = &mbd->slots[block_req->tag];
+		slot->block_req = block_req;
 	}
-	goto try_again;
+
+	t_sec = block_req->sector << 9;
+	slot->req_out.phy.b_addr = MTDX_INVALID_BLOCK;
+	if (mbd->geo.fast & MTDX_GEO_FAST_BLOCK) {
+		slot->req_out.phy.offset = t_sec & (mbd->peb_size - 1);
+		t_sec >>= mbd->geo.block_shift;
+	} else
+		slot->req_out.phy.offset = sector_div(t_sec, mbd->peb_size);
+	slot->req_out.logical = t_sec;
+	slot->req_out.length = blk_rq_bytes(block_req);
+
+	dev_dbg(&mdev->dev, "req: logical %x, offset %x, length %x, "
+		"peb_size %x, tag %d\n", slot->req_out.logical,
+		slot->req_out.phy.offset, slot->req_out.length, mbd->peb_size,
+		block_req->tag);
+
+	slot->req_out.cmd = rq_data_dir(block_req) == READ
+			    ? MTDX_CMD_READ
+			    : MTDX_CMD_WRITE;
+
+	mtdx_data_iter_init_bio(&slot->req_data, block_req->bio);
+	slot->req_out.req_data = &slot->req_data;
+	mtdx_trace(mdev, MTDX_TRACE_REQ_START, slot->req_out.cmd,
+		   slot->req_out.logical, slot->req_out.phy.offset,
+		   slot->req_out.length);
+	spin_unlock_irqrestore(&mbd->q_lock, flags);
+	return &slot->req_out;
 }
 
 static void mtdx_block_submit_req(struct request_queue *q)
@@ -193,17 +233,29 @@ static void mtdx_block_submit_req(struct request_queue *q)
 					       struct mtdx_dev, dev);
 	struct mtdx_block_data *mbd = mtdx_get_drvdata(mdev);
 	struct request *req = NULL;
-
-	if (mbd->block_req)
-		return;
+	unsigned int cnt;
 
 	if (mbd->eject) {
+		for (cnt = 0; cnt < mbd->queue_depth; ++cnt) {
+			if (!mbd->slots[cnt].retry)
+				continue;
+
+			mbd->slots[cnt].retry = 0;
+			req = mbd->slots[cnt].block_req;
+			mbd->slots[cnt].block_req = NULL;
+			__blk_end_request(req, -ENODEV, blk_rq_bytes(req));
+		}
+
 		while ((req = elv_next_request(q)) != NULL)
 			end_queued_request(req, -ENODEV);
 
 		return;
 	}
 
+	/* all tags are out, the parent will come back as requests complete */
+	if (!blk_queue_tag_queue(q))
+		return;
+
 	parent->new_request(parent, mdev);
 }
 
@@ -257,6 +309,10 @@ static int mtdx_block_init_disk(struct mtdx_dev *mdev)
 		goto out_put_disk;
 	}
 
+	rc = blk_queue_init_tags(mbd->queue, mbd->queue_depth, NULL);
+	if (rc)
+		goto out_cleanup_queue;
+
 	mbd->queue->queuedata = mdev;
 	blk_queue_prep_rq(mbd->queue, mtdx_block_prepare_req);
 
@@ -300,6 +356,9 @@ static int mtdx_block_init_disk(struct mtdx_dev *mdev)
 	add_disk(mbd->disk);
 	return 0;
 
+out_cleanup_queue:
+	blk_cleanup_queue(mbd->queue);
+	mbd->queue = NULL;
 out_put_disk:
 	put_disk(mbd->disk);
 out_release_id:
@@ -313,13 +372,23 @@ static int mtdx_block_probe(struct mtdx_dev *mdev)
 {
 	struct mtdx_dev *parent = container_of(mdev->dev.parent,
 					       struct mtdx_dev, dev);
-	struct mtdx_block_data *mbd = kzalloc(sizeof(struct mtdx_block_data),
-					      GFP_KERNEL);
+	struct mtdx_block_data *mbd;
+	unsigned int queue_depth = 1;
 	int rc;
 
+	if (parent->get_param(parent, MTDX_PARAM_QUEUE_DEPTH, &queue_depth)
+	    || !queue_depth)
+		queue_depth = 1;
+
+	queue_depth = min(queue_depth, (unsigned int)MTDX_BLOCK_MAX_DEPTH);
+	mbd = kzalloc(sizeof(struct mtdx_block_data)
+		      + queue_depth * sizeof(struct mtdx_block_slot),
+		      GFP_KERNEL);
 	if (!mbd)
 		return -ENOMEM;
 
+	mbd->queue_depth = queue_depth;
+
 	spin_lock_init(&mbd->q_lock);
 	mtdx_set_drvdata(mdev, mbd);
 	mbd->mdev = mdev;
@@ -330,6 +399,7 @@ static int mtdx_block_probe(struct mtdx_dev *mdev)
 
 	parent->get_param(parent, MTDX_PARAM_HD_GEO, &mbd->hd_geo);
 
+	mtdx_geo_compile(&mbd->geo);
 	mbd->peb_size = mbd->geo.page_cnt * mbd->geo.page_size;
 	mdev->get_request = mtdx_block_get_request;
 	mdev->end_request = mtdx_block_end_request;
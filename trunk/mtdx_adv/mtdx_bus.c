@@ -12,6 +12,8 @@
 #include "mtdx_common.h"
 #include <linux/module.h>
 #include <linux/idr.h>
+#include <linux/log2.h>
+#include <linux/bitmap.h>
 
 static DEFINE_IDA(mtdx_dev_ida);
 static DEFINE_MUTEX(mtdx_dev_lock);
@@ -24,6 +26,7 @@ static void mtdx_free_dev(struct device *dev)
 {
 	struct mtdx_dev *mdev = container_of(dev, struct mtdx_dev, dev);
 
+	mtdx_trace_destroy(mdev->trace);
 	kfree(mdev);
 }
 
@@ -309,6 +312,7 @@ struct mtdx_dev *mtdx_alloc_dev(struct device *parent,
 	snprintf(mdev->dev.bus_id, sizeof(mdev->dev.bus_id),
 		 "mtdx%d", mdev->ord);
 	device_initialize(&mdev->dev);
+	mdev->trace = mtdx_trace_create(mdev);
 
 	return mdev;
 
@@ -324,6 +328,7 @@ void __mtdx_free_dev(struct mtdx_dev *mdev)
 		mutex_lock(&mtdx_dev_lock);
 		ida_remove(&mtdx_dev_ida, mdev->ord);
 		mutex_unlock(&mtdx_dev_lock);
+		mtdx_trace_destroy(mdev->trace);
 		kfree(mdev);
 	}
 }
@@ -362,6 +367,46 @@ void mtdx_notify_children(struct mtdx_dev *mdev, enum mtdx_message msg)
 }
 EXPORT_SYMBOL(mtdx_notify_children);
 
+/**
+ * mtdx_geo_compile - precompute shifts for power of 2 geometry parameters
+ * geo: geometry, as obtained from the parent device
+ *
+ * Translations using custom methods are left on the generic path.
+ */
+void mtdx_geo_compile(struct mtdx_geo *geo)
+{
+	unsigned int z_sz;
+
+	geo->fast = 0;
+
+	if (geo->zone_cnt && !geo->log_to_zone && !geo->zone_to_log) {
+		z_sz = geo->log_block_cnt / geo->zone_cnt;
+		if (is_power_of_2(z_sz)) {
+			geo->log_zone_shift = ilog2(z_sz);
+			geo->fast |= MTDX_GEO_FAST_LOG;
+		}
+	}
+
+	if (geo->zone_cnt && !geo->phy_to_zone && !geo->zone_to_phy) {
+		z_sz = geo->phy_block_cnt / geo->zone_cnt;
+		if (is_power_of_2(z_sz)) {
+			geo->phy_zone_shift = ilog2(z_sz);
+			geo->fast |= MTDX_GEO_FAST_PHY;
+		}
+	}
+
+	if (is_power_of_2(geo->page_size)) {
+		geo->page_shift = ilog2(geo->page_size);
+		geo->fast |= MTDX_GEO_FAST_PAGE;
+	}
+
+	if (is_power_of_2(geo->page_cnt * geo->page_size)) {
+		geo->block_shift = ilog2(geo->page_cnt * geo->page_size);
+		geo->fast |= MTDX_GEO_FAST_BLOCK;
+	}
+}
+EXPORT_SYMBOL(mtdx_geo_compile);
+
 int mtdx_page_list_append(struct list_head *head, struct mtdx_page_info *info)
 {
 	struct list_head *p = head;
@@ -416,11 +461,13 @@ void mtdx_page_list_free(struct list_head *head)
 }
 EXPORT_SYMBOL(mtdx_page_list_free);
 
-void mtdx_dev_queue_push_back(struct mtdx_dev_queue *devq,
-                              struct mtdx_dev *mdev)
+/* Returns 0 if the device was already queued */
+int mtdx_dev_queue_push_back(struct mtdx_dev_queue *devq,
+			     struct mtdx_dev *mdev)
 {
 	struct list_head *p;
 	unsigned long flags;
+	int rc = 0;
 
 	spin_lock_irqsave(&devq->lock, flags);
 	__list_for_each(p, &devq->head) {
@@ -428,8 +475,10 @@ void mtdx_dev_queue_push_back(struct mtdx_dev_queue *devq,
 			goto out;
 	}
 	list_add_tail(&mdev->q_node, &devq->head);
+	rc = 1;
 out:
 	spin_unlock_irqrestore(&devq->lock, flags);
+	return rc;
 }
 EXPORT_SYMBOL(mtdx_dev_queue_push_back);
 
@@ -461,82 +510,83 @@ int mtdx_dev_queue_empty(struct mtdx_dev_queue *devq)
 }
 EXPORT_SYMBOL(mtdx_dev_queue_empty);
 
+/*
+ * Region is split into partial head and tail words, handled with masks, and
+ * whole words in between. Tail word is the one holding the last bit of the
+ * region, so words past the end of the bitmap are never touched.
+ */
 int bitmap_region_empty(unsigned long *bitmap, unsigned int offset,
 			unsigned int length)
 {
 	unsigned long w_b, w_e, m_b, m_e, cnt;
 
-	w_b = offset / BITS_PER_LONG;
-	w_e = (offset + length) / BITS_PER_LONG;
+	if (!length)
+		return 1;
 
-	m_b = ~((1UL << (offset % BITS_PER_LONG)) - 1UL);
-	m_e = (1UL << ((offset + length) % BITS_PER_LONG)) - 1UL;
+	w_b = BIT_WORD(offset);
+	w_e = BIT_WORD(offset + length - 1);
+	m_b = ~0UL << (offset % BITS_PER_LONG);
+	m_e = BITMAP_LAST_WORD_MASK(offset + length);
 
-	if (w_b == w_e) {
-		return bitmap[w_b] & (m_b ^ m_e) ? 0 : 1;
-	} else {
-		if (bitmap[w_b] & m_b)
-			return 0;
+	if (w_b == w_e)
+		return bitmap[w_b] & m_b & m_e ? 0 : 1;
 
-		if (m_e && (bitmap[w_e] & m_e))
-			return 0;
+	if ((bitmap[w_b] & m_b) || (bitmap[w_e] & m_e))
+		return 0;
 
-		for (cnt = w_b + 1; cnt < w_e; ++cnt)
-			if (bitmap[cnt])
-				return 0;
+	for (cnt = w_b + 1; cnt < w_e; ++cnt)
+		if (bitmap[cnt])
+			return 0;
 
-		return 1;
-	}
+	return 1;
 }
 EXPORT_SYMBOL(bitmap_region_empty);
 
 void bitmap_clear_region(unsigned long *bitmap, unsigned int offset,
 			 unsigned int length)
 {
-	unsigned long w_b, w_e, m_b, m_e, cnt;
+	unsigned long w_b, w_e, m_b, m_e;
 
-	w_b = offset / BITS_PER_LONG;
-	w_e = (offset + length) / BITS_PER_LONG;
+	if (!length)
+		return;
 
-	m_b = ~((1UL << (offset % BITS_PER_LONG)) - 1UL);
-	m_e = (1UL << ((offset + length) % BITS_PER_LONG)) - 1UL;
+	w_b = BIT_WORD(offset);
+	w_e = BIT_WORD(offset + length - 1);
+	m_b = ~0UL << (offset % BITS_PER_LONG);
+	m_e = BITMAP_LAST_WORD_MASK(offset + length);
 
 	if (w_b == w_e) {
 		bitmap[w_b] &= ~(m_b & m_e);
-	} else {
-		bitmap[w_b] &= ~m_b;
-
-		if (m_e)
-			bitmap[w_e] &= ~m_e;
-
-		for (cnt = w_b + 1; cnt < w_e; ++cnt)
-			bitmap[cnt] = 0UL;
+		return;
 	}
+
+	bitmap[w_b] &= ~m_b;
+	bitmap[w_e] &= ~m_e;
+	memset(bitmap + w_b + 1, 0, (w_e - w_b - 1) * sizeof(unsigned long));
 }
 EXPORT_SYMBOL(bitmap_clear_region);
 
 void bitmap_set_region(unsigned long *bitmap, unsigned int offset,
 		       unsigned int length)
 {
-	unsigned long w_b, w_e, m_b, m_e, cnt;
+	unsigned long w_b, w_e, m_b, m_e;
 
-	w_b = offset / BITS_PER_LONG;
-	w_e = (offset + length) / BITS_PER_LONG;
+	if (!length)
+		return;
 
-	m_b = ~((1UL << (offset % BITS_PER_LONG)) - 1UL);
-	m_e = (1UL << ((offset + length) % BITS_PER_LONG)) - 1UL;
+	w_b = BIT_WORD(offset);
+	w_e = BIT_WORD(offset + length - 1);
+	m_b = ~0UL << (offset % BITS_PER_LONG);
+	m_e = BITMAP_LAST_WORD_MASK(offset + length);
 
 	if (w_b == w_e) {
 		bitmap[w_b] |= m_b & m_e;
-	} else {
-		bitmap[w_b] |= m_b;
-
-		if (m_e)
-			bitmap[w_e] |= m_e;
-
-		for (cnt = w_b + 1; cnt < w_e; ++cnt)
-			bitmap[cnt] = ~0UL;
+		return;
 	}
+
+	bitmap[w_b] |= m_b;
+	bitmap[w_e] |= m_e;
+	memset(bitmap + w_b + 1, 0xff, (w_e - w_b - 1) * sizeof(unsigned long));
 }
 EXPORT_SYMBOL(bitmap_set_region);
 
@@ -544,7 +594,13 @@ static int __init mtdx_init(void)
 {
 	int rc;
 
+	rc = mtdx_trace_init();
+	if (rc)
+		return rc;
+
 	rc = bus_register(&mtdx_bus_type);
+	if (rc)
+		mtdx_trace_exit();
 
 	return rc;
 }
@@ -553,6 +609,7 @@ static void __exit mtdx_exit(void)
 {
 	bus_unregister(&mtdx_bus_type);
 	ida_destroy(&mtdx_dev_ida);
+	mtdx_trace_exit();
 }
 
 module_init(mtdx_init);
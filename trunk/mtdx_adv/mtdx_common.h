@@ -14,6 +14,7 @@
 
 #include <linux/device.h>
 #include "mtdx_data.h"
+#include "mtdx_trace.h"
 
 #define MTDX_INVALID_BLOCK 0xffffffff
 
@@ -76,8 +77,22 @@ struct mtdx_geo {
 	unsigned int (*zone_to_phy)(const struct mtdx_geo *geo,
 				    unsigned int zone,
 				    unsigned int phy_off);
+
+	/* Precomputed by mtdx_geo_compile(), valid where fast bit is set */
+	unsigned int fast;
+#define MTDX_GEO_FAST_LOG   0x01 /* log_zone_shift         */
+#define MTDX_GEO_FAST_PHY   0x02 /* phy_zone_shift         */
+#define MTDX_GEO_FAST_PAGE  0x04 /* page_shift             */
+#define MTDX_GEO_FAST_BLOCK 0x08 /* block_shift            */
+
+	unsigned char log_zone_shift; /* log2 of logical blocks per zone  */
+	unsigned char phy_zone_shift; /* log2 of physical blocks per zone */
+	unsigned char page_shift;     /* log2 of page_size                */
+	unsigned char block_shift;    /* log2 of page_cnt * page_size     */
 };
 
+void mtdx_geo_compile(struct mtdx_geo *geo);
+
 static inline unsigned int mtdx_geo_log_to_zone(const struct mtdx_geo *geo,
 						unsigned int log_addr,
 						unsigned int *log_off)
@@ -87,7 +102,10 @@ static inline unsigned int mtdx_geo_log_to_zone(const struct mtdx_geo *geo,
 	if (!log_off)
 		log_off = &l_off;
 
-	if (geo->log_to_zone)
+	if (geo->fast & MTDX_GEO_FAST_LOG) {
+		*log_off = log_addr & ((1U << geo->log_zone_shift) - 1);
+		return log_addr >> geo->log_zone_shift;
+	} else if (geo->log_to_zone)
 		return geo->log_to_zone(geo, log_addr, log_off);
 	else {
 		unsigned int z_sz = geo->log_block_cnt / geo->zone_cnt;
@@ -100,7 +118,12 @@ static inline unsigned int mtdx_geo_zone_to_log(const struct mtdx_geo *geo,
 						unsigned int zone,
 						unsigned int log_off)
 {
-	if (geo->zone_to_log)
+	if (geo->fast & MTDX_GEO_FAST_LOG) {
+		if (!(log_off >> geo->log_zone_shift))
+			return (zone << geo->log_zone_shift) + log_off;
+		else
+			return MTDX_INVALID_BLOCK;
+	} else if (geo->zone_to_log)
 		return geo->zone_to_log(geo, zone, log_off);
 	else {
 		unsigned int z_sz = geo->log_block_cnt / geo->zone_cnt;
@@ -121,7 +144,10 @@ static inline unsigned int mtdx_geo_phy_to_zone(const struct mtdx_geo *geo,
 	if (!phy_off)
 		phy_off = &p_off;
 
-	if (!geo->phy_to_zone) {
+	if (geo->fast & MTDX_GEO_FAST_PHY) {
+		*phy_off = phy_addr & ((1U << geo->phy_zone_shift) - 1);
+		return phy_addr >> geo->phy_zone_shift;
+	} else if (!geo->phy_to_zone) {
 		unsigned int z_sz = geo->phy_block_cnt / geo->zone_cnt;
 		*phy_off = phy_addr % z_sz;
 		return phy_addr / z_sz;
@@ -133,7 +159,12 @@ static inline unsigned int mtdx_geo_zone_to_phy(const struct mtdx_geo *geo,
 						unsigned int zone,
 						unsigned int phy_off)
 {
-	if (!geo->zone_to_phy) {
+	if (geo->fast & MTDX_GEO_FAST_PHY) {
+		if (!(phy_off >> geo->phy_zone_shift))
+			return (zone << geo->phy_zone_shift) + phy_off;
+		else
+			return MTDX_INVALID_BLOCK;
+	} else if (!geo->zone_to_phy) {
 		unsigned int z_sz = geo->phy_block_cnt / geo->zone_cnt;
 		if (phy_off < z_sz)
 			return (zone * z_sz) + phy_off;
@@ -143,6 +174,32 @@ static inline unsigned int mtdx_geo_zone_to_phy(const struct mtdx_geo *geo,
 		return geo->zone_to_phy(geo, zone, phy_off);
 }
 
+/* Page number of the byte offset within an eraseblock */
+static inline unsigned int mtdx_geo_page(const struct mtdx_geo *geo,
+					 unsigned int offset)
+{
+	if (geo->fast & MTDX_GEO_FAST_PAGE)
+		return offset >> geo->page_shift;
+	else
+		return offset / geo->page_size;
+}
+
+/* Eraseblock number of the byte position and offset within that block */
+static inline unsigned int mtdx_geo_block(const struct mtdx_geo *geo,
+					  unsigned int pos,
+					  unsigned int *b_off)
+{
+	if (geo->fast & MTDX_GEO_FAST_BLOCK) {
+		*b_off = pos & ((1U << geo->block_shift) - 1);
+		return pos >> geo->block_shift;
+	} else {
+		unsigned int b_sz = geo->page_cnt * geo->page_size;
+
+		*b_off = pos % b_sz;
+		return pos / b_sz;
+	}
+}
+
 struct mtdx_dev;
 
 enum mtdx_command {
@@ -151,7 +208,8 @@ enum mtdx_command {
 	MTDX_CMD_ERASE,      /* erase block                    */
 	MTDX_CMD_WRITE,      /* write both page data and oob   */
 	MTDX_CMD_OVERWRITE,  /* special cases write            */
-	MTDX_CMD_COPY        /* copy pages                     */
+	MTDX_CMD_COPY,       /* copy pages                     */
+	MTDX_CMD_READ_OOB    /* read first page oob of blocks  */
 };
 
 enum mtdx_page_status {
@@ -183,7 +241,9 @@ enum mtdx_param {
 	MTDX_PARAM_SPECIAL_BLOCKS, /* list of struct mtdx_page_info  */
 	MTDX_PARAM_READ_ONLY,      /* boolean int                    */
 	MTDX_PARAM_DEV_SUFFIX,     /* char[DEVICE_ID_SIZE]           */
-	MTDX_PARAM_DMA_MASK        /* u64*                           */
+	MTDX_PARAM_DMA_MASK,       /* u64*                           */
+	MTDX_PARAM_QUEUE_DEPTH     /* unsigned int, outstanding requests
+				    * accepted from each child       */
 };
 
 enum mtdx_message {
@@ -196,6 +256,11 @@ struct mtdx_pos {
 	unsigned int offset;
 };
 
+/* MTDX_CMD_READ_OOB reads the first page oob of "length" consecutive blocks,
+ * starting at phy.b_addr, into req_oob (one entry per block). It completes
+ * with the number of blocks read; devices not supporting it fail the request
+ * with -EINVAL.
+ */
 struct mtdx_request {
 	enum mtdx_command     cmd;       /* command to execute              */
 	unsigned int          logical;   /* logical block address           */
@@ -240,6 +305,7 @@ struct mtdx_dev {
 	void                 (*notify)(struct mtdx_dev *this_dev,
 				       enum mtdx_message msg);
 
+	struct mtdx_trace     *trace;
 	struct device         dev;
 };
 
@@ -276,8 +342,8 @@ static inline void mtdx_dev_queue_init(struct mtdx_dev_queue *devq)
 	INIT_LIST_HEAD(&devq->head);
 }
 
-void mtdx_dev_queue_push_back(struct mtdx_dev_queue *devq,
-			      struct mtdx_dev *mdev);
+int mtdx_dev_queue_push_back(struct mtdx_dev_queue *devq,
+			     struct mtdx_dev *mdev);
 struct mtdx_dev *mtdx_dev_queue_pop_front(struct mtdx_dev_queue *devq);
 int mtdx_dev_queue_empty(struct mtdx_dev_queue *devq);
 
@@ -301,4 +367,46 @@ void bitmap_clear_region(unsigned long *bitmap, unsigned int offset,
 void bitmap_set_region(unsigned long *bitmap, unsigned int offset,
 		       unsigned int length);
 
+/* Event tracing; trace is only allocated if enabled by mtdx_core parameter */
+#ifdef CONFIG_MTDX_TRACE
+
+int mtdx_trace_init(void);
+void mtdx_trace_exit(void);
+struct mtdx_trace *mtdx_trace_create(struct mtdx_dev *mdev);
+void mtdx_trace_destroy(struct mtdx_trace *trace);
+void __mtdx_trace(struct mtdx_trace *trace, unsigned int type, u32 arg0,
+		  u32 arg1, u32 arg2, u32 arg3);
+
+/* Not a function, so that disabled tracing costs a single test */
+#define mtdx_trace(mdev, type, arg0, arg1, arg2, arg3)			\
+do {									\
+	if (unlikely((mdev)->trace))					\
+		__mtdx_trace((mdev)->trace, type, arg0, arg1, arg2,	\
+			     arg3);					\
+} while (0)
+
+#else
+
+static inline int mtdx_trace_init(void)
+{
+	return 0;
+}
+
+static inline void mtdx_trace_exit(void)
+{
+}
+
+static inline struct mtdx_trace *mtdx_trace_create(struct mtdx_dev *mdev)
+{
+	return NULL;
+}
+
+static inline void mtdx_trace_destroy(struct mtdx_trace *trace)
+{
+}
+
+#define mtdx_trace(mdev, type, arg0, arg1, arg2, arg3) do {} while (0)
+
+#endif
+
 #endif
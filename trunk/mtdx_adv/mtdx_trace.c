@@ -0,0 +1,392 @@
+/*
+ *  MTDX request path event trace
+ *
+ *  Copyright (C) 2008 Alex Dubov <oakad@yahoo.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ */
+
+#include "mtdx_common.h"
+#include <linux/module.h>
+#include <linux/debugfs.h>
+#include <linux/vmalloc.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <asm/uaccess.h>
+
+struct mtdx_trace {
+	atomic_t                seq;
+	unsigned int            event_cnt; /* power of 2 */
+	atomic_t                users;     /* device and open files */
+	unsigned int            dead:1;
+	wait_queue_head_t       s_wait;
+	struct dentry           *file;
+	struct dentry           *s_file;
+	struct mtdx_trace_event events[0];
+};
+
+/* Stream file reader: seq is the last event consumed */
+struct mtdx_trace_reader {
+	struct mtdx_trace *trace;
+	unsigned int      seq;
+	unsigned int      hdr_sent:1;
+};
+
+/* Number of events kept per device, 0 to disable tracing */
+static unsigned int trace_events;
+module_param(trace_events, uint, 0444);
+
+static struct dentry *mtdx_trace_dir;
+
+void __mtdx_trace(struct mtdx_trace *trace, unsigned int type, u32 arg0,
+		  u32 arg1, u32 arg2, u32 arg3)
+{
+	unsigned int seq = atomic_inc_return(&trace->seq);
+	struct mtdx_trace_event *ev;
+
+	ev = &trace->events[(seq - 1) & (trace->event_cnt - 1)];
+
+	/* Readers skip slots with mismatching sequence numbers */
+	ev->seq = 0;
+	smp_wmb();
+	ev->time = ktime_to_ns(ktime_get());
+	ev->type = type;
+	ev->cpu = raw_smp_processor_id();
+	ev->arg[0] = arg0;
+	ev->arg[1] = arg1;
+	ev->arg[2] = arg2;
+	ev->arg[3] = arg3;
+	smp_wmb();
+	ev->seq = seq;
+
+	smp_mb();
+	if (waitqueue_active(&trace->s_wait))
+		wake_up_interruptible(&trace->s_wait);
+}
+EXPORT_SYMBOL(__mtdx_trace);
+
+static void mtdx_trace_put(struct mtdx_trace *trace)
+{
+	if (atomic_dec_and_test(&trace->users))
+		vfree(trace);
+}
+
+static int mtdx_trace_open(struct inode *inode, struct file *filp)
+{
+	struct mtdx_trace *trace = inode->i_private;
+
+	atomic_inc(&trace->users);
+	filp->private_data = trace;
+	return 0;
+}
+
+static int mtdx_trace_release(struct inode *inode, struct file *filp)
+{
+	mtdx_trace_put(filp->private_data);
+	return 0;
+}
+
+/*
+ * Slot may be overwritten while being copied: sequence number is checked
+ * before and after the copy, and the copy is marked empty if it changed.
+ */
+static void mtdx_trace_copy(struct mtdx_trace_event *dst,
+			    struct mtdx_trace_event *src)
+{
+	unsigned int seq = src->seq;
+
+	smp_rmb();
+	memcpy(dst, src, sizeof(struct mtdx_trace_event));
+	smp_rmb();
+
+	dst->seq = seq == src->seq ? seq : 0;
+}
+
+static ssize_t mtdx_trace_read(struct file *filp, char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	struct mtdx_trace *trace = filp->private_data;
+	struct mtdx_trace_header hdr = {
+		.magic = MTDX_TRACE_MAGIC,
+		.version = MTDX_TRACE_VERSION,
+		.header_size = sizeof(struct mtdx_trace_header),
+		.event_size = sizeof(struct mtdx_trace_event),
+		.event_cnt = trace->event_cnt,
+		.seq = atomic_read(&trace->seq)
+	};
+	size_t size = sizeof(hdr)
+		      + trace->event_cnt * sizeof(struct mtdx_trace_event);
+	struct mtdx_trace_event ev;
+	loff_t pos = *ppos;
+	size_t c_len, e_pos;
+	ssize_t rc = 0;
+
+	if (pos >= size)
+		return 0;
+
+	count = min(count, (size_t)(size - pos));
+
+	if (pos < sizeof(hdr)) {
+		c_len = min(count, (size_t)(sizeof(hdr) - pos));
+		if (copy_to_user(buf, (char *)&hdr + pos, c_len))
+			return -EFAULT;
+
+		buf += c_len;
+		pos += c_len;
+		count -= c_len;
+		rc += c_len;
+	}
+
+	while (count) {
+		e_pos = pos - sizeof(hdr);
+		mtdx_trace_copy(&ev, &trace->events[e_pos / sizeof(ev)]);
+		e_pos %= sizeof(ev);
+
+		c_len = min(count, sizeof(ev) - e_pos);
+		if (copy_to_user(buf, (char *)&ev + e_pos, c_len))
+			return -EFAULT;
+
+		buf += c_len;
+		pos += c_len;
+		count -= c_len;
+		rc += c_len;
+	}
+
+	*ppos = pos;
+	return rc;
+}
+
+static const struct file_operations mtdx_trace_fops = {
+	.owner   = THIS_MODULE,
+	.open    = mtdx_trace_open,
+	.read    = mtdx_trace_read,
+	.release = mtdx_trace_release
+};
+
+/*
+ * The stream file (mtdx/<device>.stream) gives every reader its own cursor:
+ * the header comes first, then only whole events newer than the ones already
+ * returned, in sequence order. Reads block until an event is logged. Events
+ * overwritten before the reader got to them are replaced by a single
+ * MTDX_TRACE_LOST event carrying their count, as the ring is never allowed
+ * to hold up the request path.
+ */
+static int mtdx_trace_s_open(struct inode *inode, struct file *filp)
+{
+	struct mtdx_trace *trace = inode->i_private;
+	struct mtdx_trace_reader *reader;
+	unsigned int seq;
+
+	reader = kzalloc(sizeof(struct mtdx_trace_reader), GFP_KERNEL);
+	if (!reader)
+		return -ENOMEM;
+
+	/* Start with the oldest event still in the ring */
+	seq = atomic_read(&trace->seq);
+	reader->seq = seq > trace->event_cnt ? seq - trace->event_cnt : 0;
+	reader->trace = trace;
+	atomic_inc(&trace->users);
+	filp->private_data = reader;
+	return 0;
+}
+
+static int mtdx_trace_s_release(struct inode *inode, struct file *filp)
+{
+	struct mtdx_trace_reader *reader = filp->private_data;
+
+	mtdx_trace_put(reader->trace);
+	kfree(reader);
+	return 0;
+}
+
+/* Event following seq is complete, or the reader was lapped */
+static int mtdx_trace_s_ready(struct mtdx_trace *trace, unsigned int seq)
+{
+	unsigned int last = atomic_read(&trace->seq);
+
+	if (trace->dead || last - seq > trace->event_cnt)
+		return 1;
+
+	return last != seq
+	       && trace->events[seq & (trace->event_cnt - 1)].seq == seq + 1;
+}
+
+static ssize_t mtdx_trace_s_read(struct file *filp, char __user *buf,
+				 size_t count, loff_t *ppos)
+{
+	struct mtdx_trace_reader *reader = filp->private_data;
+	struct mtdx_trace *trace = reader->trace;
+	struct mtdx_trace_event ev;
+	unsigned int last;
+	ssize_t rc = 0;
+
+	if (!reader->hdr_sent) {
+		struct mtdx_trace_header hdr = {
+			.magic = MTDX_TRACE_MAGIC,
+			.version = MTDX_TRACE_VERSION,
+			.header_size = sizeof(struct mtdx_trace_header),
+			.event_size = sizeof(struct mtdx_trace_event),
+			.event_cnt = trace->event_cnt,
+			.seq = reader->seq
+		};
+
+		if (count < sizeof(hdr))
+			return -EINVAL;
+
+		if (copy_to_user(buf, &hdr, sizeof(hdr)))
+			return -EFAULT;
+
+		reader->hdr_sent = 1;
+		*ppos += sizeof(hdr);
+		return sizeof(hdr);
+	}
+
+	if (count < sizeof(ev))
+		return -EINVAL;
+
+	while (count >= sizeof(ev)) {
+		if (!mtdx_trace_s_ready(trace, reader->seq)) {
+			if (rc || (filp->f_flags & O_NONBLOCK))
+				break;
+
+			if (wait_event_interruptible(trace->s_wait,
+						     mtdx_trace_s_ready(
+							trace, reader->seq)))
+				return -ERESTARTSYS;
+			continue;
+		}
+
+		if (trace->dead)
+			break;
+
+		last = atomic_read(&trace->seq);
+		if (last - reader->seq > trace->event_cnt) {
+			memset(&ev, 0, sizeof(ev));
+			ev.time = ktime_to_ns(ktime_get());
+			ev.seq = reader->seq + 1;
+			ev.type = MTDX_TRACE_LOST;
+			ev.arg[0] = last - trace->event_cnt - reader->seq;
+			reader->seq = last - trace->event_cnt;
+		} else {
+			mtdx_trace_copy(&ev, &trace->events[reader->seq
+						& (trace->event_cnt - 1)]);
+			/* Overwritten while copied: report as lost */
+			if (ev.seq != reader->seq + 1)
+				continue;
+
+			reader->seq++;
+		}
+
+		if (copy_to_user(buf, &ev, sizeof(ev)))
+			return rc ? rc : -EFAULT;
+
+		buf += sizeof(ev);
+		count -= sizeof(ev);
+		rc += sizeof(ev);
+	}
+
+	*ppos += rc;
+	return rc;
+}
+
+static const struct file_operations mtdx_trace_s_fops = {
+	.owner   = THIS_MODULE,
+	.open    = mtdx_trace_s_open,
+	.read    = mtdx_trace_s_read,
+	.release = mtdx_trace_s_release
+};
+
+/**
+ * mtdx_trace_create - allocate event ring for the device, if enabled
+ * mdev: device to trace (device name must be already set)
+ */
+struct mtdx_trace *mtdx_trace_create(struct mtdx_dev *mdev)
+{
+	struct mtdx_trace *trace;
+	unsigned int event_cnt;
+	char s_name[BUS_ID_SIZE + 8];
+
+	if (!trace_events || !mtdx_trace_dir)
+		return NULL;
+
+	event_cnt = roundup_pow_of_two(trace_events);
+	trace = vmalloc(sizeof(struct mtdx_trace)
+			+ event_cnt * sizeof(struct mtdx_trace_event));
+	if (!trace)
+		return NULL;
+
+	memset(trace->events, 0, event_cnt * sizeof(struct mtdx_trace_event));
+	atomic_set(&trace->seq, 0);
+	atomic_set(&trace->users, 1);
+	trace->dead = 0;
+	init_waitqueue_head(&trace->s_wait);
+	trace->event_cnt = event_cnt;
+	trace->file = debugfs_create_file(mdev->dev.bus_id, S_IRUSR,
+					  mtdx_trace_dir, trace,
+					  &mtdx_trace_fops);
+	if (IS_ERR(trace->file))
+		trace->file = NULL;
+
+	if (!trace->file) {
+		vfree(trace);
+		return NULL;
+	}
+
+	snprintf(s_name, sizeof(s_name), "%s.stream", mdev->dev.bus_id);
+	trace->s_file = debugfs_create_file(s_name, S_IRUSR, mtdx_trace_dir,
+					    trace, &mtdx_trace_s_fops);
+	if (IS_ERR(trace->s_file))
+		trace->s_file = NULL;
+
+	if (!trace->s_file) {
+		debugfs_remove(trace->file);
+		vfree(trace);
+		return NULL;
+	}
+
+	return trace;
+}
+EXPORT_SYMBOL(mtdx_trace_create);
+
+/*
+ * Open files keep the ring around; blocked stream readers are woken up and
+ * get end of file.
+ */
+void mtdx_trace_destroy(struct mtdx_trace *trace)
+{
+	if (!trace)
+		return;
+
+	debugfs_remove(trace->s_file);
+	debugfs_remove(trace->file);
+	trace->dead = 1;
+	smp_mb();
+	wake_up_interruptible_all(&trace->s_wait);
+	mtdx_trace_put(trace);
+}
+EXPORT_SYMBOL(mtdx_trace_destroy);
+
+int mtdx_trace_init(void)
+{
+	if (!trace_events)
+		return 0;
+
+	mtdx_trace_dir = debugfs_create_dir("mtdx", NULL);
+	if (IS_ERR(mtdx_trace_dir))
+		mtdx_trace_dir = NULL;
+
+	if (!mtdx_trace_dir)
+		printk(KERN_WARNING "mtdx: no debugfs, tracing disabled\n");
+
+	return 0;
+}
+
+void mtdx_trace_exit(void)
+{
+	debugfs_remove(mtdx_trace_dir);
+}
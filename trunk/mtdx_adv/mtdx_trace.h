@@ -0,0 +1,92 @@
+/*
+ *  MTDX request path event trace
+ *
+ *  Copyright (C) 2008 Alex Dubov <oakad@yahoo.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ */
+
+/*
+ * Each device keeps a ring of fixed size binary events, exported read-only
+ * through debugfs (mtdx/<device>). The file holds the header, followed by
+ * the ring slots in storage order. Slot of event with sequence number seq is
+ * (seq - 1) % event_cnt; empty slots, as well as slots which were being
+ * written at the time of reading, have seq of 0 or a mismatching sequence
+ * number. All values are in host byte order.
+ *
+ * The stream file (mtdx/<device>.stream) holds the same header (with seq of
+ * the last event before the stream start), followed by events in sequence
+ * order as they are logged; each open file gets its own position. Events
+ * overwritten before they were read are replaced by a single
+ * MTDX_TRACE_LOST event.
+ */
+
+#ifndef _MTDX_TRACE_H
+#define _MTDX_TRACE_H
+
+#include <linux/types.h>
+
+#define MTDX_TRACE_MAGIC   0x5844544d /* "MTDX" in host byte order */
+#define MTDX_TRACE_VERSION 1
+
+enum mtdx_trace_type {
+	MTDX_TRACE_NONE = 0,
+	MTDX_TRACE_REQ_START, /* cmd, logical, offset, length              */
+	MTDX_TRACE_REQ_END,   /* cmd, count, dst_error, src_error          */
+	MTDX_TRACE_REQ_FN,    /* handler address (low 32 bits), stack pos  */
+	MTDX_TRACE_PEB_GET,   /* zone, peb, dirty, temperature             */
+	MTDX_TRACE_PEB_PUT,   /* peb, dirty                                */
+	MTDX_TRACE_CMD_ISSUE, /* cmd, b_addr, offset, length               */
+	MTDX_TRACE_CMD_END,   /* cmd, count, dst_error, src_error          */
+	MTDX_TRACE_LOST       /* events lost by the stream reader          */
+};
+
+struct mtdx_trace_header {
+	__u32 magic;
+	__u16 version;
+	__u16 header_size;
+	__u32 event_size;
+	__u32 event_cnt;
+	__u32 seq;        /* sequence number of the last event logged */
+} __attribute__((packed));
+
+struct mtdx_trace_event {
+	__u64 time;       /* nanoseconds, monotonic */
+	__u32 seq;
+	__u16 type;
+	__u16 cpu;
+	__u32 arg[4];
+} __attribute__((packed));
+
+/*
+ * Block request capture, as extracted from MTDX_TRACE_REQ_START events of
+ * the block device ring and consumed by the replay test. The header is
+ * followed by rec_cnt records; request position is logical * block_size
+ * + offset bytes.
+ */
+
+#define MTDX_BTRACE_MAGIC   0x5442444d /* "MDBT" in host byte order */
+#define MTDX_BTRACE_VERSION 1
+
+struct mtdx_btrace_header {
+	__u32 magic;
+	__u16 version;
+	__u16 header_size;
+	__u32 rec_size;
+	__u32 rec_cnt;
+	__u32 block_size; /* logical block size of the captured device */
+} __attribute__((packed));
+
+struct mtdx_btrace_rec {
+	__u32 delay;      /* microseconds since the previous request */
+	__u16 cmd;
+	__u16 reserved;
+	__u32 logical;
+	__u32 offset;
+	__u32 length;
+} __attribute__((packed));
+
+#endif
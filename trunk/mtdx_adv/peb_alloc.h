@@ -23,16 +23,28 @@
  * User may call get_peb specifically with <*dirty> set, to get a useful block
  * that must be erased first, if explicit garbage collection is desirable.
  *
- *
+ * Users able to estimate the update frequency of the data they are about to
+ * write may pass it along as a temperature hint (get_peb_temp). Allocators
+ * supporting it will try to place frequently rewritten (hot) data into less
+ * worn blocks and rarely rewritten (cold) data into more worn ones.
  */
 
 #define MTDX_PEB_ALLOC_ALL 0xffffffff
 
+enum mtdx_peb_temp {
+	MTDX_PEB_COLD = 0,
+	MTDX_PEB_WARM,
+	MTDX_PEB_HOT
+};
+
 struct mtdx_peb_alloc {
 	const struct mtdx_geo *geo;
 
 	unsigned int (*get_peb)(struct mtdx_peb_alloc *bal,
 				unsigned int zone, int *dirty);
+	unsigned int (*get_peb_temp)(struct mtdx_peb_alloc *bal,
+				     unsigned int zone, int *dirty,
+				     enum mtdx_peb_temp temp);
 	void         (*put_peb)(struct mtdx_peb_alloc *bal, unsigned int peb,
 				int dirty);
 	void         (*reset)(struct mtdx_peb_alloc *bal, unsigned int zone);
@@ -45,6 +57,16 @@ static inline unsigned int mtdx_get_peb(struct mtdx_peb_alloc *bal,
 	return bal->get_peb(bal, zone, dirty);
 }
 
+static inline unsigned int mtdx_get_peb_temp(struct mtdx_peb_alloc *bal,
+					     unsigned int zone, int *dirty,
+					     enum mtdx_peb_temp temp)
+{
+	if (bal->get_peb_temp)
+		return bal->get_peb_temp(bal, zone, dirty, temp);
+	else
+		return bal->get_peb(bal, zone, dirty);
+}
+
 static inline void mtdx_put_peb(struct mtdx_peb_alloc *bal, unsigned int peb,
 				int dirty)
 {
@@ -19,6 +19,7 @@ struct rand_peb_alloc {
 	unsigned long         *map_a;
 	unsigned long         *map_b;
 	unsigned long         *erase_map; /* erase status of block        */
+	unsigned short        *wear;      /* allocations since mount      */
 	struct mtdx_peb_alloc mpa;
 	unsigned long         zone_map[]; /* 0 - use map A, 1 - use map B */
 };
@@ -29,8 +30,18 @@ struct rand_peb_alloc {
  * position in the unselected map (the selectors are in zone_map). When there
  * are no more free blocks in the selected map, selection is reversed and
  * search is retried.
+ *
+ * When a temperature hint is given, up to RAND_PEB_ALLOC_SAMPLES free blocks
+ * following the selected one are examined as well, and the least (for hot
+ * data) or the most (for cold data) worn of them is returned instead. Wear is
+ * approximated by the number of times the block was handed out since the
+ * allocator was created: the media keep no erase counters, so the estimate
+ * starts from scratch on every mount. Blocks not handed out yet have unknown
+ * wear and are never preferred over the random pick, nor replace it.
  */
 
+#define RAND_PEB_ALLOC_SAMPLES 8
+
 static unsigned int rand_peb_alloc_find_circ(unsigned long *map,
 					     unsigned int min_pos,
 					     unsigned int max_pos,
@@ -50,8 +61,47 @@ static unsigned int rand_peb_alloc_find_circ(unsigned long *map,
 	return rv;
 }
 
-static unsigned int rand_peb_alloc_get(struct mtdx_peb_alloc *bal,
-				       unsigned int zone, int *dirty)
+static unsigned int rand_peb_alloc_pick(struct rand_peb_alloc *rb,
+					unsigned long *c_map,
+					unsigned int zone_min,
+					unsigned int zone_max,
+					unsigned int c_pos, int c_stat,
+					enum mtdx_peb_temp temp)
+{
+	unsigned int b_pos = c_pos, n_pos = c_pos, cnt;
+
+	for (cnt = 1; cnt < RAND_PEB_ALLOC_SAMPLES; ++cnt) {
+		n_pos++;
+		if (n_pos == zone_max)
+			n_pos = zone_min;
+
+		n_pos = rand_peb_alloc_find_circ(c_map, zone_min, zone_max,
+						 n_pos);
+
+		if ((n_pos == MTDX_INVALID_BLOCK) || (n_pos == c_pos))
+			break;
+
+		if (!test_bit(n_pos, rb->erase_map) != !c_stat)
+			continue;
+
+		if (!rb->wear[n_pos] || !rb->wear[b_pos])
+			continue;
+
+		if (temp == MTDX_PEB_HOT) {
+			if (rb->wear[n_pos] < rb->wear[b_pos])
+				b_pos = n_pos;
+		} else {
+			if (rb->wear[n_pos] > rb->wear[b_pos])
+				b_pos = n_pos;
+		}
+	}
+
+	return b_pos;
+}
+
+static unsigned int rand_peb_alloc_get_temp(struct mtdx_peb_alloc *bal,
+					    unsigned int zone, int *dirty,
+					    enum mtdx_peb_temp temp)
 {
 	struct rand_peb_alloc *rb = container_of(bal, struct rand_peb_alloc,
 						 mpa);
@@ -111,6 +161,14 @@ static unsigned int rand_peb_alloc_get(struct mtdx_peb_alloc *bal,
 	}
 
 	c_stat = test_bit(c_pos, rb->erase_map);
+
+	if (temp != MTDX_PEB_WARM)
+		c_pos = rand_peb_alloc_pick(rb, c_map, zone_min, zone_max,
+					    c_pos, c_stat, temp);
+
+	if (rb->wear[c_pos] != USHORT_MAX)
+		rb->wear[c_pos]++;
+
 	*dirty = c_stat;
 	set_bit(c_pos, rb->map_a);
 	set_bit(c_pos, rb->map_b);
@@ -118,6 +176,12 @@ static unsigned int rand_peb_alloc_get(struct mtdx_peb_alloc *bal,
 	return c_pos;
 }
 
+static unsigned int rand_peb_alloc_get(struct mtdx_peb_alloc *bal,
+				       unsigned int zone, int *dirty)
+{
+	return rand_peb_alloc_get_temp(bal, zone, dirty, MTDX_PEB_WARM);
+}
+
 static void rand_peb_alloc_put(struct mtdx_peb_alloc *bal, unsigned int peb,
 			       int dirty)
 {
@@ -171,6 +235,7 @@ static void rand_peb_alloc_free(struct mtdx_peb_alloc *bal)
 	kfree(rb->map_a);
 	kfree(rb->map_b);
 	kfree(rb->erase_map);
+	kfree(rb->wear);
 
 	kfree(rb);
 }
@@ -187,6 +252,7 @@ struct mtdx_peb_alloc *mtdx_rand_peb_alloc(const struct mtdx_geo *geo)
 
 	rb->mpa.geo = geo;
 	rb->mpa.get_peb = rand_peb_alloc_get;
+	rb->mpa.get_peb_temp = rand_peb_alloc_get_temp;
 	rb->mpa.put_peb = rand_peb_alloc_put;
 	rb->mpa.reset = rand_peb_alloc_reset;
 	rb->mpa.free = rand_peb_alloc_free;
@@ -198,7 +264,10 @@ struct mtdx_peb_alloc *mtdx_rand_peb_alloc(const struct mtdx_geo *geo)
 	rb->erase_map = kmalloc(BITS_TO_LONGS(geo->phy_block_cnt)
 				* sizeof(unsigned long), GFP_KERNEL);
 
-	if (!rb->map_a || !rb->map_b || !rb->erase_map)
+	rb->wear = kzalloc(geo->phy_block_cnt * sizeof(unsigned short),
+			   GFP_KERNEL);
+
+	if (!rb->map_a || !rb->map_b || !rb->erase_map || !rb->wear)
 		goto err_out;
 
 	rand_peb_alloc_reset(&rb->mpa, MTDX_PEB_ALLOC_ALL);
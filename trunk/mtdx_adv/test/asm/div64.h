@@ -0,0 +1 @@
+#include <linux/div64.h>
@@ -0,0 +1,229 @@
+/*
+ * Microbenchmark for the bitmap region primitives of mtdx_bus.
+ *
+ * Usage: bench_bitmap [-b map_bits] [-n iterations] [-m max_region]
+ *
+ * Every primitive is first checked against a bit by bit reference on random
+ * regions, then timed on random regions of up to max_region bits and on the
+ * whole map. The per word loops the primitives used to be implemented with
+ * are timed alongside for comparison.
+ */
+
+#include "../mtdx_common.h"
+#include <linux/bitmap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static unsigned long long clock_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+int device_register(struct device *dev)
+{
+	return 0;
+}
+
+int driver_register(struct device_driver *drv)
+{
+	return 0;
+}
+
+static int ref_region_empty(unsigned long *bitmap, unsigned int offset,
+			    unsigned int length)
+{
+	unsigned int cnt;
+
+	for (cnt = offset; cnt < offset + length; ++cnt)
+		if (test_bit(cnt, bitmap))
+			return 0;
+
+	return 1;
+}
+
+static void ref_set_region(unsigned long *bitmap, unsigned int offset,
+			   unsigned int length, int val)
+{
+	unsigned int cnt;
+
+	for (cnt = offset; cnt < offset + length; ++cnt) {
+		if (val)
+			set_bit(cnt, bitmap);
+		else
+			clear_bit(cnt, bitmap);
+	}
+}
+
+/* Former word loop implementations */
+static int loop_region_empty(unsigned long *bitmap, unsigned int offset,
+			     unsigned int length)
+{
+	unsigned long w_b, w_e, m_b, m_e, cnt;
+
+	w_b = offset / BITS_PER_LONG;
+	w_e = (offset + length) / BITS_PER_LONG;
+
+	m_b = ~((1UL << (offset % BITS_PER_LONG)) - 1UL);
+	m_e = (1UL << ((offset + length) % BITS_PER_LONG)) - 1UL;
+
+	if (w_b == w_e)
+		return bitmap[w_b] & (m_b ^ m_e) ? 0 : 1;
+
+	if (bitmap[w_b] & m_b)
+		return 0;
+
+	if (m_e && (bitmap[w_e] & m_e))
+		return 0;
+
+	for (cnt = w_b + 1; cnt < w_e; ++cnt)
+		if (bitmap[cnt])
+			return 0;
+
+	return 1;
+}
+
+static void loop_set_region(unsigned long *bitmap, unsigned int offset,
+			    unsigned int length)
+{
+	unsigned long w_b, w_e, m_b, m_e, cnt;
+
+	w_b = offset / BITS_PER_LONG;
+	w_e = (offset + length) / BITS_PER_LONG;
+
+	m_b = ~((1UL << (offset % BITS_PER_LONG)) - 1UL);
+	m_e = (1UL << ((offset + length) % BITS_PER_LONG)) - 1UL;
+
+	if (w_b == w_e) {
+		bitmap[w_b] |= m_b & m_e;
+		return;
+	}
+
+	bitmap[w_b] |= m_b;
+
+	if (m_e)
+		bitmap[w_e] |= m_e;
+
+	for (cnt = w_b + 1; cnt < w_e; ++cnt)
+		bitmap[cnt] = ~0UL;
+}
+
+static int check(unsigned long *map, unsigned long *ref, unsigned int bits,
+		 unsigned int iter)
+{
+	unsigned int cnt, off, len, op;
+
+	for (cnt = 0; cnt < iter; ++cnt) {
+		off = random() % bits;
+		len = random() % (bits - off + 1);
+		op = random() % 3;
+
+		if (op == 0) {
+			bitmap_set_region(map, off, len);
+			ref_set_region(ref, off, len, 1);
+		} else if (op == 1) {
+			bitmap_clear_region(map, off, len);
+			ref_set_region(ref, off, len, 0);
+		} else if (bitmap_region_empty(map, off, len)
+			   != ref_region_empty(ref, off, len)) {
+			printf("region_empty mismatch %x:%x\n", off, len);
+			return -1;
+		}
+
+		if (memcmp(map, ref, BITS_TO_LONGS(bits)
+				     * sizeof(unsigned long))) {
+			printf("%s mismatch %x:%x\n", op ? "clear" : "set",
+			       off, len);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void bench(const char *name, unsigned long *map, unsigned int bits,
+		  unsigned int iter, unsigned int max_len)
+{
+	unsigned int *off = malloc(iter * sizeof(unsigned int));
+	unsigned int *len = malloc(iter * sizeof(unsigned int));
+	unsigned long long t[5];
+	unsigned int cnt, empty = 0;
+
+	for (cnt = 0; cnt < iter; ++cnt) {
+		len[cnt] = 1 + random() % max_len;
+		off[cnt] = random() % (bits - len[cnt] + 1);
+	}
+
+	/* Empty map: region_empty has to scan every region to the end */
+	bitmap_zero(map, bits);
+	t[0] = clock_us();
+	for (cnt = 0; cnt < iter; ++cnt)
+		empty += bitmap_region_empty(map, off[cnt], len[cnt]);
+	t[1] = clock_us();
+	for (cnt = 0; cnt < iter; ++cnt)
+		empty += loop_region_empty(map, off[cnt], len[cnt]);
+	t[2] = clock_us();
+	for (cnt = 0; cnt < iter; ++cnt)
+		bitmap_set_region(map, off[cnt], len[cnt]);
+	t[3] = clock_us();
+	for (cnt = 0; cnt < iter; ++cnt)
+		loop_set_region(map, off[cnt], len[cnt]);
+	t[4] = clock_us();
+
+	printf("%-8s empty %8llu us (loop %8llu us), "
+	       "set %8llu us (loop %8llu us) [%u]\n", name, t[1] - t[0],
+	       t[2] - t[1], t[3] - t[2], t[4] - t[3], empty);
+
+	free(off);
+	free(len);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int bits = 8192, iter = 1000000, max_len = 64;
+	unsigned long *map, *ref;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:n:m:")) != -1) {
+		switch (opt) {
+		case 'b':
+			bits = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			iter = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			max_len = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-b map_bits] "
+				"[-n iterations] [-m max_region]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (!bits || !max_len || max_len > bits)
+		return 1;
+
+	map = calloc(BITS_TO_LONGS(bits), sizeof(unsigned long));
+	ref = calloc(BITS_TO_LONGS(bits), sizeof(unsigned long));
+	if (!map || !ref)
+		return 1;
+
+	if (check(map, ref, bits, 100000))
+		return 1;
+
+	printf("%u bit map, %u iterations\n", bits, iter);
+	bitmap_zero(map, bits);
+	bench("random", map, bits, iter, max_len);
+	bench("full", map, bits, iter / 64 + 1, bits);
+
+	free(map);
+	free(ref);
+	return 0;
+}
@@ -9,22 +9,121 @@
 #include <stdio.h>
 #include "mtdx_common.h"
 
+static unsigned long long clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static pthread_mutex_t lock_class_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct spin_lock_class *lock_classes;
+
+static int lock_class_same(struct spin_lock_class *a,
+			   struct spin_lock_class *b)
+{
+	return a->line == b->line && !strcmp(a->file, b->file);
+}
+
+/*
+ * Classes of locks initialized in header inlines are instantiated in every
+ * including unit; those are merged by initialization site.
+ */
+static void lock_stat_report(void)
+{
+	struct spin_lock_class *class, *c_class, sum;
+
+	if (!lock_classes)
+		return;
+
+	fprintf(stderr, "%-24s %10s %10s %12s %10s %12s %10s\n", "lock",
+		"acquired", "contended", "wait us", "max ns", "hold us",
+		"max ns");
+
+	for (class = lock_classes; class; class = class->next) {
+		for (c_class = lock_classes; c_class != class;
+		     c_class = c_class->next)
+			if (lock_class_same(c_class, class))
+				break;
+
+		if (c_class != class)
+			continue;
+
+		memset(&sum, 0, sizeof(sum));
+		for (; c_class; c_class = c_class->next) {
+			if (!lock_class_same(c_class, class))
+				continue;
+
+			sum.instances += c_class->instances;
+			sum.acquired += c_class->acquired;
+			sum.contended += c_class->contended;
+			sum.wait_ns += c_class->wait_ns;
+			sum.hold_ns += c_class->hold_ns;
+			if (c_class->wait_max > sum.wait_max)
+				sum.wait_max = c_class->wait_max;
+			if (c_class->hold_max > sum.hold_max)
+				sum.hold_max = c_class->hold_max;
+		}
+
+		fprintf(stderr, "%-24s %10llu %10llu %12llu %10llu %12llu "
+			"%10llu\n    %s:%d, %u instances\n", class->name,
+			sum.acquired, sum.contended, sum.wait_ns / 1000,
+			sum.wait_max, sum.hold_ns / 1000, sum.hold_max,
+			class->file, class->line, sum.instances);
+	}
+}
+
 void spin_lock_irqsave(spinlock_t *lock, unsigned long flags)
 {
-	pthread_mutex_lock(&lock->mutex);
+	struct spin_lock_class *class = lock->class;
+	unsigned long long wait = 0;
+
+	if (pthread_mutex_trylock(&lock->mutex)) {
+		wait = clock_ns();
+		pthread_mutex_lock(&lock->mutex);
+		wait = clock_ns() - wait;
+		__sync_fetch_and_add(&class->contended, 1);
+		__sync_fetch_and_add(&class->wait_ns, wait);
+	}
+
+	/* Instances of the class may be held concurrently; maximums are racy */
+	__sync_fetch_and_add(&class->acquired, 1);
+	if (wait > class->wait_max)
+		class->wait_max = wait;
+
+	lock->t_acquired = clock_ns();
 }
 
 void spin_unlock_irqrestore(spinlock_t *lock, unsigned long flags)
 {
+	struct spin_lock_class *class = lock->class;
+	unsigned long long hold = clock_ns() - lock->t_acquired;
+
+	__sync_fetch_and_add(&class->hold_ns, hold);
+	if (hold > class->hold_max)
+		class->hold_max = hold;
+
 	pthread_mutex_unlock(&lock->mutex);
 }
 
-void spin_lock_init(spinlock_t *lock)
+void __spin_lock_init(spinlock_t *lock, struct spin_lock_class *class)
 {
 	pthread_mutexattr_t attr;
 	pthread_mutexattr_init(&attr);
 	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK_NP);
 	pthread_mutex_init(&lock->mutex, &attr);
+
+	lock->class = class;
+	pthread_mutex_lock(&lock_class_lock);
+	if (!class->instances++) {
+		if (!lock_classes)
+			atexit(lock_stat_report);
+
+		class->next = lock_classes;
+		lock_classes = class;
+	}
+	pthread_mutex_unlock(&lock_class_lock);
 }
 
 void kfree(const void *ptr)
@@ -54,66 +153,103 @@ void msleep(unsigned int msecs)
 		memcpy(&ts, &rem, sizeof(ts));
 }
 
+unsigned long get_jiffies(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * HZ + ts.tv_nsec / (1000000000UL / HZ);
+}
+
+static pthread_once_t work_pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t work_done_cond = PTHREAD_COND_INITIALIZER;
+static LIST_HEAD(work_list);
+
 static void *work_thread(void *data)
 {
-	struct work_struct *work = data;
-	pthread_mutex_lock(&work->lock);
-	work->state = 2;
-	printf("work thread running %p, %d\n", work, work->state);
-	pthread_cond_broadcast(&work->cond);
-	pthread_mutex_unlock(&work->lock);
-	work->func(work);
-	printf("work thread finished\n");
+	struct work_struct *work;
+
+	pthread_mutex_lock(&work_lock);
+	while (1) {
+		work = NULL;
+		list_for_each_entry(work, &work_list, entry) {
+			if (!work->running)
+				break;
+		}
+
+		if (&work->entry == &work_list) {
+			pthread_cond_wait(&work_cond, &work_lock);
+			continue;
+		}
+
+		list_del_init(&work->entry);
+		work->pending = 0;
+		work->running = 1;
+		pthread_mutex_unlock(&work_lock);
+
+		work->func(work);
+
+		pthread_mutex_lock(&work_lock);
+		work->running = 0;
+		pthread_cond_broadcast(&work_done_cond);
+		/* the item may have been queued again while running */
+		if (work->pending)
+			pthread_cond_signal(&work_cond);
+	}
 	return NULL;
 }
 
+static void work_pool_init(void)
+{
+	const char *env = getenv("MTDX_WORKERS");
+	long cnt = env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_t thread;
+
+	if (cnt < 1)
+		cnt = 1;
+
+	for (; cnt; --cnt) {
+		if (pthread_create(&thread, NULL, work_thread, NULL)) {
+			perror("work pool");
+			exit(1);
+		}
+		pthread_detach(thread);
+	}
+}
+
 int cancel_work_sync(struct work_struct *work)
 {
-	printf("cancel work %p\n", work);
-	pthread_mutex_lock(&work->lock);
-	printf("locked %d\n", work->state);
-	while (work->state == 1)
-		pthread_cond_wait(&work->cond, &work->lock);
-
-	printf("join\n");
-	if (work->thread)
-		pthread_join(work->thread, NULL);
-
-	work->thread = 0;
-	work->state = 0;
-	pthread_mutex_unlock(&work->lock);
-	printf("done\n");
-	return 0;
+	int rc;
+
+	pthread_mutex_lock(&work_lock);
+	rc = work->pending;
+	if (rc) {
+		list_del_init(&work->entry);
+		work->pending = 0;
+	}
+
+	while (work->running)
+		pthread_cond_wait(&work_done_cond, &work_lock);
+
+	pthread_mutex_unlock(&work_lock);
+	return rc;
 }
 
 int schedule_work(struct work_struct *work)
 {
 	int rc = 0;
 
-	pthread_mutex_lock(&work->lock);
-	printf("schedule work %p, %p, %d\n", work, work->thread, work->state);
-	if (work->state == 1)
-		goto out;
-	else if (work->state == 2) {
-		if (work->thread)
-			pthread_join(work->thread, NULL);
-
-		work->thread = 0;
-		work->state = 0;
-		printf("work thread joined\n");
-	}
+	pthread_once(&work_pool_once, work_pool_init);
 
-	work->state = 1;
-	rc = pthread_create(&work->thread, NULL, work_thread, work);
-	if (!rc)
-		printf("work thread created\n");
-	else {
-		work->state = 0;
-		printf("work thread failed\n");
+	pthread_mutex_lock(&work_lock);
+	if (!work->pending) {
+		work->pending = 1;
+		list_add_tail(&work->entry, &work_list);
+		pthread_cond_signal(&work_cond);
+		rc = 1;
 	}
-
-out:
-	printf("schedule out %d\n", work->state);
-	pthread_mutex_unlock(&work->lock);
+	pthread_mutex_unlock(&work_lock);
 	return rc;
 }
@@ -0,0 +1,4 @@
+#ifndef _LINUX_BITREV_H
+#define _LINUX_BITREV_H
+
+#endif
@@ -156,6 +156,20 @@ static inline void device_initialize(struct device *dev)
 {
 }
 
+#define DEVICE_ATTR(_name,_mode,_show,_store) \
+struct device_attribute dev_attr_##_name = __ATTR(_name,_mode,_show,_store)
+
+static inline int device_create_file(struct device *dev,
+				     struct device_attribute *attr)
+{
+	return 0;
+}
+
+static inline void device_remove_file(struct device *dev,
+				      struct device_attribute *attr)
+{
+}
+
 static inline void device_unregister(struct device *dev)
 {
 }
@@ -0,0 +1,16 @@
+#ifndef _LINUX_LOG2_H
+#define _LINUX_LOG2_H
+
+#include <linux/bitops.h>
+
+static inline int is_power_of_2(unsigned long n)
+{
+	return (n != 0 && ((n & (n - 1)) == 0));
+}
+
+static inline int ilog2(unsigned long n)
+{
+	return fls(n) - 1;
+}
+
+#endif
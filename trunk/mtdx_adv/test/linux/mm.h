@@ -0,0 +1,32 @@
+#ifndef _LINUX_MM_H
+#define _LINUX_MM_H
+
+#include <linux/errno.h>
+
+#define VM_WRITE    0x00000002
+#define VM_MAYWRITE 0x00000020
+
+#define smp_wmb() __sync_synchronize()
+
+struct vm_area_struct;
+
+struct vm_operations_struct {
+	void (*open)(struct vm_area_struct *area);
+	void (*close)(struct vm_area_struct *area);
+};
+
+struct vm_area_struct {
+	unsigned long               vm_flags;
+	unsigned long               vm_pgoff;
+	struct vm_operations_struct *vm_ops;
+	void                        *vm_private_data;
+};
+
+/* Nothing can be mapped here */
+static inline int remap_vmalloc_range(struct vm_area_struct *vma, void *addr,
+				      unsigned long pgoff)
+{
+	return -ENOSYS;
+}
+
+#endif
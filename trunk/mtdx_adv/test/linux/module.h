@@ -23,18 +23,30 @@
 
 #define BUG_ON(x) assert(!(x))
 
+#define USHORT_MAX ((u16)(~0U))
+
 typedef int gfp_t;
 
 void msleep(unsigned int msecs);
 
 #define msleep_interruptible msleep
 
+#define HZ 1000
+
+unsigned long get_jiffies(void);
+
+#define jiffies get_jiffies()
+#define jiffies_to_msecs(j) ((unsigned int)(j))
+
 void kfree(const void *);
 void *kzalloc(size_t size, gfp_t flags);
 void *kmalloc(size_t size, gfp_t flags);
 
 unsigned int random32(void);
 
+int scnprintf(char *buf, size_t size, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
 #define virt_to_page(x) (void*)(((unsigned long)(x) >> PAGE_SHIFT) << PAGE_SHIFT)
 
 #define offset_in_page(p)       ((unsigned long)(p) & ~PAGE_MASK)
@@ -46,7 +58,8 @@ unsigned int random32(void);
 typedef int (*initcall_t)(void);
 typedef void (*exitcall_t)(void);
 
-#define module_param(x, y, z)
+/* Parameters are exported for the tests to set, like init functions below */
+#define module_param(x, y, z) typeof(x) *exp_param_##x = &x
 
 #define module_init(x) int exp_##x() { return x(); }
 
@@ -8,13 +8,41 @@
 #define mutex_lock pthread_mutex_lock
 #define mutex_unlock pthread_mutex_unlock
 
+/*
+ * Locks initialized at the same place share a class, which accumulates the
+ * acquisition statistics of all its instances. Statistics of all classes are
+ * printed to stderr at exit.
+ */
+struct spin_lock_class {
+	const char             *name;
+	const char             *file;
+	int                    line;
+	unsigned int           instances;
+	unsigned long long     acquired;
+	unsigned long long     contended;
+	unsigned long long     wait_ns;
+	unsigned long long     wait_max;
+	unsigned long long     hold_ns;
+	unsigned long long     hold_max;
+	struct spin_lock_class *next;
+};
+
 typedef struct {
-	pthread_mutex_t mutex;
+	pthread_mutex_t        mutex;
+	struct spin_lock_class *class;
+	unsigned long long     t_acquired;
 } spinlock_t;
 
 void spin_lock_irqsave(spinlock_t *lock, unsigned long flags);
-void spin_lock_irqrestore(spinlock_t *lock, unsigned long flags);
-void spin_lock_init(spinlock_t *lock);
+void spin_unlock_irqrestore(spinlock_t *lock, unsigned long flags);
+void __spin_lock_init(spinlock_t *lock, struct spin_lock_class *class);
+
+#define spin_lock_init(lock) do {                                      \
+	static struct spin_lock_class __class = {                      \
+		.name = #lock, .file = __FILE__, .line = __LINE__      \
+	};                                                             \
+	__spin_lock_init(lock, &__class);                              \
+} while (0)
 
 
 #endif
@@ -0,0 +1,9 @@
+#ifndef _TEST_LINUX_TYPES_H
+#define _TEST_LINUX_TYPES_H
+
+#include_next <linux/types.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#endif
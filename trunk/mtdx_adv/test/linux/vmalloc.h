@@ -0,0 +1,16 @@
+#ifndef _LINUX_VMALLOC_H
+#define _LINUX_VMALLOC_H
+
+#include <stdlib.h>
+
+static inline void *vmalloc_user(unsigned long size)
+{
+	return calloc(1, size);
+}
+
+static inline void vfree(const void *addr)
+{
+	free((void *)addr);
+}
+
+#endif
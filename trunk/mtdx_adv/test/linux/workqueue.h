@@ -2,27 +2,31 @@
 #define _LINUX_WORKQUEUE_H
 
 #include <linux/errno.h>
+#include <linux/list.h>
 #include <pthread.h>
 
 struct work_struct;
 
 typedef void (*work_func_t)(struct work_struct *work);
 
+/*
+ * Work items are executed by a persistent pool of worker threads (sized by
+ * MTDX_WORKERS environment variable, number of cpus by default). As with
+ * the kernel workqueue, an item is never run by two workers at once.
+ */
 struct work_struct {
-	long            data;
-	work_func_t     func;
-	pthread_t       thread;
-	pthread_mutex_t lock;
-	pthread_cond_t  cond;
-	int             state;
+	long             data;
+	work_func_t      func;
+	struct list_head entry;
+	int              pending;
+	int              running;
 };
 
-#define INIT_WORK(x, f) { \
-	(x)->func = f;      \
-	(x)->thread = 0;    \
-	pthread_mutex_init(&(x)->lock, NULL); \
-	pthread_cond_init(&(x)->cond, NULL);  \
-	(x)->state = 0;     \
+#define INIT_WORK(x, f) {              \
+	(x)->func = f;                 \
+	INIT_LIST_HEAD(&(x)->entry);   \
+	(x)->pending = 0;              \
+	(x)->running = 0;              \
 }
 
 int schedule_work(struct work_struct *work);
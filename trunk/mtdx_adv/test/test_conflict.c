@@ -0,0 +1,376 @@
+/*
+ * Zone scan conflict resolution of ftl_simple.
+ *
+ * Usage: test_conflict
+ *
+ * Simulated media is seeded with logical blocks mapped twice: to a low
+ * addressed block and to a high addressed one. Each logical block is then
+ * read and the block the read goes to is checked against the rule of
+ * ftl_simple_settle_conflict: a selected (MTDX_PAGE_SMAPPED) copy wins,
+ * otherwise the one with the higher address does. More duplicates are seeded
+ * than FTL_SIMPLE_MAX_CONFLICTS, so that both deferred and immediate
+ * resolution get exercised.
+ */
+
+#include "test_harness.h"
+#include <pthread.h>
+#include <linux/module.h>
+#include <linux/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+pthread_mutex_t req_lock = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
+pthread_cond_t next_req_cond = PTHREAD_COND_INITIALIZER;
+struct mtdx_dev *btm_req_dev = NULL;
+struct mtdx_dev_queue btm_dev_queue;
+
+struct btm_oob {
+	unsigned int log_block;
+	enum mtdx_page_status status;
+};
+
+struct mtdx_geo btm_geo = {
+	.zone_cnt = 1,
+	.log_block_cnt = 96,
+	.phy_block_cnt = 128,
+	.page_cnt = 4,
+	.page_size = 512,
+	.oob_size = sizeof(struct btm_oob),
+	.fill_value = 0xff
+};
+
+/* Duplicate copies of logical block n are at phy n and CONFLICT_HIGH + n */
+#define CONFLICT_HIGH   64
+#define CONFLICT_PLAIN  24 /* both copies MTDX_PAGE_MAPPED */
+#define CONFLICT_SEL_LO 4  /* low copy MTDX_PAGE_SMAPPED   */
+#define CONFLICT_SEL_HI 4  /* high copy MTDX_PAGE_SMAPPED  */
+#define CONFLICT_CNT    (CONFLICT_PLAIN + CONFLICT_SEL_LO + CONFLICT_SEL_HI)
+
+struct btm_oob *pages;
+unsigned int btm_read_block = MTDX_INVALID_BLOCK;
+
+static void btm_set_block(unsigned int phy_block, unsigned int log_block,
+			  enum mtdx_page_status status)
+{
+	unsigned int cnt;
+
+	for (cnt = 0; cnt < btm_geo.page_cnt; ++cnt) {
+		pages[phy_block * btm_geo.page_cnt + cnt].log_block = log_block;
+		pages[phy_block * btm_geo.page_cnt + cnt].status = status;
+	}
+}
+
+static void btm_trans_oob(struct mtdx_request *req, int dir)
+{
+	unsigned int c_pos = req->phy.b_addr * btm_geo.page_cnt;
+	unsigned int cnt = req->length / btm_geo.page_size;
+
+	c_pos += req->phy.offset / btm_geo.page_size;
+
+	/* Zero length request accesses oob of a single page */
+	if (!cnt)
+		cnt = 1;
+
+	for (; cnt; --cnt) {
+		if (dir)
+			memcpy(&pages[c_pos], mtdx_oob_iter_get(req->req_oob),
+			       sizeof(struct btm_oob));
+		else
+			memcpy(mtdx_oob_iter_get(req->req_oob), &pages[c_pos],
+			       sizeof(struct btm_oob));
+		c_pos++;
+		mtdx_oob_iter_inc(req->req_oob, 1);
+	}
+}
+
+static unsigned int btm_scan_oob(struct mtdx_request *req)
+{
+	unsigned int cnt;
+
+	for (cnt = 0; cnt < req->length; ++cnt) {
+		if ((req->phy.b_addr + cnt) >= btm_geo.phy_block_cnt)
+			break;
+
+		memcpy(mtdx_oob_iter_get(req->req_oob),
+		       &pages[(req->phy.b_addr + cnt) * btm_geo.page_cnt],
+		       sizeof(struct btm_oob));
+		mtdx_oob_iter_inc(req->req_oob, 1);
+	}
+	return cnt;
+}
+
+/*
+ * Only the page states are kept; the block of the last data read is noted
+ * for the test to check.
+ */
+void *request_thread(void *data)
+{
+	struct mtdx_request *req;
+	unsigned int cnt;
+	int error;
+
+	while (1) {
+		pthread_mutex_lock(&req_lock);
+		while (mtdx_dev_queue_empty(&btm_dev_queue))
+			pthread_cond_wait(&next_req_cond, &req_lock);
+		pthread_mutex_unlock(&req_lock);
+
+		btm_req_dev = mtdx_dev_queue_pop_front(&btm_dev_queue);
+
+		while ((req = btm_req_dev->get_request(btm_req_dev))) {
+			cnt = req->length;
+			error = 0;
+
+			switch (req->cmd) {
+			case MTDX_CMD_READ_OOB:
+				cnt = btm_scan_oob(req);
+				break;
+			case MTDX_CMD_READ:
+				if (req->req_data) {
+					btm_read_block = req->phy.b_addr;
+					mtdx_data_iter_inc(req->req_data,
+							   req->length);
+				}
+
+				if (req->req_oob)
+					btm_trans_oob(req, 0);
+				break;
+			case MTDX_CMD_ERASE:
+				btm_set_block(req->phy.b_addr,
+					      MTDX_INVALID_BLOCK,
+					      MTDX_PAGE_ERASED);
+				cnt = 0;
+				break;
+			case MTDX_CMD_WRITE:
+				if (req->req_data)
+					mtdx_data_iter_inc(req->req_data,
+							   req->length);
+			case MTDX_CMD_OVERWRITE:
+				if (req->req_oob)
+					btm_trans_oob(req, 1);
+				break;
+			case MTDX_CMD_COPY:
+				break;
+			default:
+				cnt = 0;
+				error = -EINVAL;
+			}
+
+			btm_req_dev->end_request(btm_req_dev, req, cnt, error,
+						 0);
+		}
+		btm_req_dev = NULL;
+	}
+}
+
+void btm_new_req(struct mtdx_dev *this_dev, struct mtdx_dev *req_dev)
+{
+	pthread_mutex_lock(&req_lock);
+	mtdx_dev_queue_push_back(&btm_dev_queue, req_dev);
+	pthread_cond_signal(&next_req_cond);
+	pthread_mutex_unlock(&req_lock);
+}
+
+int btm_oob_to_info(struct mtdx_dev *this_dev, struct mtdx_page_info *p_info,
+		    void *oob)
+{
+	struct btm_oob *b_oob = oob;
+
+	p_info->log_block = b_oob->log_block;
+	p_info->status = b_oob->status;
+	return 0;
+}
+
+int btm_info_to_oob(struct mtdx_dev *this_dev, void *oob,
+		    struct mtdx_page_info *p_info)
+{
+	struct btm_oob *b_oob = oob;
+
+	b_oob->log_block = p_info->log_block;
+	b_oob->status = p_info->status;
+	return 0;
+}
+
+static int btm_get_param(struct mtdx_dev *this_dev,
+			 enum mtdx_param param, void *val)
+{
+	switch (param) {
+	case MTDX_PARAM_GEO: {
+		memcpy(val, &btm_geo, sizeof(btm_geo));
+		return 0;
+	}
+	case MTDX_PARAM_SPECIAL_BLOCKS: {
+		return 0;
+	}
+	case MTDX_PARAM_READ_ONLY: {
+		int *rv = val;
+		*rv = 0;
+		return 0;
+	}
+	case MTDX_PARAM_DEV_SUFFIX: {
+		char *rv = val;
+		sprintf(rv, "%d", this_dev->ord);
+		return 0;
+	}
+	case MTDX_PARAM_DMA_MASK: {
+		return 0;
+	}
+	default:
+		return -EINVAL;
+	}
+}
+
+struct mtdx_dev btm_dev = {
+	.id = {
+		MTDX_WMODE_PAGE_PEB, MTDX_WMODE_NONE, MTDX_RMODE_PAGE_PEB,
+		MTDX_RMODE_NONE, MTDX_TYPE_MEDIA, MTDX_ID_MEDIA_MEMORYSTICK
+	},
+	.dev = {
+		.bus_id = "btm"
+	},
+	.new_request = btm_new_req,
+	.oob_to_info = btm_oob_to_info,
+	.info_to_oob = btm_info_to_oob,
+	.get_param = btm_get_param
+};
+
+struct mtdx_dev ftl_dev = {
+	.id = {
+		MTDX_WMODE_PAGE, MTDX_WMODE_PAGE_PEB, MTDX_RMODE_PAGE,
+		MTDX_RMODE_PAGE_PEB, MTDX_TYPE_FTL, MTDX_ID_FTL_SIMPLE
+	},
+	.dev = {
+		.bus_id = "ftl",
+		.parent = &btm_dev.dev
+	}
+};
+
+char *top_data_buf;
+pthread_mutex_t top_lock = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
+wait_queue_head_t top_cond_wq;
+unsigned int top_req_done = 0;
+int top_error;
+
+static void top_end_request(struct mtdx_dev *this_dev, struct mtdx_request *req,
+			    unsigned int count, int dst_error,
+			    int src_error)
+{
+	pthread_mutex_lock(&top_lock);
+	top_error = dst_error;
+	top_req_done = 2;
+	pthread_mutex_unlock(&top_lock);
+	wake_up(&top_cond_wq);
+}
+
+static struct mtdx_request *top_get_request(struct mtdx_dev *mdev);
+
+struct mtdx_dev top_dev = {
+	.get_request = top_get_request,
+	.end_request = top_end_request,
+	.dev = {
+		.parent = &ftl_dev.dev
+	}
+};
+
+struct mtdx_request top_req;
+
+static struct mtdx_request *top_get_request(struct mtdx_dev *mdev)
+{
+	struct mtdx_request *rv;
+
+	pthread_mutex_lock(&top_lock);
+	if (!top_req_done) {
+		rv = &top_req;
+		top_req_done++;
+	} else
+		rv = NULL;
+
+	pthread_mutex_unlock(&top_lock);
+	return rv;
+}
+
+/* Block the read of log_block goes to */
+static unsigned int top_read_block(unsigned int log_block)
+{
+	struct mtdx_data_iter req_data_iter;
+
+	btm_read_block = MTDX_INVALID_BLOCK;
+
+	top_req.cmd = MTDX_CMD_READ;
+	top_req.logical = log_block;
+	top_req.phy.offset = 0;
+	top_req.length = btm_geo.page_size;
+	mtdx_data_iter_init_buf(&req_data_iter, top_data_buf,
+				btm_geo.page_size);
+	top_req.req_data = &req_data_iter;
+	top_req_done = 0;
+
+	ftl_dev.new_request(&ftl_dev, &top_dev);
+	wait_event_interruptible(top_cond_wq, top_req_done >= 2);
+
+	return top_error ? MTDX_INVALID_BLOCK : btm_read_block;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int cnt, phy_block, expected, failed = 0;
+	enum mtdx_page_status lo_status, hi_status;
+	pthread_t req_t;
+	int rc;
+
+	init_waitqueue_head(&top_cond_wq);
+	mtdx_dev_queue_init(&btm_dev_queue);
+
+	pages = calloc(btm_geo.phy_block_cnt * btm_geo.page_cnt,
+		       sizeof(struct btm_oob));
+	top_data_buf = malloc(btm_geo.page_size);
+	if (!pages || !top_data_buf)
+		return -ENOMEM;
+
+	for (cnt = 0; cnt < btm_geo.phy_block_cnt; ++cnt)
+		btm_set_block(cnt, MTDX_INVALID_BLOCK, MTDX_PAGE_ERASED);
+
+	for (cnt = 0; cnt < CONFLICT_CNT; ++cnt) {
+		lo_status = MTDX_PAGE_MAPPED;
+		hi_status = MTDX_PAGE_MAPPED;
+
+		if (cnt >= (CONFLICT_PLAIN + CONFLICT_SEL_LO))
+			hi_status = MTDX_PAGE_SMAPPED;
+		else if (cnt >= CONFLICT_PLAIN)
+			lo_status = MTDX_PAGE_SMAPPED;
+
+		btm_set_block(cnt, cnt, lo_status);
+		btm_set_block(CONFLICT_HIGH + cnt, cnt, hi_status);
+	}
+
+	rc = pthread_create(&req_t, NULL, request_thread, NULL);
+	if (rc)
+		return rc;
+
+	rc = test_ftl_probe(&ftl_dev);
+	if (rc) {
+		printf("ftl probe failed %d\n", rc);
+		return rc;
+	}
+
+	for (cnt = 0; cnt < CONFLICT_CNT; ++cnt) {
+		if ((cnt >= CONFLICT_PLAIN)
+		    && (cnt < (CONFLICT_PLAIN + CONFLICT_SEL_LO)))
+			expected = cnt;
+		else
+			expected = CONFLICT_HIGH + cnt;
+
+		phy_block = top_read_block(cnt);
+		if (phy_block != expected) {
+			printf("log block %x: read from %x, expected %x\n", cnt,
+			       phy_block, expected);
+			failed++;
+		}
+	}
+
+	test_driver->remove(&ftl_dev);
+	pthread_cancel(req_t);
+
+	printf("conflicts    %u (%u failed)\n", CONFLICT_CNT, failed);
+	return failed ? 1 : 0;
+}
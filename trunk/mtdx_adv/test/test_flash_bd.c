@@ -0,0 +1,476 @@
+/*
+ * flash_bd against a simulated xD-like media.
+ *
+ * Usage: test_flash_bd [iterations [seed]]
+ *
+ * Random writes (some of them sync), reads and flushes are run against a
+ * shadow copy of the device contents. Blocks start failing to program at
+ * random, so that open block relocation gets exercised, and every now and
+ * then the media is "pulled": flash_bd is thrown away and the block map is
+ * rebuilt from the media, the way xd_card_blk scans it (the rule of
+ * xd_card_resolve_conflict is repeated here). Every write reported complete
+ * must survive, whether its block was left open or not.
+ *
+ * A final check makes the source of an open block unreadable and verifies
+ * that closing the block blanks those pages and counts them in
+ * flash_bd_lost_pages.
+ */
+
+#include <linux/module.h>
+#include <linux/errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../driver/linux/flash_bd.h"
+
+#define PHY_BLOCK_CNT 40
+#define LOG_BLOCK_CNT 24
+#define PAGE_CNT      8
+#define PAGE_SIZE_    512
+#define BLOCK_SIZE    (PAGE_CNT * PAGE_SIZE_)
+#define DEV_SIZE      (LOG_BLOCK_CNT * BLOCK_SIZE)
+
+/* Per page extra data: the logical block the page was programmed for */
+struct sim_page {
+	unsigned int  log_block;
+	unsigned char data[PAGE_SIZE_];
+};
+
+struct sim_block {
+	struct sim_page page[PAGE_CNT];
+	unsigned int    bad:1,
+			unreadable:1;
+	/* Programming fails from page fail_from - 1 on, if non-zero */
+	unsigned int    fail_from;
+};
+
+static struct sim_block media[PHY_BLOCK_CNT];
+static unsigned char tmp_buf[BLOCK_SIZE];
+static unsigned char shadow[DEV_SIZE];
+static unsigned char *user_buf;
+static unsigned int user_pos;
+static unsigned int prog_failures, pulls, resumed;
+
+unsigned int random32(void)
+{
+	return random();
+}
+
+static void sim_erase(unsigned int phy_block)
+{
+	unsigned int cnt;
+
+	for (cnt = 0; cnt < PAGE_CNT; ++cnt) {
+		media[phy_block].page[cnt].log_block = FLASH_BD_INVALID;
+		memset(media[phy_block].page[cnt].data, 0xff, PAGE_SIZE_);
+	}
+}
+
+static int sim_program(unsigned int phy_block, unsigned int page,
+		       unsigned int log_block, const unsigned char *data)
+{
+	if (media[phy_block].fail_from
+	    && (page + 1) >= media[phy_block].fail_from) {
+		prog_failures++;
+		return -EFAULT;
+	}
+
+	media[phy_block].page[page].log_block = log_block;
+	memcpy(media[phy_block].page[page].data, data, PAGE_SIZE_);
+	return 0;
+}
+
+/* Execute flash_bd commands until the request is done, as xd_card does. */
+static int sim_run(struct flash_bd *fbd)
+{
+	struct flash_bd_request req;
+	unsigned int count = 0, cnt;
+	int error = 0, rc;
+
+	while (1) {
+		rc = flash_bd_next_req(fbd, &req, count, error);
+		if (rc)
+			return rc;
+
+		count = 0;
+		error = 0;
+
+		switch (req.cmd) {
+		case FBD_NONE:
+			return 0;
+		case FBD_READ:
+			if (media[req.phy_block].unreadable) {
+				error = -EIO;
+				break;
+			}
+
+			for (cnt = 0; cnt < req.page_cnt; ++cnt) {
+				memcpy(user_buf + user_pos,
+				       media[req.phy_block]
+				       .page[req.page_off + cnt].data,
+				       PAGE_SIZE_);
+				user_pos += PAGE_SIZE_;
+			}
+			count = req.page_cnt * PAGE_SIZE_;
+			break;
+		case FBD_READ_TMP:
+			if (media[req.phy_block].unreadable) {
+				error = -EIO;
+				break;
+			}
+
+			for (cnt = 0; cnt < req.page_cnt; ++cnt)
+				memcpy(tmp_buf + cnt * PAGE_SIZE_,
+				       media[req.phy_block]
+				       .page[req.page_off + cnt].data,
+				       PAGE_SIZE_);
+			count = req.page_cnt * PAGE_SIZE_;
+			break;
+		case FBD_FLUSH_TMP:
+			memcpy(user_buf + user_pos, tmp_buf + req.byte_off,
+			       req.byte_cnt);
+			user_pos += req.byte_cnt;
+			count = req.byte_cnt;
+			break;
+		case FBD_SKIP:
+			memset(user_buf + user_pos, 0xff, req.byte_cnt);
+			user_pos += req.byte_cnt;
+			count = req.byte_cnt;
+			break;
+		case FBD_ERASE_TMP:
+			memset(tmp_buf + req.byte_off, 0xff, req.byte_cnt);
+			count = req.byte_cnt;
+			break;
+		case FBD_FILL_TMP:
+			memcpy(tmp_buf + req.byte_off, user_buf + user_pos,
+			       req.byte_cnt);
+			user_pos += req.byte_cnt;
+			count = req.byte_cnt;
+			break;
+		case FBD_ERASE:
+			sim_erase(req.phy_block);
+			break;
+		case FBD_COPY:
+			if (media[req.src.phy_block].unreadable) {
+				error = -EIO;
+				break;
+			}
+
+			for (cnt = 0; !error && cnt < req.page_cnt; ++cnt) {
+				error = sim_program(req.phy_block,
+						    req.page_off + cnt,
+						    req.log_block,
+						    media[req.src.phy_block]
+						    .page[req.src.page_off
+							  + cnt].data);
+				if (!error)
+					count += PAGE_SIZE_;
+			}
+			break;
+		case FBD_WRITE:
+			for (cnt = 0; !error && cnt < req.page_cnt; ++cnt) {
+				error = sim_program(req.phy_block,
+						    req.page_off + cnt,
+						    req.log_block,
+						    user_buf + user_pos
+						    + cnt * PAGE_SIZE_);
+				if (!error)
+					count += PAGE_SIZE_;
+			}
+
+			/* xd_card rewinds the data position on failure */
+			if (!error)
+				user_pos += count;
+			break;
+		case FBD_WRITE_TMP:
+			for (cnt = 0; !error && cnt < req.page_cnt; ++cnt) {
+				error = sim_program(req.phy_block,
+						    req.page_off + cnt,
+						    req.log_block,
+						    tmp_buf + cnt * PAGE_SIZE_);
+				if (!error)
+					count += PAGE_SIZE_;
+			}
+			break;
+		case FBD_MARK_BAD:
+			media[req.phy_block].bad = 1;
+			break;
+		default:
+			printf("unexpected command %s\n",
+			       flash_bd_cmd_name(req.cmd));
+			abort();
+		}
+	}
+}
+
+static int sim_read(struct flash_bd *fbd, unsigned int offset,
+		    unsigned int count, unsigned char *buf)
+{
+	int rc;
+
+	user_buf = buf;
+	user_pos = 0;
+	flash_bd_start_reading(fbd, offset, count);
+	rc = sim_run(fbd);
+	flash_bd_end(fbd);
+	return rc;
+}
+
+/* Returns the error, if any, and the count written before it in t_count. */
+static int sim_write(struct flash_bd *fbd, unsigned int offset,
+		     unsigned int count, unsigned char *buf, int sync,
+		     unsigned int *t_count)
+{
+	int rc;
+
+	user_buf = buf;
+	user_pos = 0;
+	flash_bd_start_writing(fbd, offset, count);
+	if (sync)
+		flash_bd_sync(fbd);
+
+	rc = sim_run(fbd);
+	*t_count = flash_bd_end(fbd);
+	return rc;
+}
+
+static int sim_flush(struct flash_bd *fbd)
+{
+	int rc;
+
+	flash_bd_start_flushing(fbd);
+	rc = sim_run(fbd);
+	flash_bd_end(fbd);
+	return rc;
+}
+
+static int sim_blank(unsigned int phy_block, unsigned int page)
+{
+	return media[phy_block].page[page].log_block == FLASH_BD_INVALID;
+}
+
+/* As xd_card_resume_open */
+static void scan_resume_open(struct flash_bd *fbd, unsigned int log_block,
+			     unsigned int src_block, unsigned int dst_block)
+{
+	unsigned int page;
+
+	for (page = 1; page < PAGE_CNT - 1; ++page) {
+		if (sim_blank(dst_block, page))
+			break;
+	}
+
+	if (flash_bd_set_open(fbd, 0, log_block, src_block, dst_block,
+			      page)) {
+		printf("can not resume %x -> %x\n", log_block, dst_block);
+		flash_bd_set_empty(fbd, 0, dst_block, 0);
+		flash_bd_set_empty(fbd, 0, src_block, 0);
+		flash_bd_set_full(fbd, 0, src_block, log_block);
+		return;
+	}
+
+	resumed++;
+}
+
+/* As xd_card_resolve_conflict */
+static void scan_conflict(struct flash_bd *fbd, unsigned int phy_block,
+			  unsigned int log_block)
+{
+	unsigned int o_phy_block = flash_bd_get_physical(fbd, 0, log_block);
+	unsigned int l_addr = media[phy_block].page[PAGE_CNT - 1].log_block;
+	unsigned int l_addr_o = media[o_phy_block].page[PAGE_CNT - 1]
+				.log_block;
+
+	if (l_addr_o != FLASH_BD_INVALID && l_addr == FLASH_BD_INVALID)
+		scan_resume_open(fbd, log_block, o_phy_block, phy_block);
+	else if (l_addr != FLASH_BD_INVALID && l_addr_o == FLASH_BD_INVALID)
+		scan_resume_open(fbd, log_block, phy_block, o_phy_block);
+	else if (phy_block < o_phy_block) {
+		flash_bd_set_empty(fbd, 0, o_phy_block, 0);
+		flash_bd_set_full(fbd, 0, phy_block, log_block);
+	} else
+		flash_bd_set_empty(fbd, 0, phy_block, 0);
+}
+
+/* As xd_card_fill_lut_block, for the whole media */
+static struct flash_bd *sim_scan(void)
+{
+	struct flash_bd *fbd = flash_bd_init(1, PHY_BLOCK_CNT, LOG_BLOCK_CNT,
+					     PAGE_CNT, PAGE_SIZE_);
+	unsigned int b_cnt, log_block;
+
+	for (b_cnt = 0; b_cnt < PHY_BLOCK_CNT; ++b_cnt) {
+		if (media[b_cnt].bad) {
+			flash_bd_set_full(fbd, 0, b_cnt, FLASH_BD_INVALID);
+			continue;
+		}
+
+		log_block = media[b_cnt].page[0].log_block;
+		if (log_block == FLASH_BD_INVALID) {
+			flash_bd_set_empty(fbd, 0, b_cnt, 0);
+			continue;
+		}
+
+		if (flash_bd_set_full(fbd, 0, b_cnt, log_block) == -EEXIST)
+			scan_conflict(fbd, b_cnt, log_block);
+	}
+
+	return fbd;
+}
+
+static unsigned char w_buf[DEV_SIZE], r_buf[DEV_SIZE];
+
+/* Close an open block whose source became unreadable. */
+static int test_lost_pages(struct flash_bd *fbd)
+{
+	unsigned int phy_block, cnt, lost = flash_bd_lost_pages(fbd);
+	int rc;
+
+	for (cnt = 0; cnt < 2 * BLOCK_SIZE; ++cnt)
+		w_buf[cnt] = random();
+
+	rc = sim_write(fbd, 0, BLOCK_SIZE, w_buf, 1, &cnt);
+	if (!rc)
+		rc = sim_write(fbd, 0, PAGE_SIZE_, w_buf + BLOCK_SIZE, 0,
+			       &cnt);
+	if (rc) {
+		printf("lost pages: write failed %d\n", rc);
+		return 1;
+	}
+
+	phy_block = flash_bd_get_physical(fbd, 0, 0);
+	media[phy_block].unreadable = 1;
+	rc = sim_flush(fbd);
+	media[phy_block].unreadable = 0;
+
+	if (rc) {
+		printf("lost pages: flush failed %d\n", rc);
+		return 1;
+	}
+
+	if (flash_bd_lost_pages(fbd) - lost != PAGE_CNT - 1) {
+		printf("lost pages: %u counted, %u expected\n",
+		       flash_bd_lost_pages(fbd) - lost, PAGE_CNT - 1);
+		return 1;
+	}
+
+	memset(w_buf + PAGE_SIZE_, 0xff, BLOCK_SIZE - PAGE_SIZE_);
+	memcpy(w_buf, w_buf + BLOCK_SIZE, PAGE_SIZE_);
+	rc = sim_read(fbd, 0, BLOCK_SIZE, r_buf);
+	if (rc || memcmp(r_buf, w_buf, BLOCK_SIZE)) {
+		printf("lost pages: read back %d, contents %s\n", rc,
+		       memcmp(r_buf, w_buf, BLOCK_SIZE) ? "differ" : "match");
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int iter_cnt = argc > 1 ? atoi(argv[1]) : 20000;
+	unsigned int iter, b_cnt, offset, count, t_count;
+	unsigned int bad_cnt = 0, w_errors = 0, failed = 0;
+	struct flash_bd *fbd;
+	int op, rc;
+
+	srandom(argc > 2 ? atoi(argv[2]) : 1);
+
+	for (b_cnt = 0; b_cnt < PHY_BLOCK_CNT; ++b_cnt)
+		sim_erase(b_cnt);
+
+	memset(shadow, 0xff, sizeof(shadow));
+	fbd = sim_scan();
+
+	for (iter = 0; iter < iter_cnt; ++iter) {
+		/* Good blocks start failing, leaving enough spares */
+		if (!(random() % 64) && bad_cnt < (PHY_BLOCK_CNT
+						   - LOG_BLOCK_CNT - 4)) {
+			b_cnt = random() % PHY_BLOCK_CNT;
+			if (!media[b_cnt].bad && !media[b_cnt].fail_from) {
+				media[b_cnt].fail_from = 1 + random()
+							     % PAGE_CNT;
+				bad_cnt++;
+			}
+		}
+
+		op = random() % 32;
+
+		/* Mostly page aligned, sometimes not */
+		offset = (random() % (DEV_SIZE / PAGE_SIZE_)) * PAGE_SIZE_;
+		count = (1 + random() % (2 * PAGE_CNT)) * PAGE_SIZE_;
+		if (op & 1) {
+			offset += random() % PAGE_SIZE_;
+			count -= random() % PAGE_SIZE_;
+		}
+
+		if (offset + count > DEV_SIZE)
+			count = DEV_SIZE - offset;
+
+		if (op < 16) {
+			for (b_cnt = 0; b_cnt < count; ++b_cnt)
+				w_buf[b_cnt] = random();
+
+			/* A program failure outside of the open block fails
+			 * the write; what was written before it stays.
+			 */
+			rc = sim_write(fbd, offset, count, w_buf, op < 2,
+				       &t_count);
+			if (rc == -EFAULT)
+				w_errors++;
+			else if (rc) {
+				printf("%u: write %x:%x failed %d\n", iter,
+				       offset, count, rc);
+				failed++;
+				break;
+			}
+			memcpy(shadow + offset, w_buf, t_count);
+		} else if (op < 29) {
+			rc = sim_read(fbd, offset, count, r_buf);
+			if (rc) {
+				printf("%u: read %x:%x failed %d\n", iter,
+				       offset, count, rc);
+				failed++;
+				break;
+			}
+
+			if (memcmp(r_buf, shadow + offset, count)) {
+				printf("%u: read %x:%x differs\n", iter,
+				       offset, count);
+				failed++;
+				break;
+			}
+		} else if (op < 31) {
+			rc = sim_flush(fbd);
+			if (rc) {
+				printf("%u: flush failed %d\n", iter, rc);
+				failed++;
+				break;
+			}
+		} else {
+			/* Media pulled, open block or not */
+			flash_bd_destroy(fbd);
+			fbd = sim_scan();
+			pulls++;
+		}
+	}
+
+	if (!failed) {
+		rc = sim_read(fbd, 0, DEV_SIZE, r_buf);
+		if (rc || memcmp(r_buf, shadow, DEV_SIZE)) {
+			printf("final read %d, contents differ\n", rc);
+			failed++;
+		}
+	}
+
+	if (!failed)
+		failed += test_lost_pages(fbd);
+
+	flash_bd_destroy(fbd);
+
+	printf("iterations   %u (%u failed)\n", iter, failed);
+	printf("pulls        %u (%u open blocks resumed)\n", pulls, resumed);
+	printf("prog fails   %u (%u failing blocks, %u writes failed)\n",
+	       prog_failures, bad_cnt, w_errors);
+	return failed ? 1 : 0;
+}
@@ -1,12 +1,11 @@
-#include "../mtdx_common.h"
+#include "test_harness.h"
 #include <pthread.h>
 #include <linux/module.h>
 #include <linux/wait.h>
+#include <openssl/rand.h>
 #include <stdio.h>
 #include <stdlib.h>
 
-struct mtdx_driver *test_driver;
-
 pthread_mutex_t req_lock = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
 wait_queue_head_t next_req_wq;
 struct mtdx_dev *btm_req_dev = NULL;
@@ -87,6 +86,22 @@ int btm_trans_oob(struct mtdx_request *req, int dir)
 	return 0;
 }
 
+unsigned int btm_scan_oob(struct mtdx_request *req)
+{
+	unsigned int cnt;
+
+	for (cnt = 0; cnt < req->length; ++cnt) {
+		if ((req->phy.b_addr + cnt) >= btm_geo.phy_block_cnt)
+			break;
+
+		memcpy(mtdx_oob_iter_get(req->req_oob),
+		       &pages[(req->phy.b_addr + cnt) * btm_geo.page_cnt],
+		       sizeof(struct btm_oob));
+		mtdx_oob_iter_inc(req->req_oob, 1);
+	}
+	return cnt;
+}
+
 void btm_complete_req(struct mtdx_request *req, int error, unsigned int count)
 {
 	pthread_mutex_unlock(&req_lock);
@@ -113,6 +128,12 @@ void *request_thread(void *data)
 		while ((req = btm_req_dev->get_request(btm_req_dev))) {
 			printf("rt: req cmd %x, block %x, %x:%x\n", req->cmd,
 			       req->phy.b_addr, req->phy.offset, req->length);
+			if (req->cmd == MTDX_CMD_READ_OOB) {
+				btm_complete_req(req, 0,
+						 btm_scan_oob(req));
+				continue;
+			}
+
 			if ((req->phy.offset % btm_geo.page_size)
 			    || (req->length % btm_geo.page_size)) {
 				printf("rt: unaligned offset/length!\n");
@@ -349,25 +370,6 @@ static struct mtdx_request *top_get_request(struct mtdx_dev *mdev)
 	return rv;
 }
 
-unsigned int random32(void)
-{
-	unsigned int rv = random();
-
-	RAND_bytes(&rv, 4);
-	return rv;
-}
-
-int device_register(struct device *dev)
-{
-	return 0;
-}
-
-int driver_register(struct device_driver *drv)
-{
-	test_driver = container_of(drv, struct mtdx_driver, driver);
-	return 0;
-}
-
 void test_bb() {
 	unsigned int bb[] = {0x00000004, 0x000003fe, 0x000003ff, 0x00000000,
 			     0x00000001, 0x00001ffe, 0x00001fff};
@@ -441,8 +443,7 @@ int main(int argc, char **argv)
 		pages[rc].status = MTDX_PAGE_UNMAPPED;
 
 	rc = 0;
-	exp_mtdx_ftl_simple_init();
-	test_driver->probe(&ftl_dev);
+	test_ftl_probe(&ftl_dev);
 
 	test_bb();
 	return 0;
@@ -0,0 +1,40 @@
+/*
+ * Setup shared by the ftl_simple tests.
+ */
+
+#include "test_harness.h"
+#include <linux/module.h>
+#include <openssl/rand.h>
+#include <stdlib.h>
+
+struct mtdx_driver *test_driver;
+
+unsigned int random32(void)
+{
+	unsigned int rv = random();
+
+	RAND_bytes((unsigned char *)&rv, 4);
+	return rv;
+}
+
+int device_register(struct device *dev)
+{
+	return 0;
+}
+
+int driver_register(struct device_driver *drv)
+{
+	test_driver = container_of(drv, struct mtdx_driver, driver);
+	return 0;
+}
+
+/* Register ftl_simple and bind it to ftl_dev (child of the media device) */
+int test_ftl_probe(struct mtdx_dev *ftl_dev)
+{
+	int rc = exp_mtdx_ftl_simple_init();
+
+	if (rc)
+		return rc;
+
+	return test_driver->probe(ftl_dev);
+}
@@ -0,0 +1,21 @@
+/*
+ * Setup shared by the ftl_simple tests: kernel driver model stubs,
+ * registering the ftl_simple driver, and binding it to the simulated media.
+ */
+
+#ifndef _TEST_HARNESS_H
+#define _TEST_HARNESS_H
+
+#include "../mtdx_common.h"
+
+/* Driver registered by the module init function (see module_init) */
+extern struct mtdx_driver *test_driver;
+
+int exp_mtdx_ftl_simple_init(void);
+
+/* ftl_simple module parameters (see module_param) */
+extern unsigned int *exp_param_read_priority;
+
+int test_ftl_probe(struct mtdx_dev *ftl_dev);
+
+#endif
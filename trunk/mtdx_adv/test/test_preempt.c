@@ -0,0 +1,504 @@
+/*
+ * Reads overtaking a write in ftl_simple (read_priority).
+ *
+ * Usage: test_preempt
+ *
+ * A write spanning several blocks (not block aligned, so that the parked
+ * write has partial blocks to merge) is issued and the simulated media is
+ * stopped at its first command; READ_CNT clients then queue reads of blocks
+ * the write does not touch, and the media is let go. For each read_priority
+ * tried, exactly min(read_priority, READ_CNT) reads must complete before the
+ * write does (none with read_priority of 0), every read must return the data
+ * written earlier, and the blocks written must read back intact afterwards.
+ */
+
+#include "test_harness.h"
+#include <pthread.h>
+#include <linux/module.h>
+#include <openssl/rand.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+pthread_mutex_t req_lock = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
+pthread_cond_t next_req_cond = PTHREAD_COND_INITIALIZER;
+struct mtdx_dev *btm_req_dev = NULL;
+struct mtdx_dev_queue btm_dev_queue;
+
+struct btm_oob {
+	unsigned int log_block;
+	enum mtdx_page_status status;
+};
+
+struct mtdx_geo btm_geo = {
+	.zone_cnt = 1,
+	.log_block_cnt = 24,
+	.phy_block_cnt = 32,
+	.page_cnt = 8,
+	.page_size = 512,
+	.oob_size = sizeof(struct btm_oob),
+	.fill_value = 0xff
+};
+
+#define BLOCK_SIZE  (8 * 512)
+#define WRITE_BLOCK 0    /* first block of the write          */
+#define WRITE_OFF   1024 /* not block aligned                 */
+#define WRITE_CNT   4    /* blocks worth of data written      */
+#define READ_BLOCK  8    /* first block read while it is done */
+#define READ_CNT    3
+#define DATA_CNT    12   /* blocks written before the test    */
+
+struct btm_oob *pages;
+char *media;
+
+/* 1: stop before the next media command, 2: stopped there */
+unsigned int btm_gate;
+pthread_cond_t gate_cond = PTHREAD_COND_INITIALIZER;
+
+static void btm_set_block(unsigned int phy_block, unsigned int log_block,
+			  enum mtdx_page_status status)
+{
+	unsigned int cnt;
+
+	for (cnt = 0; cnt < btm_geo.page_cnt; ++cnt) {
+		pages[phy_block * btm_geo.page_cnt + cnt].log_block = log_block;
+		pages[phy_block * btm_geo.page_cnt + cnt].status = status;
+	}
+}
+
+static void btm_trans_oob(struct mtdx_request *req, int dir)
+{
+	unsigned int c_pos = req->phy.b_addr * btm_geo.page_cnt;
+	unsigned int cnt = req->length / btm_geo.page_size;
+
+	c_pos += req->phy.offset / btm_geo.page_size;
+
+	/* Zero length request accesses oob of a single page */
+	if (!cnt)
+		cnt = 1;
+
+	for (; cnt; --cnt) {
+		if (dir)
+			memcpy(&pages[c_pos], mtdx_oob_iter_get(req->req_oob),
+			       sizeof(struct btm_oob));
+		else
+			memcpy(mtdx_oob_iter_get(req->req_oob), &pages[c_pos],
+			       sizeof(struct btm_oob));
+		c_pos++;
+		mtdx_oob_iter_inc(req->req_oob, 1);
+	}
+}
+
+static void btm_trans_data(struct mtdx_request *req, int dir)
+{
+	char *pos = media + req->phy.b_addr * BLOCK_SIZE + req->phy.offset;
+	unsigned int r_len = req->length;
+	struct bio_vec b_vec;
+
+	while (r_len) {
+		mtdx_data_iter_get_bvec(req->req_data, &b_vec, r_len);
+		if (!b_vec.bv_len)
+			break;
+
+		if (dir)
+			memcpy(pos, bvec_to_phys(&b_vec), b_vec.bv_len);
+		else
+			memcpy(bvec_to_phys(&b_vec), pos, b_vec.bv_len);
+
+		pos += b_vec.bv_len;
+		r_len -= b_vec.bv_len;
+	}
+}
+
+static unsigned int btm_scan_oob(struct mtdx_request *req)
+{
+	unsigned int cnt;
+
+	for (cnt = 0; cnt < req->length; ++cnt) {
+		if ((req->phy.b_addr + cnt) >= btm_geo.phy_block_cnt)
+			break;
+
+		memcpy(mtdx_oob_iter_get(req->req_oob),
+		       &pages[(req->phy.b_addr + cnt) * btm_geo.page_cnt],
+		       sizeof(struct btm_oob));
+		mtdx_oob_iter_inc(req->req_oob, 1);
+	}
+	return cnt;
+}
+
+void *request_thread(void *data)
+{
+	struct mtdx_request *req;
+	unsigned int cnt;
+	int error;
+
+	while (1) {
+		pthread_mutex_lock(&req_lock);
+		while (mtdx_dev_queue_empty(&btm_dev_queue))
+			pthread_cond_wait(&next_req_cond, &req_lock);
+		pthread_mutex_unlock(&req_lock);
+
+		btm_req_dev = mtdx_dev_queue_pop_front(&btm_dev_queue);
+
+		while ((req = btm_req_dev->get_request(btm_req_dev))) {
+			pthread_mutex_lock(&req_lock);
+			if (btm_gate == 1) {
+				btm_gate = 2;
+				pthread_cond_broadcast(&gate_cond);
+				while (btm_gate)
+					pthread_cond_wait(&gate_cond,
+							  &req_lock);
+			}
+			pthread_mutex_unlock(&req_lock);
+
+			cnt = req->length;
+			error = 0;
+
+			switch (req->cmd) {
+			case MTDX_CMD_READ_OOB:
+				cnt = btm_scan_oob(req);
+				break;
+			case MTDX_CMD_READ:
+				if (req->req_data)
+					btm_trans_data(req, 0);
+
+				if (req->req_oob)
+					btm_trans_oob(req, 0);
+				break;
+			case MTDX_CMD_ERASE:
+				btm_set_block(req->phy.b_addr,
+					      MTDX_INVALID_BLOCK,
+					      MTDX_PAGE_ERASED);
+				memset(media + req->phy.b_addr * BLOCK_SIZE,
+				       btm_geo.fill_value, BLOCK_SIZE);
+				cnt = 0;
+				break;
+			case MTDX_CMD_WRITE:
+				if (req->req_data)
+					btm_trans_data(req, 1);
+			case MTDX_CMD_OVERWRITE:
+				if (req->req_oob)
+					btm_trans_oob(req, 1);
+				break;
+			case MTDX_CMD_COPY:
+				memcpy(media + req->phy.b_addr * BLOCK_SIZE
+				       + req->phy.offset,
+				       media + req->copy.b_addr * BLOCK_SIZE
+				       + req->copy.offset, req->length);
+
+				if (req->req_oob)
+					btm_trans_oob(req, 1);
+				break;
+			default:
+				cnt = 0;
+				error = -EINVAL;
+			}
+
+			btm_req_dev->end_request(btm_req_dev, req, cnt, error,
+						 0);
+		}
+		btm_req_dev = NULL;
+	}
+}
+
+void btm_new_req(struct mtdx_dev *this_dev, struct mtdx_dev *req_dev)
+{
+	pthread_mutex_lock(&req_lock);
+	mtdx_dev_queue_push_back(&btm_dev_queue, req_dev);
+	pthread_cond_signal(&next_req_cond);
+	pthread_mutex_unlock(&req_lock);
+}
+
+int btm_oob_to_info(struct mtdx_dev *this_dev, struct mtdx_page_info *p_info,
+		    void *oob)
+{
+	struct btm_oob *b_oob = oob;
+
+	p_info->log_block = b_oob->log_block;
+	p_info->status = b_oob->status;
+	return 0;
+}
+
+int btm_info_to_oob(struct mtdx_dev *this_dev, void *oob,
+		    struct mtdx_page_info *p_info)
+{
+	struct btm_oob *b_oob = oob;
+
+	b_oob->log_block = p_info->log_block;
+	b_oob->status = p_info->status;
+	return 0;
+}
+
+static int btm_get_param(struct mtdx_dev *this_dev,
+			 enum mtdx_param param, void *val)
+{
+	switch (param) {
+	case MTDX_PARAM_GEO: {
+		memcpy(val, &btm_geo, sizeof(btm_geo));
+		return 0;
+	}
+	case MTDX_PARAM_SPECIAL_BLOCKS: {
+		return 0;
+	}
+	case MTDX_PARAM_READ_ONLY: {
+		int *rv = val;
+		*rv = 0;
+		return 0;
+	}
+	case MTDX_PARAM_DEV_SUFFIX: {
+		char *rv = val;
+		sprintf(rv, "%d", this_dev->ord);
+		return 0;
+	}
+	case MTDX_PARAM_DMA_MASK: {
+		return 0;
+	}
+	default:
+		return -EINVAL;
+	}
+}
+
+struct mtdx_dev btm_dev = {
+	.id = {
+		MTDX_WMODE_PAGE_PEB, MTDX_WMODE_NONE, MTDX_RMODE_PAGE_PEB,
+		MTDX_RMODE_NONE, MTDX_TYPE_MEDIA, MTDX_ID_MEDIA_MEMORYSTICK
+	},
+	.dev = {
+		.bus_id = "btm"
+	},
+	.new_request = btm_new_req,
+	.oob_to_info = btm_oob_to_info,
+	.info_to_oob = btm_info_to_oob,
+	.get_param = btm_get_param
+};
+
+struct mtdx_dev ftl_dev = {
+	.id = {
+		MTDX_WMODE_PAGE, MTDX_WMODE_PAGE_PEB, MTDX_RMODE_PAGE,
+		MTDX_RMODE_PAGE_PEB, MTDX_TYPE_FTL, MTDX_ID_FTL_SIMPLE
+	},
+	.dev = {
+		.bus_id = "ftl",
+		.parent = &btm_dev.dev
+	}
+};
+
+/* Client with a single request; done is its place in completion order */
+struct top_client {
+	struct mtdx_dev       mdev;
+	struct mtdx_request   req;
+	struct mtdx_data_iter req_data;
+	char                  *buf;
+	unsigned int          issued;
+	unsigned int          done;
+	int                   error;
+};
+
+pthread_mutex_t top_lock = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
+pthread_cond_t top_cond = PTHREAD_COND_INITIALIZER;
+unsigned int top_done_cnt;
+
+static struct mtdx_request *top_get_request(struct mtdx_dev *mdev)
+{
+	struct top_client *client = container_of(mdev, struct top_client,
+						 mdev);
+	struct mtdx_request *rv = NULL;
+
+	pthread_mutex_lock(&top_lock);
+	if (!client->issued) {
+		client->issued = 1;
+		rv = &client->req;
+	}
+	pthread_mutex_unlock(&top_lock);
+	return rv;
+}
+
+static void top_end_request(struct mtdx_dev *mdev, struct mtdx_request *req,
+			    unsigned int count, int dst_error, int src_error)
+{
+	struct top_client *client = container_of(mdev, struct top_client,
+						 mdev);
+
+	pthread_mutex_lock(&top_lock);
+	client->error = dst_error;
+	if (!dst_error && count != req->length)
+		client->error = -EIO;
+	client->done = ++top_done_cnt;
+	pthread_cond_broadcast(&top_cond);
+	pthread_mutex_unlock(&top_lock);
+}
+
+static void top_init(struct top_client *client, enum mtdx_command cmd,
+		     unsigned int log_block, unsigned int offset,
+		     unsigned int length, char *buf)
+{
+	memset(client, 0, sizeof(struct top_client));
+	client->mdev.get_request = top_get_request;
+	client->mdev.end_request = top_end_request;
+	client->mdev.dev.parent = &ftl_dev.dev;
+	client->buf = buf;
+	client->req.cmd = cmd;
+	client->req.logical = log_block;
+	client->req.phy.offset = offset;
+	client->req.length = length;
+	mtdx_data_iter_init_buf(&client->req_data, buf, client->req.length);
+	client->req.req_data = &client->req_data;
+}
+
+static void top_wait(unsigned int cnt)
+{
+	pthread_mutex_lock(&top_lock);
+	while (top_done_cnt < cnt)
+		pthread_cond_wait(&top_cond, &top_lock);
+	pthread_mutex_unlock(&top_lock);
+}
+
+static void top_issue(struct top_client *client)
+{
+	ftl_dev.new_request(&ftl_dev, &client->mdev);
+}
+
+/* Single request, waited for */
+static int top_rw(enum mtdx_command cmd, unsigned int log_block,
+		  unsigned int block_cnt, char *buf)
+{
+	struct top_client client;
+	unsigned int base = top_done_cnt;
+
+	top_init(&client, cmd, log_block, 0, block_cnt * BLOCK_SIZE, buf);
+	top_issue(&client);
+	top_wait(base + 1);
+	return client.error;
+}
+
+static char *shadow;
+
+static int test_priority(unsigned int priority, char *w_buf)
+{
+	struct top_client wr, rd[READ_CNT];
+	unsigned int cnt, passed = 0, expected, base;
+	int failed = 0;
+
+	*exp_param_read_priority = priority;
+	RAND_bytes((unsigned char *)w_buf, WRITE_CNT * BLOCK_SIZE);
+	base = top_done_cnt;
+
+	pthread_mutex_lock(&req_lock);
+	btm_gate = 1;
+	pthread_mutex_unlock(&req_lock);
+
+	top_init(&wr, MTDX_CMD_WRITE, WRITE_BLOCK, WRITE_OFF,
+		 WRITE_CNT * BLOCK_SIZE, w_buf);
+	top_issue(&wr);
+
+	pthread_mutex_lock(&req_lock);
+	while (btm_gate != 2)
+		pthread_cond_wait(&gate_cond, &req_lock);
+	pthread_mutex_unlock(&req_lock);
+
+	for (cnt = 0; cnt < READ_CNT; ++cnt) {
+		top_init(&rd[cnt], MTDX_CMD_READ, READ_BLOCK + cnt, 0,
+			 BLOCK_SIZE, malloc(BLOCK_SIZE));
+		top_issue(&rd[cnt]);
+	}
+
+	pthread_mutex_lock(&req_lock);
+	btm_gate = 0;
+	pthread_cond_broadcast(&gate_cond);
+	pthread_mutex_unlock(&req_lock);
+
+	top_wait(base + READ_CNT + 1);
+
+	if (wr.error) {
+		printf("priority %u: write failed %d\n", priority, wr.error);
+		failed = 1;
+	}
+
+	for (cnt = 0; cnt < READ_CNT; ++cnt) {
+		if (rd[cnt].error) {
+			printf("priority %u: read %u failed %d\n", priority,
+			       cnt, rd[cnt].error);
+			failed = 1;
+		} else if (memcmp(rd[cnt].buf, shadow + (READ_BLOCK + cnt)
+						  * BLOCK_SIZE, BLOCK_SIZE)) {
+			printf("priority %u: read %u returned bad data\n",
+			       priority, cnt);
+			failed = 1;
+		}
+
+		if (rd[cnt].done < wr.done)
+			passed++;
+
+		free(rd[cnt].buf);
+	}
+
+	memcpy(shadow + WRITE_BLOCK * BLOCK_SIZE + WRITE_OFF, w_buf,
+	       WRITE_CNT * BLOCK_SIZE);
+
+	expected = min(priority, (unsigned int)READ_CNT);
+	printf("priority %u: %u of %u reads overtook the write (%u "
+	       "expected)\n", priority, passed, READ_CNT, expected);
+	if (passed != expected)
+		failed = 1;
+
+	/* The write spans one block more, partially */
+	memset(w_buf, 0, (WRITE_CNT + 1) * BLOCK_SIZE);
+	if (top_rw(MTDX_CMD_READ, WRITE_BLOCK, WRITE_CNT + 1, w_buf)
+	    || memcmp(w_buf, shadow + WRITE_BLOCK * BLOCK_SIZE,
+		      (WRITE_CNT + 1) * BLOCK_SIZE)) {
+		printf("priority %u: written blocks read back wrong\n",
+		       priority);
+		failed = 1;
+	}
+
+	return failed;
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned int priorities[] = {0, 1, 2, 4, 1};
+	unsigned int p_cnt = sizeof(priorities) / sizeof(priorities[0]);
+	unsigned int cnt, failed = 0;
+	char *w_buf;
+	pthread_t req_t;
+	int rc;
+
+	mtdx_dev_queue_init(&btm_dev_queue);
+
+	pages = calloc(btm_geo.phy_block_cnt * btm_geo.page_cnt,
+		       sizeof(struct btm_oob));
+	media = malloc(btm_geo.phy_block_cnt * BLOCK_SIZE);
+	shadow = malloc(DATA_CNT * BLOCK_SIZE);
+	w_buf = malloc((WRITE_CNT + 1) * BLOCK_SIZE);
+	if (!pages || !media || !shadow || !w_buf)
+		return -ENOMEM;
+
+	memset(media, btm_geo.fill_value, btm_geo.phy_block_cnt * BLOCK_SIZE);
+	for (cnt = 0; cnt < btm_geo.phy_block_cnt; ++cnt)
+		btm_set_block(cnt, MTDX_INVALID_BLOCK, MTDX_PAGE_ERASED);
+
+	rc = pthread_create(&req_t, NULL, request_thread, NULL);
+	if (rc)
+		return rc;
+
+	rc = test_ftl_probe(&ftl_dev);
+	if (rc) {
+		printf("ftl probe failed %d\n", rc);
+		return rc;
+	}
+
+	RAND_bytes((unsigned char *)shadow, DATA_CNT * BLOCK_SIZE);
+	rc = top_rw(MTDX_CMD_WRITE, 0, DATA_CNT, shadow);
+	if (rc) {
+		printf("initial write failed %d\n", rc);
+		return 1;
+	}
+
+	for (cnt = 0; cnt < p_cnt; ++cnt)
+		failed += test_priority(priorities[cnt], w_buf);
+
+	test_driver->remove(&ftl_dev);
+	pthread_cancel(req_t);
+
+	printf("preempt      %u cases (%u failed)\n", p_cnt, failed);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,566 @@
+/*
+ * Replay of captured block request streams (see tools/mtdx_trace -b)
+ * through ftl_simple and rand_peb_alloc on top of simulated media.
+ *
+ * Usage: test_replay [-z zones] [-p phy_blocks] [-l log_blocks]
+ *                    [-c pages_per_block] [-s page_size] capture.btr
+ *
+ * Request positions are rescaled to the simulated media and wrapped around
+ * its logical size. Media operations are counted and charged according to
+ * btm_timing; requests arrive with their captured spacing and are delayed
+ * while the simulated media is busy.
+ *
+ * Captured spacing is that of request dispatch by mtdx_block, not of request
+ * arrival: queueing delays of the traced device are already part of it, and
+ * are reproduced on top of the simulated ones. Requests the capture lost to
+ * ring overruns are missing from it (see tools/mtdx_trace.c).
+ */
+
+#include "test_harness.h"
+#include <pthread.h>
+#include <linux/module.h>
+#include <linux/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+pthread_mutex_t req_lock = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
+pthread_cond_t next_req_cond = PTHREAD_COND_INITIALIZER;
+struct mtdx_dev *btm_req_dev = NULL;
+struct mtdx_dev_queue btm_dev_queue;
+
+struct btm_oob {
+	unsigned int log_block;
+	enum mtdx_page_status status;
+};
+
+/* Memorystick-like 64MB media by default */
+struct mtdx_geo btm_geo = {
+	.zone_cnt = 8,
+	.log_block_cnt = 3968,
+	.phy_block_cnt = 4096,
+	.page_cnt = 32,
+	.page_size = 512,
+	.oob_size = sizeof(struct btm_oob),
+	.fill_value = 0xff
+};
+
+/* Modeled cost of media operations, in nanoseconds */
+struct {
+	unsigned long long page_read;
+	unsigned long long page_write;
+	unsigned long long block_erase;
+	unsigned long long byte_xfer;
+} btm_timing = {
+	.page_read = 25000,
+	.page_write = 250000,
+	.block_erase = 2000000,
+	.byte_xfer = 50
+};
+
+struct {
+	unsigned long long reads;
+	unsigned long long writes;
+	unsigned long long overwrites;
+	unsigned long long erases;
+	unsigned long long copies;
+	unsigned long long oob_scans;
+	unsigned long long pages_read;
+	unsigned long long pages_written;
+	unsigned long long pages_copied;
+	unsigned long long clock;      /* modeled media time, ns */
+	unsigned long long busy;       /* modeled media busy time, ns */
+} btm_stats;
+
+pthread_mutex_t stats_lock = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
+
+struct btm_oob *pages;
+
+static void btm_charge(unsigned long long t)
+{
+	pthread_mutex_lock(&stats_lock);
+	btm_stats.clock += t;
+	btm_stats.busy += t;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static unsigned int btm_page_cnt(struct mtdx_request *req)
+{
+	return (req->length + btm_geo.page_size - 1) / btm_geo.page_size;
+}
+
+int btm_trans_oob(struct mtdx_request *req, int dir)
+{
+	unsigned int c_pos = req->phy.b_addr * btm_geo.page_cnt;
+	unsigned int cnt = btm_page_cnt(req);
+	char *oob_buf;
+
+	c_pos += req->phy.offset / btm_geo.page_size;
+
+	/* Zero length request accesses oob of a single page */
+	if (!cnt)
+		cnt = 1;
+
+	for (; cnt; --cnt) {
+		oob_buf = mtdx_oob_iter_get(req->req_oob);
+		if (!oob_buf)
+			return -ENOMEM;
+
+		if (dir)
+			memcpy(&pages[c_pos], oob_buf,
+			       sizeof(struct btm_oob));
+		else
+			memcpy(oob_buf, &pages[c_pos],
+			       sizeof(struct btm_oob));
+		c_pos++;
+		mtdx_oob_iter_inc(req->req_oob, 1);
+	}
+	return 0;
+}
+
+unsigned int btm_scan_oob(struct mtdx_request *req)
+{
+	unsigned int cnt;
+
+	for (cnt = 0; cnt < req->length; ++cnt) {
+		if ((req->phy.b_addr + cnt) >= btm_geo.phy_block_cnt)
+			break;
+
+		memcpy(mtdx_oob_iter_get(req->req_oob),
+		       &pages[(req->phy.b_addr + cnt) * btm_geo.page_cnt],
+		       sizeof(struct btm_oob));
+		mtdx_oob_iter_inc(req->req_oob, 1);
+	}
+	return cnt;
+}
+
+void btm_complete_req(struct mtdx_request *req, int error, unsigned int count)
+{
+	btm_req_dev->end_request(btm_req_dev, req, count, error, 0);
+}
+
+/*
+ * Data contents are of no interest here, only the page states are kept.
+ * Requesting devices are queued and woken up under req_lock, so that
+ * requests coming from the work queue thread are not lost.
+ */
+void *request_thread(void *data)
+{
+	struct mtdx_request *req;
+	unsigned int cnt;
+
+	while (1) {
+		pthread_mutex_lock(&req_lock);
+		while (mtdx_dev_queue_empty(&btm_dev_queue))
+			pthread_cond_wait(&next_req_cond, &req_lock);
+		pthread_mutex_unlock(&req_lock);
+
+		btm_req_dev = mtdx_dev_queue_pop_front(&btm_dev_queue);
+
+		while ((req = btm_req_dev->get_request(btm_req_dev))) {
+			if (req->cmd == MTDX_CMD_READ_OOB) {
+				cnt = btm_scan_oob(req);
+				btm_stats.oob_scans++;
+				btm_charge(cnt * btm_timing.page_read);
+				btm_complete_req(req, 0, cnt);
+				continue;
+			}
+
+			if ((req->phy.offset % btm_geo.page_size)
+			    || (req->length % btm_geo.page_size)
+			    || ((req->phy.offset + req->length)
+				> (btm_geo.page_cnt * btm_geo.page_size))) {
+				printf("rt: invalid offset/length %x:%x!\n",
+				       req->phy.offset, req->length);
+				exit(2);
+			}
+
+			cnt = btm_page_cnt(req);
+
+			switch (req->cmd) {
+			case MTDX_CMD_READ:
+				if (req->req_data)
+					mtdx_data_iter_inc(req->req_data,
+							   req->length);
+
+				if (req->req_oob)
+					btm_trans_oob(req, 0);
+
+				btm_stats.reads++;
+				btm_stats.pages_read += cnt;
+				btm_charge(cnt * btm_timing.page_read
+					   + req->length * btm_timing.byte_xfer);
+				btm_complete_req(req, 0, req->length);
+				break;
+			case MTDX_CMD_ERASE:
+				for (cnt = req->phy.b_addr * btm_geo.page_cnt;
+				     cnt < ((req->phy.b_addr + 1)
+					    * btm_geo.page_cnt);
+				     ++cnt) {
+					pages[cnt].status = MTDX_PAGE_ERASED;
+					pages[cnt].log_block = MTDX_INVALID_BLOCK;
+				}
+
+				btm_stats.erases++;
+				btm_charge(btm_timing.block_erase);
+				btm_complete_req(req, 0, 0);
+				break;
+			case MTDX_CMD_WRITE:
+				if (req->req_data)
+					mtdx_data_iter_inc(req->req_data,
+							   req->length);
+
+				if (req->req_oob)
+					btm_trans_oob(req, 1);
+
+				btm_stats.writes++;
+				btm_stats.pages_written += cnt;
+				btm_charge(cnt * btm_timing.page_write
+					   + req->length * btm_timing.byte_xfer);
+				btm_complete_req(req, 0, req->length);
+				break;
+			case MTDX_CMD_OVERWRITE:
+				if (req->req_oob)
+					btm_trans_oob(req, 1);
+
+				btm_stats.overwrites++;
+				btm_charge(cnt * btm_timing.page_write);
+				btm_complete_req(req, 0, req->length);
+				break;
+			case MTDX_CMD_COPY:
+				btm_stats.copies++;
+				btm_stats.pages_copied += cnt;
+				btm_charge(cnt * (btm_timing.page_read
+						  + btm_timing.page_write));
+				btm_complete_req(req, 0, req->length);
+				break;
+			default:
+				btm_complete_req(req, -EINVAL, 0);
+			}
+		}
+		btm_req_dev = NULL;
+	}
+}
+
+void btm_new_req(struct mtdx_dev *this_dev, struct mtdx_dev *req_dev)
+{
+	pthread_mutex_lock(&req_lock);
+	mtdx_dev_queue_push_back(&btm_dev_queue, req_dev);
+	pthread_cond_signal(&next_req_cond);
+	pthread_mutex_unlock(&req_lock);
+}
+
+int btm_oob_to_info(struct mtdx_dev *this_dev, struct mtdx_page_info *p_info,
+		    void *oob)
+{
+	struct btm_oob *b_oob = oob;
+
+	p_info->log_block = b_oob->log_block;
+	p_info->status = b_oob->status;
+	return 0;
+}
+
+int btm_info_to_oob(struct mtdx_dev *this_dev, void *oob,
+		    struct mtdx_page_info *p_info)
+{
+	struct btm_oob *b_oob = oob;
+
+	b_oob->log_block = p_info->log_block;
+	b_oob->status = p_info->status;
+	return 0;
+}
+
+static int btm_get_param(struct mtdx_dev *this_dev,
+			 enum mtdx_param param, void *val)
+{
+	switch (param) {
+	case MTDX_PARAM_GEO: {
+		memcpy(val, &btm_geo, sizeof(btm_geo));
+		return 0;
+	}
+	case MTDX_PARAM_SPECIAL_BLOCKS: {
+		return 0;
+	}
+	case MTDX_PARAM_READ_ONLY: {
+		int *rv = val;
+		*rv = 0;
+		return 0;
+	}
+	case MTDX_PARAM_DEV_SUFFIX: {
+		char *rv = val;
+		sprintf(rv, "%d", this_dev->ord);
+		return 0;
+	}
+	case MTDX_PARAM_DMA_MASK: {
+		return 0;
+	}
+	default:
+		return -EINVAL;
+	}
+}
+
+struct mtdx_dev btm_dev = {
+	.id = {
+		MTDX_WMODE_PAGE_PEB, MTDX_WMODE_NONE, MTDX_RMODE_PAGE_PEB,
+		MTDX_RMODE_NONE, MTDX_TYPE_MEDIA, MTDX_ID_MEDIA_MEMORYSTICK
+	},
+	.dev = {
+		.bus_id = "btm"
+	},
+	.new_request = btm_new_req,
+	.oob_to_info = btm_oob_to_info,
+	.info_to_oob = btm_info_to_oob,
+	.get_param = btm_get_param
+};
+
+struct mtdx_dev ftl_dev = {
+	.id = {
+		MTDX_WMODE_PAGE, MTDX_WMODE_PAGE_PEB, MTDX_RMODE_PAGE,
+		MTDX_RMODE_PAGE_PEB, MTDX_TYPE_FTL, MTDX_ID_FTL_SIMPLE
+	},
+	.dev = {
+		.bus_id = "ftl",
+		.parent = &btm_dev.dev
+	}
+};
+
+/* Data contents are not kept, the buffer only fits the largest request */
+char *top_data_buf;
+unsigned int top_data_size;
+pthread_mutex_t top_lock = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
+wait_queue_head_t top_cond_wq;
+unsigned int top_req_done = 0;
+unsigned long long top_arrival;
+unsigned long long top_latency;
+unsigned long long top_latency_max;
+unsigned int top_errors;
+
+static void top_end_request(struct mtdx_dev *this_dev, struct mtdx_request *req,
+			    unsigned int count, int dst_error,
+			    int src_error)
+{
+	unsigned long long latency;
+
+	pthread_mutex_lock(&stats_lock);
+	latency = btm_stats.clock - top_arrival;
+	pthread_mutex_unlock(&stats_lock);
+
+	pthread_mutex_lock(&top_lock);
+	if (top_req_done != 1) {
+		printf("bad top_end_request %d\n", top_req_done);
+		pthread_mutex_unlock(&top_lock);
+		exit(1);
+	}
+
+	if (dst_error)
+		top_errors++;
+
+	top_latency += latency;
+	if (latency > top_latency_max)
+		top_latency_max = latency;
+
+	top_req_done = 2;
+	pthread_mutex_unlock(&top_lock);
+	wake_up(&top_cond_wq);
+}
+
+static struct mtdx_request *top_get_request(struct mtdx_dev *mdev);
+
+struct mtdx_dev top_dev = {
+	.get_request = top_get_request,
+	.end_request = top_end_request,
+	.dev = {
+		.parent = &ftl_dev.dev
+	}
+};
+
+struct mtdx_request top_req;
+
+static struct mtdx_request *top_get_request(struct mtdx_dev *mdev)
+{
+	struct mtdx_request *rv;
+
+	pthread_mutex_lock(&top_lock);
+	if (!top_req_done) {
+		rv = &top_req;
+		top_req_done++;
+	} else
+		rv = NULL;
+
+	pthread_mutex_unlock(&top_lock);
+	return rv;
+}
+
+static struct mtdx_btrace_rec *load_capture(const char *path,
+					    struct mtdx_btrace_header *hdr)
+{
+	struct mtdx_btrace_rec *recs;
+	FILE *f = fopen(path, "r");
+
+	if (!f) {
+		perror(path);
+		return NULL;
+	}
+
+	if (fread(hdr, sizeof(*hdr), 1, f) != 1
+	    || hdr->magic != MTDX_BTRACE_MAGIC
+	    || hdr->version != MTDX_BTRACE_VERSION
+	    || hdr->rec_size != sizeof(struct mtdx_btrace_rec)
+	    || !hdr->block_size) {
+		fprintf(stderr, "%s: unsupported capture format\n", path);
+		fclose(f);
+		return NULL;
+	}
+
+	recs = calloc(hdr->rec_cnt, sizeof(struct mtdx_btrace_rec));
+	fseek(f, hdr->header_size, SEEK_SET);
+	if (!recs || fread(recs, sizeof(struct mtdx_btrace_rec), hdr->rec_cnt,
+			   f) != hdr->rec_cnt) {
+		fprintf(stderr, "%s: short capture\n", path);
+		free(recs);
+		recs = NULL;
+	}
+
+	fclose(f);
+	return recs;
+}
+
+int main(int argc, char **argv)
+{
+	struct mtdx_btrace_header hdr;
+	struct mtdx_btrace_rec *recs;
+	struct mtdx_data_iter req_data_iter;
+	unsigned long long pos, media_size, arrival = 0;
+	unsigned int block_size, cnt, length, req_cnt = 0;
+	pthread_t req_t;
+	int opt, rc;
+
+	while ((opt = getopt(argc, argv, "z:p:l:c:s:")) != -1) {
+		switch (opt) {
+		case 'z':
+			btm_geo.zone_cnt = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			btm_geo.phy_block_cnt = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			btm_geo.log_block_cnt = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			btm_geo.page_cnt = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			btm_geo.page_size = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			return 1;
+		}
+	}
+
+	if (optind == argc) {
+		fprintf(stderr, "usage: %s [-z zones] [-p phy_blocks] "
+			"[-l log_blocks] [-c pages_per_block] [-s page_size] "
+			"<capture file>\n", argv[0]);
+		return 1;
+	}
+
+	recs = load_capture(argv[optind], &hdr);
+	if (!recs)
+		return 1;
+
+	block_size = btm_geo.page_cnt * btm_geo.page_size;
+	media_size = (unsigned long long)btm_geo.log_block_cnt * block_size;
+
+	init_waitqueue_head(&top_cond_wq);
+	mtdx_dev_queue_init(&btm_dev_queue);
+
+	pages = calloc(btm_geo.phy_block_cnt * btm_geo.page_cnt,
+		       sizeof(struct btm_oob));
+	if (!pages)
+		return -ENOMEM;
+
+	for (cnt = 0; cnt < (btm_geo.phy_block_cnt * btm_geo.page_cnt); ++cnt)
+		pages[cnt].status = MTDX_PAGE_UNMAPPED;
+
+	rc = pthread_create(&req_t, NULL, request_thread, NULL);
+	if (rc)
+		return rc;
+
+	rc = test_ftl_probe(&ftl_dev);
+	if (rc) {
+		printf("ftl probe failed %d\n", rc);
+		return rc;
+	}
+
+	for (cnt = 0; cnt < hdr.rec_cnt; ++cnt) {
+		if (recs[cnt].cmd != MTDX_CMD_READ
+		    && recs[cnt].cmd != MTDX_CMD_WRITE)
+			continue;
+
+		pos = (unsigned long long)recs[cnt].logical * hdr.block_size
+		      + recs[cnt].offset;
+		pos = (pos % media_size) / btm_geo.page_size
+		      * btm_geo.page_size;
+		length = (recs[cnt].length + btm_geo.page_size - 1)
+			 / btm_geo.page_size * btm_geo.page_size;
+		if (!length)
+			continue;
+
+		if ((pos + length) > media_size)
+			length = media_size - pos;
+
+		if (length > top_data_size) {
+			top_data_buf = realloc(top_data_buf, length);
+			if (!top_data_buf)
+				return -ENOMEM;
+
+			top_data_size = length;
+		}
+
+		arrival += recs[cnt].delay * 1000ULL;
+		pthread_mutex_lock(&stats_lock);
+		if (btm_stats.clock < arrival)
+			btm_stats.clock = arrival;
+		else
+			arrival = btm_stats.clock;
+		top_arrival = arrival;
+		pthread_mutex_unlock(&stats_lock);
+
+		top_req.cmd = recs[cnt].cmd;
+		top_req.logical = pos / block_size;
+		top_req.phy.offset = pos % block_size;
+		top_req.length = length;
+		mtdx_data_iter_init_buf(&req_data_iter, top_data_buf, length);
+		top_req.req_data = &req_data_iter;
+		top_req_done = 0;
+
+		ftl_dev.new_request(&ftl_dev, &top_dev);
+		wait_event_interruptible(top_cond_wq, top_req_done >= 2);
+		req_cnt++;
+	}
+
+	test_driver->remove(&ftl_dev);
+	pthread_cancel(req_t);
+
+	printf("requests     %u (%u failed)\n", req_cnt, top_errors);
+	printf("reads        %llu (%llu pages)\n", btm_stats.reads,
+	       btm_stats.pages_read);
+	printf("writes       %llu (%llu pages)\n", btm_stats.writes,
+	       btm_stats.pages_written);
+	printf("overwrites   %llu\n", btm_stats.overwrites);
+	printf("copies       %llu (%llu pages)\n", btm_stats.copies,
+	       btm_stats.pages_copied);
+	printf("erases       %llu\n", btm_stats.erases);
+	printf("oob scans    %llu\n", btm_stats.oob_scans);
+	printf("media busy   %llu us\n", btm_stats.busy / 1000);
+	printf("total time   %llu us\n", btm_stats.clock / 1000);
+	if (req_cnt)
+		printf("latency      %llu us avg, %llu us max\n",
+		       top_latency / req_cnt / 1000, top_latency_max / 1000);
+
+	free(recs);
+	free(pages);
+	free(top_data_buf);
+	cleanup_module();
+	return 0;
+}
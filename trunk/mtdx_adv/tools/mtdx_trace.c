@@ -0,0 +1,431 @@
+/*
+ *  mtdx_trace.c - decoder for the mtdx binary event trace
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Usage: mtdx_trace [-k /proc/kallsyms] /sys/kernel/debug/mtdx/mtdx0 ...
+ *        mtdx_trace -b capture.btr -s block_size \
+ *                   /sys/kernel/debug/mtdx/mtdx0.stream
+ *
+ * Events from all the given devices are merged by time and split into per
+ * request timelines: each block request starts a new timeline, events are
+ * printed with offsets (in microseconds) from the request start. Events
+ * logged while no block request was active (background work) are printed
+ * with absolute times. With kallsyms given, request handlers are printed
+ * by name.
+ *
+ * With -b, block requests (as seen by mtdx_block) are streamed from the
+ * stream file of the block device into the capture file instead, for replay
+ * by test/test_replay, until interrupted or the device goes away. Block
+ * size of the traced block device must be given with -s. Requests are
+ * logged when mtdx_block dispatches them, so the recorded spacing includes
+ * the time they spent queued. Events overwritten in the ring before they
+ * were read are counted and reported as lost; trace_events of mtdx_core
+ * only has to cover bursts the reader can't keep up with.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <libgen.h>
+#include "../mtdx_trace.h"
+
+struct trace_entry {
+	struct mtdx_trace_event ev;
+	const char              *dev;
+};
+
+struct sym {
+	unsigned int addr;
+	char         name[64];
+};
+
+static struct trace_entry *entries;
+static unsigned int entry_cnt;
+static struct sym *syms;
+static unsigned int sym_cnt;
+static volatile sig_atomic_t stop_capture;
+
+static const char *cmd_names[] = {
+	"none", "read", "erase", "write", "overwrite", "copy", "read_oob"
+};
+
+static const char *cmd_name(unsigned int cmd)
+{
+	if (cmd < sizeof(cmd_names) / sizeof(cmd_names[0]))
+		return cmd_names[cmd];
+
+	return "?";
+}
+
+static int sym_cmp(const void *a, const void *b)
+{
+	const struct sym *s_a = a, *s_b = b;
+
+	return s_a->addr < s_b->addr ? -1 : s_a->addr > s_b->addr;
+}
+
+static int load_syms(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	unsigned long long addr;
+	char type, name[256];
+	unsigned int size = 0;
+
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	while (fscanf(f, "%llx %c %255s%*[^\n]", &addr, &type, name) == 3) {
+		if (type != 't' && type != 'T')
+			continue;
+
+		if (sym_cnt == size) {
+			size = size ? size * 2 : 1024;
+			syms = realloc(syms, size * sizeof(struct sym));
+			if (!syms)
+				return -1;
+		}
+
+		syms[sym_cnt].addr = addr;
+		strncpy(syms[sym_cnt].name, name, sizeof(syms[0].name) - 1);
+		syms[sym_cnt].name[sizeof(syms[0].name) - 1] = 0;
+		sym_cnt++;
+	}
+
+	fclose(f);
+	qsort(syms, sym_cnt, sizeof(struct sym), sym_cmp);
+	return 0;
+}
+
+static const char *sym_name(unsigned int addr)
+{
+	static char buf[16];
+	unsigned int l = 0, r = sym_cnt;
+
+	while (l < r) {
+		unsigned int m = (l + r) / 2;
+
+		if (syms[m].addr == addr)
+			return syms[m].name;
+		else if (syms[m].addr < addr)
+			l = m + 1;
+		else
+			r = m;
+	}
+
+	snprintf(buf, sizeof(buf), "%08x", addr);
+	return buf;
+}
+
+static int load_trace(const char *path)
+{
+	struct mtdx_trace_header hdr;
+	struct mtdx_trace_event ev;
+	const char *dev = strdup(basename(strdup(path)));
+	unsigned int cnt;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		fprintf(stderr, "%s: short header\n", path);
+		return -1;
+	}
+
+	if (hdr.magic != MTDX_TRACE_MAGIC
+	    || hdr.version != MTDX_TRACE_VERSION
+	    || hdr.event_size != sizeof(ev)) {
+		fprintf(stderr, "%s: unsupported trace format\n", path);
+		return -1;
+	}
+
+	lseek(fd, hdr.header_size, SEEK_SET);
+	entries = realloc(entries, (entry_cnt + hdr.event_cnt)
+				   * sizeof(struct trace_entry));
+	if (!entries)
+		return -1;
+
+	for (cnt = 0; cnt < hdr.event_cnt; ++cnt) {
+		if (read(fd, &ev, sizeof(ev)) != sizeof(ev))
+			break;
+
+		/* empty or torn slot */
+		if (!ev.seq || ((ev.seq - 1) % hdr.event_cnt) != cnt)
+			continue;
+
+		entries[entry_cnt].ev = ev;
+		entries[entry_cnt].dev = dev;
+		entry_cnt++;
+	}
+
+	if (hdr.seq > hdr.event_cnt)
+		fprintf(stderr, "%s: %u oldest events lost\n", path,
+			hdr.seq - hdr.event_cnt);
+
+	close(fd);
+	return 0;
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+	const struct trace_entry *e_a = a, *e_b = b;
+
+	if (e_a->ev.time != e_b->ev.time)
+		return e_a->ev.time < e_b->ev.time ? -1 : 1;
+
+	return e_a->ev.seq < e_b->ev.seq ? -1 : e_a->ev.seq > e_b->ev.seq;
+}
+
+static void print_event(const struct trace_entry *e)
+{
+	__u32 arg[4];
+
+	memcpy(arg, e->ev.arg, sizeof(arg));
+	printf("%-8s ", e->dev);
+
+	switch (e->ev.type) {
+	case MTDX_TRACE_REQ_START:
+		printf("req   %s log %x off %x len %x\n", cmd_name(arg[0]),
+		       arg[1], arg[2], arg[3]);
+		break;
+	case MTDX_TRACE_REQ_END:
+		printf("end   %s count %x err %d/%d\n", cmd_name(arg[0]),
+		       arg[1], (int)arg[2], (int)arg[3]);
+		break;
+	case MTDX_TRACE_REQ_FN:
+		printf("fn    %s (%u)\n", sym_name(arg[0]), arg[1]);
+		break;
+	case MTDX_TRACE_PEB_GET:
+		printf("get   zone %x peb %x dirty %u temp %u\n", arg[0],
+		       arg[1], arg[2], arg[3]);
+		break;
+	case MTDX_TRACE_PEB_PUT:
+		printf("put   peb %x dirty %u\n", arg[0], arg[1]);
+		break;
+	case MTDX_TRACE_CMD_ISSUE:
+		printf("issue %s peb %x off %x len %x\n", cmd_name(arg[0]),
+		       arg[1], arg[2], arg[3]);
+		break;
+	case MTDX_TRACE_CMD_END:
+		printf("done  %s count %x err %d/%d\n", cmd_name(arg[0]),
+		       arg[1], (int)arg[2], (int)arg[3]);
+		break;
+	case MTDX_TRACE_LOST:
+		printf("lost  %u events\n", arg[0]);
+		break;
+	default:
+		printf("type %u: %x %x %x %x\n", e->ev.type, arg[0], arg[1],
+		       arg[2], arg[3]);
+	}
+}
+
+static void capture_signal(int sig)
+{
+	stop_capture = 1;
+}
+
+/*
+ * Stream file events come in sequence order, lost ones replaced by
+ * MTDX_TRACE_LOST; anything else means the file is not a stream.
+ */
+static int write_capture(const char *path, const char *t_path,
+			 unsigned int block_size)
+{
+	struct mtdx_btrace_header hdr = {
+		.magic = MTDX_BTRACE_MAGIC,
+		.version = MTDX_BTRACE_VERSION,
+		.header_size = sizeof(struct mtdx_btrace_header),
+		.rec_size = sizeof(struct mtdx_btrace_rec),
+		.block_size = block_size
+	};
+	struct mtdx_trace_header t_hdr;
+	struct mtdx_trace_event evs[64];
+	struct mtdx_btrace_rec rec;
+	struct sigaction sa;
+	unsigned long long last = 0, lost = 0;
+	unsigned int seq, cnt;
+	ssize_t len;
+	FILE *f;
+	int fd = open(t_path, O_RDONLY);
+
+	if (fd < 0) {
+		perror(t_path);
+		return -1;
+	}
+
+	if (read(fd, &t_hdr, sizeof(t_hdr)) != sizeof(t_hdr)) {
+		fprintf(stderr, "%s: short header\n", t_path);
+		return -1;
+	}
+
+	if (t_hdr.magic != MTDX_TRACE_MAGIC
+	    || t_hdr.version != MTDX_TRACE_VERSION
+	    || t_hdr.event_size != sizeof(evs[0])) {
+		fprintf(stderr, "%s: unsupported trace format\n", t_path);
+		return -1;
+	}
+
+	f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = capture_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	fseek(f, sizeof(hdr), SEEK_SET);
+	seq = t_hdr.seq;
+
+	while (!stop_capture) {
+		len = read(fd, evs, sizeof(evs));
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+
+			perror(t_path);
+			break;
+		} else if (!len)
+			break;
+
+		for (cnt = 0; cnt < len / sizeof(evs[0]); ++cnt) {
+			const struct mtdx_trace_event *ev = &evs[cnt];
+
+			if (ev->seq != seq + 1) {
+				fprintf(stderr, "%s: not a stream file, "
+					"event %u follows %u\n", t_path,
+					ev->seq, seq);
+				goto err_out;
+			}
+
+			if (ev->type == MTDX_TRACE_LOST) {
+				lost += ev->arg[0];
+				seq += ev->arg[0];
+				continue;
+			}
+
+			seq = ev->seq;
+			if (ev->type != MTDX_TRACE_REQ_START)
+				continue;
+
+			memset(&rec, 0, sizeof(rec));
+			/* Events from different CPUs may be out of order */
+			if (hdr.rec_cnt && ev->time > last)
+				rec.delay = (ev->time - last) / 1000;
+			rec.cmd = ev->arg[0];
+			rec.logical = ev->arg[1];
+			rec.offset = ev->arg[2];
+			rec.length = ev->arg[3];
+			if (ev->time > last)
+				last = ev->time;
+
+			if (fwrite(&rec, sizeof(rec), 1, f) != 1) {
+				perror(path);
+				goto err_out;
+			}
+
+			hdr.rec_cnt++;
+		}
+	}
+
+	close(fd);
+	rewind(f);
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1) {
+		perror(path);
+		fclose(f);
+		return -1;
+	}
+
+	fclose(f);
+	printf("%u requests captured\n", hdr.rec_cnt);
+	if (lost)
+		fprintf(stderr, "%s: %llu events lost, capture is "
+			"incomplete\n", t_path, lost);
+	return 0;
+err_out:
+	close(fd);
+	fclose(f);
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long start = 0;
+	unsigned int cnt, req_cnt = 0, block_size = 0;
+	const char *capture = NULL;
+	int opt, in_req = 0;
+
+	while ((opt = getopt(argc, argv, "k:b:s:")) != -1) {
+		switch (opt) {
+		case 'k':
+			if (load_syms(optarg))
+				return 1;
+			break;
+		case 'b':
+			capture = optarg;
+			break;
+		case 's':
+			block_size = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			return 1;
+		}
+	}
+
+	if (optind == argc
+	    || (capture && (!block_size || optind + 1 != argc))) {
+		fprintf(stderr, "usage: %s [-k kallsyms] <trace file> ...\n"
+			"       %s -b <capture file> -s <block size> "
+			"<stream file>\n", argv[0], argv[0]);
+		return 1;
+	}
+
+	if (capture)
+		return write_capture(capture, argv[optind], block_size) ? 1 : 0;
+
+	for (; optind < argc; ++optind)
+		if (load_trace(argv[optind]))
+			return 1;
+
+	qsort(entries, entry_cnt, sizeof(struct trace_entry), entry_cmp);
+
+	for (cnt = 0; cnt < entry_cnt; ++cnt) {
+		const struct mtdx_trace_event *ev = &entries[cnt].ev;
+
+		if (ev->type == MTDX_TRACE_REQ_START) {
+			start = ev->time;
+			in_req = 1;
+			printf("\n# request %u at %llu.%06llu\n", req_cnt++,
+			       start / 1000000000ULL,
+			       (start / 1000ULL) % 1000000ULL);
+		}
+
+		if (in_req)
+			printf("  +%10.3f ", (ev->time - start) / 1000.0);
+		else
+			printf("%llu.%06llu ", ev->time / 1000000000ULL,
+			       (ev->time / 1000ULL) % 1000000ULL);
+
+		print_event(&entries[cnt]);
+
+		if (ev->type == MTDX_TRACE_REQ_END) {
+			printf("# total %.3f us\n", (ev->time - start) / 1000.0);
+			in_req = 0;
+		}
+	}
+
+	return 0;
+}